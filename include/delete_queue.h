@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _DELETE_QUEUE_H_
+#define _DELETE_QUEUE_H_
+
+#include "global.h"
+#include "s3client_pool.h"
+
+typedef struct _DeleteItem DeleteItem;
+
+DeleteQueue *delete_queue_create (Application *app, S3ClientPool *pool);
+void delete_queue_destroy (DeleteQueue *dq);
+
+// object is removed (or failed to be removed)
+typedef void (*DeleteQueue_on_deleted_cb) (gpointer ctx, gboolean success);
+
+// queue removal of the object (path with leading '/'),
+// queued objects are sent by batches after delete_batch_delay ms or when the batch is full
+void delete_queue_add (DeleteQueue *dq, const gchar *path, DeleteQueue_on_deleted_cb on_deleted_cb, gpointer ctx);
+
+// register removal of the object which can't be sent yet (the object is being created),
+// it's pending like a queued one, but it's not sent until delete_queue_send_held () is called
+DeleteItem *delete_queue_hold (DeleteQueue *dq, const gchar *path, DeleteQueue_on_deleted_cb on_deleted_cb, gpointer ctx);
+
+// queue held removal
+void delete_queue_send_held (DeleteQueue *dq, DeleteItem *item);
+
+// return TRUE if removal of the object is queued or is in progress
+gboolean delete_queue_is_pending (DeleteQueue *dq, const gchar *path);
+
+// object is created again, drop its removals which are not sent yet (held removals are kept)
+void delete_queue_cancel (DeleteQueue *dq, const gchar *path);
+
+// call on_deleted_cb when all queued and sent removals of the object are done,
+// returns FALSE (and on_deleted_cb is not called) if there are none
+gboolean delete_queue_wait (DeleteQueue *dq, const gchar *path, DeleteQueue_on_deleted_cb on_deleted_cb, gpointer ctx);
+
+#endif
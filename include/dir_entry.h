@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _DIR_ENTRY_H_
+#define _DIR_ENTRY_H_
+
+#include "global.h"
+#include "dir_tree.h"
+
+// DirTree node, fixed-size record allocated from DirTree's SlabArena.
+// Base name is interned in NamePool, full path is built from the parent chain when needed.
+typedef struct {
+    guint32 ino;
+    guint32 parent_ino;
+    guint32 name_id; // base name in NamePool
+    guint32 age; // generation of the parent directory when the entry was seen, 0 if removed
+
+    off_t size;
+    gpointer op_data;
+    guint8 etag[16]; // MD5 of object content, valid if has_etag is set
+
+    guint32 ctime;
+    guint16 mode;
+    guint8 type; // DirEntryType
+    guint8 is_modified:1; // do not show it
+    guint8 is_removing:1; // removal of the object is queued
+    guint8 is_detached:1; // removed from the parent directory, destroyed when not used anymore
+    guint8 has_etag:1; // ETag is MD5 of content, it's unknown for multipart objects
+    guint8 is_indexed:1; // directory is listed by the bucket index, it's not listed on readdir
+} DirEntry;
+
+typedef struct _DirTreeListing DirTreeListing;
+
+// directory record, allocated from a separate SlabArena
+typedef struct {
+    DirEntry en;
+
+    DirEntry **a_children; // sorted by name, readdir offsets are positions in it
+    guint32 children_count;
+    guint32 children_size; // allocated slots
+    guint32 generation; // incremented when a listing starts, children seen by it get this age
+    guint32 listed_generation; // generation of the last complete listing, older children are not shown
+    time_t listed; // time of the last listing, 0 if it has to be listed again
+    DirTreeListing *listing; // listing in progress, NULL if none
+    guint32 snapshot_id; // record of the directory in DirTree snapshot + 1, 0 if its children are loaded
+} DirEntryDir;
+
+#define DIR_ENTRY_DIR(en) ((DirEntryDir *) (en))
+
+#endif
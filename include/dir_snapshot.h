@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _DIR_SNAPSHOT_H_
+#define _DIR_SNAPSHOT_H_
+
+#include "global.h"
+
+// snapshot of DirTree on the local disk, it's mapped into memory and read lazily.
+// Entries are stored in breadth-first order, so children of a directory are
+// consecutive records, names are stored after the records
+typedef struct _DirSnapshot DirSnapshot;
+typedef struct _DirSnapshotWriter DirSnapshotWriter;
+
+#define DIR_SNAPSHOT_VERSION 2
+
+#define DIR_SNAPSHOT_FLAG_HAS_ETAG 0x01
+
+// fixed-size record, the root is the first one
+typedef struct {
+    guint32 parent; // index of the parent record
+    guint32 name_off; // offset of the name in the names area
+    guint32 first_child; // index of the first child record (directories)
+    guint32 children_count;
+    guint64 size;
+    guint8 etag[16]; // MD5 of object content
+    guint32 ctime;
+    guint32 listed; // time of the last listing of the directory, 0 if it's not listed
+    guint16 mode;
+    guint8 type; // DirEntryType
+    guint8 flags;
+    guint32 reserved;
+} DirSnapshotEntry;
+
+// returns NULL if there is no valid snapshot of the bucket
+DirSnapshot *dir_snapshot_open (const gchar *path, const gchar *bucket_name);
+void dir_snapshot_close (DirSnapshot *snap);
+
+guint32 dir_snapshot_get_count (DirSnapshot *snap);
+// returns NULL if id is out of range
+const DirSnapshotEntry *dir_snapshot_get_entry (DirSnapshot *snap, guint32 id);
+// returns NULL if the name is out of the names area
+const gchar *dir_snapshot_get_name (DirSnapshot *snap, const DirSnapshotEntry *rec);
+
+// new snapshot is written to a temporary file, which replaces the old one when it's complete
+DirSnapshotWriter *dir_snapshot_writer_create (const gchar *path, const gchar *bucket_name);
+// records must be added in breadth-first order, name_off is set by the writer
+gboolean dir_snapshot_writer_add (DirSnapshotWriter *writer, DirSnapshotEntry *rec, const gchar *name);
+// returns FALSE if the snapshot isn't written, the writer is destroyed in any case
+gboolean dir_snapshot_writer_finish (DirSnapshotWriter *writer, gboolean commit);
+
+#endif
@@ -28,20 +28,36 @@ typedef enum {
 DirTree *dir_tree_create (Application *app);
 void dir_tree_destroy (DirTree *dtree);
 
-void dir_tree_update_entry (DirTree *dtree, const gchar *path, DirEntryType type, fuse_ino_t parent_ino, const gchar *entry_name, long long size);
+// log the size of memory used by entries, the directory index and the negative lookup cache
+void dir_tree_log_mem_usage (DirTree *dtree);
 
-void dir_tree_start_update (DirTree *dtree, const gchar *dir_path);
-void dir_tree_stop_update (DirTree *dtree, fuse_ino_t parent_ino);
+// etag is MD5 of object content (without quotes), or NULL if unknown
+void dir_tree_update_entry (DirTree *dtree, const gchar *path, DirEntryType type, fuse_ino_t parent_ino, guint32 generation, 
+    const gchar *entry_name, long long size, const gchar *etag);
 
-typedef void (*dir_tree_readdir_cb) (fuse_req_t req, gboolean success, size_t max_size, off_t off, const char *buf, size_t buf_size);
+// listings of different directories are independent, generation is returned by dir_tree_start_update ()
+guint32 dir_tree_start_update (DirTree *dtree, fuse_ino_t parent_ino);
+void dir_tree_stop_update (DirTree *dtree, fuse_ino_t parent_ino, guint32 generation);
+// a page of the listing is done, keys (relative to the directory) up to last_key are listed
+void dir_tree_update_progress (DirTree *dtree, fuse_ino_t parent_ino, guint32 generation, const gchar *last_key);
+
+typedef void (*dir_tree_readdir_cb) (fuse_req_t req, gboolean success, const char *buf, size_t buf_size);
 void dir_tree_fill_dir_buf (DirTree *dtree, 
-        fuse_ino_t ino, size_t size, off_t off,
+        fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi,
         dir_tree_readdir_cb readdir_cb, fuse_req_t req);
 
-typedef void (*dir_tree_lookup_cb) (fuse_req_t req, gboolean success, fuse_ino_t ino, int mode, off_t file_size, time_t ctime);
+// readdir stream state is kept in fi->fh
+gboolean dir_tree_opendir (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi);
+void dir_tree_releasedir (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi);
+
+// err is 0 on success, ENOENT if the name doesn't exist, or the error of the lookup
+typedef void (*dir_tree_lookup_cb) (fuse_req_t req, int err, fuse_ino_t ino, int mode, off_t file_size, time_t ctime);
 void dir_tree_lookup (DirTree *dtree, fuse_ino_t parent_ino, const char *name,
     dir_tree_lookup_cb lookup_cb, fuse_req_t req);
 
+// the kernel dropped nlookup references to the inode
+void dir_tree_forget (DirTree *dtree, fuse_ino_t ino, unsigned long nlookup);
+
 
 typedef void (*dir_tree_getattr_cb) (fuse_req_t req, gboolean success, fuse_ino_t ino, int mode, off_t file_size, time_t ctime);
 void dir_tree_getattr (DirTree *dtree, fuse_ino_t ino, 
@@ -72,11 +88,28 @@ void dir_tree_file_write (DirTree *dtree, fuse_ino_t ino,
 typedef void (*DirTree_file_open_cb) (fuse_req_t req, gboolean success, struct fuse_file_info *fi);
 gboolean dir_tree_file_open (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi, DirTree_file_open_cb file_open_cb, fuse_req_t req);
 
-void dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi);
-
-typedef void (*DirTree_file_remove_cb) (fuse_req_t req, gboolean success);
-gboolean dir_tree_file_remove (DirTree *dtree, fuse_ino_t ino, DirTree_file_remove_cb file_remove_cb, fuse_req_t req);
-
+typedef void (*DirTree_file_sync_cb) (fuse_req_t req, gboolean success);
+void dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi,
+    DirTree_file_sync_cb release_cb, fuse_req_t req);
+void dir_tree_file_flush (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi,
+    DirTree_file_sync_cb flush_cb, fuse_req_t req);
+void dir_tree_file_fsync (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi,
+    DirTree_file_sync_cb fsync_cb, fuse_req_t req);
+
+// err is 0 on success, or errno of the failure
+typedef void (*DirTree_file_remove_cb) (fuse_req_t req, int err);
+// entry is removed right away, objects are removed in background
+void dir_tree_file_unlink (DirTree *dtree, fuse_ino_t parent_ino, const char *name, 
+    DirTree_file_remove_cb file_remove_cb, fuse_req_t req);
+void dir_tree_dir_remove (DirTree *dtree, fuse_ino_t parent_ino, const char *name, 
+    DirTree_file_remove_cb dir_remove_cb, fuse_req_t req);
+
+
+// err is 0 on success, or errno of the failure
+typedef void (*DirTree_rename_cb) (fuse_req_t req, int err);
+void dir_tree_rename (DirTree *dtree, fuse_ino_t parent_ino, const char *name, 
+    fuse_ino_t new_parent_ino, const char *new_name, 
+    DirTree_rename_cb rename_cb, fuse_req_t req);
 
 typedef void (*dir_tree_mkdir_cb) (fuse_req_t req, gboolean success, fuse_ino_t ino, int mode, off_t file_size, time_t ctime);
 void dir_tree_dir_create (DirTree *dtree, fuse_ino_t parent_ino, const char *name, mode_t mode,
@@ -49,6 +49,7 @@
 #include <sys/prctl.h>
 #include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <math.h>
 
@@ -86,9 +87,31 @@ typedef struct {
     gint retries;
     gint http_port;
     gint dir_cache_max_time;
+    gint dir_cache_max_stale;
     gint max_requests_per_pool;
+    gint dir_list_partitions;
+    gint list_max_keys;
+    gint small_upload_writers;
+    gint large_upload_writers;
+    guint64 small_upload_max_size;
+    guint64 upload_bandwidth_limit;
+    guint64 write_buffer_file_size;
+    guint64 write_buffer_max_size;
+    guint64 background_upload_max_size;
+    guint64 copy_up_block_size;
+    guint64 read_cache_max_size;
+    gint delete_batch_delay;
+    gboolean upload_on_flush;
+    gboolean use_upload_journal;
     gboolean use_syslog;
     gboolean path_style;
+    gboolean list_objects_v2;
+    gboolean index_bucket;
+    gchar *index_prefix;
+    gint index_refresh_time;
+    gboolean use_snapshot;
+    gint snapshot_interval;
+    gint negative_cache_time;
 } AppConf;
 
 typedef struct _Application Application;
@@ -96,6 +119,9 @@ typedef struct _S3HttpConnection S3HttpConnection;
 typedef struct _DirTree DirTree;
 typedef struct _S3Fuse S3Fuse;
 typedef struct _S3ClientPool S3ClientPool;
+typedef struct _UploadJournal UploadJournal;
+typedef struct _UploadScheduler UploadScheduler;
+typedef struct _DeleteQueue DeleteQueue;
 typedef enum _LogLevel LogLevel;
 
 struct event_base *application_get_evbase (Application *app);
@@ -113,6 +139,9 @@ S3ClientPool *application_get_read_client_pool (Application *app);
 S3ClientPool *application_get_write_client_pool (Application *app);
 S3ClientPool *application_get_ops_client_pool (Application *app);
 DirTree *application_get_dir_tree (Application *app);
+UploadJournal *application_get_upload_journal (Application *app);
+UploadScheduler *application_get_upload_scheduler (Application *app);
+DeleteQueue *application_get_delete_queue (Application *app);
 
 #include "log.h" 
 
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _INODE_TABLE_H_
+#define _INODE_TABLE_H_
+
+#include "global.h"
+
+// inode number -> entry, a chunked array indexed directly by inode number.
+// Numbers of removed entries are reused, after the kernel forgets them.
+typedef struct _InodeTable InodeTable;
+
+InodeTable *inode_table_create ();
+void inode_table_destroy (InodeTable *table);
+
+// return a new inode number for the entry, 0 if there are no free numbers
+fuse_ino_t inode_table_add (InodeTable *table, gpointer data);
+// return NULL if the entry is not found
+gpointer inode_table_lookup (InodeTable *table, fuse_ino_t ino);
+// entry is destroyed
+void inode_table_remove (InodeTable *table, fuse_ino_t ino);
+
+// the kernel got a reference to the inode (with lookup, create or mkdir reply)
+void inode_table_ref (InodeTable *table, fuse_ino_t ino);
+// the kernel dropped nlookup references
+void inode_table_forget (InodeTable *table, fuse_ino_t ino, guint64 nlookup);
+
+// the number of entries
+guint64 inode_table_get_count (InodeTable *table);
+// the total size of memory used by the table
+gsize inode_table_get_mem_size (InodeTable *table);
+
+#endif
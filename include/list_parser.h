@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _LIST_PARSER_H_
+#define _LIST_PARSER_H_
+
+#include "global.h"
+
+// single pass parser of ListBucketResult, the body is fed in chunks as it's received,
+// objects and common prefixes are reported as soon as they are parsed
+typedef struct _ListParser ListParser;
+
+// key is the full object name or the common prefix (with the trailing delimiter),
+// the strings are valid only during the call
+typedef void (*ListParser_on_entry_cb) (gpointer ctx, const gchar *key, gboolean is_prefix, guint64 size, const gchar *etag);
+
+ListParser *list_parser_create (ListParser_on_entry_cb on_entry_cb, gpointer ctx);
+void list_parser_destroy (ListParser *parser);
+
+// returns FALSE if the document is malformed
+gboolean list_parser_feed (ListParser *parser, const gchar *buf, size_t buf_len);
+// the end of the body, returns FALSE if the document is malformed or it isn't ListBucketResult
+gboolean list_parser_finish (ListParser *parser);
+
+// IsTruncated of the page
+gboolean list_parser_is_truncated (ListParser *parser);
+// NextMarker, or the last key of the page (NextMarker is returned only if delimiter is set), NULL if the page is empty
+const gchar *list_parser_get_next_marker (ListParser *parser);
+// NextContinuationToken of ListObjectsV2 page, NULL if it's not set
+const gchar *list_parser_get_continuation_token (ListParser *parser);
+
+// the number of objects and common prefixes of the page
+guint list_parser_get_count (ListParser *parser);
+
+#endif
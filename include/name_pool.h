@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _NAME_POOL_H_
+#define _NAME_POOL_H_
+
+#include "global.h"
+
+// interned strings, stored back to back in big chunks and referenced by 32-bit ids,
+// equal strings share the same storage
+typedef struct _NamePool NamePool;
+
+NamePool *name_pool_create ();
+void name_pool_destroy (NamePool *pool);
+
+// return the id of the string, adding it if required, 0 on error
+// every name_pool_add () must be paired with name_pool_release ()
+guint32 name_pool_add (NamePool *pool, const gchar *name);
+// storage of the string is reused when it's not referenced anymore
+void name_pool_release (NamePool *pool, guint32 id);
+
+// the string stays at the same address while it's referenced
+const gchar *name_pool_get (NamePool *pool, guint32 id);
+
+// the number of different strings
+guint64 name_pool_get_count (NamePool *pool);
+// the total size of memory used by the pool
+gsize name_pool_get_mem_size (NamePool *pool);
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _RANGE_SET_H_
+#define _RANGE_SET_H_
+
+#include "global.h"
+
+// sorted set of non-overlapping byte ranges [off, off + len)
+typedef struct _RangeSet RangeSet;
+
+RangeSet *range_set_create ();
+void range_set_destroy (RangeSet *rs);
+
+void range_set_clear (RangeSet *rs);
+
+// add range, merging it with overlapping and adjacent ones
+void range_set_add (RangeSet *rs, off_t off, off_t len);
+// add all ranges of the other set
+void range_set_merge (RangeSet *rs, RangeSet *other);
+// remove range, splitting existing ranges if required
+void range_set_remove (RangeSet *rs, off_t off, off_t len);
+
+// return TRUE if the whole range is in the set
+gboolean range_set_contains (RangeSet *rs, off_t off, off_t len);
+
+// get the first range of the set, return FALSE if the set is empty
+gboolean range_set_get_first (RangeSet *rs, off_t *off, off_t *len);
+
+// the number of ranges and their total length
+guint range_set_get_count (RangeSet *rs);
+off_t range_set_get_total (RangeSet *rs);
+
+typedef void (*RangeSet_foreach_cb) (off_t off, off_t len, gpointer ctx);
+// call cb for each range in the set, in order
+void range_set_foreach (RangeSet *rs, RangeSet_foreach_cb cb, gpointer ctx);
+// call cb for each part of [off, off + len) which is not in the set, in order
+void range_set_foreach_missing (RangeSet *rs, off_t off, off_t len, RangeSet_foreach_cb cb, gpointer ctx);
+
+#endif
@@ -23,11 +23,12 @@
 struct dirbuf {
 	char *p;
 	size_t size;
+	size_t max_size;
 };
 
 S3Fuse *s3fuse_new (Application *app, const gchar *mountpoint);
 void s3fuse_destroy (S3Fuse *s3fuse);
 
-void s3fuse_add_dirbuf (fuse_req_t req, struct dirbuf *b, const char *name, fuse_ino_t ino);
+gboolean s3fuse_add_dirbuf (fuse_req_t req, struct dirbuf *b, const char *name, fuse_ino_t ino, off_t next_off);
 
 #endif
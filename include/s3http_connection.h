@@ -20,11 +20,15 @@
 
 #include "global.h"
 #include "s3client_pool.h"
+#include "list_parser.h"
 
 typedef enum {
     RT_list = 0,
 } RequestType;
 
+// a part of the responce body, called as it's received
+typedef void (*S3HttpConnection_chunk_cb) (S3HttpConnection *con, gpointer ctx, const gchar *buf, size_t buf_len);
+
 struct _S3HttpConnection {
     Application *app;
 
@@ -34,6 +38,13 @@ struct _S3HttpConnection {
     struct evhttp_connection *evcon;
     gchar *bucket_name;
 
+    // headers which are added to the next request
+    GList *l_output_headers;
+    // body callback of the next request
+    S3HttpConnection_chunk_cb chunk_cb;
+    // HTTP code of the last responce, 0 if the server isn't reached
+    gint response_code;
+
     // is taken by high level
     gboolean is_acquired;
 };
@@ -43,7 +54,8 @@ gpointer s3http_connection_create (Application *app);
 void s3http_connection_destroy (gpointer data);
 
 gchar *s3http_connection_get_auth_string (Application *app, 
-        const gchar *method, const gchar *content_type, const gchar *resource, const gchar *time_str);
+        const gchar *method, const gchar *content_md5, const gchar *content_type, 
+        const gchar *amz_headers, const gchar *resource, const gchar *time_str);
 
 void s3http_connection_set_on_released_cb (gpointer client, S3ClientPool_on_released_cb client_on_released_cb, gpointer ctx);
 gboolean s3http_connection_check_rediness (gpointer client);
@@ -63,17 +75,98 @@ struct evhttp_request *s3http_connection_create_request (S3HttpConnection *con,
 
 
 typedef void (*S3HttpConnection_directory_listing_callback) (gpointer callback_data, gboolean success);
-gboolean s3http_connection_get_directory_listing (S3HttpConnection *con, const gchar *path, fuse_ino_t ino,
+// generation is returned by dir_tree_start_update (), progress is reported after every page
+gboolean s3http_connection_get_directory_listing (S3HttpConnection *con, const gchar *path, fuse_ino_t ino, guint32 generation,
     S3HttpConnection_directory_listing_callback directory_listing_callback, gpointer callback_data);
 
 typedef void (*S3HttpConnection_on_entry_sent_cb) (gpointer ctx, gboolean success);
 gboolean s3http_connection_file_send (S3HttpConnection *con, int fd, const gchar *resource_path, 
     S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx);
+gboolean s3http_connection_buffer_send (S3HttpConnection *con, const gchar *buf, size_t buf_len, const gchar *resource_path, 
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx);
+
+gboolean s3http_connection_buffer_add_file (struct evbuffer *buf, int fd, off_t off, off_t len);
+
+// get the range of object content
+typedef void (*S3HttpConnection_on_range_received_cb) (gpointer ctx, gboolean success, const gchar *buf, size_t buf_len);
+gboolean s3http_connection_get_range (S3HttpConnection *con, const gchar *resource_path, off_t off, off_t len,
+    S3HttpConnection_on_range_received_cb on_range_received_cb, gpointer ctx);
+
+// a part of multipart upload
+typedef struct {
+    gboolean is_copy; // copy range from the existing object, otherwise send it from the file
+    off_t off; // offset in the object and in the file
+    off_t len;
+} S3HttpConnectionPart;
+
+// minimal size of multipart upload part, except the last one
+#define S3_MULTIPART_MIN_PART_SIZE (5 * 1024 * 1024)
+// maximal size of multipart upload part and of PUT object request
+#define S3_MULTIPART_MAX_PART_SIZE ((off_t) 5 * 1024 * 1024 * 1024)
+#define S3_MULTIPART_MAX_PARTS 10000
+
+// create a new version of the object from the parts, 
+// ranges which are not copied are sent from the file.
+// Copies fail unless the object still has copy_source_etag, if it's not NULL
+gboolean s3http_connection_multipart_send (S3HttpConnection *con, int fd, const gchar *resource_path, 
+    const gchar *copy_source_etag, GArray *a_parts, S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx);
+// copy object, which is too big for a single PUT copy request
+gboolean s3http_connection_multipart_copy (S3HttpConnection *con, const gchar *src_path, const gchar *dst_path, 
+    off_t size, S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx);
+
+// server-side copy of the object, connection is released when done
+gboolean s3http_connection_object_copy (S3HttpConnection *con, const gchar *src_path, const gchar *dst_path, 
+    off_t size, S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx);
+
+// remove the object, connection is released when done
+gboolean s3http_connection_object_delete (S3HttpConnection *con, const gchar *resource_path, 
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx);
+
+// max number of objects in Multi-Object Delete request
+#define S3_DELETE_MAX_KEYS 1000
+
+// remove up to S3_DELETE_MAX_KEYS objects, connection is released when done
+// h_failed contains paths of objects which were not removed, it's NULL if request failed
+typedef void (*S3HttpConnection_on_objects_deleted_cb) (gpointer ctx, gboolean success, GHashTable *h_failed);
+gboolean s3http_connection_objects_delete (S3HttpConnection *con, GPtrArray *a_paths, 
+    S3HttpConnection_on_objects_deleted_cb on_objects_deleted_cb, gpointer ctx);
+
+// flat listing of all objects, which names start with the prefix (without leading '/'),
+// on_object_cb is called for each object, connection is released when done
+typedef void (*S3HttpConnection_on_object_cb) (gpointer ctx, const gchar *key, off_t size, const gchar *etag);
+gboolean s3http_connection_object_list (S3HttpConnection *con, const gchar *prefix, 
+    S3HttpConnection_on_object_cb on_object_cb, S3HttpConnection_on_entry_sent_cb on_done_cb, gpointer ctx);
+
+// check if the object (resource_path "/dir/name") exists by HEAD request, or if it's a directory:
+// there are objects under "dir/name/". success is FALSE if the server isn't reached,
+// connection is released when done
+typedef void (*S3HttpConnection_on_object_stat_cb) (gpointer ctx, gboolean success, gboolean exists, gboolean is_dir,
+    off_t size, const gchar *etag);
+gboolean s3http_connection_object_stat (S3HttpConnection *con, const gchar *resource_path, 
+    S3HttpConnection_on_object_stat_cb on_object_stat_cb, gpointer ctx);
+
+// request string of a listing page of objects, which names start with the prefix (without leading '/'),
+// the page continues the previous one by the token (ListObjectsV2) or starts after the marker, both can be NULL,
+// max_keys is 0 for pages of list_max_keys
+gchar *s3http_connection_get_list_request_str (S3HttpConnection *con, const gchar *prefix, gboolean use_delimiter,
+    const gchar *marker, const gchar *token, gint max_keys);
+// position of the page after the truncated one, marker is set to the last key of the page,
+// returns FALSE if the listing can't be continued
+gboolean s3http_connection_list_next_page (S3HttpConnection *con, ListParser *parser, gchar **marker, gchar **token);
 
 typedef void (*S3HttpConnection_responce_cb) (S3HttpConnection *con, gpointer ctx, 
         const gchar *buf, size_t buf_len, struct evkeyvalq *headers);
+// con->response_code is the HTTP code of the error, 0 if the request failed
 typedef void (*S3HttpConnection_error_cb) (S3HttpConnection *con, gpointer ctx);
 
+// add an header to the next request made by s3http_connection_make_request ()
+// Content-MD5, Content-Type and x-amz-* headers are included into the signature
+void s3http_connection_add_output_header (S3HttpConnection *con, const gchar *key, const gchar *value);
+
+// the body of the next successful responce is passed to chunk_cb in parts as it's received,
+// responce_cb is called when the body is complete and gets the rest of it (usually nothing)
+void s3http_connection_set_chunk_cb (S3HttpConnection *con, S3HttpConnection_chunk_cb chunk_cb);
+
 gboolean s3http_connection_make_request (S3HttpConnection *con, 
     const gchar *resource_path, const gchar *request_str,
     const gchar *http_cmd,
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _SLAB_ARENA_H_
+#define _SLAB_ARENA_H_
+
+#include "global.h"
+
+// allocator of fixed-size records, records are carved out of big slabs
+// and freed records are reused, so there is no per-record malloc overhead
+typedef struct _SlabArena SlabArena;
+
+SlabArena *slab_arena_create (gsize record_size);
+// all records are freed
+void slab_arena_destroy (SlabArena *arena);
+
+// return zero-filled record
+gpointer slab_arena_alloc (SlabArena *arena);
+void slab_arena_free (SlabArena *arena, gpointer rec);
+
+// the number of allocated records
+guint64 slab_arena_get_count (SlabArena *arena);
+// the total size of memory used by the arena
+gsize slab_arena_get_mem_size (SlabArena *arena);
+
+#endif
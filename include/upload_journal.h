@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _UPLOAD_JOURNAL_H_
+#define _UPLOAD_JOURNAL_H_
+
+#include "global.h"
+
+UploadJournal *upload_journal_create (Application *app, const gchar *journal_path);
+void upload_journal_destroy (UploadJournal *journal);
+
+// store information about a pending upload of tmp file to resource path
+// tmp file content must be already synced to the disk,
+// checksum is MD5 hex string of tmp file content, it's calculated by reading the file if NULL
+// return record ID, or 0 if failed
+guint64 upload_journal_add (UploadJournal *journal, const gchar *resource_path, const gchar *tmp_path, int fd,
+    const gchar *checksum);
+
+// upload is complete, remove record and the older records of the same file
+void upload_journal_remove (UploadJournal *journal, guint64 id);
+
+// file (or directory, if recursive) is removed, drop all its records
+void upload_journal_remove_path (UploadJournal *journal, const gchar *resource_path, gboolean recursive);
+
+// file (or directory, if recursive) is renamed, pending uploads are replayed to the new path
+void upload_journal_rename (UploadJournal *journal, const gchar *src_path, const gchar *dst_path, gboolean recursive);
+
+// upload all files which were not sent before the previous shutdown
+void upload_journal_replay (UploadJournal *journal);
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _UPLOAD_PLAN_H_
+#define _UPLOAD_PLAN_H_
+
+#include "global.h"
+#include "range_set.h"
+#include "s3http_connection.h"
+
+// split a new version of the object into multipart upload parts (S3HttpConnectionPart):
+// ranges of [0, base_size) which are not in the dirty set are copied from the original object,
+// everything else is sent from the file.
+// Return FALSE and leave a_parts empty, if the whole object should be sent by a single PUT
+gboolean upload_plan_build (GArray *a_parts, RangeSet *dirty, off_t base_size, off_t size);
+
+// make parts fit multipart upload limits: each part, except the last one, 
+// is at least S3_MULTIPART_MIN_PART_SIZE and none is bigger than S3_MULTIPART_MAX_PART_SIZE
+void upload_plan_normalize (GArray *a_parts);
+
+#endif
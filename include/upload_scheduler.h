@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _UPLOAD_SCHEDULER_H_
+#define _UPLOAD_SCHEDULER_H_
+
+#include "global.h"
+#include "s3client_pool.h"
+
+UploadScheduler *upload_scheduler_create (Application *app, S3ClientPool *pool);
+void upload_scheduler_destroy (UploadScheduler *sched);
+
+// add upload of size bytes to the awaiting queue of its lane, the upload is never refused,
+// on_client_ready is called when both lane and pool have a free connection
+void upload_scheduler_get_client (UploadScheduler *sched, guint64 size, 
+    S3ClientPool_on_client_ready on_client_ready, gpointer ctx);
+
+// upload of size bytes is finished (successfully or not), start the next one
+void upload_scheduler_release (UploadScheduler *sched, guint64 size);
+
+#endif
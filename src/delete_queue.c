@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "delete_queue.h"
+#include "s3http_connection.h"
+
+/*{{{ struct */
+
+// removals are collected for a short time and sent as Multi-Object Delete requests,
+// a single object is removed by a plain DELETE request
+
+struct _DeleteQueue {
+    Application *app;
+    S3ClientPool *pool;
+
+    GQueue *q_pending; // DeleteItem, waiting to be sent
+    GQueue *q_held; // DeleteItem, waiting for delete_queue_send_held ()
+    GHashTable *h_paths; // path -> number of queued or sent removals
+    GHashTable *h_waiters; // path -> GQueue of DeleteItem, waiting until all removals of the path are done
+    struct event *ev_flush;
+    struct timeval flush_tv;
+    gboolean flush_scheduled;
+};
+
+struct _DeleteItem {
+    gchar *path;
+    DeleteQueue_on_deleted_cb on_deleted_cb;
+    gpointer ctx;
+};
+
+typedef struct {
+    DeleteQueue *dq;
+    GPtrArray *a_items; // DeleteItem
+} DeleteBatch;
+
+#define DQ_LOG "del_queue"
+
+static void delete_queue_on_flush (evutil_socket_t fd, short what, void *arg);
+static void delete_queue_free_waiters (gpointer data);
+
+/*}}}*/
+
+/*{{{ create / destroy */
+
+DeleteQueue *delete_queue_create (Application *app, S3ClientPool *pool)
+{
+    DeleteQueue *dq;
+    AppConf *conf;
+
+    conf = application_get_conf (app);
+
+    dq = g_new0 (DeleteQueue, 1);
+    dq->app = app;
+    dq->pool = pool;
+    dq->q_pending = g_queue_new ();
+    dq->q_held = g_queue_new ();
+    dq->h_paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    dq->h_waiters = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, delete_queue_free_waiters);
+    dq->flush_tv.tv_sec = conf->delete_batch_delay / 1000;
+    dq->flush_tv.tv_usec = (conf->delete_batch_delay % 1000) * 1000;
+    dq->flush_scheduled = FALSE;
+
+    dq->ev_flush = evtimer_new (application_get_evbase (app), delete_queue_on_flush, dq);
+    if (!dq->ev_flush) {
+        LOG_err (DQ_LOG, "Failed to create timer event !");
+        delete_queue_destroy (dq);
+        return NULL;
+    }
+
+    LOG_debug (DQ_LOG, "DeleteQueue created, delay: %d ms", conf->delete_batch_delay);
+
+    return dq;
+}
+
+static void delete_item_free (DeleteItem *item)
+{
+    g_free (item->path);
+    g_free (item);
+}
+
+// the last removal of the path is done, let waiters continue
+static void delete_queue_notify_waiters (DeleteQueue *dq, const gchar *path, gboolean success)
+{
+    gpointer key, value;
+    GQueue *q_waiters;
+    DeleteItem *waiter;
+
+    if (!g_hash_table_lookup_extended (dq->h_waiters, path, &key, &value))
+        return;
+    g_hash_table_steal (dq->h_waiters, path);
+    g_free (key);
+    q_waiters = (GQueue *) value;
+
+    while ((waiter = g_queue_pop_head (q_waiters))) {
+        waiter->on_deleted_cb (waiter->ctx, success);
+        delete_item_free (waiter);
+    }
+    g_queue_free (q_waiters);
+}
+
+static void delete_item_done (DeleteQueue *dq, DeleteItem *item, gboolean success)
+{
+    guint count;
+
+    count = GPOINTER_TO_UINT (g_hash_table_lookup (dq->h_paths, item->path));
+    if (count > 1)
+        g_hash_table_insert (dq->h_paths, g_strdup (item->path), GUINT_TO_POINTER (count - 1));
+    else
+        g_hash_table_remove (dq->h_paths, item->path);
+
+    if (item->on_deleted_cb)
+        item->on_deleted_cb (item->ctx, success);
+
+    if (count <= 1)
+        delete_queue_notify_waiters (dq, item->path, success);
+
+    delete_item_free (item);
+}
+
+static void delete_queue_free_waiters (gpointer data)
+{
+    g_queue_free_full ((GQueue *) data, (GDestroyNotify) delete_item_free);
+}
+
+void delete_queue_destroy (DeleteQueue *dq)
+{
+    DeleteItem *item;
+
+    // waiters are not called, their owners are being destroyed too
+    g_hash_table_destroy (dq->h_waiters);
+
+    // not sent yet
+    while ((item = g_queue_pop_head (dq->q_pending)))
+        delete_item_done (dq, item, FALSE);
+    g_queue_free (dq->q_pending);
+    while ((item = g_queue_pop_head (dq->q_held)))
+        delete_item_done (dq, item, FALSE);
+    g_queue_free (dq->q_held);
+    g_hash_table_destroy (dq->h_paths);
+
+    if (dq->ev_flush)
+        event_free (dq->ev_flush);
+
+    g_free (dq);
+}
+/*}}}*/
+
+/*{{{ batch */
+
+static void delete_batch_done (DeleteBatch *batch, gboolean success, GHashTable *h_failed)
+{
+    guint i;
+
+    for (i = 0; i < batch->a_items->len; i++) {
+        DeleteItem *item = (DeleteItem *) g_ptr_array_index (batch->a_items, i);
+        gboolean item_success = success && !(h_failed && g_hash_table_lookup_extended (h_failed, item->path, NULL, NULL));
+
+        if (!item_success)
+            LOG_err (DQ_LOG, "Failed to remove %s !", item->path);
+
+        delete_item_done (batch->dq, item, item_success);
+    }
+
+    g_ptr_array_free (batch->a_items, TRUE);
+    g_free (batch);
+}
+
+static void delete_batch_on_objects_deleted (gpointer ctx, gboolean success, GHashTable *h_failed)
+{
+    delete_batch_done ((DeleteBatch *) ctx, success, h_failed);
+}
+
+static void delete_batch_on_object_deleted (gpointer ctx, gboolean success)
+{
+    delete_batch_done ((DeleteBatch *) ctx, success, NULL);
+}
+
+static void delete_batch_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *http_con = (S3HttpConnection *) client;
+    DeleteBatch *batch = (DeleteBatch *) ctx;
+    DeleteItem *item;
+    GPtrArray *a_paths;
+    guint i;
+
+    s3http_connection_acquire (http_con);
+
+    if (batch->a_items->len == 1) {
+        item = (DeleteItem *) g_ptr_array_index (batch->a_items, 0);
+        s3http_connection_object_delete (http_con, item->path, delete_batch_on_object_deleted, batch);
+        return;
+    }
+
+    a_paths = g_ptr_array_sized_new (batch->a_items->len);
+    for (i = 0; i < batch->a_items->len; i++) {
+        item = (DeleteItem *) g_ptr_array_index (batch->a_items, i);
+        g_ptr_array_add (a_paths, item->path);
+    }
+
+    s3http_connection_objects_delete (http_con, a_paths, delete_batch_on_objects_deleted, batch);
+    g_ptr_array_free (a_paths, TRUE);
+}
+
+// send all pending objects by batches
+static void delete_queue_flush (DeleteQueue *dq)
+{
+    DeleteBatch *batch;
+    DeleteItem *item;
+
+    while (!g_queue_is_empty (dq->q_pending)) {
+        batch = g_new0 (DeleteBatch, 1);
+        batch->dq = dq;
+        batch->a_items = g_ptr_array_new ();
+
+        while (batch->a_items->len < S3_DELETE_MAX_KEYS && (item = g_queue_pop_head (dq->q_pending)))
+            g_ptr_array_add (batch->a_items, item);
+
+        if (!s3client_pool_get_client (dq->pool, delete_batch_on_http_ready, batch)) {
+            guint i;
+
+            // pool is busy, try again later
+            LOG_debug (DQ_LOG, "Pool is busy, delaying %u removals", batch->a_items->len);
+            for (i = batch->a_items->len; i > 0; i--)
+                g_queue_push_head (dq->q_pending, g_ptr_array_index (batch->a_items, i - 1));
+            g_ptr_array_free (batch->a_items, TRUE);
+            g_free (batch);
+
+            if (!dq->flush_scheduled) {
+                dq->flush_scheduled = TRUE;
+                evtimer_add (dq->ev_flush, &dq->flush_tv);
+            }
+            return;
+        }
+    }
+}
+
+static void delete_queue_on_flush (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short what, void *arg)
+{
+    DeleteQueue *dq = (DeleteQueue *) arg;
+
+    dq->flush_scheduled = FALSE;
+    delete_queue_flush (dq);
+}
+/*}}}*/
+
+// create removal of the object, it's pending from now on
+static DeleteItem *delete_queue_item_new (DeleteQueue *dq, const gchar *path, DeleteQueue_on_deleted_cb on_deleted_cb, gpointer ctx)
+{
+    DeleteItem *item;
+
+    item = g_new0 (DeleteItem, 1);
+    item->path = g_strdup (path);
+    item->on_deleted_cb = on_deleted_cb;
+    item->ctx = ctx;
+    g_hash_table_insert (dq->h_paths, g_strdup (path), 
+        GUINT_TO_POINTER (GPOINTER_TO_UINT (g_hash_table_lookup (dq->h_paths, path)) + 1));
+
+    return item;
+}
+
+static void delete_queue_push (DeleteQueue *dq, DeleteItem *item)
+{
+    g_queue_push_tail (dq->q_pending, item);
+
+    // batch is full, send it right away
+    if (g_queue_get_length (dq->q_pending) >= S3_DELETE_MAX_KEYS) {
+        if (dq->flush_scheduled) {
+            evtimer_del (dq->ev_flush);
+            dq->flush_scheduled = FALSE;
+        }
+        delete_queue_flush (dq);
+        return;
+    }
+
+    if (!dq->flush_scheduled) {
+        dq->flush_scheduled = TRUE;
+        evtimer_add (dq->ev_flush, &dq->flush_tv);
+    }
+}
+
+void delete_queue_add (DeleteQueue *dq, const gchar *path, DeleteQueue_on_deleted_cb on_deleted_cb, gpointer ctx)
+{
+    delete_queue_push (dq, delete_queue_item_new (dq, path, on_deleted_cb, ctx));
+}
+
+// removal is counted as pending right away, so uploads of a new object wait for it,
+// but it's sent only after the object is created for the last time
+DeleteItem *delete_queue_hold (DeleteQueue *dq, const gchar *path, DeleteQueue_on_deleted_cb on_deleted_cb, gpointer ctx)
+{
+    DeleteItem *item;
+
+    LOG_debug (DQ_LOG, "Removal of %s is held", path);
+
+    item = delete_queue_item_new (dq, path, on_deleted_cb, ctx);
+    g_queue_push_tail (dq->q_held, item);
+
+    return item;
+}
+
+void delete_queue_send_held (DeleteQueue *dq, DeleteItem *item)
+{
+    g_queue_remove (dq->q_held, item);
+    delete_queue_push (dq, item);
+}
+
+// return TRUE if the object is going to be removed
+gboolean delete_queue_is_pending (DeleteQueue *dq, const gchar *path)
+{
+    return g_hash_table_lookup (dq->h_paths, path) != NULL;
+}
+
+// object is created again, forget removals which are not sent yet,
+// their callbacks are called as if objects were removed
+void delete_queue_cancel (DeleteQueue *dq, const gchar *path)
+{
+    GList *l, *l_next;
+
+    if (!delete_queue_is_pending (dq, path))
+        return;
+
+    for (l = g_queue_peek_head_link (dq->q_pending); l; l = l_next) {
+        DeleteItem *item = (DeleteItem *) l->data;
+        l_next = g_list_next (l);
+
+        if (strcmp (item->path, path))
+            continue;
+
+        LOG_debug (DQ_LOG, "Removal of %s is canceled", path);
+        g_queue_delete_link (dq->q_pending, l);
+        delete_item_done (dq, item, TRUE);
+    }
+}
+
+// call on_deleted_cb when queued and sent removals of the object are done,
+// so a new version of it is not removed by them
+gboolean delete_queue_wait (DeleteQueue *dq, const gchar *path, DeleteQueue_on_deleted_cb on_deleted_cb, gpointer ctx)
+{
+    GQueue *q_waiters;
+    DeleteItem *waiter;
+
+    if (!delete_queue_is_pending (dq, path))
+        return FALSE;
+
+    LOG_debug (DQ_LOG, "Waiting for removal of %s", path);
+
+    q_waiters = g_hash_table_lookup (dq->h_waiters, path);
+    if (!q_waiters) {
+        q_waiters = g_queue_new ();
+        g_hash_table_insert (dq->h_waiters, g_strdup (path), q_waiters);
+    }
+
+    waiter = g_new0 (DeleteItem, 1);
+    waiter->path = g_strdup (path);
+    waiter->on_deleted_cb = on_deleted_cb;
+    waiter->ctx = ctx;
+    g_queue_push_tail (q_waiters, waiter);
+
+    return TRUE;
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "dir_snapshot.h"
+#include <sys/mman.h>
+
+/*{{{ struct */
+
+#define DIR_SNAPSHOT_MAGIC "S3FFSDIR"
+#define DIR_SNAPSHOT_BUCKET_LEN 256
+
+// records follow the header, then names, NUL terminated. Numbers are in the host byte order
+typedef struct {
+    gchar magic[8];
+    guint32 version;
+    guint32 entry_size; // sizeof (DirSnapshotEntry)
+    guint64 count; // the number of records
+    guint64 names_off;
+    guint64 names_size;
+    guint64 created; // time of the snapshot
+    gchar bucket_name[DIR_SNAPSHOT_BUCKET_LEN];
+} DirSnapshotHeader;
+
+struct _DirSnapshot {
+    gchar *addr;
+    gsize len;
+    const DirSnapshotEntry *a_entries;
+    guint32 count;
+    const gchar *names;
+    guint64 names_size;
+};
+
+struct _DirSnapshotWriter {
+    gchar *path;
+    gchar *tmp_path;
+    FILE *f;
+    FILE *f_names; // names are collected in a temporary file and appended to records
+    DirSnapshotHeader header;
+    gboolean failed;
+};
+
+#define SNAPSHOT_LOG "snapshot"
+
+/*}}}*/
+
+/*{{{ reader */
+
+DirSnapshot *dir_snapshot_open (const gchar *path, const gchar *bucket_name)
+{
+    DirSnapshot *snap;
+    const DirSnapshotHeader *header;
+    struct stat st;
+    int fd;
+    gpointer addr;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        LOG_debug (SNAPSHOT_LOG, "No snapshot %s: %s", path, strerror (errno));
+        return NULL;
+    }
+
+    if (fstat (fd, &st) < 0 || (gsize) st.st_size < sizeof (DirSnapshotHeader)) {
+        LOG_err (SNAPSHOT_LOG, "Snapshot %s is too short !", path);
+        close (fd);
+        return NULL;
+    }
+
+    addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (addr == MAP_FAILED) {
+        LOG_err (SNAPSHOT_LOG, "Failed to map snapshot %s: %s", path, strerror (errno));
+        return NULL;
+    }
+
+    snap = g_new0 (DirSnapshot, 1);
+    snap->addr = addr;
+    snap->len = st.st_size;
+
+    header = (const DirSnapshotHeader *) addr;
+    if (memcmp (header->magic, DIR_SNAPSHOT_MAGIC, sizeof (header->magic)) || 
+        header->version != DIR_SNAPSHOT_VERSION || header->entry_size != sizeof (DirSnapshotEntry) ||
+        !header->count || header->count > G_MAXUINT32 ||
+        header->names_off != sizeof (DirSnapshotHeader) + header->count * sizeof (DirSnapshotEntry) ||
+        header->names_off + header->names_size > snap->len) {
+        LOG_err (SNAPSHOT_LOG, "Snapshot %s is not valid, ignoring it", path);
+        dir_snapshot_close (snap);
+        return NULL;
+    }
+
+    if (strncmp (header->bucket_name, bucket_name, sizeof (header->bucket_name))) {
+        LOG_msg (SNAPSHOT_LOG, "Snapshot %s belongs to another bucket, ignoring it", path);
+        dir_snapshot_close (snap);
+        return NULL;
+    }
+
+    snap->a_entries = (const DirSnapshotEntry *) (snap->addr + sizeof (DirSnapshotHeader));
+    snap->count = header->count;
+    snap->names = snap->addr + header->names_off;
+    snap->names_size = header->names_size;
+
+    // directories are read when they are accessed
+    madvise (snap->addr, snap->len, MADV_RANDOM);
+
+    LOG_msg (SNAPSHOT_LOG, "Using snapshot %s of %u entries, created %"G_GUINT64_FORMAT" seconds ago", 
+        path, snap->count, (guint64) MAX ((gint64) time (NULL) - (gint64) header->created, 0));
+
+    return snap;
+}
+
+void dir_snapshot_close (DirSnapshot *snap)
+{
+    munmap (snap->addr, snap->len);
+    g_free (snap);
+}
+
+guint32 dir_snapshot_get_count (DirSnapshot *snap)
+{
+    return snap->count;
+}
+
+const DirSnapshotEntry *dir_snapshot_get_entry (DirSnapshot *snap, guint32 id)
+{
+    if (id >= snap->count)
+        return NULL;
+
+    return &snap->a_entries[id];
+}
+
+const gchar *dir_snapshot_get_name (DirSnapshot *snap, const DirSnapshotEntry *rec)
+{
+    if (rec->name_off >= snap->names_size || 
+        !memchr (snap->names + rec->name_off, '\0', snap->names_size - rec->name_off))
+        return NULL;
+
+    return snap->names + rec->name_off;
+}
+/*}}}*/
+
+/*{{{ writer */
+
+DirSnapshotWriter *dir_snapshot_writer_create (const gchar *path, const gchar *bucket_name)
+{
+    DirSnapshotWriter *writer;
+    gchar *names_path;
+
+    writer = g_new0 (DirSnapshotWriter, 1);
+    writer->path = g_strdup (path);
+    writer->tmp_path = g_strdup_printf ("%s.tmp", path);
+
+    memcpy (writer->header.magic, DIR_SNAPSHOT_MAGIC, sizeof (writer->header.magic));
+    writer->header.version = DIR_SNAPSHOT_VERSION;
+    writer->header.entry_size = sizeof (DirSnapshotEntry);
+    writer->header.created = time (NULL);
+    strncpy (writer->header.bucket_name, bucket_name, sizeof (writer->header.bucket_name) - 1);
+
+    writer->f = fopen (writer->tmp_path, "w");
+    names_path = g_strdup_printf ("%s.names", writer->tmp_path);
+    writer->f_names = fopen (names_path, "w+");
+    if (writer->f_names)
+        unlink (names_path);
+    g_free (names_path);
+
+    if (!writer->f || !writer->f_names) {
+        LOG_err (SNAPSHOT_LOG, "Failed to create snapshot %s: %s", writer->tmp_path, strerror (errno));
+        dir_snapshot_writer_finish (writer, FALSE);
+        return NULL;
+    }
+
+    // the header is written when the snapshot is complete
+    if (fwrite (&writer->header, sizeof (writer->header), 1, writer->f) != 1)
+        writer->failed = TRUE;
+
+    return writer;
+}
+
+gboolean dir_snapshot_writer_add (DirSnapshotWriter *writer, DirSnapshotEntry *rec, const gchar *name)
+{
+    size_t len = strlen (name) + 1;
+
+    if (writer->failed)
+        return FALSE;
+
+    if (writer->header.names_size + len > G_MAXUINT32 || writer->header.count >= G_MAXUINT32) {
+        LOG_err (SNAPSHOT_LOG, "Snapshot is too big !");
+        writer->failed = TRUE;
+        return FALSE;
+    }
+
+    rec->name_off = writer->header.names_size;
+    if (fwrite (rec, sizeof (DirSnapshotEntry), 1, writer->f) != 1 || fwrite (name, len, 1, writer->f_names) != 1) {
+        writer->failed = TRUE;
+        return FALSE;
+    }
+
+    writer->header.count++;
+    writer->header.names_size += len;
+
+    return TRUE;
+}
+
+// append names to the records
+static gboolean dir_snapshot_writer_copy_names (DirSnapshotWriter *writer)
+{
+    gchar buf[64 * 1024];
+    size_t len;
+
+    if (fflush (writer->f_names) || fseek (writer->f_names, 0, SEEK_SET))
+        return FALSE;
+
+    while ((len = fread (buf, 1, sizeof (buf), writer->f_names)) > 0) {
+        if (fwrite (buf, 1, len, writer->f) != len)
+            return FALSE;
+    }
+
+    return !ferror (writer->f_names);
+}
+
+gboolean dir_snapshot_writer_finish (DirSnapshotWriter *writer, gboolean commit)
+{
+    gboolean res = FALSE;
+
+    if (commit && !writer->failed && writer->header.count) {
+        writer->header.names_off = sizeof (DirSnapshotHeader) + writer->header.count * sizeof (DirSnapshotEntry);
+
+        res = dir_snapshot_writer_copy_names (writer) &&
+            !fseek (writer->f, 0, SEEK_SET) &&
+            fwrite (&writer->header, sizeof (writer->header), 1, writer->f) == 1 &&
+            !fflush (writer->f) && !fsync (fileno (writer->f));
+        if (!res)
+            LOG_err (SNAPSHOT_LOG, "Failed to write snapshot %s: %s", writer->tmp_path, strerror (errno));
+    }
+
+    if (writer->f && fclose (writer->f))
+        res = FALSE;
+    if (writer->f_names)
+        fclose (writer->f_names);
+
+    if (res && rename (writer->tmp_path, writer->path) < 0) {
+        LOG_err (SNAPSHOT_LOG, "Failed to rename snapshot %s: %s", writer->tmp_path, strerror (errno));
+        res = FALSE;
+    }
+    if (!res)
+        unlink (writer->tmp_path);
+    else
+        LOG_debug (SNAPSHOT_LOG, "Snapshot %s of %"G_GUINT64_FORMAT" entries is written", writer->path, writer->header.count);
+
+    g_free (writer->path);
+    g_free (writer->tmp_path);
+    g_free (writer);
+
+    return res;
+}
+/*}}}*/
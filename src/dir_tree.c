@@ -16,56 +16,99 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "dir_tree.h"
+#include "dir_entry.h"
 #include "s3fuse.h"
 #include "s3http_connection.h"
 #include "s3http_client.h"
 #include "s3client_pool.h"
-
+#include "upload_journal.h"
+#include "upload_scheduler.h"
+#include "range_set.h"
+#include "upload_plan.h"
+#include "delete_queue.h"
+#include "slab_arena.h"
+#include "name_pool.h"
+#include "inode_table.h"
+#include "dir_snapshot.h"
+
+// full paths of recently used directories, indexed by inode
 typedef struct {
-    fuse_ino_t ino;
-    fuse_ino_t parent_ino;
-    gchar *basename;
-    gchar *fullpath;
-    guint64 age;
-    
-    // type of directory entry
-    DirEntryType type;
-
-    gboolean is_modified; // do not show it
-
-    off_t size;
-    mode_t mode;
-    time_t ctime;
-
-    // for type == DET_dir
-    char *dir_cache; // FUSE directory cache
-    size_t dir_cache_size; // directory cache size
-    time_t dir_cache_created;
+    guint32 ino;
+    guint32 epoch;
+    gchar *path;
+} DirTreePathCacheItem;
 
-    GHashTable *h_dir_tree; // name -> data
-    gpointer op_data;
-} DirEntry;
+#define DIR_TREE_PATH_CACHE_SIZE 256
 
 struct _DirTree {
     DirEntry *root;
-    GHashTable *h_inodes; // inode -> DirEntry
+    InodeTable *inodes; // inode -> DirEntry
     Application *app;
 
-    fuse_ino_t max_ino;
-    guint64 current_age;
+    SlabArena *file_arena; // DirEntry records of files
+    SlabArena *dir_arena; // DirEntryDir records of directories
+    NamePool *names; // base names of entries
+
+    // cached paths are valid while the epoch is the same, it's changed when entries are moved or removed
+    DirTreePathCacheItem path_cache[DIR_TREE_PATH_CACHE_SIZE];
+    guint32 path_epoch;
+    GHashTable *h_detached_paths; // detached DirEntry -> its last full path
+
     time_t dir_cache_max_time; // max time of dir cache in seconds
+    time_t dir_cache_max_stale; // max age of dir cache, which is served while it's refreshed
 
     gint64 current_write_ops; // the number of current write operations
+
+    guint64 write_buf_size; // total size of in-memory write buffers
+    guint64 upload_pending_size; // total size of files being uploaded
+
+    GQueue *q_read_cache; // closed files, which staging data is kept for reads, LRU first
+    guint64 read_cache_size; // total size of cached staging data
+
+    // the whole tree under index_prefix is built from a flat listing
+    gchar *index_prefix; // key prefix of the index ("dir/"), empty for the whole bucket
+    struct event *ev_index_refresh;
+    gboolean is_indexing;
+
+    // entries of the previous mount, directories are loaded from it on the first access
+    DirSnapshot *snapshot;
+    gchar *snapshot_path;
+    struct event *ev_snapshot;
+    pid_t snapshot_pid; // child process which writes the snapshot, 0 if none
+
+    GHashTable *h_negative; // "<parent ino>/<name>" of names which don't exist -> expiration time
+    guint64 index_mem_size; // total size of sorted children arrays, names are looked up in them
 };
 
 #define DIR_TREE_LOG "dir_tree"
 #define DIR_DEFAULT_MODE S_IFDIR | 0755
 #define FILE_DEFAULT_MODE S_IFREG | 0444
 
+// objects smaller than this are always uploaded as a whole
+#define FILE_PATCH_MIN_SIZE (2 * S3_MULTIPART_MIN_PART_SIZE)
+// max size of original data requested at once
+#define FILE_FETCH_CHUNK_SIZE (4 * 1024 * 1024)
+// max delay between retries of failed upload of closed file (seconds)
+#define FILE_UPLOAD_RETRY_MAX_DELAY 60
+// max number of names in the negative lookup cache, it's cleared when it's full
+#define DIR_TREE_NEGATIVE_CACHE_SIZE 10000
+
 static DirEntry *dir_tree_add_entry (DirTree *dtree, const gchar *basename, mode_t mode, 
     DirEntryType type, fuse_ino_t parent_ino, off_t size, time_t ctime);
 static void dir_tree_entry_modified (DirTree *dtree, DirEntry *en);
-static void dir_entry_destroy (gpointer data);
+static void dir_entry_destroy (DirTree *dtree, DirEntry *en);
+static void dir_tree_entry_detach (DirTree *dtree, DirEntry *en);
+static off_t dir_tree_file_get_size (DirEntry *en);
+static void dir_tree_file_cache_invalidate (DirEntry *en);
+static void dir_tree_file_cache_clear (DirTree *dtree);
+static void dir_tree_listing_detach (DirTreeListing *listing);
+static void dir_tree_index_start (DirTree *dtree);
+static void dir_tree_index_on_refresh (evutil_socket_t fd, short what, void *arg);
+static void dir_tree_dir_load (DirTree *dtree, DirEntry *dir_en);
+static gboolean dir_tree_snapshot_write (DirTree *dtree);
+static gboolean dir_tree_snapshot_wait (DirTree *dtree, gboolean block);
+static void dir_tree_snapshot_on_timer (evutil_socket_t fd, short what, void *arg);
+static void dir_tree_negative_remove (DirTree *dtree, fuse_ino_t parent_ino, const gchar *name);
 
 DirTree *dir_tree_create (Application *app)
 {
@@ -76,14 +119,74 @@ DirTree *dir_tree_create (Application *app)
     dtree = g_new0 (DirTree, 1);
     dtree->app = app;
     // children entries are destroyed by parent directory entries
-    dtree->h_inodes = g_hash_table_new (g_direct_hash, g_direct_equal);
-    dtree->max_ino = FUSE_ROOT_ID;
-    dtree->current_age = 0;
+    dtree->inodes = inode_table_create ();
+    dtree->file_arena = slab_arena_create (sizeof (DirEntry));
+    dtree->dir_arena = slab_arena_create (sizeof (DirEntryDir));
+    dtree->names = name_pool_create ();
+    dtree->path_epoch = 1;
+    dtree->h_detached_paths = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
     dtree->dir_cache_max_time = conf->dir_cache_max_time; //XXX
+    dtree->dir_cache_max_stale = MAX (conf->dir_cache_max_stale, conf->dir_cache_max_time);
     dtree->current_write_ops = 0;
+    dtree->write_buf_size = 0;
+    dtree->upload_pending_size = 0;
+    dtree->q_read_cache = g_queue_new ();
+    dtree->read_cache_size = 0;
+    dtree->h_negative = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
     dtree->root = dir_tree_add_entry (dtree, "/", DIR_DEFAULT_MODE, DET_dir, 0, 0, time (NULL));
 
+    if (conf->index_bucket) {
+        const gchar *prefix = conf->index_prefix ? conf->index_prefix : "";
+        size_t len;
+
+        // "dir/subdir/" or ""
+        while (*prefix == '/')
+            prefix++;
+        len = strlen (prefix);
+        while (len && prefix[len - 1] == '/')
+            len--;
+        dtree->index_prefix = len ? g_strdup_printf ("%.*s/", (int) len, prefix) : g_strdup ("");
+    }
+
+    if (conf->use_snapshot) {
+        const DirSnapshotEntry *rec;
+        gchar *snapshot_name;
+
+        // the tree depends on the bucket and on the indexed part of it
+        if (dtree->index_prefix && *dtree->index_prefix) {
+            gchar *prefix = g_uri_escape_string (dtree->index_prefix, NULL, TRUE);
+
+            snapshot_name = g_strdup_printf ("s3ffs.%s.%s.snapshot", application_get_bucket_name (app), prefix);
+            g_free (prefix);
+        } else
+            snapshot_name = g_strdup_printf ("s3ffs.%s.snapshot", application_get_bucket_name (app));
+        dtree->snapshot_path = g_build_filename (application_get_tmp_dir (app), snapshot_name, NULL);
+        g_free (snapshot_name);
+        dtree->snapshot = dir_snapshot_open (dtree->snapshot_path, application_get_bucket_name (app));
+        rec = dtree->snapshot ? dir_snapshot_get_entry (dtree->snapshot, 0) : NULL;
+        if (rec && rec->type == DET_dir) {
+            DIR_ENTRY_DIR (dtree->root)->snapshot_id = 1;
+        } else if (dtree->snapshot) {
+            dir_snapshot_close (dtree->snapshot);
+            dtree->snapshot = NULL;
+        }
+
+        dtree->ev_snapshot = evtimer_new (application_get_evbase (app), dir_tree_snapshot_on_timer, dtree);
+        if (conf->snapshot_interval > 0) {
+            struct timeval tv;
+
+            memset (&tv, 0, sizeof (tv));
+            tv.tv_sec = conf->snapshot_interval;
+            evtimer_add (dtree->ev_snapshot, &tv);
+        }
+    }
+
+    if (conf->index_bucket) {
+        dtree->ev_index_refresh = evtimer_new (application_get_evbase (app), dir_tree_index_on_refresh, dtree);
+        dir_tree_index_start (dtree);
+    }
+
     LOG_debug (DIR_TREE_LOG, "DirTree created");
 
     return dtree;
@@ -91,27 +194,271 @@ DirTree *dir_tree_create (Application *app)
 
 void dir_tree_destroy (DirTree *dtree)
 {
-    g_hash_table_destroy (dtree->h_inodes);
-    dir_entry_destroy (dtree->root);
+    guint i;
+
+    // the last state is used on the next mount
+    if (dtree->snapshot_path) {
+        dir_tree_snapshot_wait (dtree, TRUE);
+        dir_tree_snapshot_write (dtree);
+    }
+    if (dtree->ev_snapshot)
+        event_free (dtree->ev_snapshot);
+    if (dtree->snapshot)
+        dir_snapshot_close (dtree->snapshot);
+    g_free (dtree->snapshot_path);
+    if (dtree->ev_index_refresh)
+        event_free (dtree->ev_index_refresh);
+    g_free (dtree->index_prefix);
+    dir_tree_file_cache_clear (dtree);
+    g_queue_free (dtree->q_read_cache);
+    dir_entry_destroy (dtree, dtree->root);
+    inode_table_destroy (dtree->inodes);
+    g_hash_table_destroy (dtree->h_detached_paths);
+    g_hash_table_destroy (dtree->h_negative);
+    for (i = 0; i < DIR_TREE_PATH_CACHE_SIZE; i++)
+        g_free (dtree->path_cache[i].path);
+    slab_arena_destroy (dtree->file_arena);
+    slab_arena_destroy (dtree->dir_arena);
+    name_pool_destroy (dtree->names);
     g_free (dtree);
 }
 
+// approximate size of the negative lookup cache: keys and hash table slots
+static gsize dir_tree_negative_get_mem_size (DirTree *dtree)
+{
+    GHashTableIter iter;
+    gpointer key;
+    gsize size = 0;
+
+    g_hash_table_iter_init (&iter, dtree->h_negative);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        size += strlen ((const gchar *) key) + 1 + 2 * sizeof (gpointer) + sizeof (guint);
+
+    return size;
+}
+
+void dir_tree_log_mem_usage (DirTree *dtree)
+{
+    LOG_msg (DIR_TREE_LOG, "DirTree memory: entries: %zu, names: %zu, inodes: %zu, "
+        "directory index: %"G_GUINT64_FORMAT", negative cache: %zu (%u names)", 
+        slab_arena_get_mem_size (dtree->file_arena) + slab_arena_get_mem_size (dtree->dir_arena),
+        name_pool_get_mem_size (dtree->names), inode_table_get_mem_size (dtree->inodes),
+        dtree->index_mem_size, dir_tree_negative_get_mem_size (dtree), g_hash_table_size (dtree->h_negative));
+}
+
 /*{{{ dir_entry operations */
-static void dir_entry_destroy (gpointer data)
+static void dir_entry_destroy (DirTree *dtree, DirEntry *en)
 {
-    DirEntry *en = (DirEntry *) data;
+    guint32 i;
 
     if (!en)
         return;
 
-    // recursively delete entries
-    if (en->h_dir_tree)
-        g_hash_table_destroy (en->h_dir_tree);
-    if (en->dir_cache)
-        g_free (en->dir_cache);
-    g_free (en->basename);
-    g_free (en->fullpath);
-    g_free (en);
+    if (en->type == DET_dir) {
+        // recursively delete entries
+        for (i = 0; i < DIR_ENTRY_DIR (en)->children_count; i++)
+            dir_entry_destroy (dtree, DIR_ENTRY_DIR (en)->a_children[i]);
+        g_free (DIR_ENTRY_DIR (en)->a_children);
+        dtree->index_mem_size -= DIR_ENTRY_DIR (en)->children_size * sizeof (DirEntry *);
+        if (DIR_ENTRY_DIR (en)->listing)
+            dir_tree_listing_detach (DIR_ENTRY_DIR (en)->listing);
+        // cached paths could refer to it
+        dtree->path_epoch++;
+    }
+
+    if (en->is_detached)
+        g_hash_table_remove (dtree->h_detached_paths, en);
+
+    name_pool_release (dtree->names, en->name_id);
+
+    if (en->type == DET_dir)
+        slab_arena_free (dtree->dir_arena, en);
+    else
+        slab_arena_free (dtree->file_arena, en);
+}
+
+static const gchar *dir_entry_get_name (DirTree *dtree, DirEntry *en)
+{
+    return name_pool_get (dtree->names, en->name_id);
+}
+
+// set ETag as returned by server, ignore ETags which are not MD5 of the content
+static void dir_entry_set_etag (DirEntry *en, const gchar *etag)
+{
+    gchar *tmp;
+    gint i;
+
+    en->has_etag = FALSE;
+    memset (en->etag, 0, sizeof (en->etag));
+
+    if (!etag)
+        return;
+
+    tmp = g_strdup (etag);
+    g_strdelimit (tmp, "\"", ' ');
+    g_strstrip (tmp);
+
+    // multipart upload ETags look like "<md5>-<parts>"
+    if (strlen (tmp) != 32 || strchr (tmp, '-')) {
+        g_free (tmp);
+        return;
+    }
+
+    for (i = 0; i < 32; i++) {
+        if (!g_ascii_isxdigit (tmp[i])) {
+            g_free (tmp);
+            return;
+        }
+    }
+
+    for (i = 0; i < 16; i++)
+        en->etag[i] = (g_ascii_xdigit_value (tmp[i * 2]) << 4) | g_ascii_xdigit_value (tmp[i * 2 + 1]);
+    g_free (tmp);
+
+    en->has_etag = TRUE;
+}
+
+// return TRUE if the object has the same MD5 as digest
+static gboolean dir_entry_etag_equal (DirEntry *en, const guint8 *digest)
+{
+    if (!en->has_etag)
+        return FALSE;
+
+    return !memcmp (en->etag, digest, sizeof (en->etag));
+}
+
+// binary search of the child by name, pos is set to its position or to the position to insert it
+static DirEntry *dir_entry_child_find (DirTree *dtree, DirEntry *dir_en, const gchar *name, guint32 *pos)
+{
+    DirEntryDir *dir = DIR_ENTRY_DIR (dir_en);
+    guint32 lo = 0, hi = dir->children_count, mid;
+    gint cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp (name, dir_entry_get_name (dtree, dir->a_children[mid]));
+        if (!cmp) {
+            if (pos)
+                *pos = mid;
+            return dir->a_children[mid];
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    if (pos)
+        *pos = lo;
+
+    return NULL;
+}
+
+// return the child entry with the given name, NULL if not found
+static DirEntry *dir_entry_child_lookup (DirTree *dtree, DirEntry *dir_en, const gchar *name)
+{
+    return dir_entry_child_find (dtree, dir_en, name, NULL);
+}
+
+// add the entry to the directory, there must be no child with the same name
+static void dir_entry_child_insert (DirTree *dtree, DirEntry *dir_en, DirEntry *en)
+{
+    DirEntryDir *dir = DIR_ENTRY_DIR (dir_en);
+    const gchar *name = dir_entry_get_name (dtree, en);
+    guint32 pos;
+
+    // listings are sorted by key, usually the entry is appended
+    if (!dir->children_count || strcmp (name, dir_entry_get_name (dtree, dir->a_children[dir->children_count - 1])) > 0)
+        pos = dir->children_count;
+    else
+        dir_entry_child_find (dtree, dir_en, name, &pos);
+
+    if (dir->children_count == dir->children_size) {
+        dtree->index_mem_size -= dir->children_size * sizeof (DirEntry *);
+        dir->children_size = dir->children_size ? dir->children_size * 2 : 8;
+        dir->a_children = g_renew (DirEntry *, dir->a_children, dir->children_size);
+        dtree->index_mem_size += dir->children_size * sizeof (DirEntry *);
+    }
+
+    memmove (dir->a_children + pos + 1, dir->a_children + pos, (dir->children_count - pos) * sizeof (DirEntry *));
+    dir->a_children[pos] = en;
+    dir->children_count++;
+}
+
+// remove the entry from the directory
+static void dir_entry_child_remove (DirTree *dtree, DirEntry *dir_en, DirEntry *en)
+{
+    DirEntryDir *dir = DIR_ENTRY_DIR (dir_en);
+    guint32 pos;
+
+    if (dir_entry_child_find (dtree, dir_en, dir_entry_get_name (dtree, en), &pos) != en)
+        return;
+
+    dir->children_count--;
+    memmove (dir->a_children + pos, dir->a_children + pos + 1, (dir->children_count - pos) * sizeof (DirEntry *));
+
+    if (dir->children_size > 8 && dir->children_count < dir->children_size / 4) {
+        dtree->index_mem_size -= (dir->children_size / 2) * sizeof (DirEntry *);
+        dir->children_size /= 2;
+        dir->a_children = g_renew (DirEntry *, dir->a_children, dir->children_size);
+    }
+}
+
+// add the full path of the entry to the string, the root directory is ""
+static void dir_tree_entry_append_path (DirTree *dtree, DirEntry *en, GString *str)
+{
+    DirTreePathCacheItem *item = NULL;
+    DirEntry *parent_en;
+    const gchar *path;
+
+    if (en->ino == FUSE_ROOT_ID)
+        return;
+
+    // the parent directory could be destroyed already
+    if (en->is_detached) {
+        path = g_hash_table_lookup (dtree->h_detached_paths, en);
+        if (path)
+            g_string_append (str, path);
+        return;
+    }
+
+    if (en->type == DET_dir) {
+        item = &dtree->path_cache[en->ino % DIR_TREE_PATH_CACHE_SIZE];
+        if (item->ino == en->ino && item->epoch == dtree->path_epoch) {
+            g_string_append (str, item->path);
+            return;
+        }
+    }
+
+    parent_en = inode_table_lookup (dtree->inodes, en->parent_ino);
+    if (!parent_en) {
+        LOG_err (DIR_TREE_LOG, "Parent not found for ino: %"INO_FMT" !", (fuse_ino_t) en->ino);
+        return;
+    }
+
+    dir_tree_entry_append_path (dtree, parent_en, str);
+    g_string_append_c (str, '/');
+    g_string_append (str, dir_entry_get_name (dtree, en));
+
+    if (item) {
+        g_free (item->path);
+        item->path = g_strdup (str->str);
+        item->ino = en->ino;
+        item->epoch = dtree->path_epoch;
+    }
+}
+
+// return the full path of the entry ("/dir/file"), the string must be freed
+static gchar *dir_tree_entry_get_path (DirTree *dtree, DirEntry *en)
+{
+    GString *str;
+
+    str = g_string_sized_new (64);
+    dir_tree_entry_append_path (dtree, en, str);
+    if (!str->len)
+        g_string_append_c (str, '/');
+
+    return g_string_free (str, FALSE);
 }
 
 // create and add a new entry (file or dir) to DirTree
@@ -120,956 +467,4036 @@ static DirEntry *dir_tree_add_entry (DirTree *dtree, const gchar *basename, mode
 {
     DirEntry *en;
     DirEntry *parent_en = NULL;
-    
-    en = g_new0 (DirEntry, 1);
+    DirEntry *old_en;
+    guint32 name_id;
 
     // get the parent, for inodes > 0
     if (parent_ino) {
-        parent_en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (parent_ino));
+        parent_en = inode_table_lookup (dtree->inodes, parent_ino);
         if (!parent_en) {
             LOG_err (DIR_TREE_LOG, "Parent not found for ino: %llu !", parent_ino);
             return NULL;
         }
 
+        // entry is replaced
+        old_en = dir_entry_child_lookup (dtree, parent_en, basename);
+        if (old_en)
+            dir_tree_entry_detach (dtree, old_en);
+
         // update directory buffer
         dir_tree_entry_modified (dtree, parent_en);
-
-        if (parent_ino == 1)
-            en->fullpath = g_strdup_printf ("/%s", basename);
-        else
-            en->fullpath = g_strdup_printf ("%s/%s", parent_en->fullpath, basename);
-    } else {
-        en->fullpath = g_strdup ("/");
+        dir_tree_negative_remove (dtree, parent_ino, basename);
     }
 
-    en->ino = dtree->max_ino++;
-    en->age = dtree->current_age;
-    en->basename = g_strdup (basename);
+    name_id = name_pool_add (dtree->names, basename);
+    if (!name_id)
+        return NULL;
+
+    if (type == DET_dir)
+        en = slab_arena_alloc (dtree->dir_arena);
+    else
+        en = slab_arena_alloc (dtree->file_arena);
+
+    en->ino = inode_table_add (dtree->inodes, en);
+    if (!en->ino) {
+        name_pool_release (dtree->names, name_id);
+        slab_arena_free (type == DET_dir ? dtree->dir_arena : dtree->file_arena, en);
+        return NULL;
+    }
+    // entries are updated by listings of the parent directory
+    en->age = parent_en ? DIR_ENTRY_DIR (parent_en)->generation : 1;
+    en->name_id = name_id;
     en->mode = mode;
     en->size = size;
     en->parent_ino = parent_ino;
     en->type = type;
     en->ctime = ctime;
     en->is_modified = FALSE;
+    en->is_removing = FALSE;
+    en->is_detached = FALSE;
+    en->has_etag = FALSE;
+    en->is_indexed = FALSE;
 
-    // cache is empty
-    en->dir_cache = NULL;
-    en->dir_cache_size = 0;
-    en->dir_cache_created = 0;
-
-    LOG_debug (DIR_TREE_LOG, "Creating new DirEntry: %s, inode: %d, fullpath: %s, mode: %d", en->basename, en->ino, en->fullpath, en->mode);
+    LOG_debug (DIR_TREE_LOG, "Creating new DirEntry: %s, inode: %"INO_FMT", mode: %d", basename, (fuse_ino_t) en->ino, en->mode);
     
     if (type == DET_dir) {
-        en->h_dir_tree = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, dir_entry_destroy);
+        // not listed yet
+        DIR_ENTRY_DIR (en)->a_children = NULL;
+        DIR_ENTRY_DIR (en)->children_count = 0;
+        DIR_ENTRY_DIR (en)->children_size = 0;
+        DIR_ENTRY_DIR (en)->generation = 1;
+        DIR_ENTRY_DIR (en)->listed_generation = 0;
+        DIR_ENTRY_DIR (en)->listed = 0;
+        DIR_ENTRY_DIR (en)->listing = NULL;
+        DIR_ENTRY_DIR (en)->snapshot_id = 0;
     }
     
-    // add to global inode hash
-    g_hash_table_insert (dtree->h_inodes, GUINT_TO_POINTER (en->ino), en);
-
-    // add to the parent's hash
+    // add to the parent's children
     if (parent_ino)
-        g_hash_table_insert (parent_en->h_dir_tree, en->basename, en);
+        dir_entry_child_insert (dtree, parent_en, en);
 
     return en;
 }
 
-// increase the age of directory
-void dir_tree_start_update (DirTree *dtree, const gchar *dir_path)
-{
-    //XXX: per directory ?
-    dtree->current_age++;
-}
-
-// remove DirEntry, which age is lower than the current
-static gboolean dir_tree_stop_update_on_remove_child_cb (gpointer key, gpointer value, gpointer ctx)
+// start a new generation of the directory, entries seen by the listing are updated to it
+guint32 dir_tree_start_update (DirTree *dtree, fuse_ino_t parent_ino)
 {
-    DirTree *dtree = (DirTree *)ctx;
-    DirEntry *en = (DirEntry *) value;
-    const gchar *name = (const gchar *) key;
+    DirEntry *parent_en;
 
-    if (en->age < dtree->current_age && !en->is_modified) {
-        if (en->type == DET_dir) {
-            // XXX:
-            LOG_debug (DIR_TREE_LOG, "Unsupported: %s", en->fullpath);
-            return FALSE;
-        } else {
-            LOG_debug (DIR_TREE_LOG, "Removing %s", name);
-            //XXX:
-            return TRUE;
-        }
+    parent_en = inode_table_lookup (dtree->inodes, parent_ino);
+    if (!parent_en || parent_en->type != DET_dir) {
+        LOG_err (DIR_TREE_LOG, "DirEntry is not a directory ! ino: %"INO_FMT, parent_ino);
+        return 0;
     }
 
-    return FALSE;
+    // entries of the snapshot are updated by the listing too
+    dir_tree_dir_load (dtree, parent_en);
+
+    return ++DIR_ENTRY_DIR (parent_en)->generation;
 }
 
-// remove all entries which age is less than current
-void dir_tree_stop_update (DirTree *dtree, fuse_ino_t parent_ino)
+// listing is complete, remove entries which are not seen by it
+void dir_tree_stop_update (DirTree *dtree, fuse_ino_t parent_ino, guint32 generation)
 {
     DirEntry *parent_en;
+    GSList *l_removed = NULL, *l;
+    guint32 i;
 
-    parent_en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (parent_ino));
+    parent_en = inode_table_lookup (dtree->inodes, parent_ino);
     if (!parent_en || parent_en->type != DET_dir) {
         LOG_err (DIR_TREE_LOG, "DirEntry is not a directory ! ino: %"INO_FMT, parent_ino);
         return;
     }
-    LOG_debug (DIR_TREE_LOG, "Removing old DirEntries for: %s ..", parent_en->fullpath);
-
-    if (parent_en->type != DET_dir) {
-        LOG_err (DIR_TREE_LOG, "Parent is not a directory !");
-        return;
+    LOG_debug (DIR_TREE_LOG, "Removing old DirEntries for: %s ..", dir_entry_get_name (dtree, parent_en));
+
+    for (i = 0; i < DIR_ENTRY_DIR (parent_en)->children_count; i++) {
+        DirEntry *en = DIR_ENTRY_DIR (parent_en)->a_children[i];
+
+        if (en->age < generation && !en->is_modified) {
+            if (en->type == DET_dir) {
+                // XXX:
+                LOG_debug (DIR_TREE_LOG, "Unsupported: %s", dir_entry_get_name (dtree, en));
+            } else {
+                LOG_debug (DIR_TREE_LOG, "Removing %s", dir_entry_get_name (dtree, en));
+                l_removed = g_slist_prepend (l_removed, en);
+            }
+        }
     }
-    
-    g_hash_table_foreach_remove (parent_en->h_dir_tree, dir_tree_stop_update_on_remove_child_cb, dtree);
+
+    for (l = l_removed; l; l = g_slist_next (l))
+        dir_tree_entry_detach (dtree, (DirEntry *) l->data);
+    g_slist_free (l_removed);
+
+    // entries which are not updated by this listing are not shown,
+    // a listing started earlier could complete later
+    DIR_ENTRY_DIR (parent_en)->listed_generation = MAX (DIR_ENTRY_DIR (parent_en)->listed_generation, generation);
 }
 
 void dir_tree_update_entry (DirTree *dtree, const gchar *path, DirEntryType type, 
-    fuse_ino_t parent_ino, const gchar *entry_name, long long size)
+    fuse_ino_t parent_ino, guint32 generation, const gchar *entry_name, long long size, const gchar *etag)
 {
     DirEntry *parent_en;
     DirEntry *en;
+    gboolean is_changed = FALSE;
 
     LOG_debug (DIR_TREE_LOG, "Updating %s %ld", entry_name, size);
     
     // get parent
-    parent_en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (parent_ino));
+    parent_en = inode_table_lookup (dtree->inodes, parent_ino);
     if (!parent_en || parent_en->type != DET_dir) {
         LOG_err (DIR_TREE_LOG, "DirEntry is not a directory ! ino: %"INO_FMT, parent_ino);
         return;
     }
+    dir_tree_dir_load (dtree, parent_en);
 
     // get child
-    en = g_hash_table_lookup (parent_en->h_dir_tree, entry_name);
+    en = dir_entry_child_lookup (dtree, parent_en, entry_name);
     if (en) {
-        en->age = dtree->current_age;
+        en->age = MAX (en->age, generation);
+        is_changed = (en->size != size);
         en->size = size;
     } else {
         mode_t mode;
+        gchar *fullpath;
+        gboolean is_removing;
+
+        // removed object is still listed until DeleteQueue is done with it,
+        // path is the listed prefix: "dir/" or ""
+        fullpath = g_strdup_printf ("/%s%s", path, entry_name);
+        is_removing = delete_queue_is_pending (application_get_delete_queue (dtree->app), fullpath);
+        g_free (fullpath);
+        if (type == DET_dir && !is_removing) {
+            fullpath = g_strdup_printf ("/%s%s/", path, entry_name);
+            is_removing = delete_queue_is_pending (application_get_delete_queue (dtree->app), fullpath);
+            g_free (fullpath);
+        }
+        if (is_removing)
+            return;
 
         if (type == DET_file)
             mode = FILE_DEFAULT_MODE;
         else
             mode = DIR_DEFAULT_MODE;
             
-        dir_tree_add_entry (dtree, entry_name, mode,
+        en = dir_tree_add_entry (dtree, entry_name, mode,
             type, parent_ino, size, time (NULL));
+        if (!en)
+            return;
+        en->age = MAX (en->age, generation);
+    }
+
+    if (en->op_data) {
+        gboolean had_etag = en->has_etag;
+        guint8 old_etag[16];
+
+        memcpy (old_etag, en->etag, sizeof (old_etag));
+        dir_entry_set_etag (en, etag);
+        if (had_etag != en->has_etag || memcmp (old_etag, en->etag, sizeof (old_etag)))
+            is_changed = TRUE;
+
+        // object is modified by somebody else, cached data is stale
+        if (is_changed)
+            dir_tree_file_cache_invalidate (en);
+        return;
     }
+
+    dir_entry_set_etag (en, etag);
 }
 
-// let it know that directory cache have to be updated
+// let it know that directory has to be listed again
 static void dir_tree_entry_modified (DirTree *dtree, DirEntry *en)
 {
+    DirEntryDir *dir;
+
     if (en->type == DET_dir) {
-        if (en->dir_cache_size) {
-            g_free (en->dir_cache);
-            en->dir_cache = NULL;
-            en->dir_cache_size = 0;
-            en->dir_cache_created = 0;
-        }
+        dir = DIR_ENTRY_DIR (en);
     } else {
         DirEntry *parent_en;
         
-        parent_en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (en->parent_ino));
+        parent_en = inode_table_lookup (dtree->inodes, en->parent_ino);
         if (!parent_en) {
-            LOG_err (DIR_TREE_LOG, "Parent not found for ino: %"INO_FMT" !", en->ino);
+            LOG_err (DIR_TREE_LOG, "Parent not found for ino: %"INO_FMT" !", (fuse_ino_t) en->ino);
             return;
         }
-
-        if (parent_en->dir_cache_size) {
-            if (parent_en->dir_cache)
-                g_free (parent_en->dir_cache);
-            parent_en->dir_cache = NULL;
-            parent_en->dir_cache_size = 0;
-            parent_en->dir_cache_created = 0;
-        }
-        
-        // XXX: get parent, update dir cache
+        dir = DIR_ENTRY_DIR (parent_en);
     }
+
+    // expire the listing, it's still served while the directory is listed again
+    if (dir->listed)
+        dir->listed = MIN (dir->listed, time (NULL) - dtree->dir_cache_max_time - 1);
 }
-/*}}}*/
 
-/*{{{ dir_tree_fill_dir_buf */
+// remove the entry and all its children from the inode table
+static void dir_tree_entry_forget_inodes (DirTree *dtree, DirEntry *en)
+{
+    guint32 i;
 
-typedef struct {
-    DirTree *dtree;
-    fuse_ino_t ino;
-    size_t size;
-    off_t off;
-    dir_tree_readdir_cb readdir_cb;
-    fuse_req_t req;
-    DirEntry *en;
-} DirTreeFillDirData;
+    inode_table_remove (dtree->inodes, en->ino);
+
+    if (en->type != DET_dir)
+        return;
 
-// callback: 
-void dir_tree_fill_on_dir_buf_cb (gpointer callback_data, gboolean success)
+    for (i = 0; i < DIR_ENTRY_DIR (en)->children_count; i++)
+        dir_tree_entry_forget_inodes (dtree, DIR_ENTRY_DIR (en)->a_children[i]);
+}
+
+// drop cached data of the entry and all its children
+static void dir_tree_entry_cache_invalidate_all (DirEntry *en)
 {
-    DirTreeFillDirData *dir_fill_data = (DirTreeFillDirData *) callback_data;
-    
-    LOG_debug (DIR_TREE_LOG, "Dir fill callback: %s", success ? "SUCCESS" : "FAILED");
+    guint32 i;
 
-    if (!success) {
-        dir_fill_data->readdir_cb (dir_fill_data->req, FALSE, dir_fill_data->size, dir_fill_data->off, NULL, 0);
-    } else {
-        struct dirbuf b; // directory buffer
-        GHashTableIter iter;
-        gpointer value;
+    dir_tree_file_cache_invalidate (en);
 
-        // construct directory buffer
-        // add "." and ".."
-        memset (&b, 0, sizeof(b));
-        s3fuse_add_dirbuf (dir_fill_data->req, &b, ".", dir_fill_data->en->ino);
-        s3fuse_add_dirbuf (dir_fill_data->req, &b, "..", dir_fill_data->en->ino);
+    if (en->type != DET_dir)
+        return;
 
-        LOG_debug (DIR_TREE_LOG, "Entries in directory : %u", g_hash_table_size (dir_fill_data->en->h_dir_tree));
-        
-        // get all directory items
-        g_hash_table_iter_init (&iter, dir_fill_data->en->h_dir_tree);
-        while (g_hash_table_iter_next (&iter, NULL, &value)) {
-            DirEntry *tmp_en = (DirEntry *) value;
-            // add only updated entries
-            if (tmp_en->age >= dir_fill_data->dtree->current_age)
-                s3fuse_add_dirbuf (dir_fill_data->req, &b, tmp_en->basename, tmp_en->ino);
-        }
-        // done, save as cache
-        dir_fill_data->en->dir_cache_size = b.size;
-        dir_fill_data->en->dir_cache = g_malloc (b.size);
-        dir_fill_data->en->dir_cache_created = time (NULL);
+    for (i = 0; i < DIR_ENTRY_DIR (en)->children_count; i++)
+        dir_tree_entry_cache_invalidate_all (DIR_ENTRY_DIR (en)->a_children[i]);
+}
+
+// destroy detached entry, unless its object is being removed or file is still opened
+static void dir_tree_entry_release (DirTree *dtree, DirEntry *en)
+{
+    if (!en->is_detached || en->is_removing || en->op_data)
+        return;
 
+    LOG_debug (DIR_TREE_LOG, "Destroying removed entry %s", dir_entry_get_name (dtree, en));
 
-        memcpy (dir_fill_data->en->dir_cache, b.p, b.size);
-        // send buffer to fuse
-        dir_fill_data->readdir_cb (dir_fill_data->req, TRUE, dir_fill_data->size, dir_fill_data->off, b.p, b.size);
+    dir_tree_entry_forget_inodes (dtree, en);
+    dir_entry_destroy (dtree, en);
+}
 
-        //free buffer
-        g_free (b.p);
+// remove the entry from its parent directory
+static void dir_tree_entry_detach (DirTree *dtree, DirEntry *en)
+{
+    DirEntry *parent_en;
+
+    dir_tree_entry_cache_invalidate_all (en);
+
+    // keep the path, the parent directory can be destroyed earlier than the entry
+    if (en->is_removing || en->op_data || en->type == DET_dir)
+        g_hash_table_insert (dtree->h_detached_paths, en, dir_tree_entry_get_path (dtree, en));
+
+    parent_en = inode_table_lookup (dtree->inodes, en->parent_ino);
+    if (parent_en) {
+        dir_entry_child_remove (dtree, parent_en, en);
+        dir_tree_entry_modified (dtree, parent_en);
     }
 
-    g_free (dir_fill_data);
+    en->age = 0;
+    en->is_detached = TRUE;
+    // paths of the children are taken from h_detached_paths now
+    if (en->type == DET_dir)
+        dtree->path_epoch++;
+
+    dir_tree_entry_release (dtree, en);
 }
+/*}}}*/
 
-static void dir_tree_fill_dir_on_http_ready (gpointer client, gpointer ctx)
+/*{{{ dir_tree_opendir */
+
+// readdir stream of the opened directory, cookies of entries are positions in the stream.
+// The stream is resumed after the name of the entry, so it continues correctly
+// when entries are added or removed, or the directory is listed again between pages.
+typedef struct {
+    off_t page_off; // cookie of the first entry of the last sent page
+    GArray *a_page_names; // name ids (referenced in NamePool) of children of the last sent page
+} DirTreeDirHandle;
+
+static void dir_tree_dir_handle_page_free (DirTree *dtree, GArray *a_names)
 {
-    S3HttpConnection *con = (S3HttpConnection *) client;
-    DirTreeFillDirData *dir_fill_data = (DirTreeFillDirData *) ctx;
+    guint i;
 
-    //send HTTP request
-    s3http_connection_get_directory_listing (con, 
-        dir_fill_data->en->fullpath, dir_fill_data->ino,
-        dir_tree_fill_on_dir_buf_cb, dir_fill_data
-    );
+    for (i = 0; i < a_names->len; i++)
+        name_pool_release (dtree->names, g_array_index (a_names, guint32, i));
+    g_array_free (a_names, TRUE);
 }
 
-// return directory buffer from the cache
-// or regenerate directory cache
-void dir_tree_fill_dir_buf (DirTree *dtree, 
-        fuse_ino_t ino, size_t size, off_t off,
-        dir_tree_readdir_cb readdir_cb, fuse_req_t req)
+gboolean dir_tree_opendir (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     DirEntry *en;
-    DirTreeFillDirData *dir_fill_data;
-    time_t t;
-    
-    LOG_debug (DIR_TREE_LOG, "Requesting directory buffer for dir ino %"INO_FMT", size: %zd, off: %"OFF_FMT, ino, size, off);
-    
-    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    DirTreeDirHandle *dh;
 
-    // if directory does not exist
-    // or it's not a directory type ?
+    en = inode_table_lookup (dtree->inodes, ino);
     if (!en || en->type != DET_dir) {
         LOG_msg (DIR_TREE_LOG, "Directory (ino = %"INO_FMT") not found !", ino);
-        readdir_cb (req, FALSE, size, off, NULL, 0);
-        return;
+        return FALSE;
     }
-    
-    t = time (NULL);
 
-    // already have directory buffer in the cache
-    if (en->dir_cache_size && t >= en->dir_cache_created && t - en->dir_cache_created <= dtree->dir_cache_max_time) {
-        LOG_debug (DIR_TREE_LOG, "Sending directory buffer (ino = %"INO_FMT") from cache !", ino);
-        readdir_cb (req, TRUE, size, off, en->dir_cache, en->dir_cache_size);
-        return;
-    }
+    dh = g_new0 (DirTreeDirHandle, 1);
+    dh->page_off = 0;
+    dh->a_page_names = g_array_new (FALSE, FALSE, sizeof (guint32));
+    fi->fh = (uint64_t) (uintptr_t) dh;
 
-    LOG_debug (DIR_TREE_LOG, "cache time: %ld  now: %ld", en->dir_cache_created, t);
-    
-    // reset dir cache
-    if (en->dir_cache)
-        g_free (en->dir_cache);
-    en->dir_cache_size = 0;
-    en->dir_cache_created = 0;
+    return TRUE;
+}
 
-    dir_fill_data = g_new0 (DirTreeFillDirData, 1);
-    dir_fill_data->dtree = dtree;
-    dir_fill_data->ino = ino;
-    dir_fill_data->size = size;
-    dir_fill_data->off = off;
-    dir_fill_data->readdir_cb = readdir_cb;
-    dir_fill_data->req = req;
-    dir_fill_data->en = en;
+void dir_tree_releasedir (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DirTreeDirHandle *dh = (DirTreeDirHandle *) (uintptr_t) fi->fh;
 
-    if (!s3client_pool_get_client (application_get_ops_client_pool (dtree->app), dir_tree_fill_dir_on_http_ready, dir_fill_data)) {
-        LOG_err (DIR_TREE_LOG, "Failed to get HTTP client !");
-        readdir_cb (req, FALSE, size, off, NULL, 0);
-        g_free (dir_fill_data);
-    }
+    if (!dh)
+        return;
 
+    dir_tree_dir_handle_page_free (dtree, dh->a_page_names);
+    g_free (dh);
+    fi->fh = 0;
 }
 /*}}}*/
 
-/*{{{ dir_tree_lookup */
-// lookup entry and return attributes
-void dir_tree_lookup (DirTree *dtree, fuse_ino_t parent_ino, const char *name,
-    dir_tree_lookup_cb lookup_cb, fuse_req_t req)
-{
-    DirEntry *dir_en, *en;
-    
-    LOG_debug (DIR_TREE_LOG, "Looking up for '%s' in directory ino: %d", name, parent_ino);
-    
-    dir_en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (parent_ino));
-    
-    // entry not found
-    if (!dir_en || dir_en->type != DET_dir) {
-        LOG_msg (DIR_TREE_LOG, "Directory (%d) not found !", parent_ino);
-        lookup_cb (req, FALSE, 0, 0, 0, 0);
-        return;
-    }
+/*{{{ dir_tree_fill_dir_buf */
 
-    en = g_hash_table_lookup (dir_en->h_dir_tree, name);
-    if (!en) {
-        LOG_debug (DIR_TREE_LOG, "Entry '%s' not found !", name);
-        lookup_cb (req, FALSE, 0, 0, 0, 0);
-        return;
+typedef struct {
+    DirTree *dtree;
+    fuse_ino_t ino;
+    size_t size;
+    off_t off;
+    DirTreeDirHandle *dh;
+    dir_tree_readdir_cb readdir_cb;
+    fuse_req_t req;
+    DirEntry *en;
+} DirTreeFillDirData;
+
+// listing of the directory in progress, readdir requests are served while it goes on
+struct _DirTreeListing {
+    DirTree *dtree;
+    DirEntry *en; // NULL if the directory is destroyed
+    guint32 generation;
+    gboolean is_background; // readdir is served from the previous listing meanwhile
+    gchar *last_key; // keys (relative to the directory) up to this one are listed, NULL before the first page
+    GQueue *q_readdirs; // DirTreeFillDirData waiting for entries which are not listed yet
+    GQueue *q_lookups; // DirTreeLookupData of names, which are not listed yet
+};
+
+// lookup of the name, which waits for the listing of the directory
+typedef struct {
+    DirTree *dtree;
+    fuse_ino_t parent_ino;
+    gchar *name;
+    dir_tree_lookup_cb lookup_cb;
+    fuse_req_t req;
+    gchar *path; // path of the name, if it's requested from the server
+} DirTreeLookupData;
+
+static void dir_tree_lookup_data_destroy (DirTreeLookupData *lookup_data);
+
+// compare the key of the child (keys of directories end with '/') with the key
+static gint dir_entry_key_cmp (const gchar *name, gboolean is_dir, const gchar *key)
+{
+    size_t len = strlen (name);
+    gint cmp;
+
+    cmp = strncmp (name, key, len);
+    if (cmp)
+        return cmp;
+
+    if (!is_dir)
+        return key[len] ? -1 : 0;
+
+    if (key[len] != '/')
+        return (guchar) '/' - (guchar) key[len];
+
+    return key[len + 1] ? -1 : 0;
+}
+
+// return the position of the child which follows the entry with cookie off
+static guint32 dir_tree_readdir_get_pos (DirTree *dtree, DirEntry *en, DirTreeDirHandle *dh, off_t off)
+{
+    guint32 pos;
+
+    // cookies 1 and 2 are "." and ".."
+    if (off <= 2)
+        return 0;
+
+    if (dh && off >= dh->page_off && off < dh->page_off + (off_t) dh->a_page_names->len) {
+        const gchar *name = name_pool_get (dtree->names, g_array_index (dh->a_page_names, guint32, off - dh->page_off));
+
+        if (dir_entry_child_find (dtree, en, name, &pos))
+            pos++;
+        return pos;
     }
-    
-    // file is removed
-    if (en->age == 0) {
-        LOG_debug (DIR_TREE_LOG, "Entry '%s' is removed !", name);
-        lookup_cb (req, FALSE, 0, 0, 0, 0);
-        return;
+
+    // unknown cookie, use it as a position
+    LOG_debug (DIR_TREE_LOG, "Unknown readdir cookie: %"OFF_FMT, off);
+    return MIN ((guint64) off - 2, DIR_ENTRY_DIR (en)->children_count);
+}
+
+// send directory buffer with entries which follow the entry with cookie off,
+// return FALSE if nothing is sent because the next entries are not listed yet
+static gboolean dir_tree_readdir_reply (DirTree *dtree, DirEntry *en, DirTreeDirHandle *dh, size_t size, off_t off,
+    dir_tree_readdir_cb readdir_cb, fuse_req_t req)
+{
+    DirEntryDir *dir = DIR_ENTRY_DIR (en);
+    DirTreeListing *listing = dir->listing && !dir->listing->is_background ? dir->listing : NULL;
+    struct dirbuf b; // directory buffer
+    GArray *a_names;
+    guint32 pos;
+    off_t cookie;
+    gboolean is_full = FALSE;
+
+    LOG_debug (DIR_TREE_LOG, "Entries in directory : %u", dir->children_count);
+
+    b.p = g_malloc (size);
+    b.size = 0;
+    b.max_size = size;
+    a_names = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+    pos = dir_tree_readdir_get_pos (dtree, en, dh, off);
+
+    for (cookie = off; cookie < 2 && !is_full; cookie++)
+        is_full = !s3fuse_add_dirbuf (req, &b, cookie ? ".." : ".", en->ino, cookie + 1);
+
+    for (cookie = MAX (off, 2); pos < dir->children_count && !is_full; pos++) {
+        DirEntry *tmp_en = dir->a_children[pos];
+
+        if (listing) {
+            // wait until the listing gets to it
+            if (!listing->last_key || 
+                dir_entry_key_cmp (dir_entry_get_name (dtree, tmp_en), tmp_en->type == DET_dir, listing->last_key) > 0)
+                break;
+            // not seen by the listing
+            if (tmp_en->age < listing->generation)
+                continue;
+        } else if (tmp_en->age < dir->listed_generation) {
+            // add only updated entries
+            continue;
+        }
+
+        is_full = !s3fuse_add_dirbuf (req, &b, dir_entry_get_name (dtree, tmp_en), tmp_en->ino, cookie + 1);
+        if (!is_full) {
+            guint32 name_id = name_pool_add (dtree->names, dir_entry_get_name (dtree, tmp_en));
+
+            cookie++;
+            g_array_append_val (a_names, name_id);
+        }
     }
-    
-    // hide it
-    if (en->is_modified) {
-        LOG_debug (DIR_TREE_LOG, "Entry '%s' is modified !", name);
-        lookup_cb (req, TRUE, en->ino, en->mode, 0, en->ctime);
+
+    // empty buffer means the end of directory
+    if (!b.size && listing) {
+        g_array_free (a_names, TRUE);
+        g_free (b.p);
+        return FALSE;
+    }
+
+    // remember names of the page, the next request continues after one of them
+    if (dh && a_names->len) {
+        dir_tree_dir_handle_page_free (dtree, dh->a_page_names);
+        dh->a_page_names = a_names;
+        dh->page_off = cookie - a_names->len + 1;
+    } else {
+        dir_tree_dir_handle_page_free (dtree, a_names);
+    }
+
+    // send buffer to fuse
+    readdir_cb (req, TRUE, b.p, b.size);
+
+    g_free (b.p);
+
+    return TRUE;
+}
+
+// send the page, or wait for the listing
+static void dir_tree_readdir_reply_or_wait (DirTreeFillDirData *dir_fill_data)
+{
+    DirTreeListing *listing = DIR_ENTRY_DIR (dir_fill_data->en)->listing;
+
+    if (dir_tree_readdir_reply (dir_fill_data->dtree, dir_fill_data->en, dir_fill_data->dh, 
+        dir_fill_data->size, dir_fill_data->off, dir_fill_data->readdir_cb, dir_fill_data->req)) {
+        g_free (dir_fill_data);
         return;
     }
 
-    lookup_cb (req, TRUE, en->ino, en->mode, en->size, en->ctime);
+    LOG_debug (DIR_TREE_LOG, "Waiting for listing of dir ino %"INO_FMT", off: %"OFF_FMT, dir_fill_data->ino, dir_fill_data->off);
+    g_queue_push_tail (listing->q_readdirs, dir_fill_data);
 }
-/*}}}*/
 
-/*{{{ dir_tree_getattr */
-// return entry attributes
-void dir_tree_getattr (DirTree *dtree, fuse_ino_t ino, 
-    dir_tree_getattr_cb getattr_cb, fuse_req_t req)
+// serve readdir requests which wait for the listing
+static void dir_tree_listing_serve_waiting (DirTreeListing *listing)
 {
-    DirEntry  *en;
-    
-    LOG_debug (DIR_TREE_LOG, "Getting attributes for %d", ino);
-    
-    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    guint i, len;
+
+    len = g_queue_get_length (listing->q_readdirs);
+    for (i = 0; i < len; i++)
+        dir_tree_readdir_reply_or_wait ((DirTreeFillDirData *) g_queue_pop_head (listing->q_readdirs));
+}
+
+// repeat lookups which wait for the listing, they are answered from the directory
+// or wait again if the name isn't listed yet. Lookups fail if the directory is destroyed
+static void dir_tree_listing_serve_lookups (DirTreeListing *listing)
+{
+    guint i, len;
+
+    len = g_queue_get_length (listing->q_lookups);
+    for (i = 0; i < len; i++) {
+        DirTreeLookupData *lookup_data = (DirTreeLookupData *) g_queue_pop_head (listing->q_lookups);
+
+        if (listing->en)
+            dir_tree_lookup (lookup_data->dtree, lookup_data->parent_ino, lookup_data->name, 
+                lookup_data->lookup_cb, lookup_data->req);
+        else
+            lookup_data->lookup_cb (lookup_data->req, ENOENT, 0, 0, 0, 0);
+        dir_tree_lookup_data_destroy (lookup_data);
+    }
+}
+
+// fail readdir requests which wait for the listing
+static void dir_tree_listing_fail_waiting (DirTreeListing *listing)
+{
+    DirTreeFillDirData *dir_fill_data;
+
+    while ((dir_fill_data = g_queue_pop_head (listing->q_readdirs))) {
+        dir_fill_data->readdir_cb (dir_fill_data->req, FALSE, NULL, 0);
+        g_free (dir_fill_data);
+    }
+
+    dir_tree_listing_serve_lookups (listing);
+}
+
+// directory is destroyed while it's being listed
+static void dir_tree_listing_detach (DirTreeListing *listing)
+{
+    DIR_ENTRY_DIR (listing->en)->listing = NULL;
+    listing->en = NULL;
+    dir_tree_listing_fail_waiting (listing);
+}
+
+// a page of the listing is processed
+void dir_tree_update_progress (DirTree *dtree, fuse_ino_t parent_ino, guint32 generation, const gchar *last_key)
+{
+    DirEntry *parent_en;
+    DirTreeListing *listing;
+
+    parent_en = inode_table_lookup (dtree->inodes, parent_ino);
+    if (!parent_en || parent_en->type != DET_dir)
+        return;
+
+    listing = DIR_ENTRY_DIR (parent_en)->listing;
+    if (!listing || listing->generation != generation)
+        return;
+
+    g_free (listing->last_key);
+    listing->last_key = g_strdup (last_key);
+
+    dir_tree_listing_serve_waiting (listing);
+    dir_tree_listing_serve_lookups (listing);
+}
+
+// callback: listing is done
+static void dir_tree_fill_on_dir_buf_cb (gpointer callback_data, gboolean success)
+{
+    DirTreeListing *listing = (DirTreeListing *) callback_data;
     
-    // entry not found
-    if (!en) {
-        LOG_msg (DIR_TREE_LOG, "Entry (%d) not found !", ino);
-        getattr_cb (req, FALSE, 0, 0, 0, 0);
+    LOG_debug (DIR_TREE_LOG, "Dir fill callback: %s", success ? "SUCCESS" : "FAILED");
+
+    if (listing->en) {
+        DIR_ENTRY_DIR (listing->en)->listing = NULL;
+        if (success)
+            DIR_ENTRY_DIR (listing->en)->listed = time (NULL);
+    }
+
+    // the rest of entries is sent from the directory now
+    if (success && listing->en) {
+        dir_tree_listing_serve_waiting (listing);
+        dir_tree_listing_serve_lookups (listing);
+    } else {
+        dir_tree_listing_fail_waiting (listing);
+    }
+
+    g_queue_free (listing->q_readdirs);
+    g_queue_free (listing->q_lookups);
+    g_free (listing->last_key);
+    g_free (listing);
+}
+
+static void dir_tree_fill_dir_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *con = (S3HttpConnection *) client;
+    DirTreeListing *listing = (DirTreeListing *) ctx;
+    gchar *path;
+
+    if (!listing->en) {
+        dir_tree_fill_on_dir_buf_cb (listing, FALSE);
         return;
     }
 
-    getattr_cb (req, TRUE, en->ino, en->mode, en->size, en->ctime);
+    path = dir_tree_entry_get_path (listing->dtree, listing->en);
+
+    //send HTTP request
+    s3http_connection_get_directory_listing (con, 
+        path, listing->en->ino, listing->generation,
+        dir_tree_fill_on_dir_buf_cb, listing
+    );
+
+    g_free (path);
+}
+
+// start listing of the directory on the ops pool
+static void dir_tree_listing_start (DirTree *dtree, DirTreeListing *listing)
+{
+    if (!s3client_pool_get_client (application_get_ops_client_pool (dtree->app), dir_tree_fill_dir_on_http_ready, listing)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get HTTP client !");
+        dir_tree_fill_on_dir_buf_cb (listing, FALSE);
+    }
+}
+
+static DirTreeListing *dir_tree_listing_create (DirTree *dtree, DirEntry *en, gboolean is_background)
+{
+    DirTreeListing *listing;
+
+    listing = g_new0 (DirTreeListing, 1);
+    listing->dtree = dtree;
+    listing->en = en;
+    listing->generation = dir_tree_start_update (dtree, en->ino);
+    listing->is_background = is_background;
+    listing->last_key = NULL;
+    listing->q_readdirs = g_queue_new ();
+    listing->q_lookups = g_queue_new ();
+    DIR_ENTRY_DIR (en)->listing = listing;
+
+    return listing;
 }
-/*}}}*/
 
-/*{{{ dir_tree_setattr */
-// set entry's attributes
-// update directory cache
-void dir_tree_setattr (DirTree *dtree, fuse_ino_t ino, 
-    struct stat *attr, int to_set,
-    dir_tree_setattr_cb setattr_cb, fuse_req_t req, void *fi)
+// directory is listed recently, names which are not in it don't exist
+static gboolean dir_tree_dir_is_fresh (DirTree *dtree, DirEntry *en, time_t t)
 {
-    DirEntry  *en;
+    DirEntryDir *dir = DIR_ENTRY_DIR (en);
+
+    if (!dir->listed)
+        return FALSE;
+
+    // indexed directories are updated by the bucket index
+    if (en->is_indexed)
+        return TRUE;
+
+    return t >= dir->listed && t - dir->listed <= dtree->dir_cache_max_time;
+}
+
+// expired listing of the directory is still served while it's listed again
+static gboolean dir_tree_dir_is_stale (DirTree *dtree, DirEntry *en, time_t t)
+{
+    DirEntryDir *dir = DIR_ENTRY_DIR (en);
+
+    return dir->listed && t >= dir->listed && t - dir->listed <= dtree->dir_cache_max_stale;
+}
+
+// return directory buffer generated from directory entries
+// or list the directory, pages are sent as soon as their entries are listed.
+// Expired listing is served while the directory is listed again in background,
+// until it's older than dir_cache_max_stale
+void dir_tree_fill_dir_buf (DirTree *dtree, 
+        fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi,
+        dir_tree_readdir_cb readdir_cb, fuse_req_t req)
+{
+    DirEntry *en;
+    DirEntryDir *dir;
+    DirTreeFillDirData *dir_fill_data;
+    DirTreeListing *listing;
+    time_t t;
+    gboolean is_fresh, is_stale;
     
-    LOG_debug (DIR_TREE_LOG, "Setting attributes for %d", ino);
+    LOG_debug (DIR_TREE_LOG, "Requesting directory buffer for dir ino %"INO_FMT", size: %zd, off: %"OFF_FMT, ino, size, off);
     
-    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    en = inode_table_lookup (dtree->inodes, ino);
+
+    // if directory does not exist
+    // or it's not a directory type ?
+    if (!en || en->type != DET_dir) {
+        LOG_msg (DIR_TREE_LOG, "Directory (ino = %"INO_FMT") not found !", ino);
+        readdir_cb (req, FALSE, NULL, 0);
+        return;
+    }
     
-    // entry not found
-    if (!en) {
-        LOG_msg (DIR_TREE_LOG, "Entry (%d) not found !", ino);
-        setattr_cb (req, FALSE, 0, 0, 0);
+    dir_tree_dir_load (dtree, en);
+    dir = DIR_ENTRY_DIR (en);
+    t = time (NULL);
+    is_fresh = dir_tree_dir_is_fresh (dtree, en, t);
+    is_stale = dir_tree_dir_is_stale (dtree, en, t);
+
+    dir_fill_data = g_new0 (DirTreeFillDirData, 1);
+    dir_fill_data->dtree = dtree;
+    dir_fill_data->ino = ino;
+    dir_fill_data->size = size;
+    dir_fill_data->off = off;
+    dir_fill_data->dh = (DirTreeDirHandle *) (uintptr_t) fi->fh;
+    dir_fill_data->readdir_cb = readdir_cb;
+    dir_fill_data->req = req;
+    dir_fill_data->en = en;
+
+    // directory is listed recently, the stream is continued or the listing is in progress
+    if (dir->listing || off || is_fresh) {
+        // previous listing is too old to be served, wait for the refresh
+        if (dir->listing && dir->listing->is_background && !off && !is_stale) {
+            LOG_debug (DIR_TREE_LOG, "Waiting for background listing of dir ino %"INO_FMT, ino);
+            dir->listing->is_background = FALSE;
+        }
+        LOG_debug (DIR_TREE_LOG, "Sending directory buffer (ino = %"INO_FMT") from cache !", ino);
+        dir_tree_readdir_reply_or_wait (dir_fill_data);
         return;
     }
-    //XXX: en->mode
-    setattr_cb (req, TRUE, en->ino, en->mode, en->size);
+
+    LOG_debug (DIR_TREE_LOG, "cache time: %ld  now: %ld", dir->listed, t);
+
+    // serve the expired listing, refresh it in background
+    if (is_stale) {
+        LOG_debug (DIR_TREE_LOG, "Refreshing dir ino %"INO_FMT" in background", ino);
+        dir_tree_readdir_reply_or_wait (dir_fill_data);
+        listing = dir_tree_listing_create (dtree, en, TRUE);
+        dir_tree_listing_start (dtree, listing);
+        return;
+    }
+    
+    dir->listed = 0;
+
+    listing = dir_tree_listing_create (dtree, en, FALSE);
+
+    // "." and ".." are sent right away
+    dir_tree_readdir_reply_or_wait (dir_fill_data);
+
+    dir_tree_listing_start (dtree, listing);
 }
 /*}}}*/
 
+/*{{{ bucket index */
+
+// the whole tree under index_prefix is built from a flat listing (without delimiter),
+// directories are made from key names. One pass of the index is a new generation of every
+// directory under index_prefix, objects which are not seen by it are removed
+
+// retry of the failed index, if it's not refreshed periodically (seconds)
+#define DIR_TREE_INDEX_RETRY_TIME 60
+
 typedef struct {
     DirTree *dtree;
-    DirEntry *en;
-    fuse_ino_t ino;
-    DirTree_file_read_cb file_read_cb;
-    DirTree_file_open_cb file_open_cb;
-    fuse_req_t c_req;
-    struct fuse_file_info *c_fi;
+    GHashTable *h_generations; // ino -> generation of directories under index_prefix
+    GString *dir_key; // key prefix of the last directory ("dir/subdir/"), objects of a directory follow each other
+    fuse_ino_t dir_ino; // inode of dir_key, 0 if it's not known
+    guint64 count;
+} DirTreeIndex;
+
+// generation of the directory for this pass of the index
+static guint32 dir_tree_index_get_generation (DirTreeIndex *index, DirEntry *dir_en)
+{
+    gpointer value;
+    guint32 generation;
 
-    size_t c_size;
-    off_t c_off;
-    S3HttpClient *http;
+    if (g_hash_table_lookup_extended (index->h_generations, GSIZE_TO_POINTER (dir_en->ino), NULL, &value))
+        return GPOINTER_TO_UINT (value);
 
-    int tmp_write_fd; 
+    generation = dir_tree_start_update (index->dtree, dir_en->ino);
+    g_hash_table_insert (index->h_generations, GSIZE_TO_POINTER (dir_en->ino), GUINT_TO_POINTER (generation));
 
-    GQueue *q_ranges_requested;
-    off_t total_read;
-    
-    gboolean op_in_progress;
-    
-} DirTreeFileOpData;
+    return generation;
+}
 
-typedef struct {
-    size_t size;
-    off_t off;
-    char *write_buf;
-    fuse_req_t c_req;
-} DirTreeFileRange;
+// return the directory of the key prefix (len bytes of dir_key, "dir/subdir/"), missing directories are created,
+// directories above index_prefix are only created, their other children are not affected
+static DirEntry *dir_tree_index_get_dir (DirTreeIndex *index, const gchar *dir_key, size_t len)
+{
+    DirTree *dtree = index->dtree;
+    size_t prefix_len = strlen (dtree->index_prefix);
+    DirEntry *dir_en = dtree->root;
+    const gchar *p = dir_key;
+    const gchar *end;
+
+    while (p < dir_key + len && (end = memchr (p, '/', dir_key + len - p))) {
+        DirEntry *en;
+        gchar *name, *path;
+        guint32 generation;
+
+        // empty name
+        if (end == p) {
+            p++;
+            continue;
+        }
 
-/*{{{ dir_tree_add_file */
+        if ((size_t) (p - dir_key) >= prefix_len)
+            generation = dir_tree_index_get_generation (index, dir_en);
+        else
+            generation = DIR_ENTRY_DIR (dir_en)->generation;
 
-static DirTreeFileOpData *file_op_data_create (DirTree *dtree, fuse_ino_t ino)
+        name = g_strndup (p, end - p);
+        path = g_strndup (dir_key, p - dir_key);
+        dir_tree_update_entry (dtree, path, DET_dir, dir_en->ino, generation, name, 0, NULL);
+        en = dir_entry_child_lookup (dtree, dir_en, name);
+        g_free (path);
+        g_free (name);
+
+        // file with the same name
+        if (!en || en->type != DET_dir)
+            return NULL;
+
+        dir_en = en;
+        p = end + 1;
+    }
+
+    return dir_en;
+}
+
+static void dir_tree_index_on_object (gpointer ctx, const gchar *key, off_t size, const gchar *etag)
 {
-    DirTreeFileOpData *op_data;
-    
-    op_data = g_new0 (DirTreeFileOpData, 1);
-    op_data->dtree = dtree;
-    op_data->ino = ino;
-    op_data->op_in_progress = FALSE;
-    op_data->q_ranges_requested = g_queue_new ();
-    op_data->total_read = 0;
-    op_data->tmp_write_fd = 0;
-    op_data->http = NULL;
+    DirTreeIndex *index = (DirTreeIndex *) ctx;
+    DirTree *dtree = index->dtree;
+    DirEntry *dir_en = NULL;
+    const gchar *name;
+    size_t dir_len;
+
+    name = strrchr (key, '/');
+    dir_len = name ? (size_t) (name - key + 1) : 0;
+    name = name ? name + 1 : key;
+
+    if (index->dir_ino && index->dir_key->len == dir_len && !strncmp (index->dir_key->str, key, dir_len))
+        dir_en = inode_table_lookup (dtree->inodes, index->dir_ino);
+
+    // the first object of the directory
+    if (!dir_en) {
+        index->dir_ino = 0;
+        dir_en = dir_tree_index_get_dir (index, key, dir_len);
+        if (!dir_en)
+            return;
+        g_string_truncate (index->dir_key, 0);
+        g_string_append_len (index->dir_key, key, dir_len);
+        index->dir_ino = dir_en->ino;
+    }
 
-    return op_data;
+    index->count++;
+
+    // directory object
+    if (!*name)
+        return;
+
+    dir_tree_update_entry (dtree, index->dir_key->str, DET_file, dir_en->ino, 
+        dir_tree_index_get_generation (index, dir_en), name, size, etag);
 }
 
-static void file_op_data_destroy (DirTreeFileOpData *op_data)
+static void dir_tree_index_on_done (gpointer ctx, gboolean success)
 {
-    LOG_debug (DIR_TREE_LOG, "Destroying opdata !");
+    DirTreeIndex *index = (DirTreeIndex *) ctx;
+    DirTree *dtree = index->dtree;
+    GHashTableIter iter;
+    gpointer key, value;
+    struct timeval tv;
+    time_t t = time (NULL);
 
-    if (g_queue_get_length (op_data->q_ranges_requested) > 0)
+    if (success) {
+        LOG_msg (DIR_TREE_LOG, "Indexed %"G_GUINT64_FORMAT" objects in %u directories under /%s", 
+            index->count, g_hash_table_size (index->h_generations), dtree->index_prefix);
+
+        // remove entries which are not seen, directories are not listed on readdir until the next pass
+        g_hash_table_iter_init (&iter, index->h_generations);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            DirEntry *en = inode_table_lookup (dtree->inodes, GPOINTER_TO_SIZE (key));
+
+            if (!en || en->type != DET_dir || en->is_detached)
+                continue;
+            dir_tree_stop_update (dtree, en->ino, GPOINTER_TO_UINT (value));
+            en->is_indexed = TRUE;
+            DIR_ENTRY_DIR (en)->listed = t;
+        }
+    } else {
+        LOG_err (DIR_TREE_LOG, "Failed to index /%s !", dtree->index_prefix);
+    }
+
+    g_hash_table_destroy (index->h_generations);
+    g_string_free (index->dir_key, TRUE);
+    g_free (index);
+    dtree->is_indexing = FALSE;
+
+    memset (&tv, 0, sizeof (tv));
+    tv.tv_sec = application_get_conf (dtree->app)->index_refresh_time;
+    if (!success && !tv.tv_sec)
+        tv.tv_sec = DIR_TREE_INDEX_RETRY_TIME;
+    if (tv.tv_sec > 0)
+        evtimer_add (dtree->ev_index_refresh, &tv);
+}
+
+static void dir_tree_index_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *http_con = (S3HttpConnection *) client;
+    DirTreeIndex *index = (DirTreeIndex *) ctx;
+
+    s3http_connection_acquire (http_con);
+
+    s3http_connection_object_list (http_con, index->dtree->index_prefix, 
+        dir_tree_index_on_object, dir_tree_index_on_done, index);
+}
+
+// start a new pass of the index
+static void dir_tree_index_start (DirTree *dtree)
+{
+    DirTreeIndex *index;
+    DirEntry *root_en;
+
+    if (dtree->is_indexing)
+        return;
+
+    LOG_debug (DIR_TREE_LOG, "Indexing /%s ..", dtree->index_prefix);
+
+    index = g_new0 (DirTreeIndex, 1);
+    index->dtree = dtree;
+    index->h_generations = g_hash_table_new (g_direct_hash, g_direct_equal);
+    index->dir_key = g_string_new ("");
+    index->dir_ino = 0;
+    index->count = 0;
+    dtree->is_indexing = TRUE;
+
+    // the root of the index is emptied if there are no objects under it
+    root_en = dir_tree_index_get_dir (index, dtree->index_prefix, strlen (dtree->index_prefix));
+    if (!root_en) {
+        dir_tree_index_on_done (index, FALSE);
+        return;
+    }
+    dir_tree_index_get_generation (index, root_en);
+
+    if (!s3client_pool_get_client (application_get_ops_client_pool (dtree->app), dir_tree_index_on_http_ready, index)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get HTTP client !");
+        dir_tree_index_on_done (index, FALSE);
+    }
+}
+
+static void dir_tree_index_on_refresh (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short what, void *arg)
+{
+    DirTree *dtree = (DirTree *) arg;
+
+    dir_tree_index_start (dtree);
+}
+/*}}}*/
+
+/*{{{ snapshot */
+
+// DirTree is written to the snapshot periodically and on exit. On the next mount children of
+// a directory are added from the snapshot when it's accessed, and the directory is listed again
+// (served stale until dir_cache_max_stale). Directories which are not accessed are copied
+// from the previous snapshot.
+// Periodic snapshots are written by a forked child, which has its own copy of the tree,
+// so the event loop is not blocked while the whole tree is walked
+
+// return the child record of the directory record, NULL if the snapshot is broken
+static const DirSnapshotEntry *dir_tree_snapshot_get_child (DirSnapshot *snap, guint32 dir_id, 
+    const DirSnapshotEntry *dir_rec, guint32 i, guint32 *id)
+{
+    const DirSnapshotEntry *rec;
+
+    // children follow their parent in breadth-first order
+    *id = dir_rec->first_child + i;
+    if (*id <= dir_id || *id < dir_rec->first_child)
+        return NULL;
+
+    rec = dir_snapshot_get_entry (snap, *id);
+    if (!rec || rec->parent != dir_id)
+        return NULL;
+
+    return rec;
+}
+
+// add children of the directory from the snapshot, entries which are already known are kept
+static void dir_tree_dir_load (DirTree *dtree, DirEntry *dir_en)
+{
+    DirEntryDir *dir = DIR_ENTRY_DIR (dir_en);
+    const DirSnapshotEntry *dir_rec, *rec;
+    guint32 dir_id, id, i;
+    time_t t;
+
+    if (!dir->snapshot_id || !dtree->snapshot)
+        return;
+
+    dir_id = dir->snapshot_id - 1;
+    dir->snapshot_id = 0;
+    dir_rec = dir_snapshot_get_entry (dtree->snapshot, dir_id);
+    if (!dir_rec || dir_rec->type != DET_dir)
+        return;
+
+    for (i = 0; i < dir_rec->children_count; i++) {
+        DirEntry *en;
+        const gchar *name;
+
+        rec = dir_tree_snapshot_get_child (dtree->snapshot, dir_id, dir_rec, i, &id);
+        if (!rec) {
+            LOG_err (DIR_TREE_LOG, "Snapshot record %u is not valid !", dir_id);
+            break;
+        }
+
+        name = dir_snapshot_get_name (dtree->snapshot, rec);
+        if (!name || !*name || strchr (name, '/') || !strcmp (name, ".") || !strcmp (name, ".."))
+            continue;
+        if (rec->type != DET_dir && rec->type != DET_file)
+            continue;
+        if (dir_entry_child_lookup (dtree, dir_en, name))
+            continue;
+
+        en = dir_tree_add_entry (dtree, name, rec->mode ? rec->mode : (rec->type == DET_dir ? DIR_DEFAULT_MODE : FILE_DEFAULT_MODE),
+            rec->type, dir_en->ino, rec->size, rec->ctime);
+        if (!en)
+            continue;
+
+        memcpy (en->etag, rec->etag, sizeof (en->etag));
+        en->has_etag = (rec->flags & DIR_SNAPSHOT_FLAG_HAS_ETAG) != 0;
+        if (en->type == DET_dir)
+            DIR_ENTRY_DIR (en)->snapshot_id = id + 1;
+    }
+
+    // entries are shown, but the directory is listed again on readdir
+    if (dir_rec->listed) {
+        t = time (NULL);
+        dir->listed_generation = dir->generation;
+        dir->listed = MIN ((time_t) dir_rec->listed, t - dtree->dir_cache_max_time - 1);
+    }
+
+    LOG_debug (DIR_TREE_LOG, "Loaded %u entries of dir ino %"INO_FMT" from snapshot", 
+        dir->children_count, (fuse_ino_t) dir_en->ino);
+}
+
+typedef struct {
+    DirEntry *en; // NULL if the entry is copied from the previous snapshot
+    guint32 snapshot_id; // record in the previous snapshot + 1, if its children are not loaded
+    guint32 parent;
+} DirTreeSnapshotItem;
+
+// entry is written to the snapshot, if the object exists on the server
+static gboolean dir_tree_snapshot_entry_is_valid (DirEntry *dir_en, DirEntry *en)
+{
+    return !en->is_detached && !en->is_modified && !en->is_removing && en->age && 
+        en->age >= DIR_ENTRY_DIR (dir_en)->listed_generation;
+}
+
+// add children of the item to the queue, return the number of added children
+static guint32 dir_tree_snapshot_queue_children (DirTree *dtree, DirTreeSnapshotItem *item, guint32 idx, GArray *a_items)
+{
+    DirTreeSnapshotItem child;
+    const DirSnapshotEntry *dir_rec, *rec;
+    guint32 i, id, dir_id, count = 0;
+
+    if (item->en) {
+        DirEntryDir *dir = DIR_ENTRY_DIR (item->en);
+
+        for (i = 0; i < dir->children_count; i++) {
+            DirEntry *en = dir->a_children[i];
+
+            if (!dir_tree_snapshot_entry_is_valid (item->en, en))
+                continue;
+
+            child.en = en;
+            child.snapshot_id = en->type == DET_dir ? DIR_ENTRY_DIR (en)->snapshot_id : 0;
+            child.parent = idx;
+            g_array_append_val (a_items, child);
+            count++;
+        }
+    }
+
+    // children which are not loaded yet
+    if (!item->snapshot_id || !dtree->snapshot)
+        return count;
+
+    dir_id = item->snapshot_id - 1;
+    dir_rec = dir_snapshot_get_entry (dtree->snapshot, dir_id);
+    if (!dir_rec || dir_rec->type != DET_dir)
+        return count;
+
+    for (i = 0; i < dir_rec->children_count; i++) {
+        const gchar *name;
+
+        rec = dir_tree_snapshot_get_child (dtree->snapshot, dir_id, dir_rec, i, &id);
+        if (!rec)
+            break;
+
+        name = dir_snapshot_get_name (dtree->snapshot, rec);
+        if (!name || (item->en && dir_entry_child_lookup (dtree, item->en, name)))
+            continue;
+
+        child.en = NULL;
+        child.snapshot_id = id + 1;
+        child.parent = idx;
+        g_array_append_val (a_items, child);
+        count++;
+    }
+
+    return count;
+}
+
+// write DirTree in breadth-first order, records are numbered when they are queued
+static gboolean dir_tree_snapshot_write (DirTree *dtree)
+{
+    DirSnapshotWriter *writer;
+    GArray *a_items; // DirTreeSnapshotItem, queued by value
+    DirTreeSnapshotItem item;
+    guint head = 0;
+    guint32 idx = 0, next_idx = 1;
+    gboolean success = TRUE;
+
+    writer = dir_snapshot_writer_create (dtree->snapshot_path, application_get_bucket_name (dtree->app));
+    if (!writer)
+        return FALSE;
+
+    a_items = g_array_new (FALSE, FALSE, sizeof (DirTreeSnapshotItem));
+    item.en = dtree->root;
+    item.snapshot_id = DIR_ENTRY_DIR (dtree->root)->snapshot_id;
+    item.parent = 0;
+    g_array_append_val (a_items, item);
+
+    while (head < a_items->len) {
+        DirSnapshotEntry rec;
+        const gchar *name;
+
+        // the array is reallocated when children are queued
+        item = g_array_index (a_items, DirTreeSnapshotItem, head);
+        head++;
+
+        memset (&rec, 0, sizeof (rec));
+        rec.parent = item.parent;
+
+        if (item.en) {
+            DirEntry *en = item.en;
+
+            name = dir_entry_get_name (dtree, en);
+            rec.size = dir_tree_file_get_size (en);
+            memcpy (rec.etag, en->etag, sizeof (rec.etag));
+            rec.ctime = en->ctime;
+            rec.mode = en->mode;
+            rec.type = en->type;
+            if (en->has_etag)
+                rec.flags |= DIR_SNAPSHOT_FLAG_HAS_ETAG;
+            if (en->type == DET_dir)
+                rec.listed = DIR_ENTRY_DIR (en)->listed;
+        } else {
+            const DirSnapshotEntry *old_rec = dir_snapshot_get_entry (dtree->snapshot, item.snapshot_id - 1);
+
+            name = dir_snapshot_get_name (dtree->snapshot, old_rec);
+            rec = *old_rec;
+            rec.parent = item.parent;
+        }
+
+        if (rec.type == DET_dir) {
+            rec.first_child = next_idx;
+            rec.children_count = dir_tree_snapshot_queue_children (dtree, &item, idx, a_items);
+            next_idx += rec.children_count;
+        } else {
+            rec.first_child = 0;
+            rec.children_count = 0;
+        }
+
+        if (!dir_snapshot_writer_add (writer, &rec, name)) {
+            success = FALSE;
+            break;
+        }
+        idx++;
+
+        // drop written items, the queue holds only the front of the walk
+        if (head >= 4096 && head >= a_items->len / 2) {
+            g_array_remove_range (a_items, 0, head);
+            head = 0;
+        }
+    }
+
+    g_array_free (a_items, TRUE);
+
+    if (!dir_snapshot_writer_finish (writer, success))
+        return FALSE;
+
+    LOG_debug (DIR_TREE_LOG, "DirTree snapshot of %u entries is written", idx);
+    return TRUE;
+}
+
+// reap the child which writes the snapshot, return FALSE if it's still running
+static gboolean dir_tree_snapshot_wait (DirTree *dtree, gboolean block)
+{
+    pid_t res;
+    int status;
+
+    if (!dtree->snapshot_pid)
+        return TRUE;
+
+    do {
+        res = waitpid (dtree->snapshot_pid, &status, block ? 0 : WNOHANG);
+    } while (res < 0 && errno == EINTR);
+
+    if (!res)
+        return FALSE;
+
+    if (res < 0 || !WIFEXITED (status) || WEXITSTATUS (status))
+        LOG_err (DIR_TREE_LOG, "Process %d failed to write DirTree snapshot !", (int) dtree->snapshot_pid);
+    dtree->snapshot_pid = 0;
+
+    return TRUE;
+}
+
+// write the snapshot in a child process, the tree is not changed there
+static void dir_tree_snapshot_write_bg (DirTree *dtree)
+{
+    pid_t pid;
+
+    if (!dir_tree_snapshot_wait (dtree, FALSE)) {
+        LOG_msg (DIR_TREE_LOG, "Previous DirTree snapshot is still being written, skipping");
+        return;
+    }
+
+    // buffered log lines must not be printed twice
+    fflush (stdout);
+
+    pid = fork ();
+    if (pid < 0) {
+        LOG_err (DIR_TREE_LOG, "Failed to fork snapshot writer: %s", strerror (errno));
+        return;
+    }
+
+    if (!pid) {
+        sigset_t mask;
+        gboolean res;
+
+        // parent's handlers (libevent's ones write to the parent's event loop) must not run here,
+        // only termination signals sent to the process group stop the child
+        sigfillset (&mask);
+        sigprocmask (SIG_BLOCK, &mask, NULL);
+        signal (SIGINT, SIG_DFL);
+        signal (SIGTERM, SIG_DFL);
+        signal (SIGHUP, SIG_DFL);
+        sigemptyset (&mask);
+        sigaddset (&mask, SIGINT);
+        sigaddset (&mask, SIGTERM);
+        sigaddset (&mask, SIGHUP);
+        sigprocmask (SIG_UNBLOCK, &mask, NULL);
+
+        res = dir_tree_snapshot_write (dtree);
+
+        fflush (stdout);
+        // nothing of the parent (atexit handlers, FUSE session) must run in the child
+        _exit (res ? 0 : 1);
+    }
+
+    dtree->snapshot_pid = pid;
+}
+
+static void dir_tree_snapshot_on_timer (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short what, void *arg)
+{
+    DirTree *dtree = (DirTree *) arg;
+    struct timeval tv;
+
+    dir_tree_snapshot_write_bg (dtree);
+
+    memset (&tv, 0, sizeof (tv));
+    tv.tv_sec = application_get_conf (dtree->app)->snapshot_interval;
+    evtimer_add (dtree->ev_snapshot, &tv);
+}
+/*}}}*/
+
+/*{{{ dir_tree_lookup */
+
+// names which are not in the sorted children of a fresh or indexed directory don't exist,
+// a directory created by mkdir starts as fresh (and indexed, if its parent is),
+// other names which are not found are requested from the server.
+// Names which don't exist are kept for negative_cache_time
+
+static gchar *dir_tree_negative_get_key (fuse_ino_t parent_ino, const gchar *name)
+{
+    return g_strdup_printf ("%"INO_FMT"/%s", parent_ino, name);
+}
+
+static gboolean dir_tree_negative_lookup (DirTree *dtree, fuse_ino_t parent_ino, const gchar *name)
+{
+    gchar *key;
+    gpointer value;
+    gboolean res = FALSE;
+
+    if (!g_hash_table_size (dtree->h_negative))
+        return FALSE;
+
+    key = dir_tree_negative_get_key (parent_ino, name);
+    if (g_hash_table_lookup_extended (dtree->h_negative, key, NULL, &value)) {
+        res = time (NULL) < (time_t) GPOINTER_TO_SIZE (value);
+        if (!res)
+            g_hash_table_remove (dtree->h_negative, key);
+    }
+    g_free (key);
+
+    return res;
+}
+
+static void dir_tree_negative_add (DirTree *dtree, fuse_ino_t parent_ino, const gchar *name)
+{
+    gint ttl = application_get_conf (dtree->app)->negative_cache_time;
+
+    if (ttl <= 0)
+        return;
+
+    if (g_hash_table_size (dtree->h_negative) >= DIR_TREE_NEGATIVE_CACHE_SIZE)
+        g_hash_table_remove_all (dtree->h_negative);
+
+    g_hash_table_insert (dtree->h_negative, dir_tree_negative_get_key (parent_ino, name), 
+        GSIZE_TO_POINTER (time (NULL) + ttl));
+}
+
+// the name is created or listed
+static void dir_tree_negative_remove (DirTree *dtree, fuse_ino_t parent_ino, const gchar *name)
+{
+    gchar *key;
+
+    if (!g_hash_table_size (dtree->h_negative))
+        return;
+
+    key = dir_tree_negative_get_key (parent_ino, name);
+    g_hash_table_remove (dtree->h_negative, key);
+    g_free (key);
+}
+
+// reply with attributes of the entry
+static void dir_tree_lookup_reply (DirTree *dtree, DirEntry *en, const char *name,
+    dir_tree_lookup_cb lookup_cb, fuse_req_t req)
+{
+    if (!en) {
+        LOG_debug (DIR_TREE_LOG, "Entry '%s' not found !", name);
+        lookup_cb (req, ENOENT, 0, 0, 0, 0);
+        return;
+    }
+    
+    // file is removed
+    if (en->age == 0) {
+        LOG_debug (DIR_TREE_LOG, "Entry '%s' is removed !", name);
+        lookup_cb (req, ENOENT, 0, 0, 0, 0);
+        return;
+    }
+    
+    // hide it
+    if (en->is_modified && !en->op_data) {
+        LOG_debug (DIR_TREE_LOG, "Entry '%s' is modified !", name);
+        inode_table_ref (dtree->inodes, en->ino);
+        lookup_cb (req, 0, en->ino, en->mode, 0, en->ctime);
+        return;
+    }
+
+    inode_table_ref (dtree->inodes, en->ino);
+    lookup_cb (req, 0, en->ino, en->mode, dir_tree_file_get_size (en), en->ctime);
+}
+
+static void dir_tree_lookup_data_destroy (DirTreeLookupData *lookup_data)
+{
+    g_free (lookup_data->name);
+    g_free (lookup_data->path);
+    g_free (lookup_data);
+}
+
+static void dir_tree_lookup_on_object_stat (gpointer ctx, gboolean success, gboolean exists, gboolean is_dir,
+    off_t size, const gchar *etag)
+{
+    DirTreeLookupData *lookup_data = (DirTreeLookupData *) ctx;
+    DirTree *dtree = lookup_data->dtree;
+    DirEntry *dir_en, *en = NULL;
+
+    dir_en = inode_table_lookup (dtree->inodes, lookup_data->parent_ino);
+    if (dir_en && dir_en->type == DET_dir && !dir_en->is_detached) {
+        // the name could be listed or created meanwhile
+        en = dir_entry_child_lookup (dtree, dir_en, lookup_data->name);
+
+        if (!en && success && exists) {
+            DeleteQueue *delete_queue = application_get_delete_queue (dtree->app);
+            gchar *dir_path = g_strdup_printf ("%s/", lookup_data->path);
+
+            // removed object exists until DeleteQueue is done with it
+            if (!delete_queue_is_pending (delete_queue, lookup_data->path) && 
+                (!is_dir || !delete_queue_is_pending (delete_queue, dir_path))) {
+                en = dir_tree_add_entry (dtree, lookup_data->name, is_dir ? DIR_DEFAULT_MODE : FILE_DEFAULT_MODE,
+                    is_dir ? DET_dir : DET_file, lookup_data->parent_ino, size, time (NULL));
+                if (en)
+                    dir_entry_set_etag (en, etag);
+            }
+            g_free (dir_path);
+        } else if (!en && success) {
+            dir_tree_negative_add (dtree, lookup_data->parent_ino, lookup_data->name);
+        }
+    }
+
+    // server isn't reached, the name could exist
+    if (!en && !success) {
+        LOG_err (DIR_TREE_LOG, "Failed to look up %s !", lookup_data->path);
+        lookup_data->lookup_cb (lookup_data->req, EIO, 0, 0, 0, 0);
+        dir_tree_lookup_data_destroy (lookup_data);
+        return;
+    }
+
+    dir_tree_lookup_reply (dtree, en, lookup_data->name, lookup_data->lookup_cb, lookup_data->req);
+    dir_tree_lookup_data_destroy (lookup_data);
+}
+
+static void dir_tree_lookup_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *http_con = (S3HttpConnection *) client;
+    DirTreeLookupData *lookup_data = (DirTreeLookupData *) ctx;
+
+    s3http_connection_acquire (http_con);
+
+    s3http_connection_object_stat (http_con, lookup_data->path, dir_tree_lookup_on_object_stat, lookup_data);
+}
+
+// request the name from the server
+static void dir_tree_lookup_request (DirTree *dtree, DirEntry *dir_en, const char *name,
+    dir_tree_lookup_cb lookup_cb, fuse_req_t req)
+{
+    DirTreeLookupData *lookup_data;
+    GString *path;
+
+    path = g_string_new ("");
+    dir_tree_entry_append_path (dtree, dir_en, path);
+    g_string_append_printf (path, "/%s", name);
+
+    LOG_debug (DIR_TREE_LOG, "Requesting %s from the server", path->str);
+
+    lookup_data = g_new0 (DirTreeLookupData, 1);
+    lookup_data->dtree = dtree;
+    lookup_data->parent_ino = dir_en->ino;
+    lookup_data->name = g_strdup (name);
+    lookup_data->lookup_cb = lookup_cb;
+    lookup_data->req = req;
+    lookup_data->path = g_string_free (path, FALSE);
+
+    if (!s3client_pool_get_client (application_get_ops_client_pool (dtree->app), dir_tree_lookup_on_http_ready, lookup_data)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get HTTP client !");
+        lookup_cb (req, EIO, 0, 0, 0, 0);
+        dir_tree_lookup_data_destroy (lookup_data);
+    }
+}
+
+// lookup entry and return attributes
+void dir_tree_lookup (DirTree *dtree, fuse_ino_t parent_ino, const char *name,
+    dir_tree_lookup_cb lookup_cb, fuse_req_t req)
+{
+    DirEntry *dir_en, *en;
+    DirTreeListing *listing;
+    
+    LOG_debug (DIR_TREE_LOG, "Looking up for '%s' in directory ino: %d", name, parent_ino);
+    
+    dir_en = inode_table_lookup (dtree->inodes, parent_ino);
+    
+    // entry not found
+    if (!dir_en || dir_en->type != DET_dir) {
+        LOG_msg (DIR_TREE_LOG, "Directory (%d) not found !", parent_ino);
+        lookup_cb (req, dir_en ? ENOTDIR : ESTALE, 0, 0, 0, 0);
+        return;
+    }
+
+    dir_tree_dir_load (dtree, dir_en);
+    en = dir_entry_child_lookup (dtree, dir_en, name);
+    listing = DIR_ENTRY_DIR (dir_en)->listing;
+
+    // the directory is being listed, wait until the listing gets to the name
+    if (!en && listing && 
+        (!listing->last_key || dir_entry_key_cmp (name, TRUE, listing->last_key) > 0)) {
+        DirTreeLookupData *lookup_data;
+
+        LOG_debug (DIR_TREE_LOG, "Waiting for listing of dir ino %"INO_FMT" to look up '%s'", parent_ino, name);
+        lookup_data = g_new0 (DirTreeLookupData, 1);
+        lookup_data->dtree = dtree;
+        lookup_data->parent_ino = parent_ino;
+        lookup_data->name = g_strdup (name);
+        lookup_data->lookup_cb = lookup_cb;
+        lookup_data->req = req;
+        g_queue_push_tail (listing->q_lookups, lookup_data);
+        return;
+    }
+
+    // the listing of the directory could be out of date
+    if (!en && !listing && !dir_en->is_detached && !dir_tree_dir_is_fresh (dtree, dir_en, time (NULL)) &&
+        !dir_tree_negative_lookup (dtree, parent_ino, name)) {
+        dir_tree_lookup_request (dtree, dir_en, name, lookup_cb, req);
+        return;
+    }
+
+    dir_tree_lookup_reply (dtree, en, name, lookup_cb, req);
+}
+/*}}}*/
+
+/*{{{ dir_tree_forget */
+void dir_tree_forget (DirTree *dtree, fuse_ino_t ino, unsigned long nlookup)
+{
+    inode_table_forget (dtree->inodes, ino, nlookup);
+}
+/*}}}*/
+
+/*{{{ dir_tree_getattr */
+// return entry attributes
+void dir_tree_getattr (DirTree *dtree, fuse_ino_t ino, 
+    dir_tree_getattr_cb getattr_cb, fuse_req_t req)
+{
+    DirEntry  *en;
+    
+    LOG_debug (DIR_TREE_LOG, "Getting attributes for %d", ino);
+    
+    en = inode_table_lookup (dtree->inodes, ino);
+    
+    // entry not found
+    if (!en) {
+        LOG_msg (DIR_TREE_LOG, "Entry (%d) not found !", ino);
+        getattr_cb (req, FALSE, 0, 0, 0, 0);
+        return;
+    }
+
+    getattr_cb (req, TRUE, en->ino, en->mode, dir_tree_file_get_size (en), en->ctime);
+}
+/*}}}*/
+
+/*{{{ dir_tree_setattr */
+static gboolean dir_tree_file_truncate (DirEntry *en, off_t size);
+
+// set entry's attributes
+// update directory cache
+void dir_tree_setattr (DirTree *dtree, fuse_ino_t ino, 
+    struct stat *attr, int to_set,
+    dir_tree_setattr_cb setattr_cb, fuse_req_t req, void *fi)
+{
+    DirEntry  *en;
+    
+    LOG_debug (DIR_TREE_LOG, "Setting attributes for %d", ino);
+    
+    en = inode_table_lookup (dtree->inodes, ino);
+    
+    // entry not found
+    if (!en) {
+        LOG_msg (DIR_TREE_LOG, "Entry (%d) not found !", ino);
+        setattr_cb (req, FALSE, 0, 0, 0);
+        return;
+    }
+
+    // file is not opened, cached data is not needed anymore
+    if (to_set & FUSE_SET_ATTR_SIZE)
+        dir_tree_file_cache_invalidate (en);
+
+    // truncate opened file, the new size is sent with the next upload
+    if ((to_set & FUSE_SET_ATTR_SIZE) && en->op_data) {
+        if (!dir_tree_file_truncate (en, attr->st_size)) {
+            setattr_cb (req, FALSE, 0, 0, 0);
+            return;
+        }
+        setattr_cb (req, TRUE, en->ino, en->mode, attr->st_size);
+        return;
+    }
+
+    //XXX: en->mode
+    setattr_cb (req, TRUE, en->ino, en->mode, en->size);
+}
+/*}}}*/
+
+typedef struct {
+    DirTree *dtree;
+    DirEntry *en;
+    fuse_ino_t ino;
+    gchar *path; // cached full path of the entry
+    guint32 path_epoch;
+    DirTree_file_read_cb file_read_cb;
+    DirTree_file_open_cb file_open_cb;
+    fuse_req_t c_req;
+    struct fuse_file_info *c_fi;
+
+    size_t c_size;
+    off_t c_off;
+    S3HttpClient *http;
+
+    int tmp_write_fd; 
+    gchar *tmp_write_path;
+
+    // in-memory write buffer, used until data is spilled to tmp file
+    gchar *write_buf;
+    size_t write_buf_len; // length of written data
+    size_t write_buf_alloc; // allocated buffer size
+
+    GQueue *q_ranges_requested;
+    off_t total_read;
+    
+    gboolean op_in_progress;
+
+    off_t base_size; // [0, base_size) of the object on the server is a part of the file
+    guint8 base_etag[16]; // MD5 of that object, valid if has_base_etag is set
+    gboolean has_base_etag;
+    off_t file_size; // current size of the file
+    RangeSet *dirty; // written ranges, which are not uploaded yet
+    RangeSet *valid; // ranges of tmp file which contain file data
+
+    // MD5 is calculated while data is written sequentially, 
+    // NULL if file was written out of order
+    GChecksum *md5;
+    off_t md5_len; // the length of hashed data
+
+    gboolean is_dirty; // written since the last upload was started
+    gboolean is_released; // file is closed
+    guint open_count; // file handles, which refer to it in fi->fh
+    gboolean upload_in_progress;
+    off_t upload_size; // the size of data being uploaded
+    guint8 upload_digest[16]; // MD5 of data being uploaded
+    gboolean upload_digest_valid;
+    off_t upload_trunc_size; // the smallest size the file was truncated to during the upload
+    RangeSet *upload_dirty; // dirty ranges which are being uploaded
+    RangeSet *upload_fetch; // original data which must be fetched before sending
+    GArray *a_upload_parts; // S3HttpConnectionPart, empty if the whole file is sent
+    gboolean upload_scheduled; // waiting for or using UploadScheduler's connection
+    off_t fetch_off; // original data range being fetched
+    off_t fetch_len;
+    guint64 journal_id; // UploadJournal record, 0 if none
+    GQueue *q_upload_waiters; // requests waiting for upload to finish
+    struct event *ev_upload_retry; // failed upload of closed file is started again by this timer
+    guint upload_retries; // failed uploads in a row
+
+    gboolean is_staged; // file is modified, reads are served from tmp file
+    RangeSet *copy_up_fetching; // original data ranges being copied to tmp file
+    guint copy_up_count; // number of copy-up requests in flight
+    GQueue *q_staging_reads; // reads waiting for original data
+
+    GList *l_read_cache; // link in DirTree's q_read_cache, NULL if file is not cached
+    guint64 read_cache_size; // the size of cached data
+    
+} DirTreeFileOpData;
+
+typedef struct {
+    size_t size;
+    off_t off;
+    char *write_buf;
+    fuse_req_t c_req;
+} DirTreeFileRange;
+
+/*{{{ dir_tree_add_file */
+
+// return the full path of the opened file, it's valid until the file is moved
+static const gchar *file_op_data_get_path (DirTreeFileOpData *op_data)
+{
+    if (!op_data->path || op_data->path_epoch != op_data->dtree->path_epoch) {
+        g_free (op_data->path);
+        op_data->path = dir_tree_entry_get_path (op_data->dtree, op_data->en);
+        op_data->path_epoch = op_data->dtree->path_epoch;
+    }
+
+    return op_data->path;
+}
+
+// return context data of the opened file handle, all handles of the file share it
+static DirTreeFileOpData *file_op_data_get (struct fuse_file_info *fi)
+{
+    return fi ? (DirTreeFileOpData *) (uintptr_t) fi->fh : NULL;
+}
+
+static DirTreeFileOpData *file_op_data_create (DirTree *dtree, fuse_ino_t ino)
+{
+    DirTreeFileOpData *op_data;
+    
+    op_data = g_new0 (DirTreeFileOpData, 1);
+    op_data->dtree = dtree;
+    op_data->ino = ino;
+    op_data->op_in_progress = FALSE;
+    op_data->q_ranges_requested = g_queue_new ();
+    op_data->total_read = 0;
+    op_data->tmp_write_fd = 0;
+    op_data->tmp_write_path = NULL;
+    op_data->write_buf = NULL;
+    op_data->write_buf_len = 0;
+    op_data->write_buf_alloc = 0;
+    op_data->http = NULL;
+    op_data->is_dirty = FALSE;
+    op_data->is_released = FALSE;
+    op_data->open_count = 0;
+    op_data->upload_in_progress = FALSE;
+    op_data->upload_size = 0;
+    op_data->journal_id = 0;
+    op_data->q_upload_waiters = g_queue_new ();
+    op_data->md5 = g_checksum_new (G_CHECKSUM_MD5);
+    op_data->md5_len = 0;
+    op_data->upload_digest_valid = FALSE;
+    op_data->base_size = 0;
+    op_data->file_size = 0;
+    op_data->dirty = range_set_create ();
+    op_data->valid = range_set_create ();
+    op_data->upload_dirty = range_set_create ();
+    op_data->upload_fetch = range_set_create ();
+    op_data->a_upload_parts = g_array_new (FALSE, FALSE, sizeof (S3HttpConnectionPart));
+    op_data->upload_scheduled = FALSE;
+    op_data->is_staged = FALSE;
+    op_data->copy_up_fetching = range_set_create ();
+    op_data->copy_up_count = 0;
+    op_data->q_staging_reads = g_queue_new ();
+    op_data->l_read_cache = NULL;
+    op_data->read_cache_size = 0;
+
+    return op_data;
+}
+
+static void file_op_data_destroy (DirTreeFileOpData *op_data)
+{
+    LOG_debug (DIR_TREE_LOG, "Destroying opdata !");
+
+    if (op_data->en && op_data->en->op_data == op_data) {
+        op_data->en->op_data = NULL;
+        // file was removed while it was opened
+        dir_tree_entry_release (op_data->dtree, op_data->en);
+    }
+
+    if (op_data->write_buf) {
+        op_data->dtree->write_buf_size -= op_data->write_buf_alloc;
+        g_free (op_data->write_buf);
+    }
+
+    if (op_data->tmp_write_fd) {
+        close (op_data->tmp_write_fd);
+        // tmp file is still referenced by UploadJournal
+        if (!op_data->journal_id)
+            unlink (op_data->tmp_write_path);
+    }
+    g_free (op_data->tmp_write_path);
+    g_free (op_data->path);
+
+    g_queue_free_full (op_data->q_upload_waiters, g_free);
+    if (op_data->ev_upload_retry)
+        event_free (op_data->ev_upload_retry);
+
+    if (op_data->md5)
+        g_checksum_free (op_data->md5);
+
+    range_set_destroy (op_data->dirty);
+    range_set_destroy (op_data->valid);
+    range_set_destroy (op_data->upload_dirty);
+    range_set_destroy (op_data->upload_fetch);
+    g_array_free (op_data->a_upload_parts, TRUE);
+    range_set_destroy (op_data->copy_up_fetching);
+    g_queue_free_full (op_data->q_staging_reads, g_free);
+
+    if (g_queue_get_length (op_data->q_ranges_requested) > 0)
         g_queue_free_full (op_data->q_ranges_requested, g_free);
     else
-        g_queue_free (op_data->q_ranges_requested);
-    g_free (op_data);
+        g_queue_free (op_data->q_ranges_requested);
+    g_free (op_data);
+}
+
+/*{{{ read cache */
+
+// staging data of uploaded files is kept for reads, until the total size exceeds read_cache_max_size
+
+// return the size of file, as it's seen by the user
+static off_t dir_tree_file_get_size (DirEntry *en)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) en->op_data;
+
+    if (op_data && op_data->is_staged)
+        return op_data->file_size;
+
+    return en->size;
+}
+
+// remove file from the read cache, data is owned by op_data again
+static void dir_tree_file_cache_remove (DirTreeFileOpData *op_data)
+{
+    DirTree *dtree = op_data->dtree;
+
+    g_queue_delete_link (dtree->q_read_cache, op_data->l_read_cache);
+    op_data->l_read_cache = NULL;
+    dtree->read_cache_size -= op_data->read_cache_size;
+    op_data->read_cache_size = 0;
+    dtree->write_buf_size += op_data->write_buf_alloc;
+}
+
+static void dir_tree_file_cache_evict (DirTreeFileOpData *op_data)
+{
+    LOG_debug (DIR_TREE_LOG, "[%p] Removing %s from the read cache", op_data, file_op_data_get_path (op_data));
+
+    dir_tree_file_cache_remove (op_data);
+    file_op_data_destroy (op_data);
+}
+
+// forget cached data of the entry
+static void dir_tree_file_cache_invalidate (DirEntry *en)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) en->op_data;
+
+    if (op_data && op_data->l_read_cache)
+        dir_tree_file_cache_evict (op_data);
+}
+
+static void dir_tree_file_cache_clear (DirTree *dtree)
+{
+    DirTreeFileOpData *op_data;
+
+    while ((op_data = g_queue_peek_head (dtree->q_read_cache)))
+        dir_tree_file_cache_evict (op_data);
+}
+
+// keep staging data of closed file, return FALSE if it can't be cached
+static gboolean dir_tree_file_cache_add (DirTreeFileOpData *op_data)
+{
+    DirTree *dtree = op_data->dtree;
+    AppConf *conf = application_get_conf (dtree->app);
+    guint64 size;
+
+    // only data which is stored on the server
+    if (!op_data->is_staged || op_data->is_dirty || op_data->upload_in_progress || 
+        op_data->en->is_modified || op_data->journal_id)
+        return FALSE;
+
+    if (op_data->tmp_write_fd)
+        size = op_data->file_size;
+    else if (op_data->write_buf)
+        size = op_data->write_buf_alloc;
+    else
+        return FALSE;
+
+    if (!conf->read_cache_max_size || size > conf->read_cache_max_size)
+        return FALSE;
+
+    // in-memory buffer is accounted by the read cache now
+    dtree->write_buf_size -= op_data->write_buf_alloc;
+    op_data->read_cache_size = size;
+    dtree->read_cache_size += size;
+    g_queue_push_tail (dtree->q_read_cache, op_data);
+    op_data->l_read_cache = g_queue_peek_tail_link (dtree->q_read_cache);
+
+    LOG_debug (DIR_TREE_LOG, "[%p] %s is added to the read cache, cache size: %"G_GUINT64_FORMAT, 
+        op_data, file_op_data_get_path (op_data), dtree->read_cache_size);
+
+    while (dtree->read_cache_size > conf->read_cache_max_size)
+        dir_tree_file_cache_evict (g_queue_peek_head (dtree->q_read_cache));
+
+    return TRUE;
+}
+/*}}}*/
+
+// file is closed, destroy context data unless it's still in use or cached
+static void file_op_data_release (DirTreeFileOpData *op_data)
+{
+    // original data is still being copied
+    if (op_data->copy_up_count)
+        return;
+
+    // written data is kept until it's stored on the server
+    if (op_data->is_dirty || op_data->upload_in_progress)
+        return;
+
+    if (dir_tree_file_cache_add (op_data))
+        return;
+
+    file_op_data_destroy (op_data);
+}
+
+// add new file entry to directory, return new inode
+void dir_tree_file_create (DirTree *dtree, fuse_ino_t parent_ino, const char *name, mode_t mode,
+    DirTree_file_create_cb file_create_cb, fuse_req_t req, struct fuse_file_info *fi)
+{
+    DirEntry *dir_en, *en;
+    DirTreeFileOpData *op_data;
+    
+    LOG_debug (DIR_TREE_LOG, "Adding new entry '%s' to directory ino: %"INO_FMT, name, parent_ino);
+    
+    dir_en = inode_table_lookup (dtree->inodes, parent_ino);
+    
+    // entry not found
+    if (!dir_en || dir_en->type != DET_dir) {
+        LOG_msg (DIR_TREE_LOG, "Directory (%"INO_FMT") not found !", parent_ino);
+        file_create_cb (req, FALSE, 0, 0, 0, fi);
+        return;
+    }
+    
+    // create a new entry
+    en = dir_tree_add_entry (dtree, name, mode, DET_file, parent_ino, 0, time (NULL));
+    if (!en) {
+        LOG_msg (DIR_TREE_LOG, "Failed to create file: %s !", name);
+        file_create_cb (req, FALSE, 0, 0, 0, fi);
+        return;
+    }
+    //XXX: set as new 
+    en->is_modified = TRUE;
+
+    op_data = file_op_data_create (dtree, en->ino);
+    op_data->en = en;
+    op_data->ino = en->ino;
+    // the object is created on release even if nothing is written,
+    // it's sent after pending removals of the old object
+    op_data->is_dirty = TRUE;
+    op_data->open_count = 1;
+    en->op_data = (gpointer) op_data;
+    fi->fh = (uint64_t) (uintptr_t) op_data;
+        
+    inode_table_ref (dtree->inodes, en->ino);
+    file_create_cb (req, TRUE, en->ino, en->mode, en->size, fi);
+}
+/*}}}*/
+
+static void dir_tree_file_read_prepare_request (DirTreeFileOpData *op_data, S3HttpClient *http, off_t off, size_t size);
+static void dir_tree_file_open_on_http_ready (gpointer client, gpointer ctx);
+
+// existing file is opened, create context data
+gboolean dir_tree_file_open (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi, 
+    DirTree_file_open_cb file_open_cb, fuse_req_t req)
+{
+    DirTreeFileOpData *op_data;
+    DirEntry *en;
+
+    en = inode_table_lookup (dtree->inodes, ino);
+
+    // if entry does not exist
+    // or it's not a directory type ?
+    if (!en) {
+        LOG_msg (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") not found !", ino);
+        file_open_cb (req, FALSE, fi);
+        return FALSE;
+    }
+
+    op_data = (DirTreeFileOpData *) en->op_data;
+
+    // file is already opened by another handle, share its context data
+    if (op_data && !op_data->is_released) {
+        LOG_debug (DIR_TREE_LOG, "[%p %p] %s is opened %u times", op_data, fi, file_op_data_get_path (op_data), 
+            op_data->open_count + 1);
+        op_data->open_count++;
+        fi->fh = (uint64_t) (uintptr_t) op_data;
+        file_open_cb (req, TRUE, fi);
+        return TRUE;
+    }
+
+    // file is closed, but its data is being uploaded or is cached, reuse it
+    if (op_data && op_data->is_released) {
+        LOG_debug (DIR_TREE_LOG, "[%p] Reopening %s with staged data", op_data, file_op_data_get_path (op_data));
+        if (op_data->l_read_cache)
+            dir_tree_file_cache_remove (op_data);
+        op_data->is_released = FALSE;
+    } else {
+        op_data = file_op_data_create (dtree, ino);
+        op_data->en = en;
+        op_data->base_size = en->size;
+        op_data->file_size = en->size;
+        memcpy (op_data->base_etag, en->etag, sizeof (op_data->base_etag));
+        op_data->has_base_etag = en->has_etag;
+    }
+
+    op_data->c_fi = fi;
+    op_data->c_req = req;
+    op_data->file_open_cb = file_open_cb;
+    op_data->open_count = 1;
+    
+    op_data->en->op_data = (gpointer) op_data;
+    fi->fh = (uint64_t) (uintptr_t) op_data;
+
+    LOG_debug (DIR_TREE_LOG, "[%p %p] dir_tree_open  inode %"INO_FMT, op_data, fi, ino);
+
+    if (!s3client_pool_get_client (application_get_read_client_pool (dtree->app), dir_tree_file_open_on_http_ready, op_data)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get S3HttpConnection from the pool !");
+    }
+
+    return TRUE;
+}
+
+/*{{{ file upload */
+
+typedef void (*DirTreeUploadDone_cb) (gpointer ctx, gboolean success);
+
+typedef struct {
+    DirTree_file_sync_cb sync_cb;
+    fuse_req_t req;
+    DirTreeUploadDone_cb done_cb; // used instead of sync_cb if set
+    gpointer ctx;
+} DirTreeUploadWaiter;
+
+// return the size of written data
+static off_t dir_tree_file_get_written_size (DirTreeFileOpData *op_data)
+{
+    return op_data->file_size;
+}
+
+// inform all requests which are waiting for the upload
+static void dir_tree_file_upload_notify_waiters (DirTreeFileOpData *op_data, gboolean success)
+{
+    DirTreeUploadWaiter *waiter;
+
+    while ((waiter = g_queue_pop_head (op_data->q_upload_waiters))) {
+        if (waiter->done_cb)
+            waiter->done_cb (waiter->ctx, success);
+        else
+            waiter->sync_cb (waiter->req, success);
+        g_free (waiter);
+    }
+}
+
+static gboolean dir_tree_file_upload_start (DirTreeFileOpData *op_data);
+static gboolean dir_tree_file_write_spill (DirTreeFileOpData *op_data);
+static void dir_tree_file_upload_retry (DirTreeFileOpData *op_data);
+
+// convert MD5 digest to the lowercase hex string, as used in ETags
+static void dir_tree_digest_to_hex (const guint8 *digest, gchar *hex)
+{
+    gint i;
+
+    for (i = 0; i < 16; i++)
+        g_snprintf (hex + i * 2, 3, "%02x", digest[i]);
+}
+
+// get MD5 of data which is going to be uploaded, if it was calculated while writing
+static void dir_tree_file_upload_get_digest (DirTreeFileOpData *op_data)
+{
+    GChecksum *tmp;
+    gsize len = sizeof (op_data->upload_digest);
+
+    op_data->upload_digest_valid = FALSE;
+
+    if (!op_data->md5 || op_data->md5_len != op_data->upload_size)
+        return;
+
+    // keep the original checksum, more data can be appended later
+    tmp = g_checksum_copy (op_data->md5);
+    g_checksum_get_digest (tmp, op_data->upload_digest, &len);
+    g_checksum_free (tmp);
+
+    op_data->upload_digest_valid = (len == sizeof (op_data->upload_digest));
+}
+
+// return TRUE if the server already has an object with the same content
+static gboolean dir_tree_file_upload_is_redundant (DirTreeFileOpData *op_data)
+{
+    if (!op_data->upload_digest_valid || op_data->en->size != op_data->upload_size)
+        return FALSE;
+
+    return dir_entry_etag_equal (op_data->en, op_data->upload_digest);
+}
+
+// upload is not started or failed, written data is still dirty
+static void dir_tree_file_upload_revert (DirTreeFileOpData *op_data)
+{
+    op_data->is_dirty = TRUE;
+    op_data->upload_in_progress = FALSE;
+    op_data->dtree->upload_pending_size -= op_data->upload_size;
+    op_data->upload_size = 0;
+    range_set_merge (op_data->dirty, op_data->upload_dirty);
+    range_set_clear (op_data->upload_dirty);
+    range_set_clear (op_data->upload_fetch);
+    g_array_set_size (op_data->a_upload_parts, 0);
+}
+
+static void dir_tree_file_upload_on_entry_sent_cb (gpointer ctx, gboolean success)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+    gchar hex[33];
+    // XXX: entry may be deleted
+
+    if (op_data->upload_scheduled) {
+        upload_scheduler_release (application_get_upload_scheduler (op_data->dtree->app), op_data->upload_size);
+        op_data->upload_scheduled = FALSE;
+    }
+
+    LOG_debug (DIR_TREE_LOG, "File is sent:  ino = %"INO_FMT", success: %s", op_data->ino, success ? "YES" : "NO");
+
+    if (success) {
+        // remember what is stored on the server
+        op_data->en->size = op_data->upload_size;
+        op_data->base_size = MIN (op_data->upload_size, op_data->upload_trunc_size);
+        if (op_data->upload_digest_valid && !op_data->a_upload_parts->len) {
+            dir_tree_digest_to_hex (op_data->upload_digest, hex);
+            dir_entry_set_etag (op_data->en, hex);
+        } else
+            dir_entry_set_etag (op_data->en, NULL);
+        memcpy (op_data->base_etag, op_data->en->etag, sizeof (op_data->base_etag));
+        op_data->has_base_etag = op_data->en->has_etag;
+
+        op_data->upload_in_progress = FALSE;
+        op_data->dtree->upload_pending_size -= op_data->upload_size;
+        op_data->upload_size = 0;
+        range_set_clear (op_data->upload_dirty);
+        g_array_set_size (op_data->a_upload_parts, 0);
+        op_data->upload_retries = 0;
+    } else {
+        LOG_err (DIR_TREE_LOG, "Failed to upload file: %s !", file_op_data_get_path (op_data));
+        dir_tree_file_upload_revert (op_data);
+    }
+
+    if (success && op_data->is_dirty && (op_data->is_released || g_queue_get_length (op_data->q_upload_waiters))) {
+        // file was modified during the upload, send the latest version
+        if (!dir_tree_file_upload_start (op_data))
+            success = FALSE;
+        else if (op_data->upload_in_progress)
+            return;
+    }
+
+    if (!op_data->is_dirty)
+        op_data->en->is_modified = FALSE;
+
+    dir_tree_file_upload_notify_waiters (op_data, success);
+
+    // file is stored on the server, forget about it
+    if (op_data->journal_id && success && !op_data->is_dirty) {
+        upload_journal_remove (application_get_upload_journal (op_data->dtree->app), op_data->journal_id);
+        op_data->journal_id = 0;
+    }
+
+    // file is already closed, nobody needs it anymore
+    if (op_data->is_released) {
+        if (op_data->is_dirty) {
+            dir_tree_file_upload_retry (op_data);
+            return;
+        }
+        file_op_data_release (op_data);
+    }
+}
+
+// file was removed before the upload got its write connection, its removal is already queued
+// and the object must not be created again. Return TRUE if the upload is finished
+static gboolean dir_tree_file_upload_is_removed (DirTreeFileOpData *op_data)
+{
+    if (!op_data->en->is_detached)
+        return FALSE;
+
+    LOG_debug (DIR_TREE_LOG, "%s is removed, dropping its upload", file_op_data_get_path (op_data));
+    dir_tree_file_upload_on_entry_sent_cb (op_data, TRUE);
+    return TRUE;
+}
+
+// HTTP client is ready for a new request
+static void dir_tree_file_upload_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *http_con = (S3HttpConnection *) client;
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+
+    LOG_debug (DIR_TREE_LOG, "[%p] Acquired http client ! ino: %"INO_FMT, op_data, op_data->ino);
+
+    s3http_connection_acquire (http_con);
+
+    // unchanged ranges are copied on the server side, from the version the file is based on
+    if (op_data->a_upload_parts->len) {
+        gchar hex[33];
+
+        dir_tree_digest_to_hex (op_data->base_etag, hex);
+        s3http_connection_multipart_send (http_con, op_data->tmp_write_fd, file_op_data_get_path (op_data), hex, 
+            op_data->a_upload_parts, dir_tree_file_upload_on_entry_sent_cb, op_data);
+        return;
+    }
+
+    // let the server verify data integrity
+    if (op_data->upload_digest_valid) {
+        gchar *content_md5;
+
+        content_md5 = g_base64_encode (op_data->upload_digest, sizeof (op_data->upload_digest));
+        s3http_connection_add_output_header (http_con, "Content-MD5", content_md5);
+        g_free (content_md5);
+    }
+
+    // small files are sent directly from the write buffer
+    if (op_data->tmp_write_fd)
+        s3http_connection_file_send (http_con, op_data->tmp_write_fd, file_op_data_get_path (op_data), 
+            dir_tree_file_upload_on_entry_sent_cb, op_data);
+    else
+        s3http_connection_buffer_send (http_con, op_data->write_buf, op_data->write_buf_len, file_op_data_get_path (op_data), 
+            dir_tree_file_upload_on_entry_sent_cb, op_data);
+}
+
+static void dir_tree_file_upload_schedule (DirTreeFileOpData *op_data);
+
+// removal of the old object is done, the new one can be sent
+static void dir_tree_file_upload_on_deleted_cb (gpointer ctx, G_GNUC_UNUSED gboolean success)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+
+    if (dir_tree_file_upload_is_removed (op_data))
+        return;
+
+    dir_tree_file_upload_schedule (op_data);
+}
+
+// all data is in place, wait for a connection
+static gboolean dir_tree_file_upload_send (DirTreeFileOpData *op_data)
+{
+    // tmp file might contain data past the truncated size
+    if (op_data->tmp_write_fd && ftruncate (op_data->tmp_write_fd, op_data->upload_size) < 0) {
+        LOG_err (DIR_TREE_LOG, "Failed to truncate tmp file: %s", strerror (errno));
+        return FALSE;
+    }
+
+    // the object was removed and created again, the removal must not overtake the upload
+    if (delete_queue_wait (application_get_delete_queue (op_data->dtree->app), file_op_data_get_path (op_data), 
+        dir_tree_file_upload_on_deleted_cb, op_data))
+        return TRUE;
+
+    dir_tree_file_upload_schedule (op_data);
+    return TRUE;
+}
+
+// accepted upload waits in UploadScheduler's queue until a connection is free
+static void dir_tree_file_upload_schedule (DirTreeFileOpData *op_data)
+{
+    op_data->upload_scheduled = TRUE;
+    upload_scheduler_get_client (application_get_upload_scheduler (op_data->dtree->app), op_data->upload_size, 
+        dir_tree_file_upload_on_http_ready, op_data);
+}
+
+/*{{{ upload plan */
+
+static void dir_tree_file_upload_plan_fetch_missing_cb (off_t off, off_t len, gpointer ctx)
+{
+    RangeSet *fetch = (RangeSet *) ctx;
+
+    range_set_add (fetch, off, len);
+}
+
+// original data of sent range, which is not in the tmp file yet, must be fetched
+static void dir_tree_file_upload_plan_add_sent (DirTreeFileOpData *op_data, off_t off, off_t len, off_t base_size)
+{
+    if (off >= base_size)
+        return;
+
+    range_set_foreach_missing (op_data->valid, off, MIN (len, base_size - off), 
+        dir_tree_file_upload_plan_fetch_missing_cb, op_data->upload_fetch);
+}
+
+// decide how to create a new version of the object:
+// if the most of the object is not changed, build it from server side copies of unchanged ranges 
+// and uploaded dirty ranges, otherwise PUT the whole file.
+// Copies are conditional on the ETag of the original object, the whole file is sent if it's unknown.
+// Original data which must be sent is fetched into the tmp file first
+static void dir_tree_file_upload_plan (DirTreeFileOpData *op_data)
+{
+    off_t base_size;
+    guint i;
+
+    g_array_set_size (op_data->a_upload_parts, 0);
+    range_set_clear (op_data->upload_fetch);
+
+    base_size = MIN (op_data->base_size, op_data->upload_size);
+    if (!base_size)
+        return;
+
+    if (base_size >= FILE_PATCH_MIN_SIZE && op_data->has_base_etag)
+        upload_plan_build (op_data->a_upload_parts, op_data->upload_dirty, base_size, op_data->upload_size);
+
+    if (op_data->a_upload_parts->len) {
+        for (i = 0; i < op_data->a_upload_parts->len; i++) {
+            S3HttpConnectionPart *part = &g_array_index (op_data->a_upload_parts, S3HttpConnectionPart, i);
+            if (!part->is_copy)
+                dir_tree_file_upload_plan_add_sent (op_data, part->off, part->len, base_size);
+        }
+
+        LOG_debug (DIR_TREE_LOG, "[%p] %s is patched with %u parts, fetching %"OFF_FMT" bytes", op_data, 
+            file_op_data_get_path (op_data), op_data->a_upload_parts->len, (uintmax_t) range_set_get_total (op_data->upload_fetch));
+    } else {
+        dir_tree_file_upload_plan_add_sent (op_data, 0, op_data->upload_size, base_size);
+    }
+}
+/*}}}*/
+
+/*{{{ original data fetching */
+
+static gboolean dir_tree_file_upload_fetch_next (DirTreeFileOpData *op_data);
+
+typedef struct {
+    DirTreeFileOpData *op_data;
+    const gchar *buf;
+    off_t off;
+} DirTreeFetchWriteData;
+
+// store only those parts, which were not written in the meantime
+static void dir_tree_file_upload_fetch_write_cb (off_t off, off_t len, gpointer ctx)
+{
+    DirTreeFetchWriteData *data = (DirTreeFetchWriteData *) ctx;
+
+    if (pwrite (data->op_data->tmp_write_fd, data->buf + (off - data->off), len, off) != (ssize_t) len)
+        LOG_err (DIR_TREE_LOG, "Failed to write tmp file !");
+}
+
+static void dir_tree_file_upload_fetch_on_received_cb (gpointer ctx, gboolean success, const gchar *buf, size_t buf_len)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+    DirTreeFetchWriteData data;
+
+    if (!success || (off_t) buf_len != op_data->fetch_len) {
+        LOG_err (DIR_TREE_LOG, "Failed to get original data of %s !", file_op_data_get_path (op_data));
+        dir_tree_file_upload_on_entry_sent_cb (op_data, FALSE);
+        return;
+    }
+
+    data.op_data = op_data;
+    data.buf = buf;
+    data.off = op_data->fetch_off;
+    range_set_foreach_missing (op_data->valid, op_data->fetch_off, op_data->fetch_len, 
+        dir_tree_file_upload_fetch_write_cb, &data);
+    range_set_add (op_data->valid, op_data->fetch_off, op_data->fetch_len);
+
+    if (dir_tree_file_upload_is_removed (op_data))
+        return;
+
+    if (!dir_tree_file_upload_fetch_next (op_data))
+        dir_tree_file_upload_on_entry_sent_cb (op_data, FALSE);
+}
+
+static void dir_tree_file_upload_fetch_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *http_con = (S3HttpConnection *) client;
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+
+    s3http_connection_acquire (http_con);
+
+    s3http_connection_get_range (http_con, file_op_data_get_path (op_data), op_data->fetch_off, op_data->fetch_len,
+        dir_tree_file_upload_fetch_on_received_cb, op_data);
+}
+
+// get the next range of original data, or start sending if everything is in place
+static gboolean dir_tree_file_upload_fetch_next (DirTreeFileOpData *op_data)
+{
+    off_t off, len;
+
+    if (!range_set_get_first (op_data->upload_fetch, &off, &len))
+        return dir_tree_file_upload_send (op_data);
+
+    // original data is stored in tmp file with the same offsets
+    if (!op_data->tmp_write_fd && !dir_tree_file_write_spill (op_data))
+        return FALSE;
+
+    op_data->fetch_off = off;
+    op_data->fetch_len = MIN (len, FILE_FETCH_CHUNK_SIZE);
+    range_set_remove (op_data->upload_fetch, op_data->fetch_off, op_data->fetch_len);
+
+    if (!s3client_pool_get_client (application_get_ops_client_pool (op_data->dtree->app), 
+        dir_tree_file_upload_fetch_on_http_ready, op_data)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get S3HttpConnection from the pool !");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+/*}}}*/
+
+// start uploading written data, unless it's already in progress
+// data is not sent if the server has the same content, 
+// upload_in_progress stays FALSE in this case
+// return FALSE if failed to start
+static gboolean dir_tree_file_upload_start (DirTreeFileOpData *op_data)
+{
+    if (op_data->upload_in_progress)
+        return TRUE;
+
+    // file is removed, nothing to upload
+    if (op_data->en->is_detached) {
+        LOG_debug (DIR_TREE_LOG, "%s is removed, skipping upload", file_op_data_get_path (op_data));
+        op_data->is_dirty = FALSE;
+        range_set_clear (op_data->dirty);
+        if (op_data->journal_id) {
+            upload_journal_remove (application_get_upload_journal (op_data->dtree->app), op_data->journal_id);
+            op_data->journal_id = 0;
+        }
+        return TRUE;
+    }
+
+    op_data->is_dirty = FALSE;
+    op_data->upload_size = dir_tree_file_get_written_size (op_data);
+    op_data->upload_trunc_size = op_data->upload_size;
+    dir_tree_file_upload_get_digest (op_data);
+
+    if (dir_tree_file_upload_is_redundant (op_data)) {
+        LOG_debug (DIR_TREE_LOG, "Content of %s is not changed, skipping upload", file_op_data_get_path (op_data));
+        op_data->upload_size = 0;
+        op_data->en->is_modified = FALSE;
+        range_set_clear (op_data->dirty);
+        if (op_data->journal_id) {
+            upload_journal_remove (application_get_upload_journal (op_data->dtree->app), op_data->journal_id);
+            op_data->journal_id = 0;
+        }
+        return TRUE;
+    }
+
+    // data written from now on belongs to the next upload
+    range_set_merge (op_data->upload_dirty, op_data->dirty);
+    range_set_clear (op_data->dirty);
+
+    op_data->upload_in_progress = TRUE;
+    op_data->dtree->upload_pending_size += op_data->upload_size;
+
+    dir_tree_file_upload_plan (op_data);
+
+    if (!dir_tree_file_upload_fetch_next (op_data)) {
+        dir_tree_file_upload_revert (op_data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void dir_tree_file_upload_retry_on_timer (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short what, void *arg)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) arg;
+
+    // file was opened again and its data is uploaded by other means
+    if (op_data->upload_in_progress || !op_data->is_dirty)
+        return;
+
+    if (!dir_tree_file_upload_start (op_data)) {
+        dir_tree_file_upload_retry (op_data);
+        return;
+    }
+
+    // file is removed or the server already has its content
+    if (!op_data->upload_in_progress && op_data->is_released)
+        file_op_data_release (op_data);
+}
+
+// upload of closed file failed, keep written data and start the upload again later,
+// the delay is doubled after each failure
+static void dir_tree_file_upload_retry (DirTreeFileOpData *op_data)
+{
+    struct timeval tv;
+
+    if (!op_data->ev_upload_retry)
+        op_data->ev_upload_retry = evtimer_new (application_get_evbase (op_data->dtree->app), 
+            dir_tree_file_upload_retry_on_timer, op_data);
+
+    memset (&tv, 0, sizeof (tv));
+    tv.tv_sec = MIN (1 << MIN (op_data->upload_retries, 6), FILE_UPLOAD_RETRY_MAX_DELAY);
+    op_data->upload_retries++;
+
+    LOG_err (DIR_TREE_LOG, "Upload of %s is retried in %ld seconds (attempt %u)", 
+        file_op_data_get_path (op_data), (long) tv.tv_sec, op_data->upload_retries);
+    evtimer_add (op_data->ev_upload_retry, &tv);
+}
+
+static void dir_tree_file_upload_add_waiter (DirTreeFileOpData *op_data, DirTree_file_sync_cb sync_cb, fuse_req_t req)
+{
+    DirTreeUploadWaiter *waiter;
+
+    waiter = g_new0 (DirTreeUploadWaiter, 1);
+    waiter->sync_cb = sync_cb;
+    waiter->req = req;
+    g_queue_push_tail (op_data->q_upload_waiters, waiter);
+}
+
+// call done_cb when the current upload is finished
+static void dir_tree_file_upload_add_done_waiter (DirTreeFileOpData *op_data, DirTreeUploadDone_cb done_cb, gpointer ctx)
+{
+    DirTreeUploadWaiter *waiter;
+
+    waiter = g_new0 (DirTreeUploadWaiter, 1);
+    waiter->done_cb = done_cb;
+    waiter->ctx = ctx;
+    g_queue_push_tail (op_data->q_upload_waiters, waiter);
+}
+
+// file descriptor is closed, start uploading if requested
+void dir_tree_file_flush (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi,
+    DirTree_file_sync_cb flush_cb, fuse_req_t req)
+{
+    DirTreeFileOpData *op_data;
+    AppConf *conf = application_get_conf (dtree->app);
+
+    // nothing is written with this handle
+    op_data = file_op_data_get (fi);
+    if (!op_data) {
+        LOG_debug (DIR_TREE_LOG, "No context data of ino %"INO_FMT", nothing to flush", ino);
+        flush_cb (req, TRUE);
+        return;
+    }
+
+    if (conf->upload_on_flush && op_data->is_dirty)
+        dir_tree_file_upload_start (op_data);
+
+    flush_cb (req, TRUE);
+}
+
+// upload written data and wait until it's stored on the server
+void dir_tree_file_fsync (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi,
+    DirTree_file_sync_cb fsync_cb, fuse_req_t req)
+{
+    DirTreeFileOpData *op_data;
+
+    op_data = file_op_data_get (fi);
+    if (!op_data) {
+        LOG_debug (DIR_TREE_LOG, "No context data of ino %"INO_FMT", nothing to sync", ino);
+        fsync_cb (req, TRUE);
+        return;
+    }
+
+    if (!op_data->is_dirty && !op_data->upload_in_progress) {
+        fsync_cb (req, TRUE);
+        return;
+    }
+
+    if (!dir_tree_file_upload_start (op_data)) {
+        fsync_cb (req, FALSE);
+        return;
+    }
+
+    // server already has the same content
+    if (!op_data->upload_in_progress) {
+        fsync_cb (req, TRUE);
+        return;
+    }
+
+    dir_tree_file_upload_add_waiter (op_data, fsync_cb, req);
+}
+
+// make written data durable on the local disk and add it to UploadJournal,
+// partially written files are not added (journal_id stays 0)
+static gboolean dir_tree_file_journal_add (DirTreeFileOpData *op_data, UploadJournal *journal)
+{
+    // journal can replay only the whole file upload
+    if (op_data->base_size && !range_set_contains (op_data->valid, 0, MIN (op_data->base_size, op_data->file_size))) {
+        LOG_debug (DIR_TREE_LOG, "Partially written %s is not added to the journal", file_op_data_get_path (op_data));
+        return TRUE;
+    }
+
+    if (!op_data->tmp_write_fd && !dir_tree_file_write_spill (op_data))
+        return FALSE;
+
+    // tmp file might contain data past the truncated size
+    if (ftruncate (op_data->tmp_write_fd, op_data->file_size) < 0) {
+        LOG_err (DIR_TREE_LOG, "Failed to truncate tmp file: %s", strerror (errno));
+        return FALSE;
+    }
+
+    if (fdatasync (op_data->tmp_write_fd) < 0) {
+        LOG_err (DIR_TREE_LOG, "Failed to sync tmp file: %s", strerror (errno));
+        return FALSE;
+    }
+
+    // use MD5 calculated while writing, the file is read again only if it was written out of order
+    if (op_data->md5 && op_data->md5_len == op_data->file_size) {
+        GChecksum *tmp = g_checksum_copy (op_data->md5);
+
+        op_data->journal_id = upload_journal_add (journal, file_op_data_get_path (op_data), op_data->tmp_write_path, 
+            op_data->tmp_write_fd, g_checksum_get_string (tmp));
+        g_checksum_free (tmp);
+    } else
+        op_data->journal_id = upload_journal_add (journal, file_op_data_get_path (op_data), op_data->tmp_write_path, 
+            op_data->tmp_write_fd, NULL);
+
+    return op_data->journal_id != 0;
+}
+
+// file is closed, upload it in background and free context data
+void dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi,
+    DirTree_file_sync_cb release_cb, fuse_req_t req)
+{
+    DirTreeFileOpData *op_data;
+    AppConf *conf = application_get_conf (dtree->app);
+    
+    LOG_debug (DIR_TREE_LOG, "dir_tree_file_release  inode %d", ino);
+
+    op_data = file_op_data_get (fi);
+    if (!op_data) {
+        LOG_msg (DIR_TREE_LOG, "No context data of ino %"INO_FMT" !", ino);
+        release_cb (req, FALSE);
+        return;
+    }
+    fi->fh = 0;
+
+    // the file is still opened by other handles, it's uploaded when the last one is closed
+    if (--op_data->open_count) {
+        release_cb (req, TRUE);
+        return;
+    }
+
+    op_data->is_released = TRUE;
+    
+    if (op_data->http) {
+        s3http_client_release (op_data->http);
+        op_data->http = NULL;
+    }
+    
+    // nothing to upload
+    if (!op_data->is_dirty && !op_data->upload_in_progress) {
+        file_op_data_release (op_data);
+        release_cb (req, TRUE);
+        return;
+    }
+
+    // make sure data is not lost if we are stopped before the upload is done
+    if (application_get_upload_journal (dtree->app) && 
+        !dir_tree_file_journal_add (op_data, application_get_upload_journal (dtree->app))) {
+        LOG_err (DIR_TREE_LOG, "Failed to add %s to upload journal !", file_op_data_get_path (op_data));
+    }
+
+    // releasing written file
+    if (op_data->is_dirty && !dir_tree_file_upload_start (op_data)) {
+        LOG_err (DIR_TREE_LOG, "Failed to upload file: %s !", file_op_data_get_path (op_data));
+        if (!op_data->upload_in_progress) {
+            dir_tree_file_upload_retry (op_data);
+            release_cb (req, FALSE);
+            return;
+        }
+    }
+
+    // server already has the same content
+    if (!op_data->upload_in_progress) {
+        file_op_data_release (op_data);
+        release_cb (req, TRUE);
+        return;
+    }
+
+    // upload can't be replayed after restart, file is closed when it's on the server
+    if (application_get_upload_journal (dtree->app) && !op_data->journal_id) {
+        LOG_debug (DIR_TREE_LOG, "%s is not in the journal, waiting for the upload", file_op_data_get_path (op_data));
+        dir_tree_file_upload_add_waiter (op_data, release_cb, req);
+        return;
+    }
+
+    // too much data is being uploaded in background, wait for this file
+    if (dtree->upload_pending_size > conf->background_upload_max_size) {
+        LOG_debug (DIR_TREE_LOG, "Background uploads: %"G_GUINT64_FORMAT" bytes, waiting for %s", 
+            dtree->upload_pending_size, file_op_data_get_path (op_data));
+        dir_tree_file_upload_add_waiter (op_data, release_cb, req);
+        return;
+    }
+
+    release_cb (req, TRUE);
+}
+/*}}}*/
+
+/*{{{ copy-up */
+
+// original data of the object is copied into tmp file by blocks, 
+// only when a partial write or a read of written file touches the block
+
+typedef struct {
+    size_t size;
+    off_t off;
+    DirTree_file_read_cb file_read_cb;
+    fuse_req_t c_req;
+} DirTreeStagingRead;
+
+typedef struct {
+    DirTreeFileOpData *op_data;
+    off_t off;
+    off_t len;
+} DirTreeCopyUpData;
+
+static void dir_tree_file_staging_reads_process (DirTreeFileOpData *op_data);
+
+static void dir_tree_file_copy_up_on_received_cb (gpointer ctx, gboolean success, const gchar *buf, size_t buf_len)
+{
+    DirTreeCopyUpData *copy_up = (DirTreeCopyUpData *) ctx;
+    DirTreeFileOpData *op_data = copy_up->op_data;
+    DirTreeFetchWriteData data;
+    off_t len;
+
+    range_set_remove (op_data->copy_up_fetching, copy_up->off, copy_up->len);
+    op_data->copy_up_count--;
+
+    // file could be truncated in the meantime
+    len = MIN (copy_up->len, op_data->base_size - copy_up->off);
+
+    if (success && (off_t) buf_len == copy_up->len && op_data->tmp_write_fd) {
+        if (len > 0) {
+            data.op_data = op_data;
+            data.buf = buf;
+            data.off = copy_up->off;
+            range_set_foreach_missing (op_data->valid, copy_up->off, len, dir_tree_file_upload_fetch_write_cb, &data);
+            range_set_add (op_data->valid, copy_up->off, len);
+        }
+    } else {
+        LOG_err (DIR_TREE_LOG, "Failed to copy original data of %s !", file_op_data_get_path (op_data));
+    }
+
+    g_free (copy_up);
+
+    // file was closed while data was being fetched
+    if (op_data->is_released && !op_data->upload_in_progress && !op_data->copy_up_count) {
+        file_op_data_release (op_data);
+        return;
+    }
+
+    dir_tree_file_staging_reads_process (op_data);
+}
+
+static void dir_tree_file_copy_up_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *http_con = (S3HttpConnection *) client;
+    DirTreeCopyUpData *copy_up = (DirTreeCopyUpData *) ctx;
+
+    s3http_connection_acquire (http_con);
+
+    s3http_connection_get_range (http_con, file_op_data_get_path (copy_up->op_data), copy_up->off, copy_up->len,
+        dir_tree_file_copy_up_on_received_cb, copy_up);
+}
+
+static void dir_tree_file_copy_up_range_cb (off_t off, off_t len, gpointer ctx)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+    DirTreeCopyUpData *copy_up;
+
+    // already requested
+    if (range_set_contains (op_data->copy_up_fetching, off, len))
+        return;
+
+    copy_up = g_new0 (DirTreeCopyUpData, 1);
+    copy_up->op_data = op_data;
+    copy_up->off = off;
+    copy_up->len = len;
+
+    if (!s3client_pool_get_client (application_get_ops_client_pool (op_data->dtree->app), 
+        dir_tree_file_copy_up_on_http_ready, copy_up)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get S3HttpConnection from the pool !");
+        g_free (copy_up);
+        return;
+    }
+
+    range_set_add (op_data->copy_up_fetching, off, len);
+    op_data->copy_up_count++;
+}
+
+// fetch original data of all blocks touched by the range, which are not in tmp file yet
+static void dir_tree_file_copy_up (DirTreeFileOpData *op_data, off_t off, off_t len)
+{
+    AppConf *conf = application_get_conf (op_data->dtree->app);
+    off_t block_size = conf->copy_up_block_size;
+    off_t start, end;
+
+    // fetch exactly the requested range
+    if (!block_size)
+        block_size = 1;
+
+    start = (off / block_size) * block_size;
+    end = MIN (((off + len + block_size - 1) / block_size) * block_size, op_data->base_size);
+    if (start >= end)
+        return;
+
+    if (!op_data->tmp_write_fd && !dir_tree_file_write_spill (op_data))
+        return;
+
+    range_set_foreach_missing (op_data->valid, start, end - start, dir_tree_file_copy_up_range_cb, op_data);
+}
+
+// written range does not cover whole blocks, copy the rest of the blocks in background
+static void dir_tree_file_copy_up_on_write (DirTreeFileOpData *op_data, off_t off, size_t size)
+{
+    AppConf *conf = application_get_conf (op_data->dtree->app);
+    off_t block_size = conf->copy_up_block_size;
+
+    if (!block_size || off >= op_data->base_size)
+        return;
+
+    if (off % block_size)
+        dir_tree_file_copy_up (op_data, off, 1);
+    if ((off + size) % block_size && off + (off_t) size < op_data->base_size)
+        dir_tree_file_copy_up (op_data, off + size, 1);
+}
+
+typedef struct {
+    DirTreeFileOpData *op_data;
+    gboolean is_fetching;
+} DirTreeStagingCheckData;
+
+static void dir_tree_file_staging_check_cb (off_t off, off_t len, gpointer ctx)
+{
+    DirTreeStagingCheckData *data = (DirTreeStagingCheckData *) ctx;
+
+    if (!range_set_contains (data->op_data->copy_up_fetching, off, len))
+        data->is_fetching = FALSE;
+}
+
+// send data from tmp file or write buffer
+static void dir_tree_file_staging_read_reply (DirTreeFileOpData *op_data, DirTreeStagingRead *rd)
+{
+    gchar *buf;
+    size_t len;
+    ssize_t res;
+
+    if (rd->off >= op_data->file_size) {
+        rd->file_read_cb (rd->c_req, TRUE, NULL, 0);
+        return;
+    }
+    len = MIN ((off_t) rd->size, op_data->file_size - rd->off);
+
+    // data which is not stored is zeros
+    buf = g_malloc0 (len);
+    if (op_data->tmp_write_fd) {
+        res = pread (op_data->tmp_write_fd, buf, len, rd->off);
+        if (res < 0) {
+            LOG_err (DIR_TREE_LOG, "Failed to read tmp file: %s", strerror (errno));
+            g_free (buf);
+            rd->file_read_cb (rd->c_req, FALSE, NULL, 0);
+            return;
+        }
+    } else if (op_data->write_buf && rd->off < (off_t) op_data->write_buf_len) {
+        memcpy (buf, op_data->write_buf + rd->off, MIN (len, op_data->write_buf_len - rd->off));
+    }
+
+    rd->file_read_cb (rd->c_req, TRUE, buf, len);
+    g_free (buf);
+}
+
+// return TRUE if read is done, FALSE if it waits for the data
+static gboolean dir_tree_file_staging_read_try (DirTreeFileOpData *op_data, DirTreeStagingRead *rd, gboolean can_fetch)
+{
+    DirTreeStagingCheckData data;
+    off_t end;
+
+    end = MIN (rd->off + (off_t) rd->size, op_data->base_size);
+
+    // original data is in tmp file
+    if (rd->off >= end || range_set_contains (op_data->valid, rd->off, end - rd->off)) {
+        dir_tree_file_staging_read_reply (op_data, rd);
+        return TRUE;
+    }
+
+    if (can_fetch) {
+        dir_tree_file_copy_up (op_data, rd->off, end - rd->off);
+    }
+
+    // check that the missing data is being fetched
+    data.op_data = op_data;
+    data.is_fetching = TRUE;
+    range_set_foreach_missing (op_data->valid, rd->off, end - rd->off, dir_tree_file_staging_check_cb, &data);
+
+    if (!data.is_fetching) {
+        LOG_err (DIR_TREE_LOG, "Failed to get original data of %s !", file_op_data_get_path (op_data));
+        rd->file_read_cb (rd->c_req, FALSE, NULL, 0);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+// serve read requests which are waiting for the original data
+static void dir_tree_file_staging_reads_process (DirTreeFileOpData *op_data)
+{
+    GList *l, *l_next;
+
+    for (l = g_queue_peek_head_link (op_data->q_staging_reads); l; l = l_next) {
+        DirTreeStagingRead *rd = (DirTreeStagingRead *) l->data;
+        l_next = g_list_next (l);
+
+        if (dir_tree_file_staging_read_try (op_data, rd, FALSE)) {
+            g_queue_delete_link (op_data->q_staging_reads, l);
+            g_free (rd);
+        }
+    }
+}
+
+// file is written, read it from the tmp file
+static void dir_tree_file_staging_read (DirTreeFileOpData *op_data, size_t size, off_t off,
+    DirTree_file_read_cb file_read_cb, fuse_req_t req)
+{
+    DirTreeStagingRead *rd;
+
+    rd = g_new0 (DirTreeStagingRead, 1);
+    rd->size = size;
+    rd->off = off;
+    rd->file_read_cb = file_read_cb;
+    rd->c_req = req;
+
+    if (dir_tree_file_staging_read_try (op_data, rd, TRUE)) {
+        g_free (rd);
+        return;
+    }
+
+    LOG_debug (DIR_TREE_LOG, "[%p] Read of %s waits for original data, off: %"OFF_FMT, op_data, 
+        file_op_data_get_path (op_data), (uintmax_t) off);
+    g_queue_push_tail (op_data->q_staging_reads, rd);
+}
+/*}}}*/
+
+/*{{{ file read*/
+static void dir_tree_file_open_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpClient *http = (S3HttpClient *) client;
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+    DirTreeFileRange *range;
+
+    LOG_debug (DIR_TREE_LOG, "[%p] Acquired http client %s", op_data, file_op_data_get_path (op_data));
+    
+    s3http_client_acquire (http);
+    op_data->http = http;
+    
+    if (op_data->file_open_cb)
+        op_data->file_open_cb (op_data->c_req, TRUE, op_data->c_fi);
+    
+    op_data->c_req = NULL;
+    op_data->c_size = 0;
+    op_data->c_req = 0;
+    op_data->op_in_progress = FALSE;
+
+    // get the first chunk request
+    range = g_queue_pop_head (op_data->q_ranges_requested);
+    if (range) {
+        op_data->c_size = range->size;
+        op_data->c_off = range->off;
+        op_data->c_req = range->c_req;
+        g_free (range);
+
+        LOG_debug (DIR_TREE_LOG, "[%p %p] S3HTTP client is ready for Read Object inode %"INO_FMT", path: %s", 
+            op_data->c_req, http, op_data->ino, file_op_data_get_path (op_data));
+
+        op_data->op_in_progress = TRUE;
+
+        // perform the first request
+        dir_tree_file_read_prepare_request (op_data, http, op_data->c_off, op_data->c_size);
+    }
+}
+
+static void dir_tree_file_read_on_last_chunk_cb (S3HttpClient *http, struct evbuffer *input_buf, gpointer ctx)
+{
+    gchar *buf = NULL;
+    size_t buf_len;
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+    DirTreeFileRange *range;
+
+    buf_len = evbuffer_get_length (input_buf);
+    buf = (gchar *) evbuffer_pullup (input_buf, buf_len);
+    
+    /*
+    range = g_queue_pop_head (op_data->q_ranges_requested);
+    if (range) {
+        op_data->c_size = range->size;
+        op_data->c_off = range->off;
+        op_data->c_req = range->c_req;
+    }
+    */
+
+    op_data->total_read += buf_len;
+    LOG_debug (DIR_TREE_LOG, "[%p %p] lTOTAL read: %zu (req: %zu), orig size: %zu, TOTAL: %"OFF_FMT", Qsize: %zu", 
+        op_data->c_req, http,
+        buf_len, op_data->c_size, op_data->en->size, op_data->total_read, g_queue_get_length (op_data->q_ranges_requested));
+    
+    if (op_data->file_read_cb)
+        op_data->file_read_cb (op_data->c_req, TRUE, buf, buf_len);
+
+    evbuffer_drain (input_buf, buf_len);
+    
+    // if there are more pending chunk requests 
+    if (g_queue_get_length (op_data->q_ranges_requested) > 0) {
+        range = g_queue_pop_head (op_data->q_ranges_requested);
+        LOG_debug (DIR_TREE_LOG, "[%p] more data: %zd", range->c_req, range->size);
+        op_data->c_size = range->size;
+        op_data->c_off = range->off;
+        op_data->c_req = range->c_req;
+        g_free (range);
+
+        op_data->op_in_progress = TRUE;
+        // perform the next chunk request
+        dir_tree_file_read_prepare_request (op_data, http, op_data->c_off, op_data->c_size);
+    } else {
+        LOG_debug (DIR_TREE_LOG, "Done downloading !!");
+        op_data->op_in_progress = FALSE;
+    }
+}
+
+// the part of chunk is received
+/* unused for now
+static void dir_tree_file_read_on_chunk_cb (S3HttpClient *http, struct evbuffer *input_buf, gpointer ctx)
+{
+    gchar *buf;
+    size_t buf_len;
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+
+    buf_len = evbuffer_get_length (input_buf);
+    buf = (gchar *) evbuffer_pullup (input_buf, buf_len);
+    
+    // LOG_debug (DIR_TREE_LOG, "Read Object onData callback, in size: %zu", buf_len);
+}
+*/
+
+// prepare HTTP request
+static void dir_tree_file_read_prepare_request (DirTreeFileOpData *op_data, S3HttpClient *http, off_t off, size_t size)
+{
+    gchar *auth_str;
+    char time_str[100];
+    time_t t = time (NULL);
+    gchar auth_key[300];
+    gchar *url;
+    gchar range[300];
+    AppConf *conf;
+
+    s3http_client_request_reset (http);
+
+    s3http_client_set_cb_ctx (http, op_data);
+//    s3http_client_set_on_chunk_cb (http, dir_tree_file_read_on_chunk_cb);
+    s3http_client_set_on_last_chunk_cb (http, dir_tree_file_read_on_last_chunk_cb);
+    s3http_client_set_output_length (http, 0);
+    
+    strftime (time_str, sizeof (time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+
+    auth_str = (gchar *)s3http_connection_get_auth_string (op_data->dtree->app, "GET", "", "", "", file_op_data_get_path (op_data), time_str);
+    snprintf (auth_key, sizeof (auth_key), "AWS %s:%s", application_get_access_key_id (op_data->dtree->app), auth_str);
+    g_free (auth_str);
+    snprintf (range, sizeof (range), "bytes=%"OFF_FMT"-%"OFF_FMT, off, off+size - 1);
+    LOG_debug (DIR_TREE_LOG, "range: %s", range);
+
+    s3http_client_add_output_header (http, "Authorization", auth_key);
+    s3http_client_add_output_header (http, "Date", time_str);
+    s3http_client_add_output_header (http, "Range", range);
+    s3http_client_add_output_header (http, "Host", application_get_host_header (op_data->dtree->app));
+
+    // XXX: HTTPS
+    conf = application_get_conf (op_data->dtree->app);
+    if (conf->path_style) {
+        url = g_strdup_printf ("http://%s:%d/%s%s", application_get_host (op_data->dtree->app),
+                                                    application_get_port (op_data->dtree->app),
+                                                    application_get_bucket_name (op_data->dtree->app),
+                                                    file_op_data_get_path (op_data));
+    } else {
+        url = g_strdup_printf ("http://%s%d%s", application_get_host (op_data->dtree->app),
+                                                application_get_port (op_data->dtree->app),
+                                                file_op_data_get_path (op_data));
+    }
+    
+    s3http_client_start_request (http, S3Method_get, url);
+
+    g_free (auth_str);
+    g_free (url);
+}
+
+// add new chunk range to the chunks pending queue
+void dir_tree_file_read (DirTree *dtree, fuse_ino_t ino, 
+    size_t size, off_t off,
+    DirTree_file_read_cb file_read_cb, fuse_req_t req,
+    struct fuse_file_info *fi)
+{
+    DirEntry *en;
+    char full_name[1024];
+    DirTreeFileOpData *op_data;
+    DirTreeFileRange *range;
+    
+    en = inode_table_lookup (dtree->inodes, ino);
+
+    // if entry does not exist
+    // or it's not a directory type ?
+    if (!en) {
+        LOG_msg (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") not found !", ino);
+        file_read_cb (req, FALSE, NULL, 0);
+        return;
+    }
+    
+    op_data = file_op_data_get (fi);
+    if (!op_data) {
+        LOG_msg (DIR_TREE_LOG, "No context data of ino %"INO_FMT" !", ino);
+        file_read_cb (req, FALSE, NULL, 0);
+        return;
+    }
+    
+    LOG_debug (DIR_TREE_LOG, "[%p %p] Read Object  inode %"INO_FMT", size: %zd, off: %"OFF_FMT, req, op_data, ino, size, off);
+
+    // file is modified, the server does not have its content
+    if (op_data->is_staged) {
+        dir_tree_file_staging_read (op_data, size, off, file_read_cb, req);
+        return;
+    }
+    
+    op_data->file_read_cb = file_read_cb;
+    op_data->en = en;
+    op_data->dtree = dtree;
+
+    range = g_new0 (DirTreeFileRange, 1);
+    range->off = off;
+    range->size = size;
+    range->c_req = req;
+    g_queue_push_tail (op_data->q_ranges_requested, range);
+    LOG_debug (DIR_TREE_LOG, "[%p] more data b: %zd", range->c_req, range->size);
+
+    // already reading data
+    if (op_data->op_in_progress) {
+        return;
+    }
+
+    if (op_data->http) {
+        LOG_debug (DIR_TREE_LOG, "Adding from main");
+        range = g_queue_pop_head (op_data->q_ranges_requested);
+        if (range) {
+            op_data->c_size = range->size;
+            op_data->c_off = range->off;
+            op_data->c_req = range->c_req;
+            g_free (range);
+            
+            // perform the next chunk request
+            op_data->op_in_progress = TRUE;
+            dir_tree_file_read_prepare_request (op_data, op_data->http, op_data->c_off, op_data->c_size);
+        }
+        
+        return;
+    }
+
+}
+/*}}}*/
+
+/*{{{ file write */
+
+// copy data to the in-memory write buffer
+// return FALSE if data does not fit into per-file or total buffer limits
+static gboolean dir_tree_file_write_to_buf (DirTreeFileOpData *op_data, const char *buf, size_t size, off_t off)
+{
+    AppConf *conf = application_get_conf (op_data->dtree->app);
+    size_t new_len = off + size;
+
+    if (new_len > conf->write_buffer_file_size)
+        return FALSE;
+
+    // grow buffer
+    if (new_len > op_data->write_buf_alloc) {
+        size_t new_alloc;
+
+        new_alloc = MAX (new_len, op_data->write_buf_alloc * 2);
+        new_alloc = MIN (new_alloc, conf->write_buffer_file_size);
+
+        if (op_data->dtree->write_buf_size + (new_alloc - op_data->write_buf_alloc) > conf->write_buffer_max_size)
+            return FALSE;
+
+        op_data->write_buf = g_realloc (op_data->write_buf, new_alloc);
+        op_data->dtree->write_buf_size += new_alloc - op_data->write_buf_alloc;
+        op_data->write_buf_alloc = new_alloc;
+    }
+
+    // fill the gap with zeros, as a sparse file would do
+    if ((size_t) off > op_data->write_buf_len)
+        memset (op_data->write_buf + op_data->write_buf_len, 0, off - op_data->write_buf_len);
+
+    memcpy (op_data->write_buf + off, buf, size);
+    op_data->write_buf_len = MAX (op_data->write_buf_len, new_len);
+
+    return TRUE;
+}
+
+// update MD5 of written data, as long as file is written sequentially
+static void dir_tree_file_write_md5_update (DirTreeFileOpData *op_data, const char *buf, size_t size, off_t off)
+{
+    if (!op_data->md5)
+        return;
+
+    if (off != op_data->md5_len) {
+        LOG_debug (DIR_TREE_LOG, "[%p] Non-sequential write, MD5 is not calculated", op_data);
+        g_checksum_free (op_data->md5);
+        op_data->md5 = NULL;
+        return;
+    }
+
+    g_checksum_update (op_data->md5, (const guchar *) buf, size);
+    op_data->md5_len += size;
+}
+
+// create tmp file and move the content of in-memory write buffer to it
+static gboolean dir_tree_file_write_spill (DirTreeFileOpData *op_data)
+{
+    char filename[1024];
+
+    snprintf (filename, sizeof (filename), "%s/s3ffs.XXXXXX", application_get_tmp_dir (op_data->dtree->app));
+    op_data->tmp_write_fd = mkstemp (filename);
+    if (op_data->tmp_write_fd < 0) {
+        LOG_err (DIR_TREE_LOG, "Failed to create tmp file !");
+        op_data->tmp_write_fd = 0;
+        return FALSE;
+    }
+    op_data->tmp_write_path = g_strdup (filename);
+
+    if (!op_data->write_buf)
+        return TRUE;
+
+    LOG_debug (DIR_TREE_LOG, "[%p] Spilling %zu bytes of write buffer to %s", op_data, op_data->write_buf_len, filename);
+
+    if (op_data->write_buf_len && 
+        pwrite (op_data->tmp_write_fd, op_data->write_buf, op_data->write_buf_len, 0) != (ssize_t) op_data->write_buf_len) {
+        LOG_err (DIR_TREE_LOG, "Failed to write tmp file: %s", strerror (errno));
+        // data stays in the write buffer, tmp file is created again with the next spill
+        close (op_data->tmp_write_fd);
+        unlink (op_data->tmp_write_path);
+        op_data->tmp_write_fd = 0;
+        g_free (op_data->tmp_write_path);
+        op_data->tmp_write_path = NULL;
+        return FALSE;
+    }
+
+    op_data->dtree->write_buf_size -= op_data->write_buf_alloc;
+    g_free (op_data->write_buf);
+    op_data->write_buf = NULL;
+    op_data->write_buf_len = 0;
+    op_data->write_buf_alloc = 0;
+
+    return TRUE;
+}
+
+// change the size of opened file
+static gboolean dir_tree_file_truncate (DirEntry *en, off_t size)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) en->op_data;
+
+    LOG_debug (DIR_TREE_LOG, "[%p] Truncating %s to %"OFF_FMT, op_data, file_op_data_get_path (op_data), (uintmax_t) size);
+
+    if (size < op_data->file_size) {
+        range_set_remove (op_data->dirty, size, op_data->file_size - size);
+        range_set_remove (op_data->valid, size, op_data->file_size - size);
+    }
+
+    // the rest of the file is filled with zeros
+    op_data->base_size = MIN (op_data->base_size, size);
+    op_data->upload_trunc_size = MIN (op_data->upload_trunc_size, size);
+    op_data->file_size = size;
+    op_data->is_dirty = TRUE;
+    op_data->is_staged = TRUE;
+
+    // file is rewritten from the beginning
+    if (!size) {
+        if (op_data->md5)
+            g_checksum_reset (op_data->md5);
+        else
+            op_data->md5 = g_checksum_new (G_CHECKSUM_MD5);
+        op_data->md5_len = 0;
+    } else if (op_data->md5 && size != op_data->md5_len) {
+        g_checksum_free (op_data->md5);
+        op_data->md5 = NULL;
+    }
+
+    if (!op_data->tmp_write_fd && (size_t) size <= op_data->write_buf_len) {
+        op_data->write_buf_len = size;
+        return TRUE;
+    }
+
+    if (!op_data->tmp_write_fd && !dir_tree_file_write_spill (op_data))
+        return FALSE;
+
+    if (ftruncate (op_data->tmp_write_fd, size) < 0) {
+        LOG_err (DIR_TREE_LOG, "Failed to truncate tmp file: %s", strerror (errno));
+        return FALSE;
+    }
+
+    return TRUE;
 }
 
-// add new file entry to directory, return new inode
-void dir_tree_file_create (DirTree *dtree, fuse_ino_t parent_ino, const char *name, mode_t mode,
-    DirTree_file_create_cb file_create_cb, fuse_req_t req, struct fuse_file_info *fi)
+// send data via HTTP client
+void dir_tree_file_write (DirTree *dtree, fuse_ino_t ino, 
+    const char *buf, size_t size, off_t off, 
+    DirTree_file_write_cb file_write_cb, fuse_req_t req,
+    struct fuse_file_info *fi)
 {
-    DirEntry *dir_en, *en;
+    DirEntry *en;
     DirTreeFileOpData *op_data;
-    
-    LOG_debug (DIR_TREE_LOG, "Adding new entry '%s' to directory ino: %"INO_FMT, name, parent_ino);
-    
-    dir_en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (parent_ino));
-    
-    // entry not found
-    if (!dir_en || dir_en->type != DET_dir) {
-        LOG_msg (DIR_TREE_LOG, "Directory (%"INO_FMT") not found !", parent_ino);
-        file_create_cb (req, FALSE, 0, 0, 0, fi);
+    ssize_t out_size;
+
+    en = inode_table_lookup (dtree->inodes, ino);
+
+    // if entry does not exist
+    // or it's not a directory type ?
+    if (!en) {
+        LOG_msg (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") not found !", ino);
+        file_write_cb (req, FALSE,  0);
         return;
     }
     
-    // create a new entry
-    en = dir_tree_add_entry (dtree, name, mode, DET_file, parent_ino, 0, time (NULL));
-    if (!en) {
-        LOG_msg (DIR_TREE_LOG, "Failed to create file: %s !", name);
-        file_create_cb (req, FALSE, 0, 0, 0, fi);
+    op_data = file_op_data_get (fi);
+    if (!op_data) {
+        LOG_msg (DIR_TREE_LOG, "No context data of ino %"INO_FMT" !", ino);
+        file_write_cb (req, FALSE, 0);
         return;
     }
-    //XXX: set as new 
-    en->is_modified = TRUE;
+    
+    LOG_debug (DIR_TREE_LOG, "[%p] Writing Object  inode %"INO_FMT", size: %zd, off: %"OFF_FMT, op_data, ino, size, off);
+
+    op_data->is_dirty = TRUE;
+    op_data->is_staged = TRUE;
+    dir_tree_file_write_md5_update (op_data, buf, size, off);
+    range_set_add (op_data->dirty, off, size);
+    range_set_add (op_data->valid, off, size);
+    op_data->file_size = MAX (op_data->file_size, off + (off_t) size);
+
+    // if tmp file is not opened
+    if (!op_data->tmp_write_fd) {
+        op_data->en = en;
+        op_data->op_in_progress = TRUE;
+
+        // keep data in memory as long as it fits into the write buffer,
+        // partially written existing files are kept in tmp file with the object's offsets
+        if (!op_data->base_size && dir_tree_file_write_to_buf (op_data, buf, size, off)) {
+            file_write_cb (req, TRUE, size);
+            return;
+        }
+
+        if (!dir_tree_file_write_spill (op_data)) {
+            file_write_cb (req, FALSE, 0);
+            return;
+        }
+    }
+
+    //XXX: here decide if switch to multi part upload
+    out_size = pwrite (op_data->tmp_write_fd, buf, size, off);
+    if (out_size < 0) {
+        file_write_cb (req, FALSE, 0);
+        return;
+    } else
+        file_write_cb (req, TRUE, out_size);
+
+    // the rest of partially written blocks is fetched in background
+    if (op_data->base_size)
+        dir_tree_file_copy_up_on_write (op_data, off, size);
 
-    op_data = file_op_data_create (dtree, en->ino);
-    op_data->en = en;
-    op_data->ino = en->ino;
-    en->op_data = (gpointer) op_data;
-        
-    file_create_cb (req, TRUE, en->ino, en->mode, en->size, fi);
 }
 /*}}}*/
 
-static void dir_tree_file_read_prepare_request (DirTreeFileOpData *op_data, S3HttpClient *http, off_t off, size_t size);
-static void dir_tree_file_open_on_http_ready (gpointer client, gpointer ctx);
+/*{{{ rename */
 
-// existing file is opened, create context data
-gboolean dir_tree_file_open (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi, 
-    DirTree_file_open_cb file_open_cb, fuse_req_t req)
+// objects are copied on the server side and the originals are removed by DeleteQueue after all copies are done,
+// DirEntries are moved in place, keeping their inodes
+
+typedef struct _DirTreeRenameData DirTreeRenameData;
+
+typedef struct {
+    DirTreeRenameData *rename;
+    gchar *src_path;
+    gchar *dst_path;
+    off_t size;
+} DirTreeRenameObject;
+
+struct _DirTreeRenameData {
+    DirTree *dtree;
+    fuse_ino_t ino;
+    fuse_ino_t new_parent_ino;
+    gchar *new_name;
+    gchar *src_path;
+    gchar *src_prefix; // "dir/" for directories, without leading '/'
+    gchar *dst_path;
+    DirTree_rename_cb rename_cb;
+    fuse_req_t req;
+
+    GQueue *q_copy; // objects to copy
+    GQueue *q_delete; // copied objects, which originals must be removed
+    gboolean is_deleting;
+    guint in_flight; // requests which are waiting for or using a connection
+    gboolean is_running;
+    gboolean failed;
+    guint uploads_waiting; // uploads of files in the directory, which must be finished first
+};
+
+static void dir_tree_rename_object_destroy (DirTreeRenameObject *obj)
 {
-    DirTreeFileOpData *op_data;
-    DirEntry *en;
+    g_free (obj->src_path);
+    g_free (obj->dst_path);
+    g_free (obj);
+}
 
-    op_data = file_op_data_create (dtree, ino);
-    op_data->c_fi = fi;
-    op_data->c_req = req;
-    op_data->file_open_cb = file_open_cb;
+static void dir_tree_rename_add_object (DirTreeRenameData *data, const gchar *src_path, const gchar *dst_path, off_t size)
+{
+    DirTreeRenameObject *obj;
+
+    obj = g_new0 (DirTreeRenameObject, 1);
+    obj->rename = data;
+    obj->src_path = g_strdup (src_path);
+    obj->dst_path = g_strdup (dst_path);
+    obj->size = size;
+    g_queue_push_tail (data->q_copy, obj);
+}
 
-    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+// move DirEntry to the new parent directory
+static gboolean dir_tree_entry_move (DirTree *dtree, DirEntry *en, DirEntry *new_parent_en, const gchar *new_name)
+{
+    DirEntry *parent_en, *dst_en;
+    guint32 name_id;
 
-    // if entry does not exist
-    // or it's not a directory type ?
-    if (!en) {
-        LOG_msg (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") not found !", ino);
-        file_open_cb (op_data->c_req, FALSE, op_data->c_fi);
+    parent_en = inode_table_lookup (dtree->inodes, en->parent_ino);
+    if (!parent_en) {
+        LOG_err (DIR_TREE_LOG, "Parent not found for ino: %"INO_FMT" !", (fuse_ino_t) en->ino);
         return FALSE;
     }
 
-    op_data->en = en;
-    
-    op_data->en->op_data = (gpointer) op_data;
+    name_id = name_pool_add (dtree->names, new_name);
+    if (!name_id)
+        return FALSE;
 
-    LOG_debug (DIR_TREE_LOG, "[%p %p] dir_tree_open  inode %"INO_FMT, op_data, fi, ino);
+    // replaced entry
+    dst_en = dir_entry_child_lookup (dtree, new_parent_en, new_name);
+    if (dst_en)
+        dir_tree_entry_detach (dtree, dst_en);
 
-    if (!s3client_pool_get_client (application_get_read_client_pool (dtree->app), dir_tree_file_open_on_http_ready, op_data)) {
-        LOG_err (DIR_TREE_LOG, "Failed to get S3HttpConnection from the pool !");
-    }
+    dir_entry_child_remove (dtree, parent_en, en);
+    dir_tree_entry_modified (dtree, parent_en);
+
+    name_pool_release (dtree->names, en->name_id);
+    en->name_id = name_id;
+    en->parent_ino = new_parent_en->ino;
+    // paths of the entry and all its children are changed
+    dtree->path_epoch++;
+
+    dir_entry_child_insert (dtree, new_parent_en, en);
+    dir_tree_entry_modified (dtree, new_parent_en);
 
     return TRUE;
 }
 
-static void dir_tree_file_release_on_entry_sent_cb (gpointer ctx, gboolean success)
+static void dir_tree_rename_done (DirTreeRenameData *data, gboolean success)
 {
-    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
-    // XXX: entry may be deleted
-    
-    op_data->en->is_modified = FALSE;
+    DirEntry *en, *new_parent_en;
+
+    en = inode_table_lookup (data->dtree->inodes, data->ino);
+    new_parent_en = inode_table_lookup (data->dtree->inodes, data->new_parent_ino);
+
+    if (success && en && new_parent_en) {
+        LOG_debug (DIR_TREE_LOG, "%s is renamed to %s", data->src_path, data->dst_path);
+        success = dir_tree_entry_move (data->dtree, en, new_parent_en, data->new_name);
+        // failed uploads are replayed to the new path
+        if (application_get_upload_journal (data->dtree->app))
+            upload_journal_rename (application_get_upload_journal (data->dtree->app), data->src_path, data->dst_path, 
+                en->type == DET_dir);
+    } else {
+        LOG_err (DIR_TREE_LOG, "Failed to rename %s !", data->dst_path);
+        success = FALSE;
+        // objects could be partially moved, get a fresh listing
+        if (en)
+            dir_tree_entry_modified (data->dtree, en);
+        if (new_parent_en)
+            dir_tree_entry_modified (data->dtree, new_parent_en);
+    }
 
-    close (op_data->tmp_write_fd);
+    data->rename_cb (data->req, success ? 0 : EIO);
 
-    LOG_debug (DIR_TREE_LOG, "File is sent:  ino = %"INO_FMT")", op_data->ino);
-    
-    file_op_data_destroy (op_data);
+    g_queue_free_full (data->q_copy, (GDestroyNotify) dir_tree_rename_object_destroy);
+    g_queue_free_full (data->q_delete, (GDestroyNotify) dir_tree_rename_object_destroy);
+    g_free (data->new_name);
+    g_free (data->src_path);
+    g_free (data->src_prefix);
+    g_free (data->dst_path);
+    g_free (data);
 }
 
-// HTTP client is ready for a new request
-static void dir_tree_file_release_on_http_ready (gpointer client, gpointer ctx)
+static void dir_tree_rename_run (DirTreeRenameData *data);
+
+static void dir_tree_rename_on_object_done (gpointer ctx, gboolean success)
+{
+    DirTreeRenameObject *obj = (DirTreeRenameObject *) ctx;
+    DirTreeRenameData *data = obj->rename;
+
+    data->in_flight--;
+
+    if (!success)
+        data->failed = TRUE;
+
+    if (success && !data->is_deleting)
+        g_queue_push_tail (data->q_delete, obj);
+    else
+        dir_tree_rename_object_destroy (obj);
+
+    dir_tree_rename_run (data);
+}
+
+static void dir_tree_rename_on_http_ready (gpointer client, gpointer ctx)
 {
     S3HttpConnection *http_con = (S3HttpConnection *) client;
-    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+    DirTreeRenameData *data = (DirTreeRenameData *) ctx;
+    DirTreeRenameObject *obj;
 
-    LOG_debug (DIR_TREE_LOG, "[%p] Acquired http client ! ino: %"INO_FMT, op_data, op_data->ino);
+    obj = g_queue_pop_head (data->q_copy);
+    if (!obj) {
+        data->in_flight--;
+        dir_tree_rename_run (data);
+        return;
+    }
 
     s3http_connection_acquire (http_con);
 
-    s3http_connection_file_send (http_con, op_data->tmp_write_fd, op_data->en->fullpath, 
-        dir_tree_file_release_on_entry_sent_cb, op_data);
+    s3http_connection_object_copy (http_con, obj->src_path, obj->dst_path, obj->size, dir_tree_rename_on_object_done, obj);
 }
 
-// file is closed, free context data
-void dir_tree_file_release (DirTree *dtree, fuse_ino_t ino, struct fuse_file_info *fi)
+// spread requests across all connections of the pool
+static void dir_tree_rename_run (DirTreeRenameData *data)
 {
-    DirEntry *en;
-    DirTreeFileOpData *op_data;
-    
-    LOG_debug (DIR_TREE_LOG, "dir_tree_file_release  inode %d", ino);
+    AppConf *conf = application_get_conf (data->dtree->app);
+    GQueue *q;
 
-    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
-
-    // if entry does not exist
-    // or it's not a directory type ?
-    if (!en) {
-        LOG_msg (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") not found !", ino);
-        //XXX
+    // called from a request callback
+    if (data->is_running)
         return;
-    }
+    data->is_running = TRUE;
 
-    op_data = (DirTreeFileOpData *) en->op_data;
-  //  op_data->en = en;
-  //  op_data->ino = ino;
-    
-    if (op_data->http)
-        s3http_client_release (op_data->http);
-    
-    // releasing written file
-    if (op_data->tmp_write_fd) {
-        if (!s3client_pool_get_client (application_get_write_client_pool (dtree->app), dir_tree_file_release_on_http_ready, op_data)) {
-            LOG_err (DIR_TREE_LOG, "Failed to get S3HttpConnection from the pool !");
+    for (;;) {
+        q = data->is_deleting ? data->q_delete : data->q_copy;
+
+        // originals are removed by batches
+        while (data->is_deleting && !g_queue_is_empty (q)) {
+            DirTreeRenameObject *obj = g_queue_pop_head (q);
+
+            data->in_flight++;
+            delete_queue_add (application_get_delete_queue (data->dtree->app), obj->src_path, 
+                dir_tree_rename_on_object_done, obj);
         }
-    } else {
-        file_op_data_destroy (op_data);
+
+        while (!data->failed && !g_queue_is_empty (q) && data->in_flight < (guint) conf->ops) {
+            data->in_flight++;
+            if (!s3client_pool_get_client (application_get_ops_client_pool (data->dtree->app), 
+                dir_tree_rename_on_http_ready, data)) {
+                data->in_flight--;
+                // try again when one of the requests is done
+                if (!data->in_flight) {
+                    LOG_err (DIR_TREE_LOG, "Failed to get S3HttpConnection from the pool !");
+                    data->failed = TRUE;
+                }
+                break;
+            }
+        }
+
+        if (data->in_flight || data->failed || data->is_deleting)
+            break;
+
+        // all objects are copied, remove the originals
+        data->is_deleting = TRUE;
     }
+
+    data->is_running = FALSE;
+
+    if (data->in_flight)
+        return;
+
+    dir_tree_rename_done (data, !data->failed);
 }
 
-/*{{{ file read*/
-static void dir_tree_file_open_on_http_ready (gpointer client, gpointer ctx)
+static void dir_tree_rename_on_object_listed (gpointer ctx, const gchar *key, off_t size, G_GNUC_UNUSED const gchar *etag)
 {
-    S3HttpClient *http = (S3HttpClient *) client;
-    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
-    DirTreeFileRange *range;
+    DirTreeRenameData *data = (DirTreeRenameData *) ctx;
+    gchar *src_path, *dst_path;
 
-    LOG_debug (DIR_TREE_LOG, "[%p] Acquired http client %s", op_data, op_data->en->fullpath);
-    
-    s3http_client_acquire (http);
-    op_data->http = http;
-    
-    if (op_data->file_open_cb)
-        op_data->file_open_cb (op_data->c_req, TRUE, op_data->c_fi);
-    
-    op_data->c_req = NULL;
-    op_data->c_size = 0;
-    op_data->c_req = 0;
-    op_data->op_in_progress = FALSE;
+    if (!g_str_has_prefix (key, data->src_prefix))
+        return;
 
-    // get the first chunk request
-    range = g_queue_pop_head (op_data->q_ranges_requested);
-    if (range) {
-        op_data->c_size = range->size;
-        op_data->c_off = range->off;
-        op_data->c_req = range->c_req;
-        g_free (range);
+    src_path = g_strdup_printf ("/%s", key);
+    dst_path = g_strdup_printf ("%s/%s", data->dst_path, key + strlen (data->src_prefix));
+    dir_tree_rename_add_object (data, src_path, dst_path, size);
+    g_free (src_path);
+    g_free (dst_path);
+}
 
-        LOG_debug (DIR_TREE_LOG, "[%p %p] S3HTTP client is ready for Read Object inode %"INO_FMT", path: %s", 
-            op_data->c_req, http, op_data->ino, op_data->en->fullpath);
+static void dir_tree_rename_on_list_done (gpointer ctx, gboolean success)
+{
+    DirTreeRenameData *data = (DirTreeRenameData *) ctx;
 
-        op_data->op_in_progress = TRUE;
+    if (!success) {
+        dir_tree_rename_done (data, FALSE);
+        return;
+    }
 
-        // perform the first request
-        dir_tree_file_read_prepare_request (op_data, http, op_data->c_off, op_data->c_size);
+    LOG_debug (DIR_TREE_LOG, "Renaming %u objects of %s", g_queue_get_length (data->q_copy), data->src_prefix);
+    dir_tree_rename_run (data);
+}
+
+static void dir_tree_rename_on_list_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *http_con = (S3HttpConnection *) client;
+    DirTreeRenameData *data = (DirTreeRenameData *) ctx;
+
+    s3http_connection_acquire (http_con);
+
+    s3http_connection_object_list (http_con, data->src_prefix, 
+        dir_tree_rename_on_object_listed, dir_tree_rename_on_list_done, data);
+}
+
+// list all objects with the directory prefix
+static void dir_tree_rename_list (DirTreeRenameData *data)
+{
+    if (!s3client_pool_get_client (application_get_ops_client_pool (data->dtree->app), 
+        dir_tree_rename_on_list_http_ready, data)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get S3HttpConnection from the pool !");
+        dir_tree_rename_done (data, FALSE);
     }
 }
 
-static void dir_tree_file_read_on_last_chunk_cb (S3HttpClient *http, struct evbuffer *input_buf, gpointer ctx)
+// upload of a file in the directory is finished, list the directory after the last one
+static void dir_tree_rename_on_dir_upload_done (gpointer ctx, gboolean success)
 {
-    gchar *buf = NULL;
-    size_t buf_len;
-    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
-    DirTreeFileRange *range;
+    DirTreeRenameData *data = (DirTreeRenameData *) ctx;
 
-    buf_len = evbuffer_get_length (input_buf);
-    buf = (gchar *) evbuffer_pullup (input_buf, buf_len);
-    
-    /*
-    range = g_queue_pop_head (op_data->q_ranges_requested);
-    if (range) {
-        op_data->c_size = range->size;
-        op_data->c_off = range->off;
-        op_data->c_req = range->c_req;
+    if (!success)
+        data->failed = TRUE;
+
+    if (--data->uploads_waiting)
+        return;
+
+    if (data->failed) {
+        dir_tree_rename_done (data, FALSE);
+        return;
     }
-    */
 
-    op_data->total_read += buf_len;
-    LOG_debug (DIR_TREE_LOG, "[%p %p] lTOTAL read: %zu (req: %zu), orig size: %zu, TOTAL: %"OFF_FMT", Qsize: %zu", 
-        op_data->c_req, http,
-        buf_len, op_data->c_size, op_data->en->size, op_data->total_read, g_queue_get_length (op_data->q_ranges_requested));
-    
-    if (op_data->file_read_cb)
-        op_data->file_read_cb (op_data->c_req, TRUE, buf, buf_len);
+    dir_tree_rename_list (data);
+}
 
-    evbuffer_drain (input_buf, buf_len);
-    
-    // if there are more pending chunk requests 
-    if (g_queue_get_length (op_data->q_ranges_requested) > 0) {
-        range = g_queue_pop_head (op_data->q_ranges_requested);
-        LOG_debug (DIR_TREE_LOG, "[%p] more data: %zd", range->c_req, range->size);
-        op_data->c_size = range->size;
-        op_data->c_off = range->off;
-        op_data->c_req = range->c_req;
-        g_free (range);
+// wait for uploads of closed files in the directory
+static void dir_tree_rename_wait_uploads (DirTreeRenameData *data, DirEntry *en)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) en->op_data;
+    guint32 i;
 
-        op_data->op_in_progress = TRUE;
-        // perform the next chunk request
-        dir_tree_file_read_prepare_request (op_data, http, op_data->c_off, op_data->c_size);
-    } else {
-        LOG_debug (DIR_TREE_LOG, "Done downloading !!");
-        op_data->op_in_progress = FALSE;
+    if (en->type == DET_file) {
+        if (op_data && !op_data->l_read_cache && op_data->upload_in_progress) {
+            data->uploads_waiting++;
+            dir_tree_file_upload_add_done_waiter (op_data, dir_tree_rename_on_dir_upload_done, data);
+        }
+        return;
     }
+
+    for (i = 0; i < DIR_ENTRY_DIR (en)->children_count; i++)
+        dir_tree_rename_wait_uploads (data, DIR_ENTRY_DIR (en)->a_children[i]);
 }
 
-// the part of chunk is received
-/* unused for now
-static void dir_tree_file_read_on_chunk_cb (S3HttpClient *http, struct evbuffer *input_buf, gpointer ctx)
+// the current upload of the file is finished, move the object
+static void dir_tree_rename_on_upload_done (gpointer ctx, gboolean success)
 {
-    gchar *buf;
-    size_t buf_len;
-    DirTreeFileOpData *op_data = (DirTreeFileOpData *) ctx;
+    DirTreeRenameData *data = (DirTreeRenameData *) ctx;
+    DirTreeRenameObject *obj;
+    DirEntry *en;
 
-    buf_len = evbuffer_get_length (input_buf);
-    buf = (gchar *) evbuffer_pullup (input_buf, buf_len);
-    
-    // LOG_debug (DIR_TREE_LOG, "Read Object onData callback, in size: %zu", buf_len);
+    en = inode_table_lookup (data->dtree->inodes, data->ino);
+    if (!success || !en) {
+        dir_tree_rename_done (data, FALSE);
+        return;
+    }
+
+    // the size of uploaded object
+    obj = g_queue_peek_head (data->q_copy);
+    obj->size = en->size;
+
+    dir_tree_rename_run (data);
 }
-*/
 
-// prepare HTTP request
-static void dir_tree_file_read_prepare_request (DirTreeFileOpData *op_data, S3HttpClient *http, off_t off, size_t size)
+// return TRUE if some entry in the directory has data, which is not stored on the server yet.
+// Files which failed to upload are not counted, their data is kept only by UploadJournal
+static gboolean dir_tree_entry_has_pending_data (DirEntry *en)
 {
-    gchar *auth_str;
-    char time_str[100];
-    time_t t = time (NULL);
-    gchar auth_key[300];
-    gchar *url;
-    gchar range[300];
-    AppConf *conf;
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) en->op_data;
+    guint32 i;
 
-    s3http_client_request_reset (http);
+    if (op_data && (op_data->is_dirty || op_data->upload_in_progress))
+        return TRUE;
 
-    s3http_client_set_cb_ctx (http, op_data);
-//    s3http_client_set_on_chunk_cb (http, dir_tree_file_read_on_chunk_cb);
-    s3http_client_set_on_last_chunk_cb (http, dir_tree_file_read_on_last_chunk_cb);
-    s3http_client_set_output_length (http, 0);
-    
-    strftime (time_str, sizeof (time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+    if (en->type == DET_file)
+        return FALSE;
 
-    auth_str = (gchar *)s3http_connection_get_auth_string (op_data->dtree->app, "GET", "", op_data->en->fullpath, time_str);
-    snprintf (auth_key, sizeof (auth_key), "AWS %s:%s", application_get_access_key_id (op_data->dtree->app), auth_str);
-    g_free (auth_str);
-    snprintf (range, sizeof (range), "bytes=%"OFF_FMT"-%"OFF_FMT, off, off+size - 1);
-    LOG_debug (DIR_TREE_LOG, "range: %s", range);
+    for (i = 0; i < DIR_ENTRY_DIR (en)->children_count; i++) {
+        if (dir_tree_entry_has_pending_data (DIR_ENTRY_DIR (en)->a_children[i]))
+            return TRUE;
+    }
 
-    s3http_client_add_output_header (http, "Authorization", auth_key);
-    s3http_client_add_output_header (http, "Date", time_str);
-    s3http_client_add_output_header (http, "Range", range);
-    s3http_client_add_output_header (http, "Host", application_get_host_header (op_data->dtree->app));
+    return FALSE;
+}
 
-    // XXX: HTTPS
-    conf = application_get_conf (op_data->dtree->app);
-    if (conf->path_style) {
-        url = g_strdup_printf ("http://%s:%d/%s%s", application_get_host (op_data->dtree->app),
-                                                    application_get_port (op_data->dtree->app),
-                                                    application_get_bucket_name (op_data->dtree->app),
-                                                    op_data->en->fullpath);
-    } else {
-        url = g_strdup_printf ("http://%s%d%s", application_get_host (op_data->dtree->app),
-                                                application_get_port (op_data->dtree->app),
-                                                op_data->en->fullpath);
+// return TRUE if some file in the directory is opened and written
+static gboolean dir_tree_entry_has_open_writes (DirEntry *en)
+{
+    DirTreeFileOpData *op_data = (DirTreeFileOpData *) en->op_data;
+    guint32 i;
+
+    if (en->type == DET_file)
+        return op_data && op_data->is_dirty && (!op_data->is_released || !op_data->upload_in_progress);
+
+    for (i = 0; i < DIR_ENTRY_DIR (en)->children_count; i++) {
+        if (dir_tree_entry_has_open_writes (DIR_ENTRY_DIR (en)->a_children[i]))
+            return TRUE;
     }
-    
-    s3http_client_start_request (http, S3Method_get, url);
 
-    g_free (auth_str);
-    g_free (url);
+    return FALSE;
 }
 
-// add new chunk range to the chunks pending queue
-void dir_tree_file_read (DirTree *dtree, fuse_ino_t ino, 
-    size_t size, off_t off,
-    DirTree_file_read_cb file_read_cb, fuse_req_t req,
-    struct fuse_file_info *fi)
+// rename file or directory
+void dir_tree_rename (DirTree *dtree, fuse_ino_t parent_ino, const char *name, 
+    fuse_ino_t new_parent_ino, const char *new_name, 
+    DirTree_rename_cb rename_cb, fuse_req_t req)
 {
-    DirEntry *en;
-    char full_name[1024];
+    DirEntry *parent_en, *new_parent_en, *en, *dst_en;
     DirTreeFileOpData *op_data;
-    DirTreeFileRange *range;
-    
-    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    DirTreeRenameData *data;
 
-    // if entry does not exist
-    // or it's not a directory type ?
-    if (!en) {
-        LOG_msg (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") not found !", ino);
-        file_read_cb (req, FALSE, NULL, 0);
+    LOG_debug (DIR_TREE_LOG, "Renaming '%s' (dir ino: %"INO_FMT") to '%s' (dir ino: %"INO_FMT")", 
+        name, parent_ino, new_name, new_parent_ino);
+
+    parent_en = inode_table_lookup (dtree->inodes, parent_ino);
+    new_parent_en = inode_table_lookup (dtree->inodes, new_parent_ino);
+    if (!parent_en || parent_en->type != DET_dir || !new_parent_en || new_parent_en->type != DET_dir) {
+        LOG_msg (DIR_TREE_LOG, "Directory not found !");
+        rename_cb (req, parent_en && new_parent_en ? ENOTDIR : ENOENT);
         return;
     }
-    
-    op_data = (DirTreeFileOpData *) en->op_data;
-    
-    LOG_debug (DIR_TREE_LOG, "[%p %p] Read Object  inode %"INO_FMT", size: %zd, off: %"OFF_FMT, req, op_data, ino, size, off);
-    
-    op_data->file_read_cb = file_read_cb;
-    op_data->en = en;
-    op_data->dtree = dtree;
 
-    range = g_new0 (DirTreeFileRange, 1);
-    range->off = off;
-    range->size = size;
-    range->c_req = req;
-    g_queue_push_tail (op_data->q_ranges_requested, range);
-    LOG_debug (DIR_TREE_LOG, "[%p] more data b: %zd", range->c_req, range->size);
+    en = dir_entry_child_lookup (dtree, parent_en, name);
+    if (!en || en->age == 0) {
+        LOG_debug (DIR_TREE_LOG, "Entry '%s' not found !", name);
+        rename_cb (req, ENOENT);
+        return;
+    }
 
-    // already reading data
-    if (op_data->op_in_progress) {
+    // only a file or an empty directory can be replaced
+    dst_en = dir_entry_child_lookup (dtree, new_parent_en, new_name);
+    if (dst_en == en) {
+        rename_cb (req, 0);
+        return;
+    }
+    if (dst_en && dst_en->type != en->type) {
+        LOG_msg (DIR_TREE_LOG, "Entry '%s' can't be replaced !", new_name);
+        rename_cb (req, dst_en->type == DET_dir ? EISDIR : ENOTDIR);
+        return;
+    }
+    if (dst_en && dst_en->type == DET_dir && DIR_ENTRY_DIR (dst_en)->children_count) {
+        LOG_msg (DIR_TREE_LOG, "Directory '%s' is not empty !", new_name);
+        rename_cb (req, ENOTEMPTY);
+        return;
+    }
+    if (dst_en && dst_en->op_data && !((DirTreeFileOpData *) dst_en->op_data)->l_read_cache) {
+        LOG_msg (DIR_TREE_LOG, "File '%s' is opened !", new_name);
+        rename_cb (req, EBUSY);
         return;
     }
 
-    if (op_data->http) {
-        LOG_debug (DIR_TREE_LOG, "Adding from main");
-        range = g_queue_pop_head (op_data->q_ranges_requested);
-        if (range) {
-            op_data->c_size = range->size;
-            op_data->c_off = range->off;
-            op_data->c_req = range->c_req;
-            g_free (range);
-            
-            // perform the next chunk request
-            op_data->op_in_progress = TRUE;
-            dir_tree_file_read_prepare_request (op_data, op_data->http, op_data->c_off, op_data->c_size);
+    // files in the directory must be closed first
+    if (en->type == DET_dir && dir_tree_entry_has_open_writes (en)) {
+        LOG_msg (DIR_TREE_LOG, "Directory %s has files which are being written !", name);
+        rename_cb (req, EBUSY);
+        return;
+    }
+
+    data = g_new0 (DirTreeRenameData, 1);
+    data->dtree = dtree;
+    data->ino = en->ino;
+    data->new_parent_ino = new_parent_ino;
+    data->new_name = g_strdup (new_name);
+    data->src_path = dir_tree_entry_get_path (dtree, en);
+    if (new_parent_ino == FUSE_ROOT_ID) {
+        data->dst_path = g_strdup_printf ("/%s", new_name);
+    } else {
+        gchar *parent_path = dir_tree_entry_get_path (dtree, new_parent_en);
+        data->dst_path = g_strdup_printf ("%s/%s", parent_path, new_name);
+        g_free (parent_path);
+    }
+    data->rename_cb = rename_cb;
+    data->req = req;
+    data->q_copy = g_queue_new ();
+
+    // the object is replaced, do not remove it
+    delete_queue_cancel (application_get_delete_queue (dtree->app), data->dst_path);
+    data->q_delete = g_queue_new ();
+
+    // all objects with the directory prefix, uploaded files are listed too
+    if (en->type == DET_dir) {
+        data->src_prefix = g_strdup_printf ("%s/", data->src_path + 1);
+        dir_tree_rename_wait_uploads (data, en);
+        if (data->uploads_waiting) {
+            LOG_debug (DIR_TREE_LOG, "Waiting for %u uploads in %s", data->uploads_waiting, data->src_path);
+            return;
         }
-        
+        dir_tree_rename_list (data);
+        return;
+    }
+
+    op_data = (DirTreeFileOpData *) en->op_data;
+
+    // file is not uploaded yet, it will be sent with the new name
+    if (en->is_modified && (!op_data || (!op_data->is_dirty && !op_data->upload_in_progress))) {
+        dir_tree_rename_done (data, TRUE);
         return;
     }
 
+    dir_tree_rename_add_object (data, data->src_path, data->dst_path, en->size);
+
+    // send the latest content first
+    if (op_data && !op_data->l_read_cache && (op_data->is_dirty || op_data->upload_in_progress)) {
+        if (!dir_tree_file_upload_start (op_data)) {
+            dir_tree_rename_done (data, FALSE);
+            return;
+        }
+        if (op_data->upload_in_progress) {
+            dir_tree_file_upload_add_done_waiter (op_data, dir_tree_rename_on_upload_done, data);
+            return;
+        }
+    }
+
+    dir_tree_rename_run (data);
 }
 /*}}}*/
 
-/*{{{ file write */
+/*{{{ file remove*/
 
-// send data via HTTP client
-void dir_tree_file_write (DirTree *dtree, fuse_ino_t ino, 
-    const char *buf, size_t size, off_t off, 
-    DirTree_file_write_cb file_write_cb, fuse_req_t req,
-    struct fuse_file_info *fi)
+// entries are removed from DirTree right away, objects are removed in background by DeleteQueue
+
+typedef struct {
+    DirTree *dtree;
+    fuse_ino_t ino;
+    gchar *path;
+    DeleteItem *held; // removal is waiting for the upload of the object
+} DirTreeRemoveData;
+
+static void dir_tree_remove_on_deleted_cb (gpointer ctx, gboolean success)
 {
-    DirEntry *en;
-    DirTreeFileOpData *op_data;
-    ssize_t out_size;
+    DirTreeRemoveData *data = (DirTreeRemoveData *) ctx;
+    DirEntry *en, *parent_en;
 
-    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    en = inode_table_lookup (data->dtree->inodes, data->ino);
+    if (en) {
+        en->is_removing = FALSE;
 
-    // if entry does not exist
-    // or it's not a directory type ?
-    if (!en) {
-        LOG_msg (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") not found !", ino);
-        file_write_cb (req, FALSE,  0);
-        return;
+        // object is still there, show it with the next listing
+        if (!success) {
+            parent_en = inode_table_lookup (data->dtree->inodes, en->parent_ino);
+            if (parent_en)
+                dir_tree_entry_modified (data->dtree, parent_en);
+        }
+
+        dir_tree_entry_release (data->dtree, en);
     }
+
+    g_free (data->path);
+    g_free (data);
+}
+
+// queue removal of the object, entry is kept until it's done
+static void dir_tree_remove_queue (DirTree *dtree, DirEntry *en, const gchar *path)
+{
+    DirTreeRemoveData *data;
+
+    data = g_new0 (DirTreeRemoveData, 1);
+    data->dtree = dtree;
+    data->ino = en->ino;
+    data->path = g_strdup (path);
+
+    en->is_removing = TRUE;
+    delete_queue_add (application_get_delete_queue (dtree->app), data->path, dir_tree_remove_on_deleted_cb, data);
+}
+
+// the last upload of the removed file is finished, remove the object
+static void dir_tree_file_unlink_on_upload_done (gpointer ctx, G_GNUC_UNUSED gboolean success)
+{
+    DirTreeRemoveData *data = (DirTreeRemoveData *) ctx;
+
+    delete_queue_send_held (application_get_delete_queue (data->dtree->app), data->held);
+}
+
+// remove file
+void dir_tree_file_unlink (DirTree *dtree, fuse_ino_t parent_ino, const char *name, 
+    DirTree_file_remove_cb file_remove_cb, fuse_req_t req)
+{
+    DirEntry *dir_en, *en;
+    DirTreeFileOpData *op_data;
+    DirTreeRemoveData *data;
+    gchar *path;
     
-    op_data = (DirTreeFileOpData *) en->op_data;
-    
-    LOG_debug (DIR_TREE_LOG, "[%p] Writing Object  inode %"INO_FMT", size: %zd, off: %"OFF_FMT, op_data, ino, size, off);
+    LOG_debug (DIR_TREE_LOG, "Removing '%s' from directory ino: %"INO_FMT, name, parent_ino);
 
-    // if tmp file is not opened
-    if (!op_data->tmp_write_fd) {
-        char filename[1024];
+    dir_en = inode_table_lookup (dtree->inodes, parent_ino);
+    if (!dir_en || dir_en->type != DET_dir) {
+        LOG_msg (DIR_TREE_LOG, "Directory (%"INO_FMT") not found !", parent_ino);
+        file_remove_cb (req, dir_en ? ENOTDIR : ENOENT);
+        return;
+    }
 
-        op_data->en = en;
-        op_data->op_in_progress = TRUE;
-        snprintf (filename, sizeof (filename), "%s/s3ffs.XXXXXX", application_get_tmp_dir (dtree->app));
-        op_data->tmp_write_fd = mkstemp (filename);
-        if (op_data->tmp_write_fd < 0) {
-            LOG_err (DIR_TREE_LOG, "Failed to create tmp file !");
-            file_write_cb (req, FALSE, 0);
-            return;
-        }
+    en = dir_entry_child_lookup (dtree, dir_en, name);
+    if (!en || en->age == 0) {
+        LOG_debug (DIR_TREE_LOG, "Entry '%s' not found !", name);
+        file_remove_cb (req, ENOENT);
+        return;
     }
 
-    // if http client is not acquired yet
-    //if (!op_data->con_http) {
-    //}
-    
-    //XXX: here decide if switch to multi part upload
-    out_size = pwrite (op_data->tmp_write_fd, buf, size, off);
-    if (out_size < 0) {
-        file_write_cb (req, FALSE, 0);
+    if (en->type != DET_file) {
+        LOG_err (DIR_TREE_LOG, "Entry '%s' is not a file !", name);
+        file_remove_cb (req, EISDIR);
         return;
-    } else
-        file_write_cb (req, TRUE, out_size);
+    }
+
+    op_data = (DirTreeFileOpData *) en->op_data;
+    path = dir_tree_entry_get_path (dtree, en);
+
+    // object would be created again by the upload, remove it afterwards.
+    // The removal is pending from now on, so a new file with the same name is not sent before it.
+    // Uploads which are not sending yet are dropped instead, see dir_tree_file_upload_is_removed ()
+    if (op_data && !op_data->l_read_cache && op_data->upload_in_progress && op_data->upload_scheduled) {
+        data = g_new0 (DirTreeRemoveData, 1);
+        data->dtree = dtree;
+        data->ino = en->ino;
+        data->path = g_strdup (path);
+        data->held = delete_queue_hold (application_get_delete_queue (dtree->app), data->path, 
+            dir_tree_remove_on_deleted_cb, data);
+        en->is_removing = TRUE;
+        dir_tree_file_upload_add_done_waiter (op_data, dir_tree_file_unlink_on_upload_done, data);
+    } else {
+        dir_tree_remove_queue (dtree, en, path);
+    }
+
+    // failed uploads of the file must not be replayed after restart
+    if (application_get_upload_journal (dtree->app))
+        upload_journal_remove_path (application_get_upload_journal (dtree->app), path, FALSE);
+    g_free (path);
+
+    dir_tree_entry_detach (dtree, en);
 
+    file_remove_cb (req, 0);
 }
 /*}}}*/
 
-/*{{{ file remove*/
+/*{{{ dir remove*/
+
+// directory can be removed if its prefix contains only the directory object ("dir/")
+// and objects which are being removed
 
 typedef struct {
     DirTree *dtree;
-    DirEntry *en;
     fuse_ino_t ino;
-    DirTree_file_remove_cb file_remove_cb;
+    gchar *prefix; // "dir/", without leading '/'
+    gboolean has_dir_object;
+    gboolean is_empty;
+    DirTree_file_remove_cb dir_remove_cb;
     fuse_req_t req;
-} FileRemoveData;
+} DirTreeDirRemoveData;
 
-// file is removed
-static void dir_tree_file_remove_on_http_client_data_cb (S3HttpConnection *http_con, gpointer ctx, 
-        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+static void dir_tree_dir_remove_on_object_listed (gpointer ctx, const gchar *key, G_GNUC_UNUSED off_t size, 
+    G_GNUC_UNUSED const gchar *etag)
 {
-    FileRemoveData *data = (FileRemoveData *) ctx;
-    
-    data->en->age = 0;
-    dir_tree_entry_modified (data->dtree, data->en);
-    data->file_remove_cb (data->req, TRUE);
+    DirTreeDirRemoveData *data = (DirTreeDirRemoveData *) ctx;
+    gchar *path;
 
-    g_free (data);
-    
-    s3http_connection_release (http_con);
+    if (!strcmp (key, data->prefix)) {
+        data->has_dir_object = TRUE;
+        return;
+    }
+
+    path = g_strdup_printf ("/%s", key);
+    if (!delete_queue_is_pending (application_get_delete_queue (data->dtree->app), path))
+        data->is_empty = FALSE;
+    g_free (path);
 }
 
-// error 
-static void dir_tree_file_remove_on_http_client_error_cb (S3HttpConnection *http_con, gpointer ctx)
+// directory has entries which exist only locally or aren't listed yet
+static gboolean dir_tree_dir_has_children (DirEntry *en)
 {
-    FileRemoveData *data = (FileRemoveData *) ctx;
-    
-    data->file_remove_cb (data->req, FALSE);
+    guint32 i;
+
+    for (i = 0; i < DIR_ENTRY_DIR (en)->children_count; i++) {
+        if (DIR_ENTRY_DIR (en)->a_children[i]->age)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void dir_tree_dir_remove_on_list_done (gpointer ctx, gboolean success)
+{
+    DirTreeDirRemoveData *data = (DirTreeDirRemoveData *) ctx;
+    DirEntry *en;
+    gchar *path;
+
+    en = inode_table_lookup (data->dtree->inodes, data->ino);
+
+    if (!success) {
+        LOG_err (DIR_TREE_LOG, "Failed to list %s !", data->prefix);
+        data->dir_remove_cb (data->req, EIO);
+    } else if (!en || en->is_detached) {
+        LOG_msg (DIR_TREE_LOG, "Directory %s is already removed !", data->prefix);
+        data->dir_remove_cb (data->req, ENOENT);
+    // entries could be created while the prefix was listed
+    } else if (!data->is_empty || dir_tree_dir_has_children (en) || dir_tree_entry_has_pending_data (en)) {
+        LOG_msg (DIR_TREE_LOG, "Directory %s is not removed, empty: %s", data->prefix, data->is_empty ? "YES" : "NO");
+        data->dir_remove_cb (data->req, ENOTEMPTY);
+    } else {
+        if (data->has_dir_object) {
+            path = g_strdup_printf ("/%s", data->prefix);
+            dir_tree_remove_queue (data->dtree, en, path);
+            g_free (path);
+        }
 
+        dir_tree_entry_detach (data->dtree, en);
+        data->dir_remove_cb (data->req, 0);
+    }
+
+    g_free (data->prefix);
     g_free (data);
-    
-    s3http_connection_release (http_con);
 }
 
-// HTTP client is ready for a new request
-static void dir_tree_file_remove_on_http_client_cb (gpointer client, gpointer ctx)
+static void dir_tree_dir_remove_on_http_ready (gpointer client, gpointer ctx)
 {
     S3HttpConnection *http_con = (S3HttpConnection *) client;
-    FileRemoveData *data = (FileRemoveData *) ctx;
-    gchar *req_path;
-    gboolean res;
+    DirTreeDirRemoveData *data = (DirTreeDirRemoveData *) ctx;
 
     s3http_connection_acquire (http_con);
 
-    req_path = g_strdup_printf ("%s", data->en->fullpath);
+    s3http_connection_object_list (http_con, data->prefix, 
+        dir_tree_dir_remove_on_object_listed, dir_tree_dir_remove_on_list_done, data);
+}
 
-    res = s3http_connection_make_request (http_con, 
-        req_path, req_path, "DELETE", 
-        NULL,
-        dir_tree_file_remove_on_http_client_data_cb,
-        dir_tree_file_remove_on_http_client_error_cb,
-        data
-    );
+// remove empty directory
+void dir_tree_dir_remove (DirTree *dtree, fuse_ino_t parent_ino, const char *name, 
+    DirTree_file_remove_cb dir_remove_cb, fuse_req_t req)
+{
+    DirEntry *dir_en, *en;
+    DirTreeDirRemoveData *data;
+    gchar *path;
 
-    g_free (req_path);
+    LOG_debug (DIR_TREE_LOG, "Removing directory '%s' from directory ino: %"INO_FMT, name, parent_ino);
 
-    if (!res) {
-        LOG_err (DIR_TREE_LOG, "Failed to create HTTP request !");
-        data->file_remove_cb (data->req, FALSE);
-        
-        s3http_connection_release (http_con);
-        g_free (data);
+    dir_en = inode_table_lookup (dtree->inodes, parent_ino);
+    if (!dir_en || dir_en->type != DET_dir) {
+        LOG_msg (DIR_TREE_LOG, "Directory (%"INO_FMT") not found !", parent_ino);
+        dir_remove_cb (req, dir_en ? ENOTDIR : ENOENT);
+        return;
     }
-}
-
-// remove file
-gboolean dir_tree_file_remove (DirTree *dtree, fuse_ino_t ino, DirTree_file_remove_cb file_remove_cb, fuse_req_t req)
-{
-    DirEntry *en;
-    FileRemoveData *data;
-    
-    LOG_debug (DIR_TREE_LOG, "Removing  inode %"INO_FMT, ino);
 
-    en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (ino));
+    en = dir_entry_child_lookup (dtree, dir_en, name);
+    if (!en || en->age == 0) {
+        LOG_debug (DIR_TREE_LOG, "Directory '%s' not found !", name);
+        dir_remove_cb (req, ENOENT);
+        return;
+    }
 
-    // if entry does not exist
-    // or it's not a directory type ?
-    if (!en) {
-        LOG_err (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") not found !", ino);
-        file_remove_cb (req, FALSE);
-        return FALSE;
+    if (en->type != DET_dir) {
+        LOG_debug (DIR_TREE_LOG, "Entry '%s' is not a directory !", name);
+        dir_remove_cb (req, ENOTDIR);
+        return;
     }
 
-    if (en->type != DET_file) {
-        LOG_err (DIR_TREE_LOG, "Entry (ino = %"INO_FMT") is not a file !", ino);
-        file_remove_cb (req, FALSE);
-        return FALSE;
+    if (dir_tree_dir_has_children (en)) {
+        LOG_debug (DIR_TREE_LOG, "Directory '%s' is not empty !", name);
+        dir_remove_cb (req, ENOTEMPTY);
+        return;
     }
 
-    data = g_new0 (FileRemoveData, 1);
+    data = g_new0 (DirTreeDirRemoveData, 1);
     data->dtree = dtree;
-    data->ino = ino;
-    data->en = en;
-    data->file_remove_cb = file_remove_cb;
+    data->ino = en->ino;
+    path = dir_tree_entry_get_path (dtree, en);
+    data->prefix = g_strdup_printf ("%s/", path + 1);
+    g_free (path);
+    data->has_dir_object = FALSE;
+    data->is_empty = TRUE;
+    data->dir_remove_cb = dir_remove_cb;
     data->req = req;
 
-    s3client_pool_get_client (application_get_ops_client_pool (dtree->app),
-        dir_tree_file_remove_on_http_client_cb, data);
-        
-    return TRUE;
+    // a single flat listing, instead of listing every subdirectory
+    if (!s3client_pool_get_client (application_get_ops_client_pool (dtree->app), 
+        dir_tree_dir_remove_on_http_ready, data)) {
+        LOG_err (DIR_TREE_LOG, "Failed to get S3HttpConnection from the pool !");
+        dir_tree_dir_remove_on_list_done (data, FALSE);
+    }
 }
 /*}}}*/
 
@@ -1081,7 +4508,7 @@ void dir_tree_dir_create (DirTree *dtree, fuse_ino_t parent_ino, const char *nam
     
     LOG_debug (DIR_TREE_LOG, "Creating dir: %s", name);
     
-    dir_en = g_hash_table_lookup (dtree->h_inodes, GUINT_TO_POINTER (parent_ino));
+    dir_en = inode_table_lookup (dtree->inodes, parent_ino);
     
     // entry not found
     if (!dir_en || dir_en->type != DET_dir) {
@@ -1103,6 +4530,11 @@ void dir_tree_dir_create (DirTree *dtree, fuse_ino_t parent_ino, const char *nam
     // do not delete it
     en->age = G_MAXUINT32;
     en->mode = DIR_DEFAULT_MODE;
+    // the name was just looked up, there is nothing under it: misses are answered locally.
+    // The bucket index covers the whole subtree, a directory created in an indexed one is indexed too
+    DIR_ENTRY_DIR (en)->listed = en->ctime;
+    en->is_indexed = dir_en->is_indexed;
 
+    inode_table_ref (dtree->inodes, en->ino);
     mkdir_cb (req, TRUE, en->ino, en->mode, en->size, en->ctime);
 }
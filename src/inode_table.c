@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "inode_table.h"
+
+#define INODE_TABLE_LOG "inode_table"
+
+#define INODE_TABLE_CHUNK_BITS 16
+#define INODE_TABLE_CHUNK_SIZE (1 << INODE_TABLE_CHUNK_BITS)
+// DirEntry keeps 32-bit inode numbers
+#define INODE_TABLE_MAX_INO G_MAXUINT32
+
+// free slot keeps the next free inode number, tagged with the lowest bit
+#define INODE_SLOT_IS_FREE(data) (GPOINTER_TO_SIZE (data) & 1)
+#define INODE_SLOT_FREE_NEXT(data) ((fuse_ino_t) (GPOINTER_TO_SIZE (data) >> 1))
+#define INODE_SLOT_FREE_LINK(ino) (GSIZE_TO_POINTER (((gsize) (ino) << 1) | 1))
+
+// slot is either used by an entry, or the entry is removed and the kernel still references the inode,
+// or it's in the free list
+typedef struct {
+    gpointer a_data[INODE_TABLE_CHUNK_SIZE]; // entry, NULL or a free list link
+    guint32 a_nlookup[INODE_TABLE_CHUNK_SIZE]; // kernel references
+} InodeTableChunk;
+
+struct _InodeTable {
+    GPtrArray *a_chunks;
+    fuse_ino_t next_ino; // the first inode number which was never used
+    fuse_ino_t free_ino; // the head of free list, 0 if it's empty
+    guint64 count;
+};
+
+InodeTable *inode_table_create ()
+{
+    InodeTable *table;
+
+    table = g_new0 (InodeTable, 1);
+    table->a_chunks = g_ptr_array_new_with_free_func (g_free);
+    // 0 is not a valid inode number
+    table->next_ino = 1;
+    table->free_ino = 0;
+    table->count = 0;
+
+    return table;
+}
+
+void inode_table_destroy (InodeTable *table)
+{
+    g_ptr_array_free (table->a_chunks, TRUE);
+    g_free (table);
+}
+
+static InodeTableChunk *inode_table_get_chunk (InodeTable *table, fuse_ino_t ino)
+{
+    if (!ino || ino >= table->next_ino)
+        return NULL;
+
+    return g_ptr_array_index (table->a_chunks, ino >> INODE_TABLE_CHUNK_BITS);
+}
+
+#define INODE_SLOT(ino) ((ino) & (INODE_TABLE_CHUNK_SIZE - 1))
+
+fuse_ino_t inode_table_add (InodeTable *table, gpointer data)
+{
+    InodeTableChunk *chunk;
+    fuse_ino_t ino;
+
+    if (table->free_ino) {
+        ino = table->free_ino;
+        chunk = inode_table_get_chunk (table, ino);
+        table->free_ino = INODE_SLOT_FREE_NEXT (chunk->a_data[INODE_SLOT (ino)]);
+    } else {
+        if (table->next_ino > INODE_TABLE_MAX_INO) {
+            LOG_err (INODE_TABLE_LOG, "Out of inode numbers !");
+            return 0;
+        }
+
+        ino = table->next_ino++;
+        if (INODE_SLOT (ino) == 0 || table->a_chunks->len == 0)
+            g_ptr_array_add (table->a_chunks, g_new0 (InodeTableChunk, 1));
+        chunk = inode_table_get_chunk (table, ino);
+    }
+
+    chunk->a_data[INODE_SLOT (ino)] = data;
+    chunk->a_nlookup[INODE_SLOT (ino)] = 0;
+    table->count++;
+
+    return ino;
+}
+
+gpointer inode_table_lookup (InodeTable *table, fuse_ino_t ino)
+{
+    InodeTableChunk *chunk;
+    gpointer data;
+
+    chunk = inode_table_get_chunk (table, ino);
+    if (!chunk)
+        return NULL;
+
+    data = chunk->a_data[INODE_SLOT (ino)];
+    if (INODE_SLOT_IS_FREE (data))
+        return NULL;
+
+    return data;
+}
+
+// put inode number to the free list
+static void inode_table_free (InodeTable *table, InodeTableChunk *chunk, fuse_ino_t ino)
+{
+    chunk->a_data[INODE_SLOT (ino)] = INODE_SLOT_FREE_LINK (table->free_ino);
+    table->free_ino = ino;
+}
+
+void inode_table_remove (InodeTable *table, fuse_ino_t ino)
+{
+    InodeTableChunk *chunk;
+
+    chunk = inode_table_get_chunk (table, ino);
+    if (!chunk || !chunk->a_data[INODE_SLOT (ino)] || INODE_SLOT_IS_FREE (chunk->a_data[INODE_SLOT (ino)]))
+        return;
+
+    table->count--;
+
+    // the kernel could still ask for this inode, it must not point to another entry
+    if (chunk->a_nlookup[INODE_SLOT (ino)]) {
+        chunk->a_data[INODE_SLOT (ino)] = NULL;
+        return;
+    }
+
+    inode_table_free (table, chunk, ino);
+}
+
+void inode_table_ref (InodeTable *table, fuse_ino_t ino)
+{
+    InodeTableChunk *chunk;
+
+    chunk = inode_table_get_chunk (table, ino);
+    if (!chunk || INODE_SLOT_IS_FREE (chunk->a_data[INODE_SLOT (ino)]))
+        return;
+
+    if (chunk->a_nlookup[INODE_SLOT (ino)] < G_MAXUINT32)
+        chunk->a_nlookup[INODE_SLOT (ino)]++;
+}
+
+void inode_table_forget (InodeTable *table, fuse_ino_t ino, guint64 nlookup)
+{
+    InodeTableChunk *chunk;
+
+    chunk = inode_table_get_chunk (table, ino);
+    if (!chunk || INODE_SLOT_IS_FREE (chunk->a_data[INODE_SLOT (ino)]))
+        return;
+
+    if (chunk->a_nlookup[INODE_SLOT (ino)] > nlookup)
+        chunk->a_nlookup[INODE_SLOT (ino)] -= nlookup;
+    else
+        chunk->a_nlookup[INODE_SLOT (ino)] = 0;
+
+    // entry is already removed
+    if (!chunk->a_nlookup[INODE_SLOT (ino)] && !chunk->a_data[INODE_SLOT (ino)])
+        inode_table_free (table, chunk, ino);
+}
+
+guint64 inode_table_get_count (InodeTable *table)
+{
+    return table->count;
+}
+
+gsize inode_table_get_mem_size (InodeTable *table)
+{
+    return sizeof (InodeTable) + table->a_chunks->len * (sizeof (InodeTableChunk) + sizeof (gpointer));
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "list_parser.h"
+
+// elements of ListBucketResult, which values are collected
+typedef enum {
+    LPF_none = 0,
+    LPF_key,
+    LPF_size,
+    LPF_etag,
+    LPF_prefix,
+    LPF_next_marker,
+    LPF_next_token,
+    LPF_is_truncated,
+} ListParserField;
+
+struct _ListParser {
+    xmlParserCtxtPtr ctxt;
+    xmlSAXHandler sax;
+
+    ListParser_on_entry_cb on_entry_cb;
+    gpointer ctx;
+
+    gint depth; // depth of the current element, the root is 1
+    gboolean is_list; // the root is ListBucketResult
+    gboolean in_contents;
+    gboolean in_prefixes;
+    ListParserField field; // value of the current element is collected
+
+    GString *text; // value of the current element
+    GString *key;
+    GString *etag;
+    guint64 size;
+
+    gboolean is_truncated;
+    gchar *next_marker;
+    gchar *next_token; // NextContinuationToken of ListObjectsV2
+    gchar *last_key; // the greatest key or common prefix of the page
+    guint count;
+    gboolean failed;
+};
+
+#define LIST_PARSER_LOG "list_parser"
+
+/*{{{ SAX callbacks */
+
+static void list_parser_on_element_start (void *ctx, const xmlChar *localname, G_GNUC_UNUSED const xmlChar *prefix,
+    G_GNUC_UNUSED const xmlChar *uri, G_GNUC_UNUSED int nb_namespaces, G_GNUC_UNUSED const xmlChar **namespaces,
+    G_GNUC_UNUSED int nb_attributes, G_GNUC_UNUSED int nb_defaulted, G_GNUC_UNUSED const xmlChar **attributes)
+{
+    ListParser *parser = (ListParser *) ctx;
+    const gchar *name = (const gchar *) localname;
+
+    parser->depth++;
+    parser->field = LPF_none;
+
+    if (parser->depth == 1) {
+        parser->is_list = !strcmp (name, "ListBucketResult");
+    } else if (parser->depth == 2) {
+        if (!strcmp (name, "Contents") || !strcmp (name, "CommonPrefixes")) {
+            parser->in_contents = !strcmp (name, "Contents");
+            parser->in_prefixes = !parser->in_contents;
+            g_string_truncate (parser->key, 0);
+            g_string_truncate (parser->etag, 0);
+            parser->size = 0;
+        } else if (!strcmp (name, "NextMarker")) {
+            parser->field = LPF_next_marker;
+        } else if (!strcmp (name, "NextContinuationToken")) {
+            parser->field = LPF_next_token;
+        } else if (!strcmp (name, "IsTruncated")) {
+            parser->field = LPF_is_truncated;
+        }
+    } else if (parser->depth == 3) {
+        if (parser->in_contents) {
+            if (!strcmp (name, "Key"))
+                parser->field = LPF_key;
+            else if (!strcmp (name, "Size"))
+                parser->field = LPF_size;
+            else if (!strcmp (name, "ETag"))
+                parser->field = LPF_etag;
+        } else if (parser->in_prefixes) {
+            if (!strcmp (name, "Prefix"))
+                parser->field = LPF_prefix;
+        }
+    }
+
+    if (parser->field != LPF_none)
+        g_string_truncate (parser->text, 0);
+}
+
+static void list_parser_on_characters (void *ctx, const xmlChar *ch, int len)
+{
+    ListParser *parser = (ListParser *) ctx;
+
+    if (parser->field != LPF_none)
+        g_string_append_len (parser->text, (const gchar *) ch, len);
+}
+
+static void list_parser_set_last_key (ListParser *parser, const gchar *key)
+{
+    if (!parser->last_key || strcmp (key, parser->last_key) > 0) {
+        g_free (parser->last_key);
+        parser->last_key = g_strdup (key);
+    }
+}
+
+static void list_parser_on_element_end (void *ctx, G_GNUC_UNUSED const xmlChar *localname, 
+    G_GNUC_UNUSED const xmlChar *prefix, G_GNUC_UNUSED const xmlChar *uri)
+{
+    ListParser *parser = (ListParser *) ctx;
+
+    switch (parser->field) {
+        case LPF_key:
+        case LPF_prefix:
+            g_string_assign (parser->key, parser->text->str);
+            break;
+        case LPF_size:
+            parser->size = g_ascii_strtoull (parser->text->str, NULL, 10);
+            break;
+        case LPF_etag:
+            g_string_assign (parser->etag, parser->text->str);
+            break;
+        case LPF_next_marker:
+            g_free (parser->next_marker);
+            parser->next_marker = g_strdup (parser->text->str);
+            break;
+        case LPF_next_token:
+            g_free (parser->next_token);
+            parser->next_token = g_strdup (parser->text->str);
+            break;
+        case LPF_is_truncated:
+            parser->is_truncated = !strcmp (parser->text->str, "true");
+            break;
+        case LPF_none:
+            break;
+    }
+    parser->field = LPF_none;
+
+    if (parser->depth == 2 && parser->is_list && (parser->in_contents || parser->in_prefixes)) {
+        if (parser->key->len) {
+            parser->count++;
+            list_parser_set_last_key (parser, parser->key->str);
+            parser->on_entry_cb (parser->ctx, parser->key->str, parser->in_prefixes, parser->size, 
+                parser->etag->len ? parser->etag->str : NULL);
+        }
+        parser->in_contents = FALSE;
+        parser->in_prefixes = FALSE;
+    }
+
+    parser->depth--;
+}
+
+static void list_parser_on_error (G_GNUC_UNUSED void *ctx, xmlErrorPtr error)
+{
+    LOG_debug (LIST_PARSER_LOG, "Failed to parse listing: %s", error && error->message ? error->message : "");
+}
+/*}}}*/
+
+/*{{{ create / destroy */
+ListParser *list_parser_create (ListParser_on_entry_cb on_entry_cb, gpointer ctx)
+{
+    ListParser *parser;
+
+    parser = g_new0 (ListParser, 1);
+    parser->on_entry_cb = on_entry_cb;
+    parser->ctx = ctx;
+    parser->text = g_string_sized_new (256);
+    parser->key = g_string_sized_new (256);
+    parser->etag = g_string_sized_new (64);
+
+    // only SAX2 element callbacks are set, no document is built
+    parser->sax.initialized = XML_SAX2_MAGIC;
+    parser->sax.startElementNs = list_parser_on_element_start;
+    parser->sax.endElementNs = list_parser_on_element_end;
+    parser->sax.characters = list_parser_on_characters;
+    parser->sax.serror = list_parser_on_error;
+
+    parser->ctxt = xmlCreatePushParserCtxt (&parser->sax, parser, NULL, 0, NULL);
+    if (!parser->ctxt) {
+        LOG_err (LIST_PARSER_LOG, "Failed to create XML parser !");
+        list_parser_destroy (parser);
+        return NULL;
+    }
+    xmlCtxtUseOptions (parser->ctxt, XML_PARSE_NONET | XML_PARSE_NOWARNING | XML_PARSE_NOERROR);
+
+    return parser;
+}
+
+void list_parser_destroy (ListParser *parser)
+{
+    if (parser->ctxt)
+        xmlFreeParserCtxt (parser->ctxt);
+    g_string_free (parser->text, TRUE);
+    g_string_free (parser->key, TRUE);
+    g_string_free (parser->etag, TRUE);
+    g_free (parser->next_marker);
+    g_free (parser->next_token);
+    g_free (parser->last_key);
+    g_free (parser);
+}
+/*}}}*/
+
+gboolean list_parser_feed (ListParser *parser, const gchar *buf, size_t buf_len)
+{
+    if (parser->failed)
+        return FALSE;
+
+    if (buf_len && xmlParseChunk (parser->ctxt, buf, buf_len, 0) != 0)
+        parser->failed = TRUE;
+
+    return !parser->failed;
+}
+
+gboolean list_parser_finish (ListParser *parser)
+{
+    if (parser->failed)
+        return FALSE;
+
+    if (xmlParseChunk (parser->ctxt, NULL, 0, 1) != 0 || !parser->ctxt->wellFormed)
+        parser->failed = TRUE;
+
+    if (!parser->is_list)
+        parser->failed = TRUE;
+
+    return !parser->failed;
+}
+
+gboolean list_parser_is_truncated (ListParser *parser)
+{
+    return parser->is_truncated;
+}
+
+const gchar *list_parser_get_next_marker (ListParser *parser)
+{
+    if (parser->next_marker && *parser->next_marker)
+        return parser->next_marker;
+
+    return parser->last_key;
+}
+
+const gchar *list_parser_get_continuation_token (ListParser *parser)
+{
+    if (parser->next_token && *parser->next_token)
+        return parser->next_token;
+
+    return NULL;
+}
+
+guint list_parser_get_count (ListParser *parser)
+{
+    return parser->count;
+}
@@ -21,6 +21,9 @@
 #include "s3fuse.h"
 #include "s3client_pool.h"
 #include "s3http_client.h"
+#include "upload_journal.h"
+#include "upload_scheduler.h"
+#include "delete_queue.h"
 
 #define APP_LOG "main"
 
@@ -31,6 +34,7 @@ struct _Application {
     
     S3Fuse *s3fuse;
     DirTree *dir_tree;
+    UploadJournal *upload_journal;
 
     S3HttpConnection *service_con;
     gint service_con_redirects;
@@ -38,6 +42,8 @@ struct _Application {
     S3ClientPool *write_client_pool;
     S3ClientPool *read_client_pool;
     S3ClientPool *ops_client_pool;
+    UploadScheduler *upload_scheduler;
+    DeleteQueue *delete_queue;
 
     gchar *aws_access_key_id;
     gchar *aws_secret_access_key;
@@ -54,6 +60,7 @@ struct _Application {
     struct event *sigint_ev;
     struct event *sigpipe_ev;
     struct event *sigusr1_ev;
+    struct event *sigusr2_ev;
 
 };
 
@@ -73,6 +80,11 @@ DirTree *application_get_dir_tree (Application *app)
     return app->dir_tree;
 }
 
+UploadJournal *application_get_upload_journal (Application *app)
+{
+    return app->upload_journal;
+}
+
 const gchar *application_get_access_key_id (Application *app)
 {
     return (const gchar *) app->aws_access_key_id;
@@ -98,6 +110,16 @@ S3ClientPool *application_get_ops_client_pool (Application *app)
     return app->ops_client_pool;
 }
 
+UploadScheduler *application_get_upload_scheduler (Application *app)
+{
+    return app->upload_scheduler;
+}
+
+DeleteQueue *application_get_delete_queue (Application *app)
+{
+    return app->delete_queue;
+}
+
 const gchar *application_get_bucket_name (Application *app)
 {
     return app->bucket_name;
@@ -198,6 +220,17 @@ static void sigusr1_cb (G_GNUC_UNUSED evutil_socket_t sig, G_GNUC_UNUSED short e
     exit (1);
 }
 
+// report memory usage
+static void sigusr2_cb (G_GNUC_UNUSED evutil_socket_t sig, G_GNUC_UNUSED short events, void *user_data)
+{
+	Application *app = (Application *) user_data;
+
+	LOG_msg (APP_LOG, "Got SIGUSR2");
+
+    if (app->dir_tree)
+        dir_tree_log_mem_usage (app->dir_tree);
+}
+
 // terminate application, freeing all used memory
 static void sigint_cb (G_GNUC_UNUSED evutil_socket_t sig, G_GNUC_UNUSED short events, void *user_data)
 {
@@ -248,6 +281,13 @@ static gint application_finish_initialization_and_run (Application *app)
         return -1;
     }
 
+    // uploads are sent through the write pool, split by the file size
+    app->upload_scheduler = upload_scheduler_create (app, app->write_client_pool);
+    if (!app->upload_scheduler) {
+        LOG_err (APP_LOG, "Failed to create UploadScheduler !");
+        return -1;
+    }
+
     // create S3ClientPool for various operations
     app->ops_client_pool = s3client_pool_create (app, app->conf->ops,
         s3http_connection_create,
@@ -260,6 +300,34 @@ static gint application_finish_initialization_and_run (Application *app)
         return -1;
     }
 
+    // removals are batched and sent through the ops pool
+    app->delete_queue = delete_queue_create (app, app->ops_client_pool);
+    if (!app->delete_queue) {
+        LOG_err (APP_LOG, "Failed to create DeleteQueue !");
+        return -1;
+    }
+
+/*{{{ UploadJournal*/
+    if (app->conf->use_upload_journal) {
+        gchar *journal_name;
+        gchar *journal_path;
+
+        // tmp_dir can be shared by mounts of different buckets
+        journal_name = g_strdup_printf ("s3ffs.%s.journal", app->bucket_name);
+        journal_path = g_build_filename (app->tmp_dir, journal_name, NULL);
+        app->upload_journal = upload_journal_create (app, journal_path);
+        g_free (journal_path);
+        g_free (journal_name);
+        if (!app->upload_journal) {
+            LOG_err (APP_LOG, "Failed to create UploadJournal !");
+            return -1;
+        }
+
+        // send files which were not uploaded before the previous shutdown
+        upload_journal_replay (app->upload_journal);
+    }
+/*}}}*/
+
 /*{{{ DirTree*/
     app->dir_tree = dir_tree_create (app);
     if (!app->dir_tree) {
@@ -302,6 +370,9 @@ static gint application_finish_initialization_and_run (Application *app)
     // SIGUSR1
 	app->sigusr1_ev = evsignal_new (app->evbase, SIGUSR1, sigusr1_cb, app);
 	event_add (app->sigusr1_ev, NULL);
+    // SIGUSR2
+	app->sigusr2_ev = evsignal_new (app->evbase, SIGUSR2, sigusr2_cb, app);
+	event_add (app->sigusr2_ev, NULL);
 /*}}}*/
     
     if (!app->foreground)
@@ -387,20 +458,29 @@ static void application_destroy (Application *app)
 
     if (app->read_client_pool)
         s3client_pool_destroy (app->read_client_pool);
+    if (app->upload_scheduler)
+        upload_scheduler_destroy (app->upload_scheduler);
     if (app->write_client_pool)
         s3client_pool_destroy (app->write_client_pool);
+    if (app->delete_queue)
+        delete_queue_destroy (app->delete_queue);
     if (app->ops_client_pool)
         s3client_pool_destroy (app->ops_client_pool);
 
     if (app->dir_tree)
         dir_tree_destroy (app->dir_tree);
 
+    if (app->upload_journal)
+        upload_journal_destroy (app->upload_journal);
+
     if (app->sigint_ev)
         event_free (app->sigint_ev);
     if (app->sigpipe_ev)
         event_free (app->sigpipe_ev);
     if (app->sigusr1_ev)
         event_free (app->sigusr1_ev);
+    if (app->sigusr2_ev)
+        event_free (app->sigusr2_ev);
     
     if (app->service_con)
         s3http_connection_destroy (app->service_con);
@@ -414,6 +494,7 @@ static void application_destroy (Application *app)
     g_free (app->host_header);
     evhttp_uri_free (app->uri);
 
+    g_free (app->conf->index_prefix);
     g_free (app->conf);
     g_free (app);
     
@@ -440,6 +521,7 @@ int main (int argc, char *argv[])
     gchar **s_config = NULL;
     gchar *progname;
     gboolean foreground = FALSE;
+    gboolean index_bucket = FALSE;
     GKeyFile *key_file;
     gchar conf_str[1023];
     gchar *conf_path;
@@ -451,6 +533,7 @@ int main (int argc, char *argv[])
 	    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &s_mountpoint, "Mountpoint", NULL },
 	    { "config", 'c', 0, G_OPTION_ARG_FILENAME_ARRAY, &s_config, conf_str, NULL },
         { "foreground", 'f', 0, G_OPTION_ARG_NONE, &foreground, "Do not daemonize process.", NULL },
+        { "index", 'i', 0, G_OPTION_ARG_NONE, &index_bucket, "Build directory tree from a flat listing of the bucket.", NULL },
         { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Verbose output.", NULL },
         { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
     };
@@ -496,8 +579,30 @@ int main (int argc, char *argv[])
     app->conf->retries = -1;
     app->conf->http_port = 80;
     app->conf->dir_cache_max_time = 5;
+    app->conf->dir_cache_max_stale = 60;
     app->conf->max_requests_per_pool = 100;
+    app->conf->dir_list_partitions = 4;
+    app->conf->list_max_keys = 1000;
+    app->conf->small_upload_writers = 1;
+    app->conf->large_upload_writers = 1;
+    app->conf->small_upload_max_size = 16 * 1024 * 1024;
+    app->conf->upload_bandwidth_limit = 0;
+    app->conf->write_buffer_file_size = 1024 * 1024;
+    app->conf->write_buffer_max_size = 64 * 1024 * 1024;
+    app->conf->background_upload_max_size = 256 * 1024 * 1024;
+    app->conf->copy_up_block_size = 1024 * 1024;
+    app->conf->read_cache_max_size = 128 * 1024 * 1024;
+    app->conf->delete_batch_delay = 50;
+    app->conf->upload_on_flush = FALSE;
+    app->conf->use_upload_journal = FALSE;
     app->conf->path_style = TRUE;
+    app->conf->list_objects_v2 = TRUE;
+    app->conf->index_bucket = FALSE;
+    app->conf->index_prefix = g_strdup ("");
+    app->conf->index_refresh_time = 600;
+    app->conf->use_snapshot = FALSE;
+    app->conf->snapshot_interval = 300;
+    app->conf->negative_cache_time = 5;
     app->conf->use_syslog = TRUE;
 
     //XXX: fix it
@@ -626,17 +731,119 @@ int main (int argc, char *argv[])
             return -1;
         }
 
+        app->conf->dir_list_partitions = g_key_file_get_integer (key_file, "connections", "dir_list_partitions", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->small_upload_writers = g_key_file_get_integer (key_file, "connections", "small_upload_writers", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->large_upload_writers = g_key_file_get_integer (key_file, "connections", "large_upload_writers", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->small_upload_max_size = g_key_file_get_uint64 (key_file, "connections", "small_upload_max_size", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->upload_bandwidth_limit = g_key_file_get_uint64 (key_file, "connections", "upload_bandwidth_limit", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
         app->conf->path_style = g_key_file_get_boolean (key_file, "connections", "path_style", &error);
         if (error) {
             LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
             return -1;
         }
 
+        app->conf->list_max_keys = g_key_file_get_integer (key_file, "connections", "list_max_keys", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->list_objects_v2 = g_key_file_get_boolean (key_file, "connections", "list_objects_v2", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
         app->conf->dir_cache_max_time = g_key_file_get_integer (key_file, "filesystem", "dir_cache_max_time", &error);
         if (error) {
             LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
             return -1;
         }
+
+        app->conf->dir_cache_max_stale = g_key_file_get_integer (key_file, "filesystem", "dir_cache_max_stale", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->negative_cache_time = g_key_file_get_integer (key_file, "filesystem", "negative_cache_time", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+        
+        app->conf->write_buffer_file_size = g_key_file_get_uint64 (key_file, "filesystem", "write_buffer_file_size", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->write_buffer_max_size = g_key_file_get_uint64 (key_file, "filesystem", "write_buffer_max_size", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->background_upload_max_size = g_key_file_get_uint64 (key_file, "filesystem", "background_upload_max_size", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->copy_up_block_size = g_key_file_get_uint64 (key_file, "filesystem", "copy_up_block_size", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->read_cache_max_size = g_key_file_get_uint64 (key_file, "filesystem", "read_cache_max_size", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->delete_batch_delay = g_key_file_get_integer (key_file, "filesystem", "delete_batch_delay", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->upload_on_flush = g_key_file_get_boolean (key_file, "filesystem", "upload_on_flush", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->use_upload_journal = g_key_file_get_boolean (key_file, "filesystem", "use_upload_journal", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
         
         g_free (app->tmp_dir);
         app->tmp_dir = g_key_file_get_string (key_file, "filesystem", "tmp_dir", &error);
@@ -645,6 +852,37 @@ int main (int argc, char *argv[])
             return -1;
         }
 
+        app->conf->index_bucket = g_key_file_get_boolean (key_file, "filesystem", "index_bucket", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        g_free (app->conf->index_prefix);
+        app->conf->index_prefix = g_key_file_get_string (key_file, "filesystem", "index_prefix", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->index_refresh_time = g_key_file_get_integer (key_file, "filesystem", "index_refresh_time", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->use_snapshot = g_key_file_get_boolean (key_file, "filesystem", "use_snapshot", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
+        app->conf->snapshot_interval = g_key_file_get_integer (key_file, "filesystem", "snapshot_interval", &error);
+        if (error) {
+            LOG_err (APP_LOG, "Failed to read configuration file (%s): %s", conf_path, error->message);
+            return -1;
+        }
+
         g_key_file_free (key_file);
     } else {
         LOG_msg (APP_LOG, "Configuration file does not exist, using predefined values.");
@@ -652,6 +890,10 @@ int main (int argc, char *argv[])
 
     g_free (conf_path);
 
+    // command line option overrides the config file
+    if (index_bucket)
+        app->conf->index_bucket = TRUE;
+
     // update logging settings
     logger_set_syslog (app->conf->use_syslog);
 
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "name_pool.h"
+
+#define NAME_POOL_LOG "name_pool"
+
+// strings are stored in chunks as blocks of 4 byte units:
+// reference counter, followed by the NUL-terminated string.
+// id of the string is the number of its first unit: chunk number and unit inside the chunk
+#define NAME_POOL_UNIT 4
+#define NAME_POOL_CHUNK_BITS 18
+#define NAME_POOL_CHUNK_UNITS (1 << NAME_POOL_CHUNK_BITS)
+#define NAME_POOL_MAX_CHUNKS (G_MAXUINT32 >> NAME_POOL_CHUNK_BITS)
+// S3 keys are up to 1024 bytes
+#define NAME_POOL_MAX_LEN 1024
+#define NAME_POOL_MAX_UNITS ((sizeof (guint32) + NAME_POOL_MAX_LEN + 1 + NAME_POOL_UNIT - 1) / NAME_POOL_UNIT)
+#define NAME_POOL_INDEX_MIN_SIZE 1024
+
+struct _NamePool {
+    GPtrArray *a_chunks;
+    guint32 chunk_used; // units used in the last chunk
+
+    // free blocks by size in units, linked through the string part, 0 terminated
+    guint32 free_lists[NAME_POOL_MAX_UNITS + 1];
+
+    // open addressing hash table of string ids, 0 is an empty slot
+    guint32 *index;
+    guint32 index_size; // power of 2
+
+    guint64 count;
+};
+
+static guint32 *name_pool_get_block (NamePool *pool, guint32 id)
+{
+    guint32 *chunk = g_ptr_array_index (pool->a_chunks, id >> NAME_POOL_CHUNK_BITS);
+
+    return chunk + (id & (NAME_POOL_CHUNK_UNITS - 1));
+}
+
+static guint32 name_pool_get_units (size_t len)
+{
+    // free block must have a room for the link
+    return MAX ((sizeof (guint32) + len + 1 + NAME_POOL_UNIT - 1) / NAME_POOL_UNIT, 2);
+}
+
+NamePool *name_pool_create ()
+{
+    NamePool *pool;
+
+    pool = g_new0 (NamePool, 1);
+    pool->a_chunks = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (pool->a_chunks, g_malloc (NAME_POOL_CHUNK_UNITS * NAME_POOL_UNIT));
+    // id 0 is reserved
+    pool->chunk_used = 1;
+    pool->index_size = NAME_POOL_INDEX_MIN_SIZE;
+    pool->index = g_new0 (guint32, pool->index_size);
+    pool->count = 0;
+
+    return pool;
+}
+
+void name_pool_destroy (NamePool *pool)
+{
+    g_free (pool->index);
+    g_ptr_array_free (pool->a_chunks, TRUE);
+    g_free (pool);
+}
+
+// return the id of a new block, 0 if the pool is full
+static guint32 name_pool_block_alloc (NamePool *pool, guint32 units)
+{
+    guint32 id;
+
+    if (pool->free_lists[units]) {
+        id = pool->free_lists[units];
+        pool->free_lists[units] = name_pool_get_block (pool, id)[1];
+        return id;
+    }
+
+    if (pool->chunk_used + units > NAME_POOL_CHUNK_UNITS) {
+        guint32 left = NAME_POOL_CHUNK_UNITS - pool->chunk_used;
+
+        if (pool->a_chunks->len >= NAME_POOL_MAX_CHUNKS)
+            return 0;
+
+        // the rest of the chunk is kept for smaller strings
+        if (left >= 2) {
+            id = ((pool->a_chunks->len - 1) << NAME_POOL_CHUNK_BITS) | pool->chunk_used;
+            name_pool_get_block (pool, id)[1] = pool->free_lists[left];
+            pool->free_lists[left] = id;
+        }
+
+        g_ptr_array_add (pool->a_chunks, g_malloc (NAME_POOL_CHUNK_UNITS * NAME_POOL_UNIT));
+        pool->chunk_used = 0;
+    }
+
+    id = ((pool->a_chunks->len - 1) << NAME_POOL_CHUNK_BITS) | pool->chunk_used;
+    pool->chunk_used += units;
+
+    return id;
+}
+
+static void name_pool_index_resize (NamePool *pool, guint32 new_size)
+{
+    guint32 *old_index = pool->index;
+    guint32 old_size = pool->index_size;
+    guint32 i;
+
+    pool->index_size = new_size;
+    pool->index = g_new0 (guint32, new_size);
+
+    for (i = 0; i < old_size; i++) {
+        guint32 slot;
+
+        if (!old_index[i])
+            continue;
+
+        slot = g_str_hash (name_pool_get (pool, old_index[i])) & (new_size - 1);
+        while (pool->index[slot])
+            slot = (slot + 1) & (new_size - 1);
+        pool->index[slot] = old_index[i];
+    }
+
+    g_free (old_index);
+}
+
+guint32 name_pool_add (NamePool *pool, const gchar *name)
+{
+    guint32 mask, slot, id;
+    guint32 *block;
+    size_t len;
+
+    len = strlen (name);
+    if (len > NAME_POOL_MAX_LEN) {
+        LOG_err (NAME_POOL_LOG, "Name is too long: %zu bytes !", len);
+        return 0;
+    }
+
+    // keep the load factor below 3/4
+    if ((pool->count + 1) * 4 > (guint64) pool->index_size * 3)
+        name_pool_index_resize (pool, pool->index_size * 2);
+
+    mask = pool->index_size - 1;
+    for (slot = g_str_hash (name) & mask; pool->index[slot]; slot = (slot + 1) & mask) {
+        if (!strcmp (name_pool_get (pool, pool->index[slot]), name)) {
+            name_pool_get_block (pool, pool->index[slot])[0]++;
+            return pool->index[slot];
+        }
+    }
+
+    id = name_pool_block_alloc (pool, name_pool_get_units (len));
+    if (!id) {
+        LOG_err (NAME_POOL_LOG, "Name pool is full !");
+        return 0;
+    }
+
+    block = name_pool_get_block (pool, id);
+    block[0] = 1;
+    memcpy (block + 1, name, len + 1);
+
+    pool->index[slot] = id;
+    pool->count++;
+
+    return id;
+}
+
+void name_pool_release (NamePool *pool, guint32 id)
+{
+    guint32 *block;
+    guint32 mask, slot, next, units;
+
+    if (!id)
+        return;
+
+    block = name_pool_get_block (pool, id);
+    if (--block[0] > 0)
+        return;
+
+    // remove from the index, moving back entries of the same probe sequence
+    mask = pool->index_size - 1;
+    for (slot = g_str_hash ((const gchar *) (block + 1)) & mask; pool->index[slot] != id; slot = (slot + 1) & mask);
+    pool->index[slot] = 0;
+
+    for (next = (slot + 1) & mask; pool->index[next]; next = (next + 1) & mask) {
+        guint32 home = g_str_hash (name_pool_get (pool, pool->index[next])) & mask;
+
+        // entry can't be moved before its home slot
+        if ((next > slot && (home <= slot || home > next)) || 
+            (next < slot && home <= slot && home > next)) {
+            pool->index[slot] = pool->index[next];
+            pool->index[next] = 0;
+            slot = next;
+        }
+    }
+
+    units = name_pool_get_units (strlen ((const gchar *) (block + 1)));
+    block[1] = pool->free_lists[units];
+    pool->free_lists[units] = id;
+    pool->count--;
+}
+
+const gchar *name_pool_get (NamePool *pool, guint32 id)
+{
+    return (const gchar *) (name_pool_get_block (pool, id) + 1);
+}
+
+guint64 name_pool_get_count (NamePool *pool)
+{
+    return pool->count;
+}
+
+gsize name_pool_get_mem_size (NamePool *pool)
+{
+    return sizeof (NamePool) + pool->a_chunks->len * ((gsize) NAME_POOL_CHUNK_UNITS * NAME_POOL_UNIT + sizeof (gpointer)) +
+        pool->index_size * sizeof (guint32);
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "range_set.h"
+
+typedef struct {
+    off_t off;
+    off_t len;
+} RangeSetItem;
+
+struct _RangeSet {
+    GArray *a_items; // RangeSetItem, sorted by offset
+};
+
+#define RANGE_ITEM(rs, i) (&g_array_index ((rs)->a_items, RangeSetItem, (i)))
+
+RangeSet *range_set_create ()
+{
+    RangeSet *rs;
+
+    rs = g_new0 (RangeSet, 1);
+    rs->a_items = g_array_new (FALSE, FALSE, sizeof (RangeSetItem));
+
+    return rs;
+}
+
+void range_set_destroy (RangeSet *rs)
+{
+    g_array_free (rs->a_items, TRUE);
+    g_free (rs);
+}
+
+void range_set_clear (RangeSet *rs)
+{
+    g_array_set_size (rs->a_items, 0);
+}
+
+// return the index of the first range which ends at or after off
+static guint range_set_find (RangeSet *rs, off_t off)
+{
+    guint lo = 0, hi = rs->a_items->len;
+
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        RangeSetItem *item = RANGE_ITEM (rs, mid);
+
+        if (item->off + item->len < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+void range_set_add (RangeSet *rs, off_t off, off_t len)
+{
+    RangeSetItem new_item;
+    guint i, j;
+    off_t end;
+
+    if (len <= 0)
+        return;
+
+    end = off + len;
+    i = range_set_find (rs, off);
+
+    // merge with all ranges which overlap or touch the new one
+    for (j = i; j < rs->a_items->len; j++) {
+        RangeSetItem *item = RANGE_ITEM (rs, j);
+
+        if (item->off > end)
+            break;
+        off = MIN (off, item->off);
+        end = MAX (end, item->off + item->len);
+    }
+
+    if (j > i)
+        g_array_remove_range (rs->a_items, i, j - i);
+
+    new_item.off = off;
+    new_item.len = end - off;
+    g_array_insert_val (rs->a_items, i, new_item);
+}
+
+static void range_set_merge_cb (off_t off, off_t len, gpointer ctx)
+{
+    range_set_add ((RangeSet *) ctx, off, len);
+}
+
+void range_set_merge (RangeSet *rs, RangeSet *other)
+{
+    range_set_foreach (other, range_set_merge_cb, rs);
+}
+
+void range_set_remove (RangeSet *rs, off_t off, off_t len)
+{
+    off_t end;
+    guint i;
+
+    if (len <= 0)
+        return;
+
+    end = off + len;
+    i = range_set_find (rs, off);
+
+    while (i < rs->a_items->len) {
+        RangeSetItem *item = RANGE_ITEM (rs, i);
+        off_t item_end = item->off + item->len;
+
+        if (item->off >= end)
+            break;
+
+        // does not intersect, only touches
+        if (item_end <= off) {
+            i++;
+            continue;
+        }
+
+        if (item->off < off && item_end > end) {
+            // split into two ranges
+            RangeSetItem tail;
+
+            tail.off = end;
+            tail.len = item_end - end;
+            item->len = off - item->off;
+            g_array_insert_val (rs->a_items, i + 1, tail);
+            break;
+        } else if (item->off < off) {
+            // cut the tail
+            item->len = off - item->off;
+            i++;
+        } else if (item_end > end) {
+            // cut the head
+            item->off = end;
+            item->len = item_end - end;
+            break;
+        } else {
+            g_array_remove_index (rs->a_items, i);
+        }
+    }
+}
+
+gboolean range_set_contains (RangeSet *rs, off_t off, off_t len)
+{
+    RangeSetItem *item;
+    guint i;
+
+    if (len <= 0)
+        return TRUE;
+
+    i = range_set_find (rs, off);
+    if (i >= rs->a_items->len)
+        return FALSE;
+
+    item = RANGE_ITEM (rs, i);
+
+    return item->off <= off && item->off + item->len >= off + len;
+}
+
+gboolean range_set_get_first (RangeSet *rs, off_t *off, off_t *len)
+{
+    if (!rs->a_items->len)
+        return FALSE;
+
+    *off = RANGE_ITEM (rs, 0)->off;
+    *len = RANGE_ITEM (rs, 0)->len;
+
+    return TRUE;
+}
+
+guint range_set_get_count (RangeSet *rs)
+{
+    return rs->a_items->len;
+}
+
+off_t range_set_get_total (RangeSet *rs)
+{
+    off_t total = 0;
+    guint i;
+
+    for (i = 0; i < rs->a_items->len; i++)
+        total += RANGE_ITEM (rs, i)->len;
+
+    return total;
+}
+
+void range_set_foreach (RangeSet *rs, RangeSet_foreach_cb cb, gpointer ctx)
+{
+    guint i;
+
+    for (i = 0; i < rs->a_items->len; i++) {
+        RangeSetItem *item = RANGE_ITEM (rs, i);
+        cb (item->off, item->len, ctx);
+    }
+}
+
+void range_set_foreach_missing (RangeSet *rs, off_t off, off_t len, RangeSet_foreach_cb cb, gpointer ctx)
+{
+    off_t end = off + len;
+    guint i;
+
+    for (i = range_set_find (rs, off); i < rs->a_items->len && off < end; i++) {
+        RangeSetItem *item = RANGE_ITEM (rs, i);
+
+        if (item->off >= end)
+            break;
+        if (item->off > off)
+            cb (off, item->off - off, ctx);
+        off = MAX (off, item->off + item->len);
+    }
+
+    if (off < end)
+        cb (off, end - off, ctx);
+}
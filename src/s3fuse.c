@@ -40,6 +40,8 @@ struct _S3Fuse {
 #define FUSE_LOG "fuse"
 
 static void s3fuse_on_read (evutil_socket_t fd, short what, void *arg);
+static void s3fuse_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void s3fuse_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 static void s3fuse_readdir (fuse_req_t req, fuse_ino_t ino, 
     size_t size, off_t off, struct fuse_file_info *fi);
 static void s3fuse_lookup (fuse_req_t req, fuse_ino_t parent_ino, const char *name);
@@ -47,6 +49,8 @@ static void s3fuse_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
 static void s3fuse_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
 static void s3fuse_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 static void s3fuse_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void s3fuse_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void s3fuse_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
 static void s3fuse_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
 static void s3fuse_write (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
 static void s3fuse_create (fuse_req_t req, fuse_ino_t parent_ino, const char *name, mode_t mode, struct fuse_file_info *fi);
@@ -54,15 +58,20 @@ static void s3fuse_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup
 static void s3fuse_unlink (fuse_req_t req, fuse_ino_t parent_ino, const char *name);
 static void s3fuse_mkdir (fuse_req_t req, fuse_ino_t parent_ino, const char *name, mode_t mode);
 static void s3fuse_rmdir (fuse_req_t req, fuse_ino_t parent_ino, const char *name);
+static void s3fuse_rename (fuse_req_t req, fuse_ino_t parent_ino, const char *name, fuse_ino_t new_parent_ino, const char *new_name);
 static void s3fuse_on_timer (evutil_socket_t fd, short what, void *arg);
 
 static struct fuse_lowlevel_ops s3fuse_opers = {
+	.opendir	= s3fuse_opendir,
+	.releasedir	= s3fuse_releasedir,
 	.readdir	= s3fuse_readdir,
 	.lookup		= s3fuse_lookup,
     .getattr	= s3fuse_getattr,
     .setattr	= s3fuse_setattr,
 	.open		= s3fuse_open,
 	.release	= s3fuse_release,
+	.flush		= s3fuse_flush,
+	.fsync		= s3fuse_fsync,
 	.read		= s3fuse_read,
 	.write		= s3fuse_write,
 	.create		= s3fuse_create,
@@ -70,6 +79,7 @@ static struct fuse_lowlevel_ops s3fuse_opers = {
     .unlink     = s3fuse_unlink,
     .mkdir      = s3fuse_mkdir,
     .rmdir      = s3fuse_rmdir,
+    .rename     = s3fuse_rename,
 };
 /*}}}*/
 
@@ -219,42 +229,37 @@ static void s3fuse_on_read (evutil_socket_t fd, short what, void *arg)
 
 /*{{{ readdir operation */
 
-#define min(x, y) ((x) < (y) ? (x) : (y))
-
-// return newly allocated buffer which holds directory entry
-void s3fuse_add_dirbuf (fuse_req_t req, struct dirbuf *b, const char *name, fuse_ino_t ino)
+// add directory entry to the buffer, return FALSE if there is no space left
+gboolean s3fuse_add_dirbuf (fuse_req_t req, struct dirbuf *b, const char *name, fuse_ino_t ino, off_t next_off)
 {
     struct stat stbuf;
-    size_t oldsize = b->size;
+    size_t entry_size;
     
     LOG_debug (FUSE_LOG, "add_dirbuf  ino: %d, name: %s", ino, name);
 
-    // get required buff size
-	b->size += fuse_add_direntry (req, NULL, 0, name, NULL, 0);
-
-    // extend buffer
-	b->p = (char *) g_realloc (b->p, b->size);
 	memset (&stbuf, 0, sizeof (stbuf));
 	stbuf.st_ino = ino;
-    // add entry
-	fuse_add_direntry (req, b->p + oldsize, b->size - oldsize, name, &stbuf, b->size);
+    // add entry, nothing is written if it doesn't fit
+	entry_size = fuse_add_direntry (req, b->p + b->size, b->max_size - b->size, name, &stbuf, next_off);
+    if (entry_size > b->max_size - b->size)
+        return FALSE;
+
+    b->size += entry_size;
+    return TRUE;
 }
 
 // readdir callback
 // Valid replies: fuse_reply_buf() fuse_reply_err()
-static void s3fuse_readdir_cb (fuse_req_t req, gboolean success, size_t max_size, off_t off, const char *buf, size_t buf_size)
+static void s3fuse_readdir_cb (fuse_req_t req, gboolean success, const char *buf, size_t buf_size)
 {
-    LOG_debug (FUSE_LOG, "readdir_cb  success: %s, buf_size: %zd, size: %zd, off: %"OFF_FMT, success?"YES":"NO", buf_size, max_size, off);
+    LOG_debug (FUSE_LOG, "readdir_cb  success: %s, buf_size: %zd", success?"YES":"NO", buf_size);
 
     if (!success) {
 		fuse_reply_err (req, ENOTDIR);
         return;
     }
 
-	if (off < buf_size)
-		fuse_reply_buf (req, buf + off, min (buf_size - off, max_size));
-	else
-	    fuse_reply_buf (req, NULL, 0);
+	fuse_reply_buf (req, buf_size ? buf : NULL, buf_size);
 }
 
 // FUSE lowlevel operation: readdir
@@ -266,7 +271,36 @@ static void s3fuse_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t o
     LOG_debug (FUSE_LOG, "readdir  inode: %"INO_FMT", size: %zd, off: %"OFF_FMT, ino, size, off);
     
     // fill directory buffer for "ino" directory
-    dir_tree_fill_dir_buf (s3fuse->dir_tree, ino, size, off, s3fuse_readdir_cb, req);
+    dir_tree_fill_dir_buf (s3fuse->dir_tree, ino, size, off, fi, s3fuse_readdir_cb, req);
+}
+
+// FUSE lowlevel operation: opendir
+// Valid replies: fuse_reply_open() fuse_reply_err()
+static void s3fuse_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    S3Fuse *s3fuse = fuse_req_userdata (req);
+
+    LOG_debug (FUSE_LOG, "opendir  inode: %"INO_FMT, ino);
+
+    if (!dir_tree_opendir (s3fuse->dir_tree, ino, fi)) {
+        fuse_reply_err (req, ENOTDIR);
+        return;
+    }
+
+    fuse_reply_open (req, fi);
+}
+
+// FUSE lowlevel operation: releasedir
+// Valid replies: fuse_reply_err()
+static void s3fuse_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    S3Fuse *s3fuse = fuse_req_userdata (req);
+
+    LOG_debug (FUSE_LOG, "releasedir  inode: %"INO_FMT, ino);
+
+    dir_tree_releasedir (s3fuse->dir_tree, ino, fi);
+
+    fuse_reply_err (req, 0);
 }
 /*}}}*/
 
@@ -339,13 +373,31 @@ static void s3fuse_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, i
 /*{{{ lookup operation*/
 
 // lookup callback
-static void s3fuse_lookup_cb (fuse_req_t req, gboolean success, fuse_ino_t ino, int mode, off_t file_size, time_t ctime)
+static void s3fuse_lookup_cb (fuse_req_t req, int err, fuse_ino_t ino, int mode, off_t file_size, time_t ctime)
 {
 	struct fuse_entry_param e;
 
-    LOG_debug (FUSE_LOG, "lookup_cb  success: %s", success?"YES":"NO");
-    if (!success) {
-		fuse_reply_err (req, ENOENT);
+    LOG_debug (FUSE_LOG, "lookup_cb  err: %d", err);
+    if (err == ENOENT) {
+        S3Fuse *s3fuse = fuse_req_userdata (req);
+        gint ttl = application_get_conf (s3fuse->app)->negative_cache_time;
+
+        if (ttl <= 0) {
+		    fuse_reply_err (req, ENOENT);
+            return;
+        }
+
+        // negative entry, the kernel doesn't ask for the name until it expires
+        memset(&e, 0, sizeof(e));
+        e.ino = 0;
+        e.entry_timeout = ttl;
+        fuse_reply_entry (req, &e);
+        return;
+    }
+
+    // errors are not cached
+    if (err) {
+        fuse_reply_err (req, err);
         return;
     }
 
@@ -438,6 +490,19 @@ static void s3fuse_create (fuse_req_t req, fuse_ino_t parent_ino, const char *na
 
 /*{{{ release operation */
 
+// release, flush and fsync callback
+static void s3fuse_file_sync_cb (fuse_req_t req, gboolean success)
+{
+    LOG_debug (FUSE_LOG, "file_sync_cb  success: %s", success?"YES":"NO");
+
+    if (!success) {
+        fuse_reply_err (req, EIO);
+        return;
+    }
+
+    fuse_reply_err (req, 0);
+}
+
 // FUSE lowlevel operation: release
 // Valid replies: fuse_reply_err()
 static void s3fuse_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
@@ -446,9 +511,29 @@ static void s3fuse_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
 
     LOG_debug (FUSE_LOG, "release  inode: %d, flags: %d", ino, fi->flags);
 
-    dir_tree_file_release (s3fuse->dir_tree, ino, fi);
+    dir_tree_file_release (s3fuse->dir_tree, ino, fi, s3fuse_file_sync_cb, req);
+}
 
-    fuse_reply_err (req, 0);
+// FUSE lowlevel operation: flush
+// Valid replies: fuse_reply_err()
+static void s3fuse_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    S3Fuse *s3fuse = fuse_req_userdata (req);
+
+    LOG_debug (FUSE_LOG, "flush  inode: %"INO_FMT, ino);
+
+    dir_tree_file_flush (s3fuse->dir_tree, ino, fi, s3fuse_file_sync_cb, req);
+}
+
+// FUSE lowlevel operation: fsync
+// Valid replies: fuse_reply_err()
+static void s3fuse_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    S3Fuse *s3fuse = fuse_req_userdata (req);
+
+    LOG_debug (FUSE_LOG, "fsync  inode: %"INO_FMT", datasync: %d", ino, datasync);
+
+    dir_tree_file_fsync (s3fuse->dir_tree, ino, fi, s3fuse_file_sync_cb, req);
 }
 /*}}}*/
 
@@ -507,39 +592,41 @@ static void s3fuse_write (fuse_req_t req, fuse_ino_t ino, const char *buf, size_
 
 /*{{{ forget operation*/
 
-// forget callback
-static void s3fuse_forget_cb (fuse_req_t req, gboolean success)
-{
-    if (success)
-        fuse_reply_none (req);
-    else
-        fuse_reply_none (req);
-}
-
 // Forget about an inode
 // Valid replies: fuse_reply_none
-// XXX: it removes files and directories
+// entries are kept in DirTree, objects are removed by unlink and rmdir
 static void s3fuse_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
     S3Fuse *s3fuse = fuse_req_userdata (req);
-    
+
     LOG_debug (FUSE_LOG, "forget  inode: %"INO_FMT", nlookup: %lu", ino, nlookup);
 
-    dir_tree_file_remove (s3fuse->dir_tree, ino, s3fuse_forget_cb, req);
+    // inode number can be reused after the kernel forgets it
+    dir_tree_forget (s3fuse->dir_tree, ino, nlookup);
+
+    fuse_reply_none (req);
 }
 /*}}}*/
 
 /*{{{ unlink operation*/
+
+// unlink and rmdir callback
+static void s3fuse_remove_cb (fuse_req_t req, int err)
+{
+    LOG_debug (FUSE_LOG, "remove_cb  err: %d", err);
+
+    fuse_reply_err (req, err);
+}
+
 // Remove a file
 // Valid replies: fuse_reply_err
-// XXX: not used, see s3fuse_forget
-static void s3fuse_unlink (fuse_req_t req, fuse_ino_t parent, const char *name)
+static void s3fuse_unlink (fuse_req_t req, fuse_ino_t parent_ino, const char *name)
 {
-    LOG_debug (FUSE_LOG, "unlink  parent_ino: %"INO_FMT", name: %s", parent, name);
+    S3Fuse *s3fuse = fuse_req_userdata (req);
 
-    // XXX:
+    LOG_debug (FUSE_LOG, "unlink  parent_ino: %"INO_FMT", name: %s", parent_ino, name);
 
-    fuse_reply_err (req, 0);
+    dir_tree_file_unlink (s3fuse->dir_tree, parent_ino, name, s3fuse_remove_cb, req);
 }
 /*}}}*/
 
@@ -585,14 +672,47 @@ static void s3fuse_mkdir (fuse_req_t req, fuse_ino_t parent_ino, const char *nam
 }
 /*}}}*/
 
+/*{{{ rmdir operation*/
+
+// rmdir callback
+static void s3fuse_rmdir_cb (fuse_req_t req, int err)
+{
+    LOG_debug (FUSE_LOG, "rmdir_cb  err: %d", err);
+
+    fuse_reply_err (req, err);
+}
+
 // Remove a directory
 // Valid replies: fuse_reply_err
-// XXX: not used, see s3fuse_forget
 static void s3fuse_rmdir (fuse_req_t req, fuse_ino_t parent_ino, const char *name)
 {
     S3Fuse *s3fuse = fuse_req_userdata (req);
     
     LOG_debug (FUSE_LOG, "rmdir  parent_ino: %"INO_FMT", name: %s", parent_ino, name);
 
-    fuse_reply_err (req, 0);
+    dir_tree_dir_remove (s3fuse->dir_tree, parent_ino, name, s3fuse_rmdir_cb, req);
 }
+/*}}}*/
+
+/*{{{ rename operation */
+
+// rename callback
+static void s3fuse_rename_cb (fuse_req_t req, int err)
+{
+    LOG_debug (FUSE_LOG, "rename_cb  err: %d", err);
+
+    fuse_reply_err (req, err);
+}
+
+// Rename a file or directory
+// Valid replies: fuse_reply_err
+static void s3fuse_rename (fuse_req_t req, fuse_ino_t parent_ino, const char *name, fuse_ino_t new_parent_ino, const char *new_name)
+{
+    S3Fuse *s3fuse = fuse_req_userdata (req);
+
+    LOG_debug (FUSE_LOG, "rename  parent_ino: %"INO_FMT", name: %s, new_parent_ino: %"INO_FMT", new_name: %s", 
+        parent_ino, name, new_parent_ino, new_name);
+
+    dir_tree_rename (s3fuse->dir_tree, parent_ino, name, new_parent_ino, new_name, s3fuse_rename_cb, req);
+}
+/*}}}*/
@@ -21,7 +21,13 @@
 
 #define CON_LOG "con"
 
+typedef struct {
+    gchar *key;
+    gchar *value;
+} S3HttpConnectionHeader;
+
 static void s3http_connection_on_close (struct evhttp_connection *evcon, void *ctx);
+static void s3http_connection_free_headers (GList *l_headers);
 
 /*}}}*/
 
@@ -84,6 +90,7 @@ void s3http_connection_destroy (gpointer data)
     S3HttpConnection *con = (S3HttpConnection *) data;
 
     evhttp_connection_free (con->evcon);
+    s3http_connection_free_headers (con->l_output_headers);
     g_free (con->bucket_name);
     g_free (con);
 }
@@ -145,8 +152,10 @@ struct evhttp_connection *s3http_connection_get_evcon (S3HttpConnection *con)
 /*{{{ get_auth_string */
 // create S3 auth string
 // http://docs.amazonwebservices.com/AmazonS3/2006-03-01/dev/RESTAuthentication.html
+// amz_headers must be already canonicalized: sorted, lowercase names, each ends with '\n'
 gchar *s3http_connection_get_auth_string (Application *app, 
-        const gchar *method, const gchar *content_type, const gchar *resource, const gchar *time_str)
+        const gchar *method, const gchar *content_md5, const gchar *content_type, 
+        const gchar *amz_headers, const gchar *resource, const gchar *time_str)
 {
     gchar *string_to_sign;
     unsigned int md_len;
@@ -167,7 +176,7 @@ gchar *s3http_connection_get_auth_string (Application *app,
         "%s"    // CanonicalizedAmzHeaders
         "%s",    // CanonicalizedResource
 
-        method, "", content_type, time_str, "", tmp
+        method, content_md5, content_type, time_str, amz_headers, tmp
     );
 
     g_free (tmp);
@@ -232,9 +241,84 @@ struct evhttp_request *s3http_connection_create_request (S3HttpConnection *con,
 }
 
 
+/*{{{ output headers */
+static void s3http_connection_free_headers (GList *l_headers)
+{
+    GList *l;
+
+    for (l = g_list_first (l_headers); l; l = g_list_next (l)) {
+        S3HttpConnectionHeader *header = (S3HttpConnectionHeader *) l->data;
+        g_free (header->key);
+        g_free (header->value);
+        g_free (header);
+    }
+
+    g_list_free (l_headers);
+}
+
+void s3http_connection_add_output_header (S3HttpConnection *con, const gchar *key, const gchar *value)
+{
+    S3HttpConnectionHeader *header;
+
+    header = g_new0 (S3HttpConnectionHeader, 1);
+    header->key = g_strdup (key);
+    header->value = g_strdup (value);
+
+    con->l_output_headers = g_list_append (con->l_output_headers, header);
+}
+
+static gint s3http_connection_header_cmp (gconstpointer a, gconstpointer b)
+{
+    const S3HttpConnectionHeader *ha = (const S3HttpConnectionHeader *) a;
+    const S3HttpConnectionHeader *hb = (const S3HttpConnectionHeader *) b;
+
+    return g_ascii_strcasecmp (ha->key, hb->key);
+}
+
+// return CanonicalizedAmzHeaders string of the pending headers
+static gchar *s3http_connection_get_amz_headers (S3HttpConnection *con)
+{
+    GString *str;
+    GList *l, *l_sorted;
+
+    str = g_string_new ("");
+    l_sorted = g_list_sort (g_list_copy (con->l_output_headers), s3http_connection_header_cmp);
+
+    for (l = g_list_first (l_sorted); l; l = g_list_next (l)) {
+        S3HttpConnectionHeader *header = (S3HttpConnectionHeader *) l->data;
+        gchar *key;
+
+        if (g_ascii_strncasecmp (header->key, "x-amz-", 6))
+            continue;
+
+        key = g_ascii_strdown (header->key, -1);
+        g_string_append_printf (str, "%s:%s\n", key, header->value);
+        g_free (key);
+    }
+    g_list_free (l_sorted);
+
+    return g_string_free (str, FALSE);
+}
+
+// return the value of pending header, or empty string
+static const gchar *s3http_connection_get_output_header (S3HttpConnection *con, const gchar *key)
+{
+    GList *l;
+
+    for (l = g_list_first (con->l_output_headers); l; l = g_list_next (l)) {
+        S3HttpConnectionHeader *header = (S3HttpConnectionHeader *) l->data;
+        if (!g_ascii_strcasecmp (header->key, key))
+            return header->value;
+    }
+
+    return "";
+}
+/*}}}*/
+
 typedef struct {
     S3HttpConnection *con;
     S3HttpConnection_responce_cb responce_cb;
+    S3HttpConnection_chunk_cb chunk_cb;
     S3HttpConnection_error_cb error_cb;
     gpointer ctx;
 } RequestData;
@@ -248,6 +332,8 @@ static void s3http_connection_on_responce_cb (struct evhttp_request *req, void *
 
     LOG_debug (CON_LOG, "Got HTTP response from server !");
 
+    data->con->response_code = req ? evhttp_request_get_response_code (req) : 0;
+
     if (!req) {
         LOG_err (CON_LOG, "Request failed !");
         if (data->error_cb)
@@ -256,9 +342,9 @@ static void s3http_connection_on_responce_cb (struct evhttp_request *req, void *
     }
 
     // XXX: handle redirect
-    // 200 and 204 (No Content) are ok
+    // 200, 204 (No Content) and 206 (Partial Content) are ok
     if (evhttp_request_get_response_code (req) != 200 && evhttp_request_get_response_code (req) != 204
-        && evhttp_request_get_response_code (req) != 307) {
+        && evhttp_request_get_response_code (req) != 206 && evhttp_request_get_response_code (req) != 307) {
         LOG_err (CON_LOG, "Server returned HTTP error: %d !", evhttp_request_get_response_code (req));
         LOG_debug (CON_LOG, "Error str: %s", req->response_code_line);
         if (data->error_cb)
@@ -279,6 +365,28 @@ done:
     g_free (data);
 }
 
+// libevent drains the input buffer after this call
+static void s3http_connection_on_chunk_cb (struct evhttp_request *req, void *ctx)
+{
+    RequestData *data = (RequestData *) ctx;
+    struct evbuffer *inbuf;
+    size_t buf_len;
+
+    // error responces are reported by s3http_connection_on_responce_cb ()
+    if (evhttp_request_get_response_code (req) != 200)
+        return;
+
+    inbuf = evhttp_request_get_input_buffer (req);
+    buf_len = evbuffer_get_length (inbuf);
+    if (buf_len)
+        data->chunk_cb (data->con, data->ctx, (const gchar *) evbuffer_pullup (inbuf, buf_len), buf_len);
+}
+
+void s3http_connection_set_chunk_cb (S3HttpConnection *con, S3HttpConnection_chunk_cb chunk_cb)
+{
+    con->chunk_cb = chunk_cb;
+}
+
 gboolean s3http_connection_make_request (S3HttpConnection *con, 
     const gchar *resource_path, const gchar *request_str,
     const gchar *http_cmd,
@@ -296,12 +404,18 @@ gboolean s3http_connection_make_request (S3HttpConnection *con,
     int res;
     enum evhttp_cmd_type cmd_type;
     AppConf *conf;
+    gchar *amz_headers;
+    GList *l;
 
     data = g_new0 (RequestData, 1);
     data->responce_cb = responce_cb;
     data->error_cb = error_cb;
     data->ctx = ctx;
     data->con = con;
+    // chunk callback is used only once
+    data->chunk_cb = con->chunk_cb;
+    con->chunk_cb = NULL;
+    con->response_code = 0;
     
     if (!strcasecmp (http_cmd, "GET")) {
         cmd_type = EVHTTP_REQ_GET;
@@ -311,27 +425,49 @@ gboolean s3http_connection_make_request (S3HttpConnection *con,
         cmd_type = EVHTTP_REQ_DELETE;
     } else if (!strcasecmp (http_cmd, "HEAD")) {
         cmd_type = EVHTTP_REQ_HEAD;
+    } else if (!strcasecmp (http_cmd, "POST")) {
+        cmd_type = EVHTTP_REQ_POST;
     } else {
         LOG_err (CON_LOG, "Unsupported HTTP method: %s", http_cmd);
+        s3http_connection_free_headers (con->l_output_headers);
+        con->l_output_headers = NULL;
         return FALSE;
     }
     
     t = time (NULL);
     strftime (time_str, sizeof (time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
-    auth_str = s3http_connection_get_auth_string (con->app, http_cmd, "", resource_path, time_str);
+    amz_headers = s3http_connection_get_amz_headers (con);
+    auth_str = s3http_connection_get_auth_string (con->app, http_cmd, 
+        s3http_connection_get_output_header (con, "Content-MD5"), 
+        s3http_connection_get_output_header (con, "Content-Type"), 
+        amz_headers, resource_path, time_str);
     snprintf (auth_key, sizeof (auth_key), "AWS %s:%s", application_get_access_key_id (con->app), auth_str);
     g_free (auth_str);
+    g_free (amz_headers);
 
     req = evhttp_request_new (s3http_connection_on_responce_cb, data);
     if (!req) {
         LOG_err (CON_LOG, "Failed to create HTTP request object !");
+        s3http_connection_free_headers (con->l_output_headers);
+        con->l_output_headers = NULL;
         return FALSE;
     }
 
+    if (data->chunk_cb)
+        evhttp_request_set_chunked_cb (req, s3http_connection_on_chunk_cb);
+
     evhttp_add_header (req->output_headers, "Authorization", auth_key);
     evhttp_add_header (req->output_headers, "Host", application_get_host_header (con->app));
 	evhttp_add_header (req->output_headers, "Date", time_str);
 
+    // headers are used only once
+    for (l = g_list_first (con->l_output_headers); l; l = g_list_next (l)) {
+        S3HttpConnectionHeader *header = (S3HttpConnectionHeader *) l->data;
+        evhttp_add_header (req->output_headers, header->key, header->value);
+    }
+    s3http_connection_free_headers (con->l_output_headers);
+    con->l_output_headers = NULL;
+
     if (out_buffer) {
         evbuffer_add_buffer (req->output_buffer, out_buffer);
     }
@@ -350,3 +486,58 @@ gboolean s3http_connection_make_request (S3HttpConnection *con,
     else
         return TRUE;
 }    
+
+/*{{{ listing pages */
+// ListObjectsV2 continues the truncated page by the token, the original listing starts after the marker
+gchar *s3http_connection_get_list_request_str (S3HttpConnection *con, const gchar *prefix, gboolean use_delimiter,
+    const gchar *marker, const gchar *token, gint max_keys)
+{
+    AppConf *conf = application_get_conf (con->app);
+    GString *str;
+    gchar *tmp;
+
+    str = g_string_new ("/?");
+    if (conf->list_objects_v2)
+        g_string_append (str, "list-type=2&fetch-owner=false&");
+
+    tmp = g_uri_escape_string (prefix, "/", FALSE);
+    g_string_append_printf (str, "prefix=%s&max-keys=%d", tmp, MAX (max_keys ? max_keys : conf->list_max_keys, 1));
+    g_free (tmp);
+
+    if (use_delimiter)
+        g_string_append (str, "&delimiter=/");
+
+    if (conf->list_objects_v2 && token) {
+        tmp = g_uri_escape_string (token, NULL, FALSE);
+        g_string_append_printf (str, "&continuation-token=%s", tmp);
+        g_free (tmp);
+    } else if (marker) {
+        tmp = g_uri_escape_string (marker, NULL, FALSE);
+        g_string_append_printf (str, conf->list_objects_v2 ? "&start-after=%s" : "&marker=%s", tmp);
+        g_free (tmp);
+    }
+
+    return g_string_free (str, FALSE);
+}
+
+gboolean s3http_connection_list_next_page (S3HttpConnection *con, ListParser *parser, gchar **marker, gchar **token)
+{
+    AppConf *conf = application_get_conf (con->app);
+    const gchar *next_marker = list_parser_get_next_marker (parser);
+    const gchar *next_token = list_parser_get_continuation_token (parser);
+
+    // the last key of the page is kept with the token, it's the progress of the listing
+    if (!next_marker || (conf->list_objects_v2 && !next_token)) {
+        LOG_err (CON_LOG, "Truncated listing page doesn't have the position of the next page%s !", 
+            conf->list_objects_v2 ? ", set list_objects_v2 = false if ListObjectsV2 isn't supported" : "");
+        return FALSE;
+    }
+
+    g_free (*marker);
+    *marker = g_strdup (next_marker);
+    g_free (*token);
+    *token = g_strdup (next_token);
+
+    return TRUE;
+}
+/*}}}*/
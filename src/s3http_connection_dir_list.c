@@ -17,249 +17,484 @@
  */
 #include "s3http_connection.h"
 #include "dir_tree.h"
+#include "list_parser.h"
 
+typedef struct _DirListRequest DirListRequest;
+
+// a range of the key space, which is listed by its own connection: keys after the marker up to hi
 typedef struct {
+    DirListRequest *dir_req;
+    S3HttpConnection *con;
+    gchar *marker; // the last listed key, NULL if nothing is listed yet
+    gchar *token; // continuation token of ListObjectsV2 page, NULL for the range which starts after the marker
+    gchar *hi; // the last key of the range, NULL for the end of the key space
+    gchar *first_key; // the first listed key, to guess the key space of the range
+    ListParser *parser; // parser of the current page
+    gboolean is_after; // keys after the range are found
+    gboolean is_done;
+} DirListPart;
+
+struct _DirListRequest {
     Application *app;
     DirTree *dir_tree;
-    S3HttpConnection *con;
     gchar *resource_path;
     gchar *dir_path;
     gchar *dir_path_orig; // save ptr
     fuse_ino_t ino;
-    gint max_keys;
+    guint32 generation; // generation of the directory started by this listing
+    gint max_parts; // max number of ranges listed concurrently
+    GList *l_parts; // DirListPart, sorted by key ranges
+    gint parts_active; // ranges which are not done yet
+    gboolean failed;
+    gchar *progress; // keys up to this one are listed
     S3HttpConnection_directory_listing_callback directory_listing_callback;
     gpointer callback_data;
-} DirListRequest;
+};
 
 #define CON_DIR_LOG "con_dir"
 
-// parses S3 directory XML 
-// returns TRUE if ok
-static gboolean parse_dir_xml (DirListRequest *dir_list, const char *xml, size_t xml_len)
+// the number of characters after the common prefix, which are used to compute split points
+#define DIR_LIST_SPLIT_DIGITS 4
+
+static void dir_list_part_request (DirListPart *part);
+
+// returns TRUE if the key is out of the range of the partition
+static gboolean dir_list_part_is_after (DirListPart *part, const gchar *key)
 {
-    xmlDocPtr doc;
-    xmlXPathContextPtr ctx;
-    xmlXPathObjectPtr contents_xp;
-    xmlNodeSetPtr content_nodes;
-    xmlXPathObjectPtr subdirs_xp;
-    xmlNodeSetPtr subdir_nodes;
-    int i;
-    xmlXPathObjectPtr key;
-    xmlNodeSetPtr key_nodes;
-    gchar *name = NULL;
-    gchar *size;
-
-    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
-    if (doc == NULL)
-        return FALSE;
-
-    ctx = xmlXPathNewContext (doc);
-    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
-
-    // files
-    contents_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:Contents", ctx);
-    content_nodes = contents_xp->nodesetval;
-    for(i = 0; i < content_nodes->nodeNr; i++) {
-        char *bname;
-        ctx->node = content_nodes->nodeTab[i];
-
-        // object name
-        key = xmlXPathEvalExpression ((xmlChar *) "s3:Key", ctx);
-        key_nodes = key->nodesetval;
-        name = (gchar *)xmlNodeListGetString (doc, key_nodes->nodeTab[0]->xmlChildrenNode, 1);
-        xmlXPathFreeObject (key);
-        
-        key = xmlXPathEvalExpression ((xmlChar *) "s3:Size", ctx);
-        key_nodes = key->nodesetval;
-        size = (gchar *)xmlNodeListGetString (doc, key_nodes->nodeTab[0]->xmlChildrenNode, 1);
-        xmlXPathFreeObject (key);
-        
-        if (!strcmp (name, dir_list->dir_path)) {
-            xmlFree (size);
-            xmlFree (name);
-            continue;
-        }
+    return part->hi && strcmp (key, part->hi) > 0;
+}
 
-        bname = strstr (name, dir_list->dir_path);
-        bname = bname + strlen (dir_list->dir_path);
-        dir_tree_update_entry (dir_list->dir_tree, dir_list->dir_path, DET_file, dir_list->ino, bname, atoll (size));
-        
-        xmlFree (size);
-        xmlFree (name);
+// remember the first key of the range
+static void dir_list_part_set_first_key (DirListPart *part, const gchar *key)
+{
+    if (!part->first_key || strcmp (key, part->first_key) < 0) {
+        g_free (part->first_key);
+        part->first_key = g_strdup (key);
     }
+}
 
-    xmlXPathFreeObject (contents_xp);
+// an object or a common prefix of the page
+static void dir_list_part_on_entry (gpointer ctx, const gchar *key, gboolean is_prefix, guint64 size, const gchar *etag)
+{
+    DirListPart *part = (DirListPart *) ctx;
+    DirListRequest *dir_list = part->dir_req;
+    const gchar *bname;
 
-    // directories
-    subdirs_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:CommonPrefixes", ctx);
-    subdir_nodes = subdirs_xp->nodesetval;
-    for(i = 0; i < subdir_nodes->nodeNr; i++) {
-        char *bname;
+    // listed by the next partition
+    if (dir_list_part_is_after (part, key)) {
+        part->is_after = TRUE;
+        return;
+    }
 
-        ctx->node = subdir_nodes->nodeTab[i];
+    if (!g_str_has_prefix (key, dir_list->dir_path) || !strcmp (key, dir_list->dir_path))
+        return;
 
-        // object name
-        key = xmlXPathEvalExpression((xmlChar *) "s3:Prefix", ctx);
-        key_nodes = key->nodesetval;
-        name = (gchar *)xmlNodeListGetString (doc, key_nodes->nodeTab[0]->xmlChildrenNode, 1);
-        xmlXPathFreeObject(key);
+    dir_list_part_set_first_key (part, key);
 
-        bname = strstr (name, dir_list->dir_path);
-        bname = bname + strlen (dir_list->dir_path);
-    
-        //XXX: remove trailing '/' characters
-        if (bname[strlen (bname) - 1] == '/')
-            bname[strlen (bname) - 1] = '\0';
-        
-        dir_tree_update_entry (dir_list->dir_tree, dir_list->dir_path, DET_dir, dir_list->ino, bname, 0);
+    bname = key + strlen (dir_list->dir_path);
 
-        xmlFree (name);
+    if (is_prefix) {
+        gchar *dname;
+        size_t len = strlen (bname);
+
+        // remove trailing '/' character
+        if (len && bname[len - 1] == '/')
+            len--;
+        dname = g_strndup (bname, len);
+        dir_tree_update_entry (dir_list->dir_tree, dir_list->dir_path, DET_dir, dir_list->ino, dir_list->generation, dname, 0, NULL);
+        g_free (dname);
+    } else {
+        dir_tree_update_entry (dir_list->dir_tree, dir_list->dir_path, DET_file, dir_list->ino, dir_list->generation, bname, size, etag);
     }
+}
 
-    xmlXPathFreeObject (subdirs_xp);
+/*{{{ key space partitions */
 
-    xmlXPathFreeContext (ctx);
-    xmlFreeDoc (doc);
+// characters of keys which are used to compute split points
+typedef struct {
+    size_t prefix_len; // common prefix of the range
+    guchar c_min;
+    guchar c_max;
+} DirListKeySpace;
 
-    return TRUE;
+// extend the set of characters with the characters of the key after the common prefix
+static void dir_list_key_space_add (DirListKeySpace *ks, const gchar *key)
+{
+    size_t len = strlen (key);
+    size_t i;
+
+    for (i = ks->prefix_len; i < len && i < ks->prefix_len + DIR_LIST_SPLIT_DIGITS; i++) {
+        ks->c_min = MIN (ks->c_min, (guchar) key[i]);
+        ks->c_max = MAX (ks->c_max, (guchar) key[i]);
+    }
+}
+
+// return the value of the key digits after the common prefix
+static guint64 dir_list_key_value (DirListKeySpace *ks, const gchar *key)
+{
+    guint64 val = 0;
+    size_t len = strlen (key);
+    gint i;
+
+    for (i = 0; i < DIR_LIST_SPLIT_DIGITS; i++) {
+        guchar c = ks->prefix_len + i < len ? (guchar) key[ks->prefix_len + i] : ks->c_min;
+
+        c = CLAMP (c, ks->c_min, ks->c_max);
+        val = val * (ks->c_max - ks->c_min + 1) + (c - ks->c_min);
+    }
+
+    return val;
+}
+
+// return n - 1 keys which split range (lo, hi) into n parts of the same size, if keys use 
+// the same characters as lo, hi and the sample key. Returned keys are sorted, some can be missing
+static GPtrArray *dir_list_get_split_points (const gchar *lo, const gchar *hi, const gchar *sample, gint n)
+{
+    GPtrArray *a_points;
+    DirListKeySpace ks;
+    guint64 lo_val, hi_val;
+    guint base;
+    gint i, j;
+
+    a_points = g_ptr_array_new_with_free_func (g_free);
+
+    ks.prefix_len = 0;
+    while (lo[ks.prefix_len] && lo[ks.prefix_len] == hi[ks.prefix_len])
+        ks.prefix_len++;
+
+    ks.c_min = G_MAXUINT8;
+    ks.c_max = 0;
+    dir_list_key_space_add (&ks, lo);
+    dir_list_key_space_add (&ks, hi);
+    if (sample && !strncmp (sample, lo, ks.prefix_len))
+        dir_list_key_space_add (&ks, sample);
+    if (ks.c_min >= ks.c_max)
+        return a_points;
+    base = ks.c_max - ks.c_min + 1;
+
+    lo_val = dir_list_key_value (&ks, lo);
+    hi_val = dir_list_key_value (&ks, hi);
+    if (hi_val <= lo_val)
+        return a_points;
+
+    for (i = 1; i < n; i++) {
+        guint64 val = lo_val + (hi_val - lo_val) * i / n;
+        gchar *point = g_malloc (ks.prefix_len + DIR_LIST_SPLIT_DIGITS + 1);
+
+        memcpy (point, lo, ks.prefix_len);
+        for (j = DIR_LIST_SPLIT_DIGITS - 1; j >= 0; j--) {
+            point[ks.prefix_len + j] = ks.c_min + val % base;
+            val /= base;
+        }
+        point[ks.prefix_len + DIR_LIST_SPLIT_DIGITS] = '\0';
+
+        // keep split points strictly inside the range
+        if (strcmp (point, lo) <= 0 || strcmp (point, hi) >= 0 || 
+            (a_points->len && strcmp (point, g_ptr_array_index (a_points, a_points->len - 1)) <= 0)) {
+            g_free (point);
+            continue;
+        }
+        g_ptr_array_add (a_points, point);
+    }
+
+    return a_points;
 }
 
-static const char *get_next_marker(const char *xml, size_t xml_len) {
-    xmlDocPtr doc;
-    xmlXPathContextPtr ctx;
-    xmlXPathObjectPtr marker_xp;
-    xmlNodeSetPtr nodes;
-    char *next_marker = NULL;
-
-    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
-    ctx = xmlXPathNewContext (doc);
-    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
-    marker_xp = xmlXPathEvalExpression ((xmlChar *) "//s3:NextMarker", ctx);
-    nodes = marker_xp->nodesetval;
-
-    if (!nodes || nodes->nodeNr < 1) {
-        next_marker = NULL;
+// guess the end of the key space for an unbounded range: keys of the range likely share
+// the prefix of the keys listed so far, without their last common character
+static gchar *dir_list_part_guess_hi (DirListPart *part)
+{
+    DirListRequest *dir_req = part->dir_req;
+    size_t prefix_len = 0;
+    size_t dir_len = strlen (dir_req->dir_path);
+    gchar *hi;
+
+    while (part->first_key[prefix_len] && part->first_key[prefix_len] == part->marker[prefix_len])
+        prefix_len++;
+
+    // the whole directory
+    if (prefix_len <= dir_len + 1)
+        return g_strdup_printf ("%s~", dir_req->dir_path);
+
+    hi = g_strndup (part->marker, prefix_len - 1);
+    if ((guchar) hi[prefix_len - 2] < '~') {
+        hi[prefix_len - 2]++;
     } else {
-        next_marker = (char *) xmlNodeListGetString (doc, nodes->nodeTab[0]->xmlChildrenNode, 1);
+        g_free (hi);
+        hi = g_strdup_printf ("%s~", dir_req->dir_path);
     }
 
-    xmlXPathFreeObject (marker_xp);
-    xmlXPathFreeContext (ctx);
-    xmlFreeDoc (doc);
+    return hi;
+}
+
+static void dir_list_part_on_client_ready (gpointer client, gpointer ctx)
+{
+    DirListPart *part = (DirListPart *) ctx;
 
-    return next_marker;
+    part->con = (S3HttpConnection *) client;
+    s3http_connection_acquire (part->con);
+    dir_list_part_request (part);
 }
 
-// error, return error to fuse 
-static void s3http_connection_on_directory_listing_error (S3HttpConnection *con, void *ctx)
+// split the rest of the range, the new ranges are listed with other connections of the pool
+static void dir_list_part_split (DirListPart *part)
 {
-    DirListRequest *dir_req = (DirListRequest *) ctx;
-    
-    LOG_err (CON_DIR_LOG, "Failed to retrieve directory listing !");
+    DirListRequest *dir_req = part->dir_req;
+    GPtrArray *a_points;
+    gchar *hi;
+    gchar *cur_hi;
+    GList *l;
+    gint i;
+
+    if (dir_req->parts_active >= dir_req->max_parts || !part->marker || !part->first_key)
+        return;
+
+    hi = part->hi ? g_strdup (part->hi) : dir_list_part_guess_hi (part);
+    a_points = dir_list_get_split_points (part->marker, hi, part->first_key, dir_req->max_parts - dir_req->parts_active + 1);
+    g_free (hi);
+
+    l = g_list_find (dir_req->l_parts, part);
+    cur_hi = part->hi;
+
+    // the last range keeps the end of the original one
+    for (i = a_points->len - 1; i >= 0; i--) {
+        DirListPart *new_part;
+
+        new_part = g_new0 (DirListPart, 1);
+        new_part->dir_req = dir_req;
+        new_part->marker = g_strdup (g_ptr_array_index (a_points, i));
+        new_part->hi = cur_hi;
+
+        dir_req->parts_active++;
+        if (!s3client_pool_get_client (application_get_ops_client_pool (dir_req->app), dir_list_part_on_client_ready, new_part)) {
+            dir_req->parts_active--;
+            g_free (new_part->marker);
+            g_free (new_part);
+            break;
+        }
+
+        LOG_debug (CON_DIR_LOG, "Listing keys after %s up to %s in parallel", new_part->marker, new_part->hi ? new_part->hi : "the end");
+
+        dir_req->l_parts = g_list_insert_before (dir_req->l_parts, l->next, new_part);
+        cur_hi = g_strdup (new_part->marker);
+    }
+    part->hi = cur_hi;
+
+    g_ptr_array_free (a_points, TRUE);
+}
+
+// report the keys which are listed by all ranges, so their entries can be shown
+static void dir_list_update_progress (DirListRequest *dir_req)
+{
+    const gchar *progress = NULL;
+    GList *l;
+
+    for (l = g_list_first (dir_req->l_parts); l; l = g_list_next (l)) {
+        DirListPart *part = (DirListPart *) l->data;
+
+        if (!part->is_done) {
+            if (part->marker)
+                progress = part->marker;
+            break;
+        }
+        progress = part->hi;
+    }
+
+    if (!progress || (dir_req->progress && strcmp (progress, dir_req->progress) <= 0))
+        return;
+
+    g_free (dir_req->progress);
+    dir_req->progress = g_strdup (progress);
+
+    // entries up to the marker can be shown already
+    if (g_str_has_prefix (progress, dir_req->dir_path))
+        dir_tree_update_progress (dir_req->dir_tree, dir_req->ino, dir_req->generation, progress + strlen (dir_req->dir_path));
+}
+
+// all ranges are done
+static void dir_list_done (DirListRequest *dir_req)
+{
+    GList *l;
+
+    if (!dir_req->failed) {
+        LOG_debug (CON_DIR_LOG, "DONE !!");
+        
+        // we are done, stop updating
+        dir_tree_stop_update (dir_req->dir_tree, dir_req->ino, dir_req->generation);
+    } else {
+        LOG_err (CON_DIR_LOG, "Failed to retrieve directory listing !");
+        // listing is incomplete, entries which are not seen yet are kept
+    }
 
-    // we are done, stop updating
-    dir_tree_stop_update (dir_req->dir_tree, dir_req->ino);
-    
     if (dir_req->directory_listing_callback)
-        dir_req->directory_listing_callback (dir_req->callback_data, FALSE);
+        dir_req->directory_listing_callback (dir_req->callback_data, !dir_req->failed);
+
+    for (l = g_list_first (dir_req->l_parts); l; l = g_list_next (l)) {
+        DirListPart *part = (DirListPart *) l->data;
 
-    // release HTTP client
-    s3http_connection_release (con);
+        g_free (part->marker);
+        g_free (part->token);
+        g_free (part->hi);
+        g_free (part->first_key);
+        g_free (part);
+    }
+    g_list_free (dir_req->l_parts);
     
+    g_free (dir_req->progress);
     g_free (dir_req->dir_path_orig);
     g_free (dir_req->resource_path);
     g_free (dir_req);
 }
 
+// the range is done, release its HTTP client
+static void dir_list_part_done (DirListPart *part, gboolean success)
+{
+    DirListRequest *dir_req = part->dir_req;
+
+    part->is_done = TRUE;
+    if (!success)
+        dir_req->failed = TRUE;
+
+    if (part->con)
+        s3http_connection_release (part->con);
+    part->con = NULL;
+
+    if (part->parser)
+        list_parser_destroy (part->parser);
+    part->parser = NULL;
+
+    dir_req->parts_active--;
+    if (!dir_req->parts_active)
+        dir_list_done (dir_req);
+    else if (success)
+        dir_list_update_progress (dir_req);
+}
+/*}}}*/
+
+// error, return error to fuse 
+static void s3http_connection_on_directory_listing_error (S3HttpConnection *con, void *ctx)
+{
+    DirListPart *part = (DirListPart *) ctx;
+    
+    LOG_err (CON_DIR_LOG, "Failed to retrieve directory listing page !");
+
+    dir_list_part_done (part, FALSE);
+}
+
+// a part of the page body, entries are added as soon as they are parsed
+static void s3http_connection_on_directory_listing_chunk (G_GNUC_UNUSED S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len)
+{
+    DirListPart *part = (DirListPart *) ctx;
+
+    list_parser_feed (part->parser, buf, buf_len);
+}
+
 // Directory read callback function
 static void s3http_connection_on_directory_listing_data (S3HttpConnection *con, void *ctx, 
         const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
 {   
-    DirListRequest *dir_req = (DirListRequest *) ctx;
-    const gchar *next_marker = NULL;
-    gchar *req_path;
-    gboolean res;
+    DirListPart *part = (DirListPart *) ctx;
+    DirListRequest *dir_req = part->dir_req;
    
-    if (!buf_len || !buf) {
-        LOG_err (CON_DIR_LOG, "Directory buffer is empty !");
-        s3http_connection_on_directory_listing_error (con, (void *) dir_req);
-        g_free (dir_req->dir_path_orig);
-        g_free (dir_req->resource_path);
-        g_free (dir_req);
+    // the rest of the body, which wasn't passed to the chunk callback
+    if (buf_len && buf)
+        list_parser_feed (part->parser, buf, buf_len);
+
+    if (!list_parser_finish (part->parser)) {
+        LOG_err (CON_DIR_LOG, "Failed to parse directory listing !");
+        s3http_connection_on_directory_listing_error (con, (void *) part);
         return;
     }
-   
-    parse_dir_xml (dir_req, buf, buf_len);
     
+    // check if we need to get more data
+    if (!list_parser_is_truncated (part->parser) || part->is_after || dir_req->failed) {
+        dir_list_part_done (part, TRUE);
+        return;
+    }
+
     // repeat starting from the mark
-    next_marker = get_next_marker (buf, buf_len);
+    if (!s3http_connection_list_next_page (con, part->parser, &part->marker, &part->token)) {
+        dir_list_part_done (part, FALSE);
+        return;
+    }
 
-    // check if we need to get more data
-    if (!strstr (buf, "<IsTruncated>true</IsTruncated>") && !next_marker) {
-        LOG_debug (CON_DIR_LOG, "DONE !!");
-        
-        if (dir_req->directory_listing_callback)
-            dir_req->directory_listing_callback (dir_req->callback_data, TRUE);
-        
-        // we are done, stop updating
-        dir_tree_stop_update (dir_req->dir_tree, dir_req->ino);
-        
-        // release HTTP client
-        s3http_connection_release (con);
-        
-        g_free (dir_req->dir_path_orig);
-        g_free (dir_req->resource_path);
-        g_free (dir_req);
+    if (dir_list_part_is_after (part, part->marker)) {
+        dir_list_part_done (part, TRUE);
         return;
     }
 
-    // execute HTTP request
-    req_path = g_strdup_printf ("/?delimiter=/&prefix=%s&max-keys=%d&marker=%s", dir_req->dir_path, dir_req->max_keys, next_marker);
-    
-    xmlFree ((void *) next_marker);
+    dir_list_update_progress (dir_req);
+
+    // list the rest of the range with more connections
+    dir_list_part_split (part);
+
+    dir_list_part_request (part);
+}
+
+// request the next page of the range
+static void dir_list_part_request (DirListPart *part)
+{
+    DirListRequest *dir_req = part->dir_req;
+    gchar *req_path;
+    gboolean res;
+
+    // failed while waiting for HTTP client
+    if (dir_req->failed) {
+        dir_list_part_done (part, FALSE);
+        return;
+    }
+
+    req_path = s3http_connection_get_list_request_str (part->con, dir_req->dir_path, TRUE, part->marker, part->token, 0);
 
-    res = s3http_connection_make_request (dir_req->con, 
+    if (part->parser)
+        list_parser_destroy (part->parser);
+    part->parser = list_parser_create (dir_list_part_on_entry, part);
+    if (!part->parser) {
+        g_free (req_path);
+        s3http_connection_on_directory_listing_error (part->con, (void *) part);
+        return;
+    }
+    s3http_connection_set_chunk_cb (part->con, s3http_connection_on_directory_listing_chunk);
+
+    res = s3http_connection_make_request (part->con, 
         dir_req->resource_path, req_path, "GET", NULL,
         s3http_connection_on_directory_listing_data,
         s3http_connection_on_directory_listing_error, 
-        dir_req
+        part
     );
+    
     g_free (req_path);
 
     if (!res) {
         LOG_err (CON_DIR_LOG, "Failed to create HTTP request !");
-        s3http_connection_on_directory_listing_error (con, (void *) dir_req);
-        return;
+        s3http_connection_on_directory_listing_error (part->con, (void *) part);
     }
 }
 
-// create DirListRequest
-gboolean s3http_connection_get_directory_listing (S3HttpConnection *con, const gchar *dir_path, fuse_ino_t ino,
+// create DirListRequest, large directories are listed by several connections,
+// each of them lists its own range of keys
+gboolean s3http_connection_get_directory_listing (S3HttpConnection *con, const gchar *dir_path, fuse_ino_t ino, guint32 generation,
     S3HttpConnection_directory_listing_callback directory_listing_callback, gpointer callback_data)
 {
     DirListRequest *dir_req;
-    gchar *req_path;
-    gboolean res;
+    DirListPart *part;
+    AppConf *conf;
 
     LOG_debug (CON_DIR_LOG, "Getting directory listing for: %s", dir_path);
 
     dir_req = g_new0 (DirListRequest, 1);
-    dir_req->con = con;
     dir_req->app = s3http_connection_get_app (con);
+    conf = application_get_conf (dir_req->app);
     dir_req->dir_tree = application_get_dir_tree (dir_req->app);
     dir_req->ino = ino;
-    // XXX: settings
-    dir_req->max_keys = 1000;
+    dir_req->generation = generation;
+    dir_req->max_parts = MAX (conf->dir_list_partitions, 1);
+    dir_req->failed = FALSE;
+    dir_req->progress = NULL;
     dir_req->directory_listing_callback = directory_listing_callback;
     dir_req->callback_data = callback_data;
 
-    // acquire HTTP client
-    s3http_connection_acquire (con);
-    
-    // inform that we started to update the directory
-    dir_tree_start_update (dir_req->dir_tree, dir_path);
-
-    
     //XXX: fix dir_path
     if (!strcmp (dir_path, "/")) {
         dir_req->dir_path = g_strdup ("");
@@ -271,24 +506,18 @@ gboolean s3http_connection_get_directory_listing (S3HttpConnection *con, const g
         dir_req->dir_path = dir_req->dir_path + 1;
         dir_req->resource_path = g_strdup_printf ("/");
     }
-   
-    req_path = g_strdup_printf ("/?delimiter=/&prefix=%s&max-keys=%d", dir_req->dir_path, dir_req->max_keys);
 
-    res = s3http_connection_make_request (con, 
-        dir_req->resource_path, req_path, "GET", NULL,
-        s3http_connection_on_directory_listing_data,
-        s3http_connection_on_directory_listing_error, 
-        dir_req
-    );
-    
-    g_free (req_path);
+    // the whole key space, it's split when the first page is truncated
+    part = g_new0 (DirListPart, 1);
+    part->dir_req = dir_req;
+    part->con = con;
+    dir_req->l_parts = g_list_append (NULL, part);
+    dir_req->parts_active = 1;
 
-    if (!res) {
-        LOG_err (CON_DIR_LOG, "Failed to create HTTP request !");
-        s3http_connection_on_directory_listing_error (con, (void *) dir_req);
+    // acquire HTTP client
+    s3http_connection_acquire (con);
 
-        return FALSE;
-    }
+    dir_list_part_request (part);
 
     return TRUE;
 }
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "s3http_connection.h"
+
+typedef struct {
+    S3HttpConnection_on_range_received_cb on_range_received_cb;
+    gpointer ctx;
+} RangeGetData;
+
+#define CON_GET_LOG "con_get"
+
+static void s3http_connection_on_get_range_error (S3HttpConnection *con, void *ctx)
+{
+    RangeGetData *data = (RangeGetData *) ctx;
+
+    LOG_err (CON_GET_LOG, "Failed to get object range !");
+
+    s3http_connection_release (con);
+
+    if (data->on_range_received_cb)
+        data->on_range_received_cb (data->ctx, FALSE, NULL, 0);
+
+    g_free (data);
+}
+
+static void s3http_connection_on_get_range_done (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    RangeGetData *data = (RangeGetData *) ctx;
+
+    LOG_debug (CON_GET_LOG, "Got %zu bytes of object", buf_len);
+
+    s3http_connection_release (con);
+
+    if (data->on_range_received_cb)
+        data->on_range_received_cb (data->ctx, TRUE, buf, buf_len);
+
+    g_free (data);
+}
+
+// get the range of object content, connection is released when done
+gboolean s3http_connection_get_range (S3HttpConnection *con, const gchar *resource_path, off_t off, off_t len,
+    S3HttpConnection_on_range_received_cb on_range_received_cb, gpointer ctx)
+{
+    RangeGetData *data;
+    gchar range[100];
+    gboolean res;
+
+    data = g_new0 (RangeGetData, 1);
+    data->on_range_received_cb = on_range_received_cb;
+    data->ctx = ctx;
+
+    g_snprintf (range, sizeof (range), "bytes=%"OFF_FMT"-%"OFF_FMT, (uintmax_t) off, (uintmax_t) (off + len - 1));
+    s3http_connection_add_output_header (con, "Range", range);
+
+    LOG_debug (CON_GET_LOG, "[%p] Getting %s of %s", con, range, resource_path);
+
+    res = s3http_connection_make_request (con, 
+        resource_path, resource_path, "GET", 
+        NULL,
+        s3http_connection_on_get_range_done,
+        s3http_connection_on_get_range_error, 
+        data
+    );
+
+    if (!res) {
+        LOG_err (CON_GET_LOG, "Failed to create HTTP request !");
+        s3http_connection_on_get_range_error (con, (void *) data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
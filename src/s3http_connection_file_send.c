@@ -34,7 +34,7 @@ static void s3http_connection_on_file_send_error (S3HttpConnection *con, void *c
     s3http_connection_release (con);
 
     if (data->on_entry_sent_cb)
-        data->on_entry_sent_cb (ctx, FALSE);
+        data->on_entry_sent_cb (data->ctx, FALSE);
 
     g_free (data);
 }
@@ -56,10 +56,61 @@ static void s3http_connection_on_file_send_done (S3HttpConnection *con, void *ct
     g_free (data);
 }
 
+// add file range to the buffer, without reading it into the memory
+// unlike evbuffer_add_file (), file descriptor stays open
+gboolean s3http_connection_buffer_add_file (struct evbuffer *buf, int fd, off_t off, off_t len)
+{
+    struct evbuffer_file_segment *seg;
+    int res;
+
+    if (!len)
+        return TRUE;
+
+    seg = evbuffer_file_segment_new (fd, off, len, 0);
+    if (!seg)
+        return FALSE;
+
+    res = evbuffer_add_file_segment (buf, seg, 0, len);
+    // buffer keeps its own reference
+    evbuffer_file_segment_free (seg);
+
+    return res == 0;
+}
+
+// send output buffer as a new object content
+static gboolean s3http_connection_output_send (S3HttpConnection *con, struct evbuffer *output_buf, 
+    const gchar *resource_path, FileSendData *data)
+{
+    gchar *req_path;
+    gboolean res;
+
+    req_path = g_strdup_printf ("%s", resource_path);
+
+    LOG_debug (CON_SEND_LOG, "[%p %p] Sending %s file, req: %s, buff: %zd", con, data, 
+        resource_path, req_path, evbuffer_get_length (output_buf));
+
+    res = s3http_connection_make_request (con, 
+        resource_path, req_path, "PUT", 
+        output_buf,
+        s3http_connection_on_file_send_done,
+        s3http_connection_on_file_send_error, 
+        data
+    );
+
+    g_free (req_path);
+
+    if (!res) {
+        LOG_err (CON_SEND_LOG, "Failed to create HTTP request !");
+        s3http_connection_on_file_send_error (con, (void *) data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 gboolean s3http_connection_file_send (S3HttpConnection *con, int fd, const gchar *resource_path, 
     S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx)
 {
-    gchar *req_path;
     gboolean res;
     FileSendData *data;
     struct evbuffer *output_buf = NULL;
@@ -78,7 +129,7 @@ gboolean s3http_connection_file_send (S3HttpConnection *con, int fd, const gchar
     }
 
     output_buf = evbuffer_new ();
-    if (!output_buf || evbuffer_add_file (output_buf, fd, 0, st.st_size) < 0) {
+    if (!output_buf || !s3http_connection_buffer_add_file (output_buf, fd, 0, st.st_size)) {
         LOG_err (CON_SEND_LOG, "Failed to read temp file !");
         s3http_connection_on_file_send_error (con, (void *) data);
         if (output_buf)
@@ -86,27 +137,37 @@ gboolean s3http_connection_file_send (S3HttpConnection *con, int fd, const gchar
         return FALSE;
     }
 
-    req_path = g_strdup_printf ("%s", resource_path);
+    res = s3http_connection_output_send (con, output_buf, resource_path, data);
+    evbuffer_free (output_buf);
 
-    LOG_debug (CON_SEND_LOG, "[%p %p] Sending %s file, req: %s, %"OFF_FMT"  buff: %zd", con, data, 
-        resource_path, req_path, st.st_size, evbuffer_get_length (output_buf));
+    return res;
+}
 
-    res = s3http_connection_make_request (con, 
-        resource_path, req_path, "PUT", 
-        output_buf,
-        s3http_connection_on_file_send_done,
-        s3http_connection_on_file_send_error, 
-        data
-    );
+// send object content directly from the memory buffer
+gboolean s3http_connection_buffer_send (S3HttpConnection *con, const gchar *buf, size_t buf_len, const gchar *resource_path, 
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx)
+{
+    gboolean res;
+    FileSendData *data;
+    struct evbuffer *output_buf = NULL;
 
-    g_free (req_path);
-    evbuffer_free (output_buf);
+    data = g_new0 (FileSendData, 1);
+    data->on_entry_sent_cb = on_entry_sent_cb;
+    data->ctx = ctx;
 
-    if (!res) {
-        LOG_err (CON_SEND_LOG, "Failed to create HTTP request !");
+    LOG_debug (CON_SEND_LOG, "Sending buffer.. %p", data);
+
+    output_buf = evbuffer_new ();
+    if (!output_buf || (buf_len && evbuffer_add (output_buf, buf, buf_len) < 0)) {
+        LOG_err (CON_SEND_LOG, "Failed to create output buffer !");
         s3http_connection_on_file_send_error (con, (void *) data);
+        if (output_buf)
+            evbuffer_free (output_buf);
         return FALSE;
     }
 
-    return TRUE;
+    res = s3http_connection_output_send (con, output_buf, resource_path, data);
+    evbuffer_free (output_buf);
+
+    return res;
 }
@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "s3http_connection.h"
+
+// Multipart upload:
+// initiate -> upload or copy each part -> complete, abort if any step failed
+// http://docs.amazonwebservices.com/AmazonS3/latest/API/mpUploadInitiate.html
+
+typedef struct {
+    S3HttpConnection *con;
+    gchar *resource_path;
+    gchar *copy_source_path; // object, which ranges are copied
+    gchar *copy_source_etag; // expected ETag of the copied object, NULL if it's not checked
+    int fd;
+    GArray *a_parts; // S3HttpConnectionPart
+    guint cur_part;
+    gchar *upload_id;
+    GPtrArray *a_etags; // ETags of sent parts
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb;
+    gpointer ctx;
+} MultipartData;
+
+#define CON_MP_LOG "con_mp"
+
+static void s3http_connection_multipart_send_part (MultipartData *data);
+
+static void multipart_data_destroy (MultipartData *data)
+{
+    g_free (data->resource_path);
+    g_free (data->copy_source_path);
+    g_free (data->copy_source_etag);
+    g_free (data->upload_id);
+    g_ptr_array_free (data->a_etags, TRUE);
+    g_array_free (data->a_parts, TRUE);
+    g_free (data);
+}
+
+// return the content of the first element with the given name, or NULL
+static gchar *s3http_connection_multipart_xml_node_find (xmlNodePtr node, const gchar *name)
+{
+    gchar *res;
+
+    for (; node; node = node->next) {
+        if (node->type == XML_ELEMENT_NODE && !strcmp ((const char *) node->name, name)) {
+            xmlChar *content = xmlNodeGetContent (node);
+            res = g_strdup ((const gchar *) content);
+            xmlFree (content);
+            return res;
+        }
+
+        res = s3http_connection_multipart_xml_node_find (node->children, name);
+        if (res)
+            return res;
+    }
+
+    return NULL;
+}
+
+static gchar *s3http_connection_multipart_xml_get_value (const gchar *xml, size_t xml_len, const gchar *name)
+{
+    xmlDocPtr doc;
+    gchar *res;
+
+    if (!xml || !xml_len)
+        return NULL;
+
+    doc = xmlReadMemory (xml, xml_len, "", NULL, 0);
+    if (!doc)
+        return NULL;
+
+    res = s3http_connection_multipart_xml_node_find (xmlDocGetRootElement (doc), name);
+    xmlFreeDoc (doc);
+
+    return res;
+}
+
+/*{{{ done / abort */
+
+static void s3http_connection_multipart_done (MultipartData *data, gboolean success)
+{
+    s3http_connection_release (data->con);
+
+    if (data->on_entry_sent_cb)
+        data->on_entry_sent_cb (data->ctx, success);
+
+    multipart_data_destroy (data);
+}
+
+static void s3http_connection_multipart_on_abort_done (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    MultipartData *data = (MultipartData *) ctx;
+
+    LOG_debug (CON_MP_LOG, "Multipart upload of %s is aborted", data->resource_path);
+    s3http_connection_multipart_done (data, FALSE);
+}
+
+static void s3http_connection_multipart_on_abort_error (S3HttpConnection *con, void *ctx)
+{
+    MultipartData *data = (MultipartData *) ctx;
+
+    // uploaded parts are kept on the server until lifecycle rule removes them
+    LOG_err (CON_MP_LOG, "Failed to abort multipart upload %s of %s !", data->upload_id, data->resource_path);
+    s3http_connection_multipart_done (data, FALSE);
+}
+
+// something went wrong, remove already uploaded parts
+static void s3http_connection_multipart_abort (MultipartData *data)
+{
+    gchar *req_path;
+    gboolean res;
+
+    if (!data->upload_id) {
+        s3http_connection_multipart_done (data, FALSE);
+        return;
+    }
+
+    req_path = g_strdup_printf ("%s?uploadId=%s", data->resource_path, data->upload_id);
+
+    res = s3http_connection_make_request (data->con, 
+        req_path, req_path, "DELETE", 
+        NULL,
+        s3http_connection_multipart_on_abort_done,
+        s3http_connection_multipart_on_abort_error, 
+        data
+    );
+    g_free (req_path);
+
+    if (!res)
+        s3http_connection_multipart_on_abort_error (data->con, data);
+}
+
+static void s3http_connection_multipart_on_error (S3HttpConnection *con, void *ctx)
+{
+    MultipartData *data = (MultipartData *) ctx;
+
+    LOG_err (CON_MP_LOG, "Multipart upload of %s failed at part %u !", data->resource_path, data->cur_part + 1);
+    s3http_connection_multipart_abort (data);
+}
+/*}}}*/
+
+/*{{{ complete */
+
+static void s3http_connection_multipart_on_complete_done (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    MultipartData *data = (MultipartData *) ctx;
+    gchar *error_code;
+
+    // server may return an error after 200 OK is sent
+    error_code = s3http_connection_multipart_xml_get_value (buf, buf_len, "Code");
+    if (error_code) {
+        LOG_err (CON_MP_LOG, "Failed to complete multipart upload of %s: %s", data->resource_path, error_code);
+        g_free (error_code);
+        s3http_connection_multipart_abort (data);
+        return;
+    }
+
+    LOG_debug (CON_MP_LOG, "Multipart upload of %s is complete, parts: %u", data->resource_path, data->a_parts->len);
+    s3http_connection_multipart_done (data, TRUE);
+}
+
+static void s3http_connection_multipart_complete (MultipartData *data)
+{
+    struct evbuffer *output_buf;
+    gchar *req_path;
+    gboolean res;
+    guint i;
+
+    output_buf = evbuffer_new ();
+    evbuffer_add_printf (output_buf, "<CompleteMultipartUpload>");
+    for (i = 0; i < data->a_etags->len; i++) {
+        evbuffer_add_printf (output_buf, "<Part><PartNumber>%u</PartNumber><ETag>%s</ETag></Part>", 
+            i + 1, (const gchar *) g_ptr_array_index (data->a_etags, i));
+    }
+    evbuffer_add_printf (output_buf, "</CompleteMultipartUpload>");
+
+    req_path = g_strdup_printf ("%s?uploadId=%s", data->resource_path, data->upload_id);
+
+    res = s3http_connection_make_request (data->con, 
+        req_path, req_path, "POST", 
+        output_buf,
+        s3http_connection_multipart_on_complete_done,
+        s3http_connection_multipart_on_error, 
+        data
+    );
+    g_free (req_path);
+    evbuffer_free (output_buf);
+
+    if (!res)
+        s3http_connection_multipart_on_error (data->con, data);
+}
+/*}}}*/
+
+/*{{{ parts */
+
+static void s3http_connection_multipart_on_part_done (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, struct evkeyvalq *headers)
+{
+    MultipartData *data = (MultipartData *) ctx;
+    S3HttpConnectionPart *part = &g_array_index (data->a_parts, S3HttpConnectionPart, data->cur_part);
+    gchar *etag = NULL;
+    const char *header;
+
+    // copied part's ETag is returned in the body
+    if (part->is_copy) {
+        etag = s3http_connection_multipart_xml_get_value (buf, buf_len, "ETag");
+    } else {
+        header = evhttp_find_header (headers, "ETag");
+        if (header)
+            etag = g_strdup (header);
+    }
+
+    if (!etag) {
+        LOG_err (CON_MP_LOG, "Part %u of %s has no ETag !", data->cur_part + 1, data->resource_path);
+        s3http_connection_multipart_abort (data);
+        return;
+    }
+
+    g_ptr_array_add (data->a_etags, etag);
+    data->cur_part++;
+
+    s3http_connection_multipart_send_part (data);
+}
+
+static void s3http_connection_multipart_send_part (MultipartData *data)
+{
+    S3HttpConnectionPart *part;
+    struct evbuffer *output_buf = NULL;
+    gchar *req_path;
+    gchar *tmp;
+    gboolean res;
+
+    if (data->cur_part >= data->a_parts->len) {
+        s3http_connection_multipart_complete (data);
+        return;
+    }
+
+    part = &g_array_index (data->a_parts, S3HttpConnectionPart, data->cur_part);
+
+    LOG_debug (CON_MP_LOG, "[%p] %s part %u of %s, off: %"OFF_FMT", len: %"OFF_FMT, data->con, 
+        part->is_copy ? "Copying" : "Sending", data->cur_part + 1, data->resource_path, 
+        (uintmax_t) part->off, (uintmax_t) part->len);
+
+    if (part->is_copy) {
+        // the object is not replaced until upload is complete
+        tmp = g_strdup_printf ("/%s%s", application_get_bucket_name (s3http_connection_get_app (data->con)), data->copy_source_path);
+        s3http_connection_add_output_header (data->con, "x-amz-copy-source", tmp);
+        g_free (tmp);
+
+        // all parts must be copied from the same version of the object
+        if (data->copy_source_etag) {
+            tmp = g_strdup_printf ("\"%s\"", data->copy_source_etag);
+            s3http_connection_add_output_header (data->con, "x-amz-copy-source-if-match", tmp);
+            g_free (tmp);
+        }
+
+        tmp = g_strdup_printf ("bytes=%"OFF_FMT"-%"OFF_FMT, (uintmax_t) part->off, (uintmax_t) (part->off + part->len - 1));
+        s3http_connection_add_output_header (data->con, "x-amz-copy-source-range", tmp);
+        g_free (tmp);
+    } else {
+        output_buf = evbuffer_new ();
+        if (!output_buf || !s3http_connection_buffer_add_file (output_buf, data->fd, part->off, part->len)) {
+            LOG_err (CON_MP_LOG, "Failed to read temp file !");
+            if (output_buf)
+                evbuffer_free (output_buf);
+            s3http_connection_multipart_abort (data);
+            return;
+        }
+    }
+
+    req_path = g_strdup_printf ("%s?partNumber=%u&uploadId=%s", data->resource_path, data->cur_part + 1, data->upload_id);
+
+    res = s3http_connection_make_request (data->con, 
+        req_path, req_path, "PUT", 
+        output_buf,
+        s3http_connection_multipart_on_part_done,
+        s3http_connection_multipart_on_error, 
+        data
+    );
+    g_free (req_path);
+    if (output_buf)
+        evbuffer_free (output_buf);
+
+    if (!res)
+        s3http_connection_multipart_on_error (data->con, data);
+}
+/*}}}*/
+
+/*{{{ initiate */
+
+static void s3http_connection_multipart_on_initiate_done (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    MultipartData *data = (MultipartData *) ctx;
+
+    data->upload_id = s3http_connection_multipart_xml_get_value (buf, buf_len, "UploadId");
+    if (!data->upload_id) {
+        LOG_err (CON_MP_LOG, "Failed to initiate multipart upload of %s !", data->resource_path);
+        s3http_connection_multipart_done (data, FALSE);
+        return;
+    }
+
+    LOG_debug (CON_MP_LOG, "Multipart upload of %s initiated: %s", data->resource_path, data->upload_id);
+
+    s3http_connection_multipart_send_part (data);
+}
+
+static gboolean s3http_connection_multipart_start (S3HttpConnection *con, int fd, const gchar *resource_path, 
+    const gchar *copy_source_path, const gchar *copy_source_etag, GArray *a_parts, 
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx)
+{
+    MultipartData *data;
+    gchar *req_path;
+    gboolean res;
+
+    data = g_new0 (MultipartData, 1);
+    data->con = con;
+    data->resource_path = g_strdup (resource_path);
+    data->copy_source_path = g_strdup (copy_source_path);
+    data->copy_source_etag = g_strdup (copy_source_etag);
+    data->fd = fd;
+    data->a_parts = g_array_sized_new (FALSE, FALSE, sizeof (S3HttpConnectionPart), a_parts->len);
+    g_array_append_vals (data->a_parts, a_parts->data, a_parts->len);
+    data->cur_part = 0;
+    data->upload_id = NULL;
+    data->a_etags = g_ptr_array_new_with_free_func (g_free);
+    data->on_entry_sent_cb = on_entry_sent_cb;
+    data->ctx = ctx;
+
+    req_path = g_strdup_printf ("%s?uploads", resource_path);
+
+    res = s3http_connection_make_request (con, 
+        req_path, req_path, "POST", 
+        NULL,
+        s3http_connection_multipart_on_initiate_done,
+        s3http_connection_multipart_on_error, 
+        data
+    );
+    g_free (req_path);
+
+    if (!res) {
+        LOG_err (CON_MP_LOG, "Failed to create HTTP request !");
+        s3http_connection_multipart_done (data, FALSE);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// connection is released when done
+gboolean s3http_connection_multipart_send (S3HttpConnection *con, int fd, const gchar *resource_path, 
+    const gchar *copy_source_etag, GArray *a_parts, S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx)
+{
+    return s3http_connection_multipart_start (con, fd, resource_path, resource_path, copy_source_etag, a_parts, 
+        on_entry_sent_cb, ctx);
+}
+
+// copy the whole object by the biggest parts, connection is released when done
+gboolean s3http_connection_multipart_copy (S3HttpConnection *con, const gchar *src_path, const gchar *dst_path, 
+    off_t size, S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx)
+{
+    GArray *a_parts;
+    S3HttpConnectionPart part;
+    off_t off;
+    gboolean res;
+
+    a_parts = g_array_new (FALSE, FALSE, sizeof (S3HttpConnectionPart));
+    for (off = 0; off < size; off += part.len) {
+        part.is_copy = TRUE;
+        part.off = off;
+        part.len = MIN (size - off, S3_MULTIPART_MAX_PART_SIZE);
+        g_array_append_val (a_parts, part);
+    }
+
+    res = s3http_connection_multipart_start (con, -1, dst_path, src_path, NULL, a_parts, on_entry_sent_cb, ctx);
+    g_array_free (a_parts, TRUE);
+
+    return res;
+}
+/*}}}*/
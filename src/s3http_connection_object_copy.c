@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "s3http_connection.h"
+
+// server-side copy, objects bigger than PUT limit are copied by multipart upload
+// http://docs.amazonwebservices.com/AmazonS3/latest/API/RESTObjectCOPY.html
+
+typedef struct {
+    gchar *src_path;
+    gchar *dst_path;
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb;
+    gpointer ctx;
+} ObjectCopyData;
+
+#define CON_COPY_LOG "con_copy"
+
+static void object_copy_data_destroy (ObjectCopyData *data)
+{
+    g_free (data->src_path);
+    g_free (data->dst_path);
+    g_free (data);
+}
+
+static void s3http_connection_on_object_copy_error (S3HttpConnection *con, void *ctx)
+{
+    ObjectCopyData *data = (ObjectCopyData *) ctx;
+
+    LOG_err (CON_COPY_LOG, "Failed to copy %s to %s !", data->src_path, data->dst_path);
+
+    s3http_connection_release (con);
+
+    if (data->on_entry_sent_cb)
+        data->on_entry_sent_cb (data->ctx, FALSE);
+
+    object_copy_data_destroy (data);
+}
+
+static void s3http_connection_on_object_copy_done (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    ObjectCopyData *data = (ObjectCopyData *) ctx;
+
+    // server may return an error after 200 OK is sent
+    if (!buf || !g_strstr_len (buf, buf_len, "<CopyObjectResult")) {
+        s3http_connection_on_object_copy_error (con, ctx);
+        return;
+    }
+
+    LOG_debug (CON_COPY_LOG, "%s is copied to %s", data->src_path, data->dst_path);
+
+    s3http_connection_release (con);
+
+    if (data->on_entry_sent_cb)
+        data->on_entry_sent_cb (data->ctx, TRUE);
+
+    object_copy_data_destroy (data);
+}
+
+gboolean s3http_connection_object_copy (S3HttpConnection *con, const gchar *src_path, const gchar *dst_path, 
+    off_t size, S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx)
+{
+    ObjectCopyData *data;
+    gchar *tmp;
+    gboolean res;
+
+    if (size > S3_MULTIPART_MAX_PART_SIZE)
+        return s3http_connection_multipart_copy (con, src_path, dst_path, size, on_entry_sent_cb, ctx);
+
+    data = g_new0 (ObjectCopyData, 1);
+    data->src_path = g_strdup (src_path);
+    data->dst_path = g_strdup (dst_path);
+    data->on_entry_sent_cb = on_entry_sent_cb;
+    data->ctx = ctx;
+
+    LOG_debug (CON_COPY_LOG, "[%p] Copying %s to %s", con, src_path, dst_path);
+
+    tmp = g_strdup_printf ("/%s%s", application_get_bucket_name (s3http_connection_get_app (con)), src_path);
+    s3http_connection_add_output_header (con, "x-amz-copy-source", tmp);
+    g_free (tmp);
+
+    res = s3http_connection_make_request (con, 
+        dst_path, dst_path, "PUT", 
+        NULL,
+        s3http_connection_on_object_copy_done,
+        s3http_connection_on_object_copy_error, 
+        data
+    );
+
+    if (!res) {
+        LOG_err (CON_COPY_LOG, "Failed to create HTTP request !");
+        s3http_connection_on_object_copy_error (con, (void *) data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
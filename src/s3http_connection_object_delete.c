@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "s3http_connection.h"
+
+typedef struct {
+    gchar *resource_path;
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb;
+    gpointer ctx;
+} ObjectDeleteData;
+
+#define CON_DEL_LOG "con_del"
+
+static void s3http_connection_on_object_delete_error (S3HttpConnection *con, void *ctx)
+{
+    ObjectDeleteData *data = (ObjectDeleteData *) ctx;
+
+    LOG_err (CON_DEL_LOG, "Failed to remove %s !", data->resource_path);
+
+    s3http_connection_release (con);
+
+    if (data->on_entry_sent_cb)
+        data->on_entry_sent_cb (data->ctx, FALSE);
+
+    g_free (data->resource_path);
+    g_free (data);
+}
+
+static void s3http_connection_on_object_delete_done (S3HttpConnection *con, void *ctx, 
+        G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    ObjectDeleteData *data = (ObjectDeleteData *) ctx;
+
+    LOG_debug (CON_DEL_LOG, "%s is removed", data->resource_path);
+
+    s3http_connection_release (con);
+
+    if (data->on_entry_sent_cb)
+        data->on_entry_sent_cb (data->ctx, TRUE);
+
+    g_free (data->resource_path);
+    g_free (data);
+}
+
+gboolean s3http_connection_object_delete (S3HttpConnection *con, const gchar *resource_path, 
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx)
+{
+    ObjectDeleteData *data;
+    gboolean res;
+
+    data = g_new0 (ObjectDeleteData, 1);
+    data->resource_path = g_strdup (resource_path);
+    data->on_entry_sent_cb = on_entry_sent_cb;
+    data->ctx = ctx;
+
+    res = s3http_connection_make_request (con, 
+        resource_path, resource_path, "DELETE", 
+        NULL,
+        s3http_connection_on_object_delete_done,
+        s3http_connection_on_object_delete_error, 
+        data
+    );
+
+    if (!res) {
+        LOG_err (CON_DEL_LOG, "Failed to create HTTP request !");
+        s3http_connection_on_object_delete_error (con, (void *) data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*{{{ Multi-Object Delete */
+
+// up to S3_DELETE_MAX_KEYS objects are removed by one request
+// http://docs.amazonwebservices.com/AmazonS3/latest/API/multiobjectdeleteapi.html
+
+typedef struct {
+    S3HttpConnection_on_objects_deleted_cb on_objects_deleted_cb;
+    gpointer ctx;
+} ObjectsDeleteData;
+
+static void s3http_connection_on_objects_delete_error (S3HttpConnection *con, void *ctx)
+{
+    ObjectsDeleteData *data = (ObjectsDeleteData *) ctx;
+
+    LOG_err (CON_DEL_LOG, "Failed to remove objects !");
+
+    s3http_connection_release (con);
+
+    if (data->on_objects_deleted_cb)
+        data->on_objects_deleted_cb (data->ctx, FALSE, NULL);
+
+    g_free (data);
+}
+
+// in quiet mode the response contains only objects which were not removed
+static void s3http_connection_on_objects_delete_done (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    ObjectsDeleteData *data = (ObjectsDeleteData *) ctx;
+    GHashTable *h_failed;
+    xmlDocPtr doc;
+    xmlNodePtr node, child;
+
+    doc = buf_len ? xmlReadMemory (buf, buf_len, "", NULL, 0) : NULL;
+    if (!doc || !xmlDocGetRootElement (doc) || strcmp ((const char *) xmlDocGetRootElement (doc)->name, "DeleteResult")) {
+        if (doc)
+            xmlFreeDoc (doc);
+        s3http_connection_on_objects_delete_error (con, ctx);
+        return;
+    }
+
+    h_failed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (node = xmlDocGetRootElement (doc)->children; node; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE || strcmp ((const char *) node->name, "Error"))
+            continue;
+
+        for (child = node->children; child; child = child->next) {
+            if (child->type == XML_ELEMENT_NODE && !strcmp ((const char *) child->name, "Key")) {
+                xmlChar *key = xmlNodeGetContent (child);
+                g_hash_table_insert (h_failed, g_strdup_printf ("/%s", (const gchar *) key), NULL);
+                xmlFree (key);
+            }
+        }
+    }
+    xmlFreeDoc (doc);
+
+    LOG_debug (CON_DEL_LOG, "Objects are removed, failed: %u", g_hash_table_size (h_failed));
+
+    s3http_connection_release (con);
+
+    if (data->on_objects_deleted_cb)
+        data->on_objects_deleted_cb (data->ctx, TRUE, h_failed);
+
+    g_hash_table_destroy (h_failed);
+    g_free (data);
+}
+
+gboolean s3http_connection_objects_delete (S3HttpConnection *con, GPtrArray *a_paths, 
+    S3HttpConnection_on_objects_deleted_cb on_objects_deleted_cb, gpointer ctx)
+{
+    ObjectsDeleteData *data;
+    struct evbuffer *output_buf;
+    GChecksum *md5;
+    guint8 digest[16];
+    gsize digest_len = sizeof (digest);
+    gchar *content_md5;
+    gchar *body;
+    size_t body_len;
+    gboolean res;
+    guint i;
+
+    data = g_new0 (ObjectsDeleteData, 1);
+    data->on_objects_deleted_cb = on_objects_deleted_cb;
+    data->ctx = ctx;
+
+    output_buf = evbuffer_new ();
+    evbuffer_add_printf (output_buf, "<?xml version=\"1.0\" encoding=\"UTF-8\"?><Delete><Quiet>true</Quiet>");
+    for (i = 0; i < a_paths->len; i++) {
+        const gchar *path = (const gchar *) g_ptr_array_index (a_paths, i);
+        gchar *key;
+
+        // object keys don't have leading '/'
+        key = g_markup_escape_text (path[0] == '/' ? path + 1 : path, -1);
+        evbuffer_add_printf (output_buf, "<Object><Key>%s</Key></Object>", key);
+        g_free (key);
+    }
+    evbuffer_add_printf (output_buf, "</Delete>");
+
+    // Content-MD5 is required by Multi-Object Delete
+    body_len = evbuffer_get_length (output_buf);
+    body = (gchar *) evbuffer_pullup (output_buf, -1);
+    md5 = g_checksum_new (G_CHECKSUM_MD5);
+    g_checksum_update (md5, (const guchar *) body, body_len);
+    g_checksum_get_digest (md5, digest, &digest_len);
+    g_checksum_free (md5);
+
+    content_md5 = g_base64_encode (digest, digest_len);
+    s3http_connection_add_output_header (con, "Content-MD5", content_md5);
+    g_free (content_md5);
+
+    LOG_debug (CON_DEL_LOG, "[%p] Removing %u objects", con, a_paths->len);
+
+    res = s3http_connection_make_request (con, 
+        "/?delete", "/?delete", "POST", 
+        output_buf,
+        s3http_connection_on_objects_delete_done,
+        s3http_connection_on_objects_delete_error, 
+        data
+    );
+    evbuffer_free (output_buf);
+
+    if (!res) {
+        LOG_err (CON_DEL_LOG, "Failed to create HTTP request !");
+        s3http_connection_on_objects_delete_error (con, (void *) data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+/*}}}*/
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "s3http_connection.h"
+
+// flat listing (without delimiter) of all objects under the prefix
+
+typedef struct {
+    S3HttpConnection *con;
+    gchar *prefix;
+    gchar *marker; // the last received key
+    gchar *token; // continuation token of ListObjectsV2 page
+    ListParser *parser; // parser of the current page
+    S3HttpConnection_on_object_cb on_object_cb;
+    S3HttpConnection_on_entry_sent_cb on_done_cb;
+    gpointer ctx;
+} ObjectListData;
+
+#define CON_LIST_LOG "con_list"
+
+static gboolean s3http_connection_object_list_request (ObjectListData *data);
+
+static void s3http_connection_object_list_done (ObjectListData *data, gboolean success)
+{
+    s3http_connection_release (data->con);
+
+    if (data->on_done_cb)
+        data->on_done_cb (data->ctx, success);
+
+    if (data->parser)
+        list_parser_destroy (data->parser);
+    g_free (data->prefix);
+    g_free (data->marker);
+    g_free (data->token);
+    g_free (data);
+}
+
+static void s3http_connection_on_object_list_error (S3HttpConnection *con, void *ctx)
+{
+    ObjectListData *data = (ObjectListData *) ctx;
+
+    LOG_err (CON_LIST_LOG, "Failed to get the list of %s objects !", data->prefix);
+    s3http_connection_object_list_done (data, FALSE);
+}
+
+static void s3http_connection_object_list_on_entry (gpointer ctx, const gchar *key, gboolean is_prefix, 
+    guint64 size, const gchar *etag)
+{
+    ObjectListData *data = (ObjectListData *) ctx;
+
+    if (!is_prefix && data->on_object_cb)
+        data->on_object_cb (data->ctx, key, size, etag);
+}
+
+static void s3http_connection_on_object_list_chunk (G_GNUC_UNUSED S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len)
+{
+    ObjectListData *data = (ObjectListData *) ctx;
+
+    list_parser_feed (data->parser, buf, buf_len);
+}
+
+static void s3http_connection_on_object_list_data (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    ObjectListData *data = (ObjectListData *) ctx;
+
+    if (buf_len && buf)
+        list_parser_feed (data->parser, buf, buf_len);
+
+    if (!list_parser_finish (data->parser)) {
+        LOG_err (CON_LIST_LOG, "Failed to parse the list of objects !");
+        s3http_connection_object_list_done (data, FALSE);
+        return;
+    }
+
+    if (!list_parser_is_truncated (data->parser)) {
+        LOG_debug (CON_LIST_LOG, "Got the list of %s objects", data->prefix);
+        s3http_connection_object_list_done (data, TRUE);
+        return;
+    }
+
+    if (!s3http_connection_list_next_page (con, data->parser, &data->marker, &data->token)) {
+        s3http_connection_object_list_done (data, FALSE);
+        return;
+    }
+
+    s3http_connection_object_list_request (data);
+}
+
+static gboolean s3http_connection_object_list_request (ObjectListData *data)
+{
+    gchar *req_path;
+    gboolean res;
+
+    if (data->parser)
+        list_parser_destroy (data->parser);
+    data->parser = list_parser_create (s3http_connection_object_list_on_entry, data);
+    if (!data->parser) {
+        s3http_connection_on_object_list_error (data->con, (void *) data);
+        return FALSE;
+    }
+    s3http_connection_set_chunk_cb (data->con, s3http_connection_on_object_list_chunk);
+
+    req_path = s3http_connection_get_list_request_str (data->con, data->prefix, FALSE, data->marker, data->token, 0);
+
+    res = s3http_connection_make_request (data->con, 
+        "/", req_path, "GET", 
+        NULL,
+        s3http_connection_on_object_list_data,
+        s3http_connection_on_object_list_error, 
+        data
+    );
+    g_free (req_path);
+
+    if (!res) {
+        LOG_err (CON_LIST_LOG, "Failed to create HTTP request !");
+        s3http_connection_on_object_list_error (data->con, (void *) data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean s3http_connection_object_list (S3HttpConnection *con, const gchar *prefix, 
+    S3HttpConnection_on_object_cb on_object_cb, S3HttpConnection_on_entry_sent_cb on_done_cb, gpointer ctx)
+{
+    ObjectListData *data;
+
+    data = g_new0 (ObjectListData, 1);
+    data->con = con;
+    data->prefix = g_strdup (prefix);
+    data->marker = NULL;
+    data->on_object_cb = on_object_cb;
+    data->on_done_cb = on_done_cb;
+    data->ctx = ctx;
+
+    LOG_debug (CON_LIST_LOG, "[%p] Getting the list of %s objects", con, prefix);
+
+    return s3http_connection_object_list_request (data);
+}
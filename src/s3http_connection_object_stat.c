@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "s3http_connection.h"
+
+// targeted lookup of a single name: HEAD of the object, then a listing
+// of one key under "name/" if there is no such object
+
+typedef struct {
+    S3HttpConnection *con;
+    gchar *resource_path;
+    S3HttpConnection_on_object_stat_cb on_object_stat_cb;
+    gpointer ctx;
+} ObjectStatData;
+
+#define CON_STAT_LOG "con_stat"
+
+static void s3http_connection_object_stat_done (ObjectStatData *data, gboolean success, gboolean exists, gboolean is_dir,
+    off_t size, const gchar *etag)
+{
+    s3http_connection_release (data->con);
+
+    if (data->on_object_stat_cb)
+        data->on_object_stat_cb (data->ctx, success, exists, is_dir, size, etag);
+
+    g_free (data->resource_path);
+    g_free (data);
+}
+
+/*{{{ directory */
+static void s3http_connection_on_object_stat_list_error (G_GNUC_UNUSED S3HttpConnection *con, void *ctx)
+{
+    ObjectStatData *data = (ObjectStatData *) ctx;
+
+    LOG_err (CON_STAT_LOG, "Failed to check %s !", data->resource_path);
+    s3http_connection_object_stat_done (data, FALSE, FALSE, FALSE, 0, NULL);
+}
+
+static void s3http_connection_object_stat_on_entry (G_GNUC_UNUSED gpointer ctx, G_GNUC_UNUSED const gchar *key, 
+    G_GNUC_UNUSED gboolean is_prefix, G_GNUC_UNUSED guint64 size, G_GNUC_UNUSED const gchar *etag)
+{
+}
+
+static void s3http_connection_on_object_stat_list_data (S3HttpConnection *con, void *ctx, 
+        const gchar *buf, size_t buf_len, G_GNUC_UNUSED struct evkeyvalq *headers)
+{
+    ObjectStatData *data = (ObjectStatData *) ctx;
+    ListParser *parser;
+    gboolean is_dir;
+
+    parser = list_parser_create (s3http_connection_object_stat_on_entry, data);
+    if (!parser) {
+        s3http_connection_on_object_stat_list_error (con, ctx);
+        return;
+    }
+
+    if (buf_len && buf)
+        list_parser_feed (parser, buf, buf_len);
+
+    if (!list_parser_finish (parser)) {
+        LOG_err (CON_STAT_LOG, "Failed to parse the list of objects !");
+        list_parser_destroy (parser);
+        s3http_connection_on_object_stat_list_error (con, ctx);
+        return;
+    }
+
+    is_dir = list_parser_get_count (parser) > 0;
+    list_parser_destroy (parser);
+
+    LOG_debug (CON_STAT_LOG, "%s %s", data->resource_path, is_dir ? "is a directory" : "is not found");
+    s3http_connection_object_stat_done (data, TRUE, is_dir, is_dir, 0, NULL);
+}
+
+static void s3http_connection_object_stat_list (ObjectStatData *data)
+{
+    gchar *prefix;
+    gchar *req_path;
+    gboolean res;
+
+    // object keys don't have leading '/'
+    prefix = g_strdup_printf ("%s/", data->resource_path + 1);
+    req_path = s3http_connection_get_list_request_str (data->con, prefix, FALSE, NULL, NULL, 1);
+    g_free (prefix);
+
+    res = s3http_connection_make_request (data->con, 
+        "/", req_path, "GET", 
+        NULL,
+        s3http_connection_on_object_stat_list_data,
+        s3http_connection_on_object_stat_list_error, 
+        data
+    );
+    g_free (req_path);
+
+    if (!res) {
+        LOG_err (CON_STAT_LOG, "Failed to create HTTP request !");
+        s3http_connection_on_object_stat_list_error (data->con, (void *) data);
+    }
+}
+/*}}}*/
+
+/*{{{ object */
+// the object doesn't exist, check if it's a directory.
+// Other errors don't tell anything about the name
+static void s3http_connection_on_object_stat_head_error (S3HttpConnection *con, void *ctx)
+{
+    ObjectStatData *data = (ObjectStatData *) ctx;
+
+    if (con->response_code != 404) {
+        LOG_err (CON_STAT_LOG, "Failed to check %s, HTTP code: %d !", data->resource_path, con->response_code);
+        s3http_connection_object_stat_done (data, FALSE, FALSE, FALSE, 0, NULL);
+        return;
+    }
+
+    s3http_connection_object_stat_list (data);
+}
+
+static void s3http_connection_on_object_stat_head_done (G_GNUC_UNUSED S3HttpConnection *con, void *ctx, 
+        G_GNUC_UNUSED const gchar *buf, G_GNUC_UNUSED size_t buf_len, struct evkeyvalq *headers)
+{
+    ObjectStatData *data = (ObjectStatData *) ctx;
+    const gchar *size_str = NULL;
+    const gchar *etag = NULL;
+
+    if (headers) {
+        size_str = evhttp_find_header (headers, "Content-Length");
+        etag = evhttp_find_header (headers, "ETag");
+    }
+
+    LOG_debug (CON_STAT_LOG, "%s exists, size: %s", data->resource_path, size_str ? size_str : "unknown");
+    s3http_connection_object_stat_done (data, TRUE, TRUE, FALSE, 
+        size_str ? (off_t) g_ascii_strtoull (size_str, NULL, 10) : 0, etag);
+}
+
+gboolean s3http_connection_object_stat (S3HttpConnection *con, const gchar *resource_path, 
+    S3HttpConnection_on_object_stat_cb on_object_stat_cb, gpointer ctx)
+{
+    ObjectStatData *data;
+    gboolean res;
+
+    data = g_new0 (ObjectStatData, 1);
+    data->con = con;
+    data->resource_path = g_strdup (resource_path);
+    data->on_object_stat_cb = on_object_stat_cb;
+    data->ctx = ctx;
+
+    LOG_debug (CON_STAT_LOG, "[%p] Checking %s", con, resource_path);
+
+    res = s3http_connection_make_request (con, 
+        resource_path, resource_path, "HEAD", 
+        NULL,
+        s3http_connection_on_object_stat_head_done,
+        s3http_connection_on_object_stat_head_error, 
+        data
+    );
+
+    if (!res) {
+        LOG_err (CON_STAT_LOG, "Failed to create HTTP request !");
+        s3http_connection_object_stat_done (data, FALSE, FALSE, FALSE, 0, NULL);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+/*}}}*/
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "slab_arena.h"
+
+// size of a single slab
+#define SLAB_SIZE (256 * 1024)
+
+struct _SlabArena {
+    gsize record_size;
+    guint records_per_slab;
+
+    GPtrArray *a_slabs; // allocated slabs
+    guint slab_used; // records carved out of the last slab
+    gpointer free_list; // freed records, linked through their first bytes
+
+    guint64 count;
+};
+
+SlabArena *slab_arena_create (gsize record_size)
+{
+    SlabArena *arena;
+
+    arena = g_new0 (SlabArena, 1);
+    // keep records aligned and big enough to hold the free list link
+    arena->record_size = (MAX (record_size, sizeof (gpointer)) + sizeof (gpointer) - 1) & ~(sizeof (gpointer) - 1);
+    arena->records_per_slab = MAX (SLAB_SIZE / arena->record_size, 1);
+    arena->a_slabs = g_ptr_array_new_with_free_func (g_free);
+    arena->slab_used = arena->records_per_slab;
+    arena->free_list = NULL;
+    arena->count = 0;
+
+    return arena;
+}
+
+void slab_arena_destroy (SlabArena *arena)
+{
+    g_ptr_array_free (arena->a_slabs, TRUE);
+    g_free (arena);
+}
+
+gpointer slab_arena_alloc (SlabArena *arena)
+{
+    gpointer rec;
+
+    if (arena->free_list) {
+        rec = arena->free_list;
+        arena->free_list = *(gpointer *) rec;
+    } else {
+        if (arena->slab_used == arena->records_per_slab) {
+            g_ptr_array_add (arena->a_slabs, g_malloc (arena->records_per_slab * arena->record_size));
+            arena->slab_used = 0;
+        }
+        rec = (gchar *) g_ptr_array_index (arena->a_slabs, arena->a_slabs->len - 1) + 
+            arena->slab_used * arena->record_size;
+        arena->slab_used++;
+    }
+
+    memset (rec, 0, arena->record_size);
+    arena->count++;
+
+    return rec;
+}
+
+void slab_arena_free (SlabArena *arena, gpointer rec)
+{
+    if (!rec)
+        return;
+
+    *(gpointer *) rec = arena->free_list;
+    arena->free_list = rec;
+    arena->count--;
+}
+
+guint64 slab_arena_get_count (SlabArena *arena)
+{
+    return arena->count;
+}
+
+gsize slab_arena_get_mem_size (SlabArena *arena)
+{
+    return sizeof (SlabArena) + arena->a_slabs->len * (arena->records_per_slab * arena->record_size + sizeof (gpointer));
+}
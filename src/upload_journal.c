@@ -0,0 +1,533 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "upload_journal.h"
+#include "s3http_connection.h"
+#include "upload_scheduler.h"
+
+/*{{{ struct */
+
+// journal is a text file, each line is a record:
+// A <id> <size> <md5> <resource path> <tmp path>   - upload is pending
+// D <id>                                           - upload is done
+// an upload which succeeded retires the older records of the same path
+// fields are separated by tabs, paths are escaped with g_strescape ()
+
+struct _UploadJournal {
+    Application *app;
+    gchar *path;
+    int fd;
+
+    guint64 next_id;
+    GHashTable *h_records; // id -> JournalRecord, records without "done" mark
+};
+
+typedef struct {
+    UploadJournal *journal;
+    guint64 id;
+    off_t size;
+    gchar *checksum;
+    gchar *resource_path;
+    gchar *tmp_path;
+    int fd;
+} JournalRecord;
+
+#define JOURNAL_LOG "journal"
+
+/*}}}*/
+
+/*{{{ create / destroy */
+
+static void journal_record_free (JournalRecord *rec);
+
+UploadJournal *upload_journal_create (Application *app, const gchar *journal_path)
+{
+    UploadJournal *journal;
+
+    journal = g_new0 (UploadJournal, 1);
+    journal->app = app;
+    journal->path = g_strdup (journal_path);
+    journal->next_id = 1;
+    journal->h_records = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, (GDestroyNotify) journal_record_free);
+
+    journal->fd = open (journal->path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (journal->fd < 0) {
+        LOG_err (JOURNAL_LOG, "Failed to open journal file %s: %s", journal->path, strerror (errno));
+        g_hash_table_destroy (journal->h_records);
+        g_free (journal->path);
+        g_free (journal);
+        return NULL;
+    }
+
+    LOG_debug (JOURNAL_LOG, "Upload journal opened: %s", journal->path);
+
+    return journal;
+}
+
+void upload_journal_destroy (UploadJournal *journal)
+{
+    close (journal->fd);
+    g_hash_table_destroy (journal->h_records);
+    g_free (journal->path);
+    g_free (journal);
+}
+
+static void journal_record_free (JournalRecord *rec)
+{
+    if (rec->fd >= 0)
+        close (rec->fd);
+    g_free (rec->checksum);
+    g_free (rec->resource_path);
+    g_free (rec->tmp_path);
+    g_free (rec);
+}
+/*}}}*/
+
+/*{{{ records */
+
+// return MD5 hex string of the file content, or NULL if failed
+static gchar *upload_journal_file_checksum (int fd, off_t size)
+{
+    GChecksum *checksum;
+    gchar buf[64 * 1024];
+    off_t off = 0;
+    ssize_t n;
+    gchar *res;
+
+    checksum = g_checksum_new (G_CHECKSUM_MD5);
+    while (off < size) {
+        n = pread (fd, buf, MIN ((off_t) sizeof (buf), size - off), off);
+        if (n <= 0) {
+            g_checksum_free (checksum);
+            return NULL;
+        }
+        g_checksum_update (checksum, (guchar *) buf, n);
+        off += n;
+    }
+
+    res = g_strdup (g_checksum_get_string (checksum));
+    g_checksum_free (checksum);
+
+    return res;
+}
+
+// append lines to the journal and make sure they are on the disk
+// start from the empty journal if all uploads are done
+static gboolean upload_journal_append (UploadJournal *journal, const gchar *lines)
+{
+    size_t len = strlen (lines);
+
+    if (write (journal->fd, lines, len) != (ssize_t) len) {
+        LOG_err (JOURNAL_LOG, "Failed to write journal: %s", strerror (errno));
+        return FALSE;
+    }
+
+    if (fdatasync (journal->fd) < 0) {
+        LOG_err (JOURNAL_LOG, "Failed to sync journal: %s", strerror (errno));
+        return FALSE;
+    }
+
+    if (!g_hash_table_size (journal->h_records)) {
+        if (ftruncate (journal->fd, 0) < 0)
+            LOG_err (JOURNAL_LOG, "Failed to truncate journal: %s", strerror (errno));
+    }
+
+    return TRUE;
+}
+
+// add "pending" line of the record
+static void upload_journal_format_add (GString *lines, JournalRecord *rec)
+{
+    gchar *e_resource_path;
+    gchar *e_tmp_path;
+
+    e_resource_path = g_strescape (rec->resource_path, NULL);
+    e_tmp_path = g_strescape (rec->tmp_path, NULL);
+    g_string_append_printf (lines, "A\t%"G_GUINT64_FORMAT"\t%"OFF_FMT"\t%s\t%s\t%s\n", 
+        rec->id, (uintmax_t) rec->size, rec->checksum, e_resource_path, e_tmp_path);
+    g_free (e_tmp_path);
+    g_free (e_resource_path);
+}
+
+// return the part of record path after path, or NULL if the record doesn't belong to path
+static const gchar *upload_journal_path_match (const gchar *rec_path, const gchar *path, gboolean recursive)
+{
+    size_t len = strlen (path);
+
+    if (strncmp (rec_path, path, len))
+        return NULL;
+
+    if (!rec_path[len] || (recursive && rec_path[len] == '/'))
+        return rec_path + len;
+
+    return NULL;
+}
+
+guint64 upload_journal_add (UploadJournal *journal, const gchar *resource_path, const gchar *tmp_path, int fd,
+    const gchar *checksum)
+{
+    struct stat st;
+    JournalRecord *rec;
+    GString *lines;
+    gboolean res;
+
+    if (fstat (fd, &st) < 0) {
+        LOG_err (JOURNAL_LOG, "Failed to stat tmp file %s !", tmp_path);
+        return 0;
+    }
+
+    rec = g_new0 (JournalRecord, 1);
+    rec->journal = journal;
+    rec->fd = -1;
+    rec->size = st.st_size;
+    if (checksum)
+        rec->checksum = g_strdup (checksum);
+    else
+        rec->checksum = upload_journal_file_checksum (fd, st.st_size);
+    if (!rec->checksum) {
+        LOG_err (JOURNAL_LOG, "Failed to read tmp file %s !", tmp_path);
+        journal_record_free (rec);
+        return 0;
+    }
+    rec->id = journal->next_id++;
+    rec->resource_path = g_strdup (resource_path);
+    rec->tmp_path = g_strdup (tmp_path);
+
+    lines = g_string_new (NULL);
+    upload_journal_format_add (lines, rec);
+    g_hash_table_insert (journal->h_records, &rec->id, rec);
+
+    res = upload_journal_append (journal, lines->str);
+    g_string_free (lines, TRUE);
+
+    if (!res) {
+        g_hash_table_remove (journal->h_records, &rec->id);
+        return 0;
+    }
+
+    LOG_debug (JOURNAL_LOG, "Added record %"G_GUINT64_FORMAT" for %s", rec->id, resource_path);
+
+    return rec->id;
+}
+
+void upload_journal_remove (UploadJournal *journal, guint64 id)
+{
+    JournalRecord *rec;
+    GString *lines;
+    GHashTableIter iter;
+    gpointer value;
+
+    // already retired by a newer upload, unlink or rename
+    rec = g_hash_table_lookup (journal->h_records, &id);
+    if (!rec)
+        return;
+
+    lines = g_string_new (NULL);
+
+    // the server has a newer content, previous failed uploads must not be replayed over it
+    g_hash_table_iter_init (&iter, journal->h_records);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        JournalRecord *old = (JournalRecord *) value;
+
+        if (old->id >= id || strcmp (old->resource_path, rec->resource_path))
+            continue;
+
+        LOG_debug (JOURNAL_LOG, "Retiring outdated record %"G_GUINT64_FORMAT" for %s", old->id, old->resource_path);
+        g_string_append_printf (lines, "D\t%"G_GUINT64_FORMAT"\n", old->id);
+        // tmp file of the same context is removed by its owner
+        if (strcmp (old->tmp_path, rec->tmp_path))
+            unlink (old->tmp_path);
+        g_hash_table_iter_remove (&iter);
+    }
+
+    g_string_append_printf (lines, "D\t%"G_GUINT64_FORMAT"\n", id);
+    g_hash_table_remove (journal->h_records, &id);
+
+    upload_journal_append (journal, lines->str);
+    g_string_free (lines, TRUE);
+
+    LOG_debug (JOURNAL_LOG, "Removed record %"G_GUINT64_FORMAT, id);
+}
+
+void upload_journal_remove_path (UploadJournal *journal, const gchar *resource_path, gboolean recursive)
+{
+    GString *lines;
+    GHashTableIter iter;
+    gpointer value;
+
+    lines = g_string_new (NULL);
+
+    g_hash_table_iter_init (&iter, journal->h_records);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        JournalRecord *rec = (JournalRecord *) value;
+
+        if (!upload_journal_path_match (rec->resource_path, resource_path, recursive))
+            continue;
+
+        LOG_debug (JOURNAL_LOG, "%s is removed, dropping record %"G_GUINT64_FORMAT, rec->resource_path, rec->id);
+        g_string_append_printf (lines, "D\t%"G_GUINT64_FORMAT"\n", rec->id);
+        unlink (rec->tmp_path);
+        g_hash_table_iter_remove (&iter);
+    }
+
+    if (lines->len)
+        upload_journal_append (journal, lines->str);
+    g_string_free (lines, TRUE);
+}
+
+void upload_journal_rename (UploadJournal *journal, const gchar *src_path, const gchar *dst_path, gboolean recursive)
+{
+    GString *lines;
+    GHashTableIter iter;
+    gpointer value;
+    GList *l_records = NULL, *l;
+
+    // the destination is replaced
+    upload_journal_remove_path (journal, dst_path, recursive);
+
+    g_hash_table_iter_init (&iter, journal->h_records);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        JournalRecord *rec = (JournalRecord *) value;
+
+        if (upload_journal_path_match (rec->resource_path, src_path, recursive)) {
+            l_records = g_list_prepend (l_records, rec);
+            g_hash_table_iter_steal (&iter);
+        }
+    }
+
+    if (!l_records)
+        return;
+
+    // add records with the new path before retiring the old ones
+    lines = g_string_new (NULL);
+    for (l = g_list_first (l_records); l; l = g_list_next (l)) {
+        JournalRecord *rec = (JournalRecord *) l->data;
+        gchar *resource_path;
+        guint64 old_id = rec->id;
+
+        resource_path = g_strdup_printf ("%s%s", dst_path, 
+            upload_journal_path_match (rec->resource_path, src_path, recursive));
+        LOG_debug (JOURNAL_LOG, "Record %"G_GUINT64_FORMAT" is moved from %s to %s", rec->id, rec->resource_path, resource_path);
+        g_free (rec->resource_path);
+        rec->resource_path = resource_path;
+        rec->id = journal->next_id++;
+
+        upload_journal_format_add (lines, rec);
+        g_string_append_printf (lines, "D\t%"G_GUINT64_FORMAT"\n", old_id);
+        g_hash_table_insert (journal->h_records, &rec->id, rec);
+    }
+    g_list_free (l_records);
+
+    upload_journal_append (journal, lines->str);
+    g_string_free (lines, TRUE);
+}
+/*}}}*/
+
+/*{{{ replay */
+
+static void upload_journal_replay_on_sent_cb (gpointer ctx, gboolean success)
+{
+    JournalRecord *rec = (JournalRecord *) ctx;
+
+    upload_scheduler_release (application_get_upload_scheduler (rec->journal->app), rec->size);
+
+    if (success) {
+        LOG_msg (JOURNAL_LOG, "Recovered upload of %s", rec->resource_path);
+        upload_journal_remove (rec->journal, rec->id);
+        unlink (rec->tmp_path);
+    } else {
+        // keep the record, it will be retried on the next start
+        LOG_err (JOURNAL_LOG, "Failed to recover upload of %s, data is kept in %s", rec->resource_path, rec->tmp_path);
+    }
+
+    journal_record_free (rec);
+}
+
+static void upload_journal_replay_on_http_ready (gpointer client, gpointer ctx)
+{
+    S3HttpConnection *http_con = (S3HttpConnection *) client;
+    JournalRecord *rec = (JournalRecord *) ctx;
+    guint8 digest[16];
+    gchar *content_md5;
+    gint i;
+
+    s3http_connection_acquire (http_con);
+
+    // checksum is already verified, let the server check it as well
+    if (rec->checksum && strlen (rec->checksum) == sizeof (digest) * 2) {
+        for (i = 0; i < (gint) sizeof (digest); i++)
+            digest[i] = (g_ascii_xdigit_value (rec->checksum[i * 2]) << 4) | g_ascii_xdigit_value (rec->checksum[i * 2 + 1]);
+
+        content_md5 = g_base64_encode (digest, sizeof (digest));
+        s3http_connection_add_output_header (http_con, "Content-MD5", content_md5);
+        g_free (content_md5);
+    }
+
+    s3http_connection_file_send (http_con, rec->fd, rec->resource_path,
+        upload_journal_replay_on_sent_cb, rec);
+}
+
+// make sure tmp file is complete
+static gboolean upload_journal_record_check (JournalRecord *rec)
+{
+    struct stat st;
+    gchar *checksum;
+    gboolean res;
+
+    rec->fd = open (rec->tmp_path, O_RDONLY);
+    if (rec->fd < 0) {
+        LOG_err (JOURNAL_LOG, "Tmp file %s of %s is lost !", rec->tmp_path, rec->resource_path);
+        return FALSE;
+    }
+
+    if (fstat (rec->fd, &st) < 0 || st.st_size != rec->size) {
+        LOG_err (JOURNAL_LOG, "Tmp file %s of %s has a wrong size !", rec->tmp_path, rec->resource_path);
+        return FALSE;
+    }
+
+    checksum = upload_journal_file_checksum (rec->fd, st.st_size);
+    res = checksum && !strcmp (checksum, rec->checksum);
+    g_free (checksum);
+
+    if (!res)
+        LOG_err (JOURNAL_LOG, "Tmp file %s of %s is corrupted !", rec->tmp_path, rec->resource_path);
+
+    return res;
+}
+
+// parse journal line, return a new record or NULL
+static JournalRecord *upload_journal_parse_line (UploadJournal *journal, const gchar *line, guint64 *done_id)
+{
+    gchar **fields;
+    JournalRecord *rec = NULL;
+
+    *done_id = 0;
+    fields = g_strsplit (line, "\t", -1);
+
+    if (fields[0] && !strcmp (fields[0], "A") && g_strv_length (fields) == 6) {
+        rec = g_new0 (JournalRecord, 1);
+        rec->journal = journal;
+        rec->fd = -1;
+        rec->id = g_ascii_strtoull (fields[1], NULL, 10);
+        rec->size = g_ascii_strtoull (fields[2], NULL, 10);
+        rec->checksum = g_strdup (fields[3]);
+        rec->resource_path = g_strcompress (fields[4]);
+        rec->tmp_path = g_strcompress (fields[5]);
+    } else if (fields[0] && !strcmp (fields[0], "D") && g_strv_length (fields) == 2) {
+        *done_id = g_ascii_strtoull (fields[1], NULL, 10);
+    } else if (*line) {
+        LOG_err (JOURNAL_LOG, "Invalid journal line: %s", line);
+    }
+
+    g_strfreev (fields);
+
+    return rec;
+}
+
+void upload_journal_replay (UploadJournal *journal)
+{
+    gchar *contents = NULL;
+    gsize len;
+    gchar **lines;
+    gint i;
+    GHashTable *h_records; // id -> JournalRecord
+    GHashTable *h_paths; // resource path -> the latest JournalRecord
+    GHashTableIter iter;
+    gpointer value;
+    GList *l_records = NULL, *l;
+
+    if (!g_file_get_contents (journal->path, &contents, &len, NULL) || !len) {
+        g_free (contents);
+        return;
+    }
+
+    h_records = g_hash_table_new (g_int64_hash, g_int64_equal);
+    h_paths = g_hash_table_new (g_str_hash, g_str_equal);
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        JournalRecord *rec;
+        guint64 done_id;
+
+        rec = upload_journal_parse_line (journal, lines[i], &done_id);
+        if (rec) {
+            g_hash_table_insert (h_records, &rec->id, rec);
+            journal->next_id = MAX (journal->next_id, rec->id + 1);
+        } else if (done_id) {
+            rec = g_hash_table_lookup (h_records, &done_id);
+            if (rec) {
+                g_hash_table_remove (h_records, &done_id);
+                journal_record_free (rec);
+            }
+        }
+    }
+    g_strfreev (lines);
+    g_free (contents);
+
+    // only the latest version of each file has to be uploaded
+    g_hash_table_iter_init (&iter, h_records);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        JournalRecord *rec = (JournalRecord *) value;
+        JournalRecord *prev = g_hash_table_lookup (h_paths, rec->resource_path);
+
+        if (!prev || prev->id < rec->id)
+            g_hash_table_replace (h_paths, rec->resource_path, rec);
+    }
+
+    g_hash_table_iter_init (&iter, h_records);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        JournalRecord *rec = (JournalRecord *) value;
+
+        if (g_hash_table_lookup (h_paths, rec->resource_path) == rec)
+            l_records = g_list_prepend (l_records, rec);
+        else {
+            LOG_debug (JOURNAL_LOG, "Skipping outdated record %"G_GUINT64_FORMAT" for %s", rec->id, rec->resource_path);
+            unlink (rec->tmp_path);
+            journal_record_free (rec);
+        }
+    }
+    g_hash_table_destroy (h_paths);
+    g_hash_table_destroy (h_records);
+
+    // start from the empty journal and re-add pending records
+    if (ftruncate (journal->fd, 0) < 0)
+        LOG_err (JOURNAL_LOG, "Failed to truncate journal: %s", strerror (errno));
+    g_hash_table_remove_all (journal->h_records);
+
+    for (l = g_list_first (l_records); l; l = g_list_next (l)) {
+        JournalRecord *rec = (JournalRecord *) l->data;
+
+        if (!upload_journal_record_check (rec)) {
+            journal_record_free (rec);
+            continue;
+        }
+
+        // checksum is just verified
+        rec->id = upload_journal_add (journal, rec->resource_path, rec->tmp_path, rec->fd, rec->checksum);
+        if (!rec->id) {
+            journal_record_free (rec);
+            continue;
+        }
+
+        LOG_msg (JOURNAL_LOG, "Recovering upload of %s", rec->resource_path);
+
+        upload_scheduler_get_client (application_get_upload_scheduler (journal->app), rec->size, 
+            upload_journal_replay_on_http_ready, rec);
+    }
+    g_list_free (l_records);
+}
+/*}}}*/
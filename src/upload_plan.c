@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "upload_plan.h"
+
+// each part of multipart upload, except the last one, must be at least 5 MB,
+// part which is sent from the file is extended with original data to fit the limit
+void upload_plan_normalize (GArray *a_parts)
+{
+    gboolean changed = TRUE;
+    guint i;
+
+    while (changed) {
+        changed = FALSE;
+
+        // merge neighbours of the same type
+        for (i = 0; i + 1 < a_parts->len; ) {
+            S3HttpConnectionPart *part = &g_array_index (a_parts, S3HttpConnectionPart, i);
+            S3HttpConnectionPart *next = &g_array_index (a_parts, S3HttpConnectionPart, i + 1);
+
+            if (part->is_copy == next->is_copy && part->off + part->len == next->off) {
+                part->len += next->len;
+                g_array_remove_index (a_parts, i + 1);
+            } else
+                i++;
+        }
+
+        for (i = 0; i + 1 < a_parts->len; i++) {
+            S3HttpConnectionPart *part = &g_array_index (a_parts, S3HttpConnectionPart, i);
+            S3HttpConnectionPart *next = &g_array_index (a_parts, S3HttpConnectionPart, i + 1);
+            off_t need;
+
+            if (part->len >= S3_MULTIPART_MIN_PART_SIZE)
+                continue;
+
+            // too small to be copied, send it
+            if (part->is_copy) {
+                part->is_copy = FALSE;
+                changed = TRUE;
+                break;
+            }
+
+            // take the beginning of the next copied range
+            need = S3_MULTIPART_MIN_PART_SIZE - part->len;
+            if (next->len - need >= S3_MULTIPART_MIN_PART_SIZE || (i + 2 == a_parts->len && next->len > need)) {
+                part->len += need;
+                next->off += need;
+                next->len -= need;
+            } else {
+                next->is_copy = FALSE;
+                changed = TRUE;
+                break;
+            }
+        }
+    }
+
+    // split parts which are too big
+    for (i = 0; i < a_parts->len; i++) {
+        S3HttpConnectionPart *part = &g_array_index (a_parts, S3HttpConnectionPart, i);
+        S3HttpConnectionPart tail;
+        off_t count, len;
+
+        if (part->len <= S3_MULTIPART_MAX_PART_SIZE)
+            continue;
+
+        count = (part->len + S3_MULTIPART_MAX_PART_SIZE - 1) / S3_MULTIPART_MAX_PART_SIZE;
+        len = (part->len + count - 1) / count;
+
+        tail.is_copy = part->is_copy;
+        tail.off = part->off + len;
+        tail.len = part->len - len;
+        part->len = len;
+        g_array_insert_val (a_parts, i + 1, tail);
+    }
+}
+
+static void upload_plan_add_copy_cb (off_t off, off_t len, gpointer ctx)
+{
+    GArray *a_parts = (GArray *) ctx;
+    S3HttpConnectionPart part;
+    off_t end;
+
+    // fill the gap before with the part sent from the file
+    end = a_parts->len ? g_array_index (a_parts, S3HttpConnectionPart, a_parts->len - 1).off + 
+        g_array_index (a_parts, S3HttpConnectionPart, a_parts->len - 1).len : 0;
+    if (end < off) {
+        part.is_copy = FALSE;
+        part.off = end;
+        part.len = off - end;
+        g_array_append_val (a_parts, part);
+    }
+
+    part.is_copy = TRUE;
+    part.off = off;
+    part.len = len;
+    g_array_append_val (a_parts, part);
+}
+
+
+gboolean upload_plan_build (GArray *a_parts, RangeSet *dirty, off_t base_size, off_t size)
+{
+    gboolean has_copy = FALSE;
+    guint i;
+
+    g_array_set_size (a_parts, 0);
+
+    range_set_foreach_missing (dirty, 0, MIN (base_size, size), upload_plan_add_copy_cb, a_parts);
+    upload_plan_add_copy_cb (size, 0, a_parts);
+    // remove empty copy range which is added as the end marker
+    if (g_array_index (a_parts, S3HttpConnectionPart, a_parts->len - 1).len == 0)
+        g_array_set_size (a_parts, a_parts->len - 1);
+
+    upload_plan_normalize (a_parts);
+
+    for (i = 0; i < a_parts->len; i++) {
+        if (g_array_index (a_parts, S3HttpConnectionPart, i).is_copy)
+            has_copy = TRUE;
+    }
+
+    if (!has_copy || a_parts->len > S3_MULTIPART_MAX_PARTS) {
+        g_array_set_size (a_parts, 0);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "upload_scheduler.h"
+#include "s3http_connection.h"
+
+/*{{{ struct */
+
+// uploads are split into lanes by the object size, each lane has its own
+// queue and concurrency limit, so small files are not stuck behind a bulk upload.
+// Lane queues are not limited: an upload is accepted once the file is closed, 
+// the amount of pending data is limited by the caller (background_upload_max_size).
+// All connections of the write pool share the same bandwidth limit
+
+typedef enum {
+    UL_small = 0,
+    UL_large = 1,
+    UL_count = 2,
+} UploadLaneType;
+
+typedef struct {
+    const gchar *name;
+    gint max_active; // maximum uploads in progress
+    gint active;
+    GQueue *q_requests; // the queue of awaiting uploads
+} UploadLane;
+
+struct _UploadScheduler {
+    Application *app;
+    S3ClientPool *pool;
+
+    guint64 small_upload_max_size;
+    UploadLane lanes[UL_count];
+
+    struct ev_token_bucket_cfg *rate_cfg;
+    struct bufferevent_rate_limit_group *rate_group;
+};
+
+typedef struct {
+    UploadScheduler *sched;
+    S3ClientPool_on_client_ready on_client_ready;
+    gpointer ctx;
+} UploadRequest;
+
+#define SCHED_LOG "sched"
+
+/*}}}*/
+
+/*{{{ create / destroy */
+
+UploadScheduler *upload_scheduler_create (Application *app, S3ClientPool *pool)
+{
+    UploadScheduler *sched;
+    AppConf *conf;
+    gint i;
+
+    conf = application_get_conf (app);
+
+    sched = g_new0 (UploadScheduler, 1);
+    sched->app = app;
+    sched->pool = pool;
+    sched->small_upload_max_size = conf->small_upload_max_size;
+
+    sched->lanes[UL_small].name = "small";
+    sched->lanes[UL_small].max_active = MAX (1, conf->small_upload_writers);
+    sched->lanes[UL_large].name = "large";
+    sched->lanes[UL_large].max_active = MAX (1, conf->large_upload_writers);
+
+    // always leave a connection for small files
+    if (conf->writers > 1 && sched->lanes[UL_large].max_active >= conf->writers) {
+        LOG_msg (SCHED_LOG, "Large uploads are limited to %d connections, one is reserved for small files", conf->writers - 1);
+        sched->lanes[UL_large].max_active = conf->writers - 1;
+    }
+
+    for (i = 0; i < UL_count; i++) {
+        sched->lanes[i].active = 0;
+        sched->lanes[i].q_requests = g_queue_new ();
+    }
+
+    if (conf->upload_bandwidth_limit) {
+        size_t rate = MIN (conf->upload_bandwidth_limit, EV_RATE_LIMIT_MAX);
+
+        // only outgoing traffic is limited
+        sched->rate_cfg = ev_token_bucket_cfg_new (EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, rate, rate, NULL);
+        if (sched->rate_cfg)
+            sched->rate_group = bufferevent_rate_limit_group_new (application_get_evbase (app), sched->rate_cfg);
+        if (!sched->rate_group) {
+            LOG_err (SCHED_LOG, "Failed to create upload rate limit group !");
+            upload_scheduler_destroy (sched);
+            return NULL;
+        }
+    }
+
+    LOG_debug (SCHED_LOG, "UploadScheduler created, small: %d, large: %d, bandwidth: %"G_GUINT64_FORMAT" B/s", 
+        sched->lanes[UL_small].max_active, sched->lanes[UL_large].max_active, conf->upload_bandwidth_limit);
+
+    return sched;
+}
+
+void upload_scheduler_destroy (UploadScheduler *sched)
+{
+    gint i;
+
+    for (i = 0; i < UL_count; i++) {
+        if (sched->lanes[i].q_requests)
+            g_queue_free_full (sched->lanes[i].q_requests, g_free);
+    }
+    // connections are removed from the group when they are freed
+    if (sched->rate_group)
+        bufferevent_rate_limit_group_free (sched->rate_group);
+    if (sched->rate_cfg)
+        ev_token_bucket_cfg_free (sched->rate_cfg);
+
+    g_free (sched);
+}
+/*}}}*/
+
+/*{{{ scheduling */
+
+static UploadLane *upload_scheduler_get_lane (UploadScheduler *sched, guint64 size)
+{
+    if (size <= sched->small_upload_max_size)
+        return &sched->lanes[UL_small];
+    else
+        return &sched->lanes[UL_large];
+}
+
+// write pool's connection is ready for the upload
+static void upload_scheduler_on_client_ready (gpointer client, gpointer ctx)
+{
+    UploadRequest *req = (UploadRequest *) ctx;
+    S3HttpConnection *con = (S3HttpConnection *) client;
+    struct bufferevent *bev;
+
+    // connection's bufferevent is kept between requests, 
+    // adding it to the same group again does nothing
+    if (req->sched->rate_group) {
+        bev = evhttp_connection_get_bufferevent (s3http_connection_get_evcon (con));
+        if (bev && bufferevent_add_to_rate_limit_group (bev, req->sched->rate_group) < 0)
+            LOG_err (SCHED_LOG, "Failed to add connection to the rate limit group !");
+    }
+
+    req->on_client_ready (client, req->ctx);
+    g_free (req);
+}
+
+// take a connection from the pool for the request
+static gboolean upload_scheduler_dispatch (UploadScheduler *sched, UploadLane *lane, UploadRequest *req)
+{
+    lane->active++;
+
+    if (!s3client_pool_get_client (sched->pool, upload_scheduler_on_client_ready, req)) {
+        LOG_err (SCHED_LOG, "Failed to get S3HttpConnection from the pool !");
+        lane->active--;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void upload_scheduler_get_client (UploadScheduler *sched, guint64 size, 
+    S3ClientPool_on_client_ready on_client_ready, gpointer ctx)
+{
+    UploadLane *lane;
+    UploadRequest *req;
+
+    lane = upload_scheduler_get_lane (sched, size);
+
+    req = g_new0 (UploadRequest, 1);
+    req->sched = sched;
+    req->on_client_ready = on_client_ready;
+    req->ctx = ctx;
+
+    if (lane->active < lane->max_active && upload_scheduler_dispatch (sched, lane, req))
+        return;
+
+    // sent when one of the current uploads is finished
+    LOG_debug (SCHED_LOG, "Upload lane %s is busy, queued: %u", lane->name, g_queue_get_length (lane->q_requests));
+    g_queue_push_tail (lane->q_requests, req);
+}
+
+void upload_scheduler_release (UploadScheduler *sched, guint64 size)
+{
+    UploadLane *lane;
+    UploadRequest *req;
+    gint i;
+
+    lane = upload_scheduler_get_lane (sched, size);
+    if (lane->active > 0)
+        lane->active--;
+
+    // pool's connection is free for any lane
+    for (i = 0; i < UL_count; i++) {
+        lane = &sched->lanes[i];
+
+        while (lane->active < lane->max_active && (req = g_queue_pop_head (lane->q_requests))) {
+            // pool is full, retry when the next upload is finished
+            if (!upload_scheduler_dispatch (sched, lane, req)) {
+                g_queue_push_head (lane->q_requests, req);
+                return;
+            }
+        }
+    }
+}
+/*}}}*/
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "global.h"
+#include "dir_entry.h"
+#include "slab_arena.h"
+#include "name_pool.h"
+#include "inode_table.h"
+
+// builds a directory tree the way DirTree does and reports memory used per entry,
+// compared with the former layout: separately allocated entries with own name and full path copies
+//
+// usage: dir_entry_bench [entries] [files per directory]
+
+#define BENCH_LOG "bench"
+
+// DirEntry before it was moved to SlabArena
+typedef struct {
+    fuse_ino_t ino;
+    fuse_ino_t parent_ino;
+    gchar *basename;
+    gchar *fullpath;
+    guint64 age;
+    DirEntryType type;
+    gboolean is_modified;
+    gboolean is_removing;
+    gboolean is_detached;
+    off_t size;
+    mode_t mode;
+    time_t ctime;
+    gchar *etag;
+    char *dir_cache;
+    size_t dir_cache_size;
+    time_t dir_cache_created;
+    GHashTable *h_dir_tree;
+    gpointer op_data;
+} LegacyDirEntry;
+
+static gsize get_rss ()
+{
+    FILE *f;
+    unsigned long size = 0, resident = 0;
+
+    f = fopen ("/proc/self/statm", "r");
+    if (!f)
+        return 0;
+    if (fscanf (f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose (f);
+
+    return resident * sysconf (_SC_PAGESIZE);
+}
+
+static void report (const gchar *name, guint64 count, gsize mem, gint64 usec)
+{
+    g_printf ("%-28s %10.1f bytes/entry %8.1f ns/entry\n", name, 
+        (gdouble) mem / count, (gdouble) usec * 1000 / count);
+}
+
+// names are generated in sorted order, children are appended the same way DirTree does for listings
+static void bench_child_append (DirEntryDir *dir, DirEntry *en)
+{
+    if (dir->children_count == dir->children_size) {
+        dir->children_size = dir->children_size ? dir->children_size * 2 : 8;
+        dir->a_children = g_renew (DirEntry *, dir->a_children, dir->children_size);
+    }
+    dir->a_children[dir->children_count++] = en;
+}
+
+static void bench_compact (guint64 count, guint files_per_dir)
+{
+    SlabArena *file_arena, *dir_arena;
+    NamePool *names;
+    InodeTable *inodes;
+    DirEntry *dir_en = NULL, *en;
+    guint64 i;
+    gsize rss;
+    gint64 start;
+    gchar name[64];
+
+    rss = get_rss ();
+    start = g_get_monotonic_time ();
+
+    file_arena = slab_arena_create (sizeof (DirEntry));
+    dir_arena = slab_arena_create (sizeof (DirEntryDir));
+    names = name_pool_create ();
+    inodes = inode_table_create ();
+
+    for (i = 0; i < count; i++) {
+        if (i % files_per_dir == 0) {
+            g_snprintf (name, sizeof (name), "dir-%05"G_GUINT64_FORMAT, i / files_per_dir);
+            dir_en = slab_arena_alloc (dir_arena);
+            dir_en->ino = inode_table_add (inodes, dir_en);
+            dir_en->parent_ino = 1;
+            dir_en->name_id = name_pool_add (names, name);
+            dir_en->type = DET_dir;
+        }
+
+        g_snprintf (name, sizeof (name), "file-%07"G_GUINT64_FORMAT".dat", i);
+        en = slab_arena_alloc (file_arena);
+        en->ino = inode_table_add (inodes, en);
+        en->parent_ino = dir_en->ino;
+        en->name_id = name_pool_add (names, name);
+        en->type = DET_file;
+        en->size = i;
+        memcpy (en->etag, &i, sizeof (i));
+        en->has_etag = TRUE;
+        bench_child_append (DIR_ENTRY_DIR (dir_en), en);
+    }
+
+    report ("compact (records + names + inodes)", count, 
+        slab_arena_get_mem_size (file_arena) + slab_arena_get_mem_size (dir_arena) + name_pool_get_mem_size (names) + 
+        inode_table_get_mem_size (inodes), 
+        g_get_monotonic_time () - start);
+    report ("compact (RSS)", count, get_rss () - rss, g_get_monotonic_time () - start);
+}
+
+static void bench_legacy (guint64 count, guint files_per_dir)
+{
+    GHashTable *h_inodes;
+    LegacyDirEntry *dir_en = NULL, *en;
+    guint64 i;
+    fuse_ino_t ino = 1;
+    gsize rss;
+    gint64 start;
+    gchar name[64];
+
+    rss = get_rss ();
+    start = g_get_monotonic_time ();
+
+    h_inodes = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for (i = 0; i < count; i++) {
+        if (i % files_per_dir == 0) {
+            g_snprintf (name, sizeof (name), "dir-%05"G_GUINT64_FORMAT, i / files_per_dir);
+            dir_en = g_new0 (LegacyDirEntry, 1);
+            dir_en->ino = ino++;
+            dir_en->parent_ino = 1;
+            dir_en->basename = g_strdup (name);
+            dir_en->fullpath = g_strdup_printf ("/%s", name);
+            dir_en->type = DET_dir;
+            dir_en->h_dir_tree = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+            g_hash_table_insert (h_inodes, GUINT_TO_POINTER (dir_en->ino), dir_en);
+        }
+
+        g_snprintf (name, sizeof (name), "file-%07"G_GUINT64_FORMAT".dat", i);
+        en = g_new0 (LegacyDirEntry, 1);
+        en->ino = ino++;
+        en->parent_ino = dir_en->ino;
+        en->basename = g_strdup (name);
+        en->fullpath = g_strdup_printf ("%s/%s", dir_en->fullpath, name);
+        en->type = DET_file;
+        en->size = i;
+        en->etag = g_strdup ("0123456789abcdef0123456789abcdef");
+        g_hash_table_insert (h_inodes, GUINT_TO_POINTER (en->ino), en);
+        g_hash_table_insert (dir_en->h_dir_tree, en->basename, en);
+    }
+
+    report ("legacy (RSS)", count, get_rss () - rss, g_get_monotonic_time () - start);
+}
+
+int main (int argc, char *argv[])
+{
+    guint64 count = 1000000;
+    guint files_per_dir = 1000;
+
+    log_level = LOG_msg;
+
+    if (argc > 1)
+        count = g_ascii_strtoull (argv[1], NULL, 10);
+    if (argc > 2)
+        files_per_dir = atoi (argv[2]);
+    if (!count || !files_per_dir) {
+        LOG_err (BENCH_LOG, "Usage: %s [entries] [files per directory]", argv[0]);
+        return 1;
+    }
+
+    g_printf ("sizeof (DirEntry): %zu, entries: %"G_GUINT64_FORMAT", files per directory: %u\n", 
+        sizeof (DirEntry), count, files_per_dir);
+
+    // allocated memory is not returned to the system, compact layout goes first
+    bench_compact (count, files_per_dir);
+    bench_legacy (count, files_per_dir);
+
+    return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "global.h"
+#include "list_parser.h"
+
+// parses a ListBucketResult page of 1000 keys with the streaming parser, the body is fed in chunks
+// the way it's received from the connection, compared with the former parser: DOM with XPath queries
+// per object and a second pass for NextMarker
+//
+// usage: list_parser_bench [pages] [chunk size]
+
+#define BENCH_LOG "bench"
+#define BENCH_KEYS 1000
+#define BENCH_PREFIXES 20
+
+typedef struct {
+    guint64 count;
+    guint64 size;
+} BenchResult;
+
+static GString *bench_create_page ()
+{
+    GString *page = g_string_sized_new (BENCH_KEYS * 400);
+    gint i;
+
+    g_string_append (page, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+        "<Name>bucket</Name><Prefix>dir/</Prefix><Marker></Marker><NextMarker>dir/sub-0019/</NextMarker>"
+        "<MaxKeys>1000</MaxKeys><Delimiter>/</Delimiter><IsTruncated>true</IsTruncated>");
+    for (i = 0; i < BENCH_KEYS - BENCH_PREFIXES; i++) {
+        g_string_append_printf (page, "<Contents><Key>dir/file-%07d.dat</Key>"
+            "<LastModified>2012-10-01T12:00:00.000Z</LastModified>"
+            "<ETag>&quot;%032x&quot;</ETag><Size>%d</Size>"
+            "<Owner><ID>75aa57f09aa0c8caeab4f8c24e99d10f8e7faeebf76c078efc7c6caea54ba06a</ID><DisplayName>owner</DisplayName></Owner>"
+            "<StorageClass>STANDARD</StorageClass></Contents>", i, i * 7919, i * 1024);
+    }
+    for (i = 0; i < BENCH_PREFIXES; i++)
+        g_string_append_printf (page, "<CommonPrefixes><Prefix>dir/sub-%04d/</Prefix></CommonPrefixes>", i);
+    g_string_append (page, "</ListBucketResult>");
+
+    return page;
+}
+
+/*{{{ DOM + XPath */
+static gchar *legacy_get_child (xmlDocPtr doc, xmlXPathContextPtr ctx, const gchar *expr)
+{
+    xmlXPathObjectPtr key;
+    gchar *value = NULL;
+
+    key = xmlXPathEvalExpression ((xmlChar *) expr, ctx);
+    if (key->nodesetval && key->nodesetval->nodeNr > 0)
+        value = (gchar *) xmlNodeListGetString (doc, key->nodesetval->nodeTab[0]->xmlChildrenNode, 1);
+    xmlXPathFreeObject (key);
+
+    return value;
+}
+
+static gboolean legacy_parse (const gchar *buf, size_t buf_len, BenchResult *res)
+{
+    xmlDocPtr doc;
+    xmlXPathContextPtr ctx;
+    xmlXPathObjectPtr xp;
+    gchar *name, *size, *etag, *next_marker;
+    int i;
+
+    // entries
+    doc = xmlReadMemory (buf, buf_len, "", NULL, 0);
+    if (!doc)
+        return FALSE;
+    ctx = xmlXPathNewContext (doc);
+    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
+
+    xp = xmlXPathEvalExpression ((xmlChar *) "//s3:Contents", ctx);
+    for (i = 0; i < xp->nodesetval->nodeNr; i++) {
+        ctx->node = xp->nodesetval->nodeTab[i];
+        name = legacy_get_child (doc, ctx, "s3:Key");
+        size = legacy_get_child (doc, ctx, "s3:Size");
+        etag = legacy_get_child (doc, ctx, "s3:ETag");
+        res->count++;
+        res->size += atoll (size);
+        xmlFree (name);
+        xmlFree (size);
+        if (etag)
+            xmlFree (etag);
+    }
+    xmlXPathFreeObject (xp);
+
+    xp = xmlXPathEvalExpression ((xmlChar *) "//s3:CommonPrefixes", ctx);
+    for (i = 0; i < xp->nodesetval->nodeNr; i++) {
+        ctx->node = xp->nodesetval->nodeTab[i];
+        name = legacy_get_child (doc, ctx, "s3:Prefix");
+        res->count++;
+        xmlFree (name);
+    }
+    xmlXPathFreeObject (xp);
+
+    xmlXPathFreeContext (ctx);
+    xmlFreeDoc (doc);
+
+    // NextMarker, the document is parsed again
+    doc = xmlReadMemory (buf, buf_len, "", NULL, 0);
+    ctx = xmlXPathNewContext (doc);
+    xmlXPathRegisterNs (ctx, (xmlChar *) "s3", (xmlChar *) "http://s3.amazonaws.com/doc/2006-03-01/");
+    next_marker = legacy_get_child (doc, ctx, "//s3:NextMarker");
+    xmlXPathFreeContext (ctx);
+    xmlFreeDoc (doc);
+
+    if (!next_marker || !strstr (buf, "<IsTruncated>true</IsTruncated>"))
+        return FALSE;
+    xmlFree (next_marker);
+
+    return TRUE;
+}
+/*}}}*/
+
+/*{{{ streaming */
+static void bench_on_entry (gpointer ctx, G_GNUC_UNUSED const gchar *key, G_GNUC_UNUSED gboolean is_prefix, 
+    guint64 size, G_GNUC_UNUSED const gchar *etag)
+{
+    BenchResult *res = (BenchResult *) ctx;
+
+    res->count++;
+    res->size += size;
+}
+
+static gboolean stream_parse (const gchar *buf, size_t buf_len, size_t chunk_size, BenchResult *res)
+{
+    ListParser *parser;
+    size_t off;
+    gboolean ok;
+
+    parser = list_parser_create (bench_on_entry, res);
+    for (off = 0; off < buf_len; off += chunk_size)
+        list_parser_feed (parser, buf + off, MIN (chunk_size, buf_len - off));
+    ok = list_parser_finish (parser) && list_parser_is_truncated (parser) && list_parser_get_next_marker (parser);
+    list_parser_destroy (parser);
+
+    return ok;
+}
+/*}}}*/
+
+static void report (const gchar *name, guint pages, gint64 usec, BenchResult *res)
+{
+    g_printf ("%-28s %10.1f us/page %8.1f ns/entry (%"G_GUINT64_FORMAT" entries)\n", name, 
+        (gdouble) usec / pages, (gdouble) usec * 1000 / res->count, res->count);
+}
+
+int main (int argc, char *argv[])
+{
+    guint pages = 200;
+    size_t chunk_size = 4096;
+    GString *page;
+    BenchResult res;
+    gint64 start;
+    guint i;
+
+    log_level = LOG_msg;
+
+    if (argc > 1)
+        pages = atoi (argv[1]);
+    if (argc > 2)
+        chunk_size = atoi (argv[2]);
+    if (!pages || !chunk_size) {
+        LOG_err (BENCH_LOG, "Usage: %s [pages] [chunk size]", argv[0]);
+        return 1;
+    }
+
+    xmlInitParser ();
+    page = bench_create_page ();
+
+    g_printf ("page: %zu bytes, %d entries, pages: %u, chunk size: %zu\n", 
+        page->len, BENCH_KEYS, pages, chunk_size);
+
+    memset (&res, 0, sizeof (res));
+    start = g_get_monotonic_time ();
+    for (i = 0; i < pages; i++) {
+        if (!legacy_parse (page->str, page->len, &res)) {
+            LOG_err (BENCH_LOG, "Failed to parse the page !");
+            return 1;
+        }
+    }
+    report ("DOM + XPath", pages, g_get_monotonic_time () - start, &res);
+
+    memset (&res, 0, sizeof (res));
+    start = g_get_monotonic_time ();
+    for (i = 0; i < pages; i++) {
+        if (!stream_parse (page->str, page->len, chunk_size, &res)) {
+            LOG_err (BENCH_LOG, "Failed to parse the page !");
+            return 1;
+        }
+    }
+    report ("streaming", pages, g_get_monotonic_time () - start, &res);
+
+    g_string_free (page, TRUE);
+    xmlCleanupParser ();
+
+    return 0;
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "global.h"
+#include "upload_journal.h"
+#include "upload_scheduler.h"
+#include "s3http_connection.h"
+
+// replays journal files written by hand and by UploadJournal itself,
+// uploads are captured by the stubs below instead of being sent
+//
+// usage: upload_journal_test
+
+#define JOURNAL_TEST "journal_test"
+
+/*{{{ stubs */
+
+struct _Application {
+    gboolean send_ok;
+    GHashTable *h_sent; // resource path -> uploaded content
+};
+
+static Application *test_app;
+
+UploadScheduler *application_get_upload_scheduler (G_GNUC_UNUSED Application *app)
+{
+    return NULL;
+}
+
+void upload_scheduler_get_client (G_GNUC_UNUSED UploadScheduler *sched, G_GNUC_UNUSED guint64 size, 
+    S3ClientPool_on_client_ready on_client_ready, gpointer ctx)
+{
+    on_client_ready (NULL, ctx);
+}
+
+void upload_scheduler_release (G_GNUC_UNUSED UploadScheduler *sched, G_GNUC_UNUSED guint64 size)
+{
+}
+
+gboolean s3http_connection_acquire (G_GNUC_UNUSED S3HttpConnection *con)
+{
+    return TRUE;
+}
+
+void s3http_connection_add_output_header (G_GNUC_UNUSED S3HttpConnection *con, 
+    G_GNUC_UNUSED const gchar *key, G_GNUC_UNUSED const gchar *value)
+{
+}
+
+gboolean s3http_connection_file_send (G_GNUC_UNUSED S3HttpConnection *con, int fd, const gchar *resource_path, 
+    S3HttpConnection_on_entry_sent_cb on_entry_sent_cb, gpointer ctx)
+{
+    GString *content = g_string_new (NULL);
+    gchar buf[1024];
+    off_t off = 0;
+    ssize_t n;
+
+    while ((n = pread (fd, buf, sizeof (buf), off)) > 0) {
+        g_string_append_len (content, buf, n);
+        off += n;
+    }
+
+    if (test_app->send_ok)
+        g_hash_table_insert (test_app->h_sent, g_strdup (resource_path), g_string_free (content, FALSE));
+    else
+        g_string_free (content, TRUE);
+
+    on_entry_sent_cb (ctx, test_app->send_ok);
+
+    return TRUE;
+}
+/*}}}*/
+
+/*{{{ helpers */
+
+static gchar *test_dir;
+
+static gchar *test_file_create (const gchar *name, const gchar *content)
+{
+    gchar *path = g_build_filename (test_dir, name, NULL);
+
+    g_assert (g_file_set_contents (path, content, -1, NULL));
+
+    return path;
+}
+
+// "pending" journal line of the file with content
+static gchar *test_journal_line (guint64 id, const gchar *resource_path, const gchar *tmp_path, const gchar *content)
+{
+    gchar *checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, content, -1);
+    gchar *e_resource_path = g_strescape (resource_path, NULL);
+    gchar *e_tmp_path = g_strescape (tmp_path, NULL);
+    gchar *line;
+
+    line = g_strdup_printf ("A\t%"G_GUINT64_FORMAT"\t%zu\t%s\t%s\t%s\n", 
+        id, strlen (content), checksum, e_resource_path, e_tmp_path);
+
+    g_free (e_tmp_path);
+    g_free (e_resource_path);
+    g_free (checksum);
+
+    return line;
+}
+
+static off_t test_file_size (const gchar *path)
+{
+    struct stat st;
+
+    g_assert (stat (path, &st) == 0);
+
+    return st.st_size;
+}
+
+// open journal, replay it and return the number of uploaded files
+static guint test_replay (const gchar *journal_path, gboolean send_ok)
+{
+    UploadJournal *journal;
+
+    g_hash_table_remove_all (test_app->h_sent);
+    test_app->send_ok = send_ok;
+
+    journal = upload_journal_create (test_app, journal_path);
+    g_assert (journal);
+    upload_journal_replay (journal);
+    upload_journal_destroy (journal);
+
+    return g_hash_table_size (test_app->h_sent);
+}
+
+static void test_assert_sent (const gchar *resource_path, const gchar *content)
+{
+    const gchar *sent = g_hash_table_lookup (test_app->h_sent, resource_path);
+
+    g_assert (sent);
+    g_assert_cmpstr (sent, ==, content);
+}
+/*}}}*/
+
+/*{{{ tests */
+
+// the latest record of each file is replayed, done and damaged records are skipped
+static void test_parse (void)
+{
+    gchar *journal_path = g_build_filename (test_dir, "parse.journal", NULL);
+    gchar *a1 = test_file_create ("a1", "old a");
+    gchar *a3 = test_file_create ("a3", "new a");
+    gchar *b = test_file_create ("b", "b");
+    gchar *c = test_file_create ("c", "tab");
+    gchar *e = test_file_create ("e", "corrupted");
+    GString *contents = g_string_new (NULL);
+    gchar *line;
+
+    line = test_journal_line (1, "/a", a1, "old a");
+    g_string_append (contents, line);
+    g_free (line);
+    line = test_journal_line (2, "/b", b, "b");
+    g_string_append (contents, line);
+    g_free (line);
+    line = test_journal_line (3, "/a", a3, "new a");
+    g_string_append (contents, line);
+    g_free (line);
+    g_string_append (contents, "D\t2\n");
+    g_string_append (contents, "invalid line\n");
+    g_string_append (contents, "D\t100\n");
+    line = test_journal_line (4, "/c\td", c, "tab");
+    g_string_append (contents, line);
+    g_free (line);
+    line = test_journal_line (5, "/e", e, "content");
+    g_string_append (contents, line);
+    g_free (line);
+    // the last line is not finished
+    g_string_append (contents, "A\t6\t");
+
+    g_assert (g_file_set_contents (journal_path, contents->str, -1, NULL));
+
+    g_assert_cmpuint (test_replay (journal_path, TRUE), ==, 2);
+    test_assert_sent ("/a", "new a");
+    test_assert_sent ("/c\td", "tab");
+
+    // outdated and uploaded tmp files are removed
+    g_assert (!g_file_test (a1, G_FILE_TEST_EXISTS));
+    g_assert (!g_file_test (a3, G_FILE_TEST_EXISTS));
+    g_assert (!g_file_test (c, G_FILE_TEST_EXISTS));
+
+    // nothing is pending
+    g_assert_cmpint (test_file_size (journal_path), ==, 0);
+    g_assert_cmpuint (test_replay (journal_path, TRUE), ==, 0);
+
+    g_string_free (contents, TRUE);
+    g_free (journal_path);
+    g_free (a1);
+    g_free (a3);
+    g_free (b);
+    g_free (c);
+    g_free (e);
+}
+
+// failed replay is retried on the next start
+static void test_replay_failed (void)
+{
+    gchar *journal_path = g_build_filename (test_dir, "failed.journal", NULL);
+    gchar *f = test_file_create ("f", "f");
+    gchar *line;
+
+    line = test_journal_line (7, "/f", f, "f");
+    g_assert (g_file_set_contents (journal_path, line, -1, NULL));
+    g_free (line);
+
+    g_assert_cmpuint (test_replay (journal_path, FALSE), ==, 0);
+    g_assert (g_file_test (f, G_FILE_TEST_EXISTS));
+
+    g_assert_cmpuint (test_replay (journal_path, TRUE), ==, 1);
+    test_assert_sent ("/f", "f");
+    g_assert (!g_file_test (f, G_FILE_TEST_EXISTS));
+
+    g_free (journal_path);
+    g_free (f);
+}
+
+// checksum calculated by the caller is stored as it is
+static void test_add_checksum (void)
+{
+    gchar *journal_path = g_build_filename (test_dir, "checksum.journal", NULL);
+    gchar *k = test_file_create ("k", "k");
+    gchar *w = test_file_create ("w", "w");
+    gchar *checksum;
+    UploadJournal *journal;
+    int fd;
+
+    journal = upload_journal_create (test_app, journal_path);
+    g_assert (journal);
+
+    checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, "k", -1);
+    fd = open (k, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/k", k, fd, checksum));
+    close (fd);
+    g_free (checksum);
+
+    // content doesn't match, record is dropped by replay
+    checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, "not w", -1);
+    fd = open (w, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/w", w, fd, checksum));
+    close (fd);
+    g_free (checksum);
+    upload_journal_destroy (journal);
+
+    g_assert_cmpuint (test_replay (journal_path, TRUE), ==, 1);
+    test_assert_sent ("/k", "k");
+
+    g_free (journal_path);
+    g_free (k);
+    g_free (w);
+}
+
+// successful upload retires the older records of the same file
+static void test_retire (void)
+{
+    gchar *journal_path = g_build_filename (test_dir, "retire.journal", NULL);
+    gchar *x1 = test_file_create ("x1", "x1");
+    gchar *x2 = test_file_create ("x2", "x2");
+    gchar *y1 = test_file_create ("y1", "y1");
+    gchar *y2 = test_file_create ("y2", "y2");
+    UploadJournal *journal;
+    int fd;
+    guint64 id;
+
+    test_app->send_ok = TRUE;
+    journal = upload_journal_create (test_app, journal_path);
+    g_assert (journal);
+
+    fd = open (x1, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/x", x1, fd, NULL));
+    close (fd);
+    fd = open (x2, O_RDONLY);
+    id = upload_journal_add (journal, "/x", x2, fd, NULL);
+    g_assert (id);
+    close (fd);
+
+    upload_journal_remove (journal, id);
+    g_assert (!g_file_test (x1, G_FILE_TEST_EXISTS));
+    // removed by the owner of the record
+    g_assert (g_file_test (x2, G_FILE_TEST_EXISTS));
+    g_assert_cmpint (test_file_size (journal_path), ==, 0);
+
+    // retired record
+    upload_journal_remove (journal, id - 1);
+    g_assert_cmpint (test_file_size (journal_path), ==, 0);
+
+    // both uploads failed, only the latest one is replayed
+    fd = open (y1, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/y", y1, fd, NULL));
+    close (fd);
+    fd = open (y2, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/y", y2, fd, NULL));
+    close (fd);
+    upload_journal_destroy (journal);
+
+    g_assert_cmpuint (test_replay (journal_path, TRUE), ==, 1);
+    test_assert_sent ("/y", "y2");
+    g_assert (!g_file_test (y1, G_FILE_TEST_EXISTS));
+
+    g_free (journal_path);
+    g_free (x1);
+    g_free (x2);
+    g_free (y1);
+    g_free (y2);
+}
+
+// records follow renamed files and are dropped with removed ones
+static void test_rename_remove (void)
+{
+    gchar *journal_path = g_build_filename (test_dir, "rename.journal", NULL);
+    gchar *df = test_file_create ("df", "df");
+    gchar *dx = test_file_create ("dx", "dx");
+    gchar *h = test_file_create ("h", "h");
+    gchar *g = test_file_create ("g", "g");
+    UploadJournal *journal;
+    int fd;
+
+    journal = upload_journal_create (test_app, journal_path);
+    g_assert (journal);
+
+    fd = open (df, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/d/f", df, fd, NULL));
+    close (fd);
+    fd = open (dx, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/dx", dx, fd, NULL));
+    close (fd);
+    fd = open (h, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/h", h, fd, NULL));
+    close (fd);
+    fd = open (g, O_RDONLY);
+    g_assert (upload_journal_add (journal, "/g/f", g, fd, NULL));
+    close (fd);
+
+    // "/g" is replaced
+    upload_journal_rename (journal, "/d", "/g", TRUE);
+    g_assert (!g_file_test (g, G_FILE_TEST_EXISTS));
+
+    upload_journal_remove_path (journal, "/h", FALSE);
+    g_assert (!g_file_test (h, G_FILE_TEST_EXISTS));
+
+    // not a prefix of the directory
+    upload_journal_remove_path (journal, "/d", TRUE);
+    upload_journal_destroy (journal);
+
+    g_assert_cmpuint (test_replay (journal_path, TRUE), ==, 2);
+    test_assert_sent ("/g/f", "df");
+    test_assert_sent ("/dx", "dx");
+
+    g_free (journal_path);
+    g_free (df);
+    g_free (dx);
+    g_free (h);
+    g_free (g);
+}
+/*}}}*/
+
+int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
+{
+    gchar tmpl[] = "/tmp/upload_journal_test.XXXXXX";
+
+    log_level = LOG_msg;
+
+    test_dir = mkdtemp (tmpl);
+    if (!test_dir) {
+        LOG_err (JOURNAL_TEST, "Failed to create tmp directory: %s", strerror (errno));
+        return 1;
+    }
+
+    test_app = g_new0 (Application, 1);
+    test_app->h_sent = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    test_parse ();
+    test_replay_failed ();
+    test_add_checksum ();
+    test_retire ();
+    test_rename_remove ();
+
+    g_hash_table_destroy (test_app->h_sent);
+    g_free (test_app);
+
+    LOG_msg (JOURNAL_TEST, "All tests passed, tmp files are left in %s", test_dir);
+
+    return 0;
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2012 Paul Ionkin <paul.ionkin@gmail.com>
+ * Copyright (C) 2012 Skoobe GmbH. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "global.h"
+#include "range_set.h"
+#include "upload_plan.h"
+
+// checks RangeSet operations and how multipart upload plans fit S3 part limits
+//
+// usage: upload_plan_test
+
+#define PLAN_TEST "plan_test"
+
+#define MB ((off_t) 1024 * 1024)
+#define GB ((off_t) 1024 * MB)
+
+/*{{{ helpers */
+
+static void test_range_collect_cb (off_t off, off_t len, gpointer ctx)
+{
+    GString *s = (GString *) ctx;
+
+    g_string_append_printf (s, "[%"OFF_FMT",%"OFF_FMT")", (uintmax_t) off, (uintmax_t) (off + len));
+}
+
+// return ranges of the set as a string, must be freed
+static gchar *test_range_set_str (RangeSet *rs)
+{
+    GString *s = g_string_new (NULL);
+
+    range_set_foreach (rs, test_range_collect_cb, s);
+
+    return g_string_free (s, FALSE);
+}
+
+static void test_range_set_assert (RangeSet *rs, const gchar *expected)
+{
+    gchar *str = test_range_set_str (rs);
+
+    g_assert_cmpstr (str, ==, expected);
+    g_free (str);
+}
+
+static GArray *test_plan_build (RangeSet *dirty, off_t base_size, off_t size, gboolean expected)
+{
+    GArray *a_parts = g_array_new (FALSE, FALSE, sizeof (S3HttpConnectionPart));
+
+    g_assert (upload_plan_build (a_parts, dirty, base_size, size) == expected);
+    if (!expected)
+        g_assert_cmpuint (a_parts->len, ==, 0);
+
+    return a_parts;
+}
+
+// parts cover the whole object, fit the limits and copy only unchanged original data
+static void test_plan_check (GArray *a_parts, RangeSet *dirty, off_t base_size, off_t size)
+{
+    off_t end = 0;
+    guint i;
+
+    for (i = 0; i < a_parts->len; i++) {
+        S3HttpConnectionPart *part = &g_array_index (a_parts, S3HttpConnectionPart, i);
+
+        g_assert_cmpint (part->off, ==, end);
+        g_assert_cmpint (part->len, >, 0);
+        g_assert_cmpint (part->len, <=, S3_MULTIPART_MAX_PART_SIZE);
+        if (i + 1 < a_parts->len)
+            g_assert_cmpint (part->len, >=, S3_MULTIPART_MIN_PART_SIZE);
+
+        if (part->is_copy) {
+            GString *s = g_string_new (NULL);
+            gchar *whole;
+
+            g_assert_cmpint (part->off + part->len, <=, base_size);
+
+            // copied range is not written at all
+            range_set_foreach_missing (dirty, part->off, part->len, test_range_collect_cb, s);
+            whole = g_strdup_printf ("[%"OFF_FMT",%"OFF_FMT")", (uintmax_t) part->off, (uintmax_t) (part->off + part->len));
+            g_assert_cmpstr (s->str, ==, whole);
+            g_free (whole);
+            g_string_free (s, TRUE);
+        }
+
+        end = part->off + part->len;
+    }
+
+    g_assert_cmpint (end, ==, size);
+}
+
+static void test_plan_assert_part (GArray *a_parts, guint i, gboolean is_copy, off_t off, off_t len)
+{
+    S3HttpConnectionPart *part;
+
+    g_assert_cmpuint (i, <, a_parts->len);
+    part = &g_array_index (a_parts, S3HttpConnectionPart, i);
+    g_assert (part->is_copy == is_copy);
+    g_assert_cmpint (part->off, ==, off);
+    g_assert_cmpint (part->len, ==, len);
+}
+/*}}}*/
+
+/*{{{ tests */
+
+static void test_range_set (void)
+{
+    RangeSet *rs = range_set_create ();
+    RangeSet *other = range_set_create ();
+    GString *s = g_string_new (NULL);
+    off_t off, len;
+
+    g_assert (!range_set_get_first (rs, &off, &len));
+    g_assert_cmpuint (range_set_get_count (rs), ==, 0);
+
+    // adjacent and overlapping ranges are merged
+    range_set_add (rs, 10, 10);
+    range_set_add (rs, 30, 10);
+    range_set_add (rs, 20, 5);
+    test_range_set_assert (rs, "[10,25)[30,40)");
+    range_set_add (rs, 24, 7);
+    test_range_set_assert (rs, "[10,40)");
+    range_set_add (rs, 0, 0);
+    test_range_set_assert (rs, "[10,40)");
+
+    // removal splits the range
+    range_set_remove (rs, 15, 5);
+    test_range_set_assert (rs, "[10,15)[20,40)");
+    range_set_remove (rs, 0, 12);
+    range_set_remove (rs, 35, 100);
+    test_range_set_assert (rs, "[12,15)[20,35)");
+    g_assert_cmpuint (range_set_get_count (rs), ==, 2);
+    g_assert_cmpint (range_set_get_total (rs), ==, 18);
+
+    g_assert (range_set_contains (rs, 20, 15));
+    g_assert (range_set_contains (rs, 12, 1));
+    g_assert (!range_set_contains (rs, 14, 7));
+    g_assert (!range_set_contains (rs, 0, 1));
+
+    g_assert (range_set_get_first (rs, &off, &len));
+    g_assert_cmpint (off, ==, 12);
+    g_assert_cmpint (len, ==, 3);
+
+    // gaps inside the requested range
+    range_set_foreach_missing (rs, 0, 50, test_range_collect_cb, s);
+    g_assert_cmpstr (s->str, ==, "[0,12)[15,20)[35,50)");
+    g_string_truncate (s, 0);
+    range_set_foreach_missing (rs, 13, 10, test_range_collect_cb, s);
+    g_assert_cmpstr (s->str, ==, "[15,20)");
+    g_string_truncate (s, 0);
+    range_set_foreach_missing (rs, 20, 10, test_range_collect_cb, s);
+    g_assert_cmpstr (s->str, ==, "");
+
+    range_set_add (other, 5, 8);
+    range_set_add (other, 50, 1);
+    range_set_merge (rs, other);
+    test_range_set_assert (rs, "[5,15)[20,35)[50,51)");
+
+    range_set_clear (rs);
+    g_assert_cmpuint (range_set_get_count (rs), ==, 0);
+    g_assert_cmpint (range_set_get_total (rs), ==, 0);
+
+    g_string_free (s, TRUE);
+    range_set_destroy (other);
+    range_set_destroy (rs);
+}
+
+// a small change in the middle is sent as a single minimal part
+static void test_plan_middle (void)
+{
+    RangeSet *dirty = range_set_create ();
+    GArray *a_parts;
+
+    range_set_add (dirty, 10 * MB, 100);
+    a_parts = test_plan_build (dirty, 20 * MB, 20 * MB, TRUE);
+    test_plan_check (a_parts, dirty, 20 * MB, 20 * MB);
+
+    g_assert_cmpuint (a_parts->len, ==, 3);
+    test_plan_assert_part (a_parts, 0, TRUE, 0, 10 * MB);
+    test_plan_assert_part (a_parts, 1, FALSE, 10 * MB, S3_MULTIPART_MIN_PART_SIZE);
+    test_plan_assert_part (a_parts, 2, TRUE, 10 * MB + S3_MULTIPART_MIN_PART_SIZE, 5 * MB);
+
+    g_array_free (a_parts, TRUE);
+    range_set_destroy (dirty);
+}
+
+// copied ranges smaller than 5 MB are sent instead
+static void test_plan_min_part (void)
+{
+    RangeSet *dirty = range_set_create ();
+    GArray *a_parts;
+
+    range_set_add (dirty, 1 * MB, 10);
+    a_parts = test_plan_build (dirty, 20 * MB, 20 * MB, TRUE);
+    test_plan_check (a_parts, dirty, 20 * MB, 20 * MB);
+
+    g_assert_cmpuint (a_parts->len, ==, 2);
+    test_plan_assert_part (a_parts, 0, FALSE, 0, S3_MULTIPART_MIN_PART_SIZE);
+    test_plan_assert_part (a_parts, 1, TRUE, S3_MULTIPART_MIN_PART_SIZE, 15 * MB);
+    g_array_free (a_parts, TRUE);
+
+    // the rest of copied range would be too small, the whole range is sent
+    range_set_clear (dirty);
+    range_set_add (dirty, 0, 10);
+    range_set_add (dirty, 7 * MB, 10);
+    a_parts = test_plan_build (dirty, 20 * MB, 20 * MB, TRUE);
+    test_plan_check (a_parts, dirty, 20 * MB, 20 * MB);
+
+    g_assert_cmpuint (a_parts->len, ==, 2);
+    test_plan_assert_part (a_parts, 0, FALSE, 0, 7 * MB + 10);
+    test_plan_assert_part (a_parts, 1, TRUE, 7 * MB + 10, 13 * MB - 10);
+    g_array_free (a_parts, TRUE);
+
+    // nothing is left to copy
+    range_set_clear (dirty);
+    range_set_add (dirty, 4 * MB, 10);
+    range_set_add (dirty, 9 * MB - 10, 10);
+    a_parts = test_plan_build (dirty, 9 * MB, 9 * MB, FALSE);
+    g_array_free (a_parts, TRUE);
+
+    range_set_destroy (dirty);
+}
+
+// the last part may be smaller than 5 MB
+static void test_plan_last_part (void)
+{
+    RangeSet *dirty = range_set_create ();
+    GArray *a_parts;
+
+    // changed tail
+    range_set_add (dirty, 20 * MB - 10, 10);
+    a_parts = test_plan_build (dirty, 20 * MB, 20 * MB, TRUE);
+    test_plan_check (a_parts, dirty, 20 * MB, 20 * MB);
+    g_assert_cmpuint (a_parts->len, ==, 2);
+    test_plan_assert_part (a_parts, 0, TRUE, 0, 20 * MB - 10);
+    test_plan_assert_part (a_parts, 1, FALSE, 20 * MB - 10, 10);
+    g_array_free (a_parts, TRUE);
+
+    // appended data
+    range_set_clear (dirty);
+    range_set_add (dirty, 20 * MB, MB);
+    a_parts = test_plan_build (dirty, 20 * MB, 21 * MB, TRUE);
+    test_plan_check (a_parts, dirty, 20 * MB, 21 * MB);
+    g_assert_cmpuint (a_parts->len, ==, 2);
+    test_plan_assert_part (a_parts, 1, FALSE, 20 * MB, MB);
+    g_array_free (a_parts, TRUE);
+
+    // the last copied range is shorter than 5 MB after the sent part is extended
+    range_set_clear (dirty);
+    range_set_add (dirty, 0, 10);
+    a_parts = test_plan_build (dirty, 8 * MB, 8 * MB, TRUE);
+    test_plan_check (a_parts, dirty, 8 * MB, 8 * MB);
+    g_assert_cmpuint (a_parts->len, ==, 2);
+    test_plan_assert_part (a_parts, 0, FALSE, 0, S3_MULTIPART_MIN_PART_SIZE);
+    test_plan_assert_part (a_parts, 1, TRUE, S3_MULTIPART_MIN_PART_SIZE, 3 * MB);
+    g_array_free (a_parts, TRUE);
+
+    // truncated object
+    range_set_clear (dirty);
+    range_set_add (dirty, 0, 10);
+    a_parts = test_plan_build (dirty, 20 * MB, 15 * MB, TRUE);
+    test_plan_check (a_parts, dirty, 20 * MB, 15 * MB);
+    g_array_free (a_parts, TRUE);
+
+    range_set_destroy (dirty);
+}
+
+// parts bigger than 5 GB are split into equal parts
+static void test_plan_split (void)
+{
+    RangeSet *dirty = range_set_create ();
+    GArray *a_parts;
+
+    range_set_add (dirty, 6 * GB, 10);
+    a_parts = test_plan_build (dirty, 12 * GB, 12 * GB, TRUE);
+    test_plan_check (a_parts, dirty, 12 * GB, 12 * GB);
+
+    g_assert_cmpuint (a_parts->len, ==, 5);
+    test_plan_assert_part (a_parts, 0, TRUE, 0, 3 * GB);
+    test_plan_assert_part (a_parts, 1, TRUE, 3 * GB, 3 * GB);
+    test_plan_assert_part (a_parts, 2, FALSE, 6 * GB, S3_MULTIPART_MIN_PART_SIZE);
+    g_array_free (a_parts, TRUE);
+
+    // exactly 5 GB is not split
+    range_set_clear (dirty);
+    range_set_add (dirty, 5 * GB, 10);
+    a_parts = test_plan_build (dirty, 5 * GB + 10, 5 * GB + 10, TRUE);
+    test_plan_check (a_parts, dirty, 5 * GB + 10, 5 * GB + 10);
+    g_assert_cmpuint (a_parts->len, ==, 2);
+    test_plan_assert_part (a_parts, 0, TRUE, 0, S3_MULTIPART_MAX_PART_SIZE);
+    g_array_free (a_parts, TRUE);
+
+    // big appended data
+    range_set_clear (dirty);
+    range_set_add (dirty, 20 * MB, 11 * GB);
+    a_parts = test_plan_build (dirty, 20 * MB, 20 * MB + 11 * GB, TRUE);
+    test_plan_check (a_parts, dirty, 20 * MB, 20 * MB + 11 * GB);
+    g_assert_cmpuint (a_parts->len, ==, 4);
+    g_array_free (a_parts, TRUE);
+
+    range_set_destroy (dirty);
+}
+/*}}}*/
+
+int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
+{
+    log_level = LOG_msg;
+
+    test_range_set ();
+    test_plan_middle ();
+    test_plan_min_part ();
+    test_plan_last_part ();
+    test_plan_split ();
+
+    LOG_msg (PLAN_TEST, "All tests passed");
+
+    return 0;
+}